@@ -1,52 +1,158 @@
 #ifndef __AD5541_H__
 #define __AD5541_H__
 
+#include "spi_bus.h"
+
 // TODO: We should wrap the DAC and ADC too
 #define AD5541_SPI_SPEED   5000000ul
 #define AD5541_CODES       65536u
 #define AD5541_CODE_LOW    0
 #define AD5541_CODE_HIGH   65535u
+// An unchanged code is still re-sent this often, so a write lost to noise
+// cannot leave the load at a stale output for long.
+#define AD5541_REFRESH_INTERVAL_MS 100ul
 
 class AD5541
 {
 private:
-    uint16_t _current;
+    // Written by whoever holds the bus, main or an interrupt; read through
+    // InterruptGuard, so a read from main is never torn by a write from the
+    // waveform tick or the stop interrupt.
+    volatile uint16_t _current;
     int _cs_pin;
+    volatile bool _written;
+    volatile uint32_t _written_ms;
+    SPISettings _setting;
+#if defined(__AVR__)
+    // CS through its port register; resolved once in begin().
+    volatile uint8_t* _cs_port;
+    uint8_t _cs_mask;
+    // SPI control and status for this device, for zero().
+    uint8_t _spcr;
+    uint8_t _spsr;
+#endif
+
+    void select()
+    {
+#if defined(__AVR__)
+        *_cs_port &= (uint8_t)~_cs_mask;
+#else
+        digitalWrite(_cs_pin, LOW);
+        delayMicroseconds(1);  // datsheet only need 10ns
+#endif
+    }
+
+    void deselect()
+    {
+#if defined(__AVR__)
+        *_cs_port |= _cs_mask;
+#else
+        digitalWrite(_cs_pin, HIGH);
+#endif
+    }
 
 protected:
 
     void send_to_device() {
-        // Send CS signal
-        digitalWrite(_cs_pin, LOW);
-        delayMicroseconds(1);  // datsheet only need 10ns
-        SPISettings setting(AD5541_SPI_SPEED, MSBFIRST, SPI_MODE0);
-        SPI.beginTransaction(setting);
+        // Switch the SPI mode before CS falls, so the clock polarity change
+        // is not seen as an edge.
+        SPI.beginTransaction(_setting);
+        select();
         SPI.transfer16(_current);
-        digitalWrite(_cs_pin, HIGH);
+        deselect();
         SPI.endTransaction();
+        _written = true;
+        _written_ms = millis();
     }
 
 public:
     AD5541(int cs_pin) :
-        _cs_pin(cs_pin)
+        _cs_pin(cs_pin),
+        _written(false),
+        _written_ms(0),
+        _setting(AD5541_SPI_SPEED, MSBFIRST, SPI_MODE0)
     {
         _current = 0;
+#if defined(__AVR__)
+        _cs_port = 0;
+        _cs_mask = 0;
+        _spcr = 0;
+        _spsr = 0;
+#endif
     }
 
     void begin()
     {
         pinMode(_cs_pin, OUTPUT);
         digitalWrite(_cs_pin, HIGH);
+#if defined(__AVR__)
+        _cs_port = portOutputRegister(digitalPinToPort(_cs_pin));
+        _cs_mask = digitalPinToBitMask(_cs_pin);
+        // Needs SPI.begin() first.
+        SPI.beginTransaction(_setting);
+        _spcr = SPCR;
+        _spsr = SPSR;
+        SPI.endTransaction();
+#endif
     }
 
+    // Always writes the device.
     void setValue(uint16_t value)
     {
         _current = value;
         send_to_device();
     }
 
+    /* ISR context, with priority access to the bus: writes 0 the shortest
+     * way.  On the AVR the SPI mode captured in begin() is loaded straight
+     * into the registers and restored afterwards, so whatever transaction
+     * the interrupted code had set up carries on unchanged. */
+    void zero()
+    {
+#if defined(__AVR__)
+        const uint8_t spcr = SPCR;
+        const uint8_t spsr = SPSR;
+        SPCR = _spcr;
+        SPSR = _spsr;
+        select();
+        SPDR = 0;
+        while (!(SPSR & _BV(SPIF))) {
+        }
+        SPDR = 0;
+        while (!(SPSR & _BV(SPIF))) {
+        }
+        deselect();
+        SPCR = spcr;
+        SPSR = spsr;
+        _current = 0;
+        _written = true;
+        _written_ms = millis();
+#else
+        setValue(0);
+#endif
+    }
+
+    /* Whether setValue(value) would change anything: the code differs from
+     * the last one written, nothing was written yet, or the last write is
+     * older than AD5541_REFRESH_INTERVAL_MS. */
+    bool needsWrite(uint16_t value) const
+    {
+        uint16_t current;
+        bool written;
+        uint32_t written_ms;
+        {
+            InterruptGuard guard;
+            current = _current;
+            written = _written;
+            written_ms = _written_ms;
+        }
+        return !written || value != current ||
+            (uint32_t)(millis() - written_ms) >= AD5541_REFRESH_INTERVAL_MS;
+    }
+
     uint16_t getValue() __attribute__((always_inline))
     {
+        InterruptGuard guard;
         return _current;
     }
 
@@ -144,13 +144,18 @@ private:
     uint8_t _ready_pin;
     AD7190Status _status;
 
+    // Shadow copies of the writable setup registers.  A bit in _shadow_valid
+    // is set once the matching copy is known to equal the device register.
+    uint32_t _mode_reg;
+    uint32_t _conf_reg;
+    uint8_t _gpocon_reg;
+    uint8_t _shadow_valid;
+
 protected:
+    // Inside beginTransaction()/endTransaction(), which set the SPI mode.
     void _SPI_Transfer(uint8_t* data, uint8_t nr)
     {
-        SPISettings setting(AD7190_SPI_CLK_SPEED, MSBFIRST, SPI_MODE3);
-        SPI.beginTransaction(setting);
         SPI.transfer(data, nr);
-        SPI.endTransaction();
     }
 
     uint32_t _readRegister(uint8_t reg, uint8_t nr)
@@ -182,6 +187,53 @@ protected:
         _SPI_Transfer(cmd, nr + 1);
     }
 
+    static uint8_t _registerSize(uint8_t reg)
+    {
+        return reg == AD7190_REG_GPOCON ? 1 : 3;
+    }
+
+    uint32_t _shadowValue(uint8_t reg) const
+    {
+        if (reg == AD7190_REG_MODE) {
+            return _mode_reg;
+        }
+        if (reg == AD7190_REG_CONF) {
+            return _conf_reg;
+        }
+        return _gpocon_reg;
+    }
+
+    void _setShadow(uint8_t reg, uint32_t val)
+    {
+        if (reg == AD7190_REG_MODE) {
+            _mode_reg = val;
+        } else if (reg == AD7190_REG_CONF) {
+            _conf_reg = val;
+        } else {
+            _gpocon_reg = (uint8_t)val;
+        }
+        _shadow_valid |= (uint8_t)(1u << reg);
+    }
+
+    // Returns the cached register, reading it once if it is not known yet.
+    uint32_t _shadowRegister(uint8_t reg)
+    {
+        if ((_shadow_valid & (1u << reg)) == 0) {
+            _setShadow(reg, _readRegister(reg, _registerSize(reg)));
+        }
+        return _shadowValue(reg);
+    }
+
+    // Blind write through the shadow; an unchanged value costs no SPI.
+    void _writeShadowed(uint8_t reg, uint32_t val)
+    {
+        if ((_shadow_valid & (1u << reg)) != 0 && _shadowValue(reg) == val) {
+            return;
+        }
+        _writeRegister(reg, val, _registerSize(reg));
+        _setShadow(reg, val);
+    }
+
     bool _waitDataReady(uint32_t timeout_ms)
     {
         uint32_t start = millis();
@@ -196,13 +248,37 @@ protected:
         return true;
     }
 
-    bool _validateDataStatus(uint8_t data_status, int expected_channel)
+    bool _readDataRegister(uint32_t& value,
+                           uint8_t& channel,
+                           int expected_channel)
+    {
+        if (!_waitDataReady(AD7190_CONVERSION_TIMEOUT_MS)) {
+            return false;
+        }
+        return _fetchDataRegister(value, channel, expected_channel);
+    }
+
+    bool _fetchDataRegister(uint32_t& value,
+                            uint8_t& channel,
+                            int expected_channel)
+    {
+        return decodeDataWord(readDataWord(), value, channel,
+                              expected_channel);
+    }
+
+    // ERR is also set when a result is clamped at either end of the range.
+    // Such a result is still a reading, and the caller re-ranges a clipped
+    // one, so only ERR with an unclamped code is a conversion error.
+    bool _validateDataStatus(uint8_t data_status,
+                             int expected_channel,
+                             uint32_t data)
     {
         if ((data_status & AD7190_STAT_NOREF) != 0) {
             _status = AD7190_STATUS_NO_REFERENCE;
             return false;
         }
-        if ((data_status & AD7190_STAT_ERR) != 0) {
+        if ((data_status & AD7190_STAT_ERR) != 0 &&
+            data != 0 && data != 0xFFFFFFUL) {
             _status = AD7190_STATUS_DATA_ERROR;
             return false;
         }
@@ -225,7 +301,11 @@ public:
         _gain_factor(1),
         _data_sta(0),
         _ready_pin(ready_pin),
-        _status(AD7190_STATUS_OK)
+        _status(AD7190_STATUS_OK),
+        _mode_reg(0),
+        _conf_reg(0),
+        _gpocon_reg(0),
+        _shadow_valid(0)
     {
 
     }
@@ -236,6 +316,8 @@ public:
         // Keep the six transmitted bytes, but do not write past the buffer.
         uint8_t registerWord[6] = {0x01, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
         _SPI_Transfer(registerWord, 6);
+        // Every register is back at its power-on value.
+        _shadow_valid = 0;
         delay(1);
     }
 
@@ -255,154 +337,262 @@ public:
             _status = AD7190_STATUS_DEVICE_ERROR;
             return false;
         }
+        syncRegisters();
         _status = AD7190_STATUS_OK;
         return true;
     }
 
+    // Reload every shadow from the device, e.g. after a suspected upset.
+    void syncRegisters()
+    {
+        _setShadow(AD7190_REG_MODE, _readRegister(AD7190_REG_MODE, 3));
+        _setShadow(AD7190_REG_CONF, _readRegister(AD7190_REG_CONF, 3));
+        _setShadow(AD7190_REG_GPOCON, _readRegister(AD7190_REG_GPOCON, 1));
+    }
+
+    /* Every register transfer sits between these.  The SPI mode is set
+     * before CS falls: after an AD5541 write in mode 0 SCK idles low, and
+     * switching it to the mode 3 idle level with the AD7190 selected would
+     * clock its serial interface once. */
     void beginTransaction()
     {
+        SPI.beginTransaction(
+            SPISettings(AD7190_SPI_CLK_SPEED, MSBFIRST, SPI_MODE3));
         digitalWrite(_cs_pin, LOW);
     }
 
     void endTransaction()
     {
         digitalWrite(_cs_pin, HIGH);
+        SPI.endTransaction();
     }
 
     void configDataStatus(int enable)
     {
-        uint32_t val = _readRegister(AD7190_REG_MODE, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_MODE);
         val &= ~AD7190_MODE_DAT_STA;  // clear current mode
         if (enable) {
             val |= AD7190_MODE_DAT_STA;
         }
         _data_sta = enable;
-        _writeRegister(AD7190_REG_MODE, val, 3);
+        _writeShadowed(AD7190_REG_MODE, val);
     }
 
     bool readDataRegister(uint32_t& value, int expected_channel = -1)
     {
-        if (!_waitDataReady(AD7190_CONVERSION_TIMEOUT_MS)) {
-            return false;
-        }
-        uint32_t raw = 0;
+        uint8_t channel = 0;
+        return _readDataRegister(value, channel, expected_channel);
+    }
+
+    /* Non-blocking counterparts of readDataRegister() for callers that poll
+     * a conversion across loop passes.  CS must be asserted: the AD7190 only
+     * drives DOUT/RDY while it is selected. */
+    bool isDataReady()
+    {
+        return digitalRead(_ready_pin) == LOW;
+    }
+
+    bool readReadyData(uint32_t& value, int expected_channel = -1)
+    {
+        uint8_t channel = 0;
+        return _fetchDataRegister(value, channel, expected_channel);
+    }
+
+    /* Raw data register access for the ready interrupt, which only latches
+     * the word and leaves validation to decodeDataWord() in the main loop.
+     * With status transmission the status byte is the low byte. */
+    uint32_t readDataWord()
+    {
+        return _readRegister(AD7190_REG_DATA, _data_sta ? 4 : 3);
+    }
+
+    // The conversion result of a data word, without any validation.
+    uint32_t dataOfWord(uint32_t word) const
+    {
+        return _data_sta ? word >> 8 : word;
+    }
+
+    bool decodeDataWord(uint32_t word,
+                        uint32_t& value,
+                        uint8_t& channel,
+                        int expected_channel = -1)
+    {
         if (_data_sta) {
-            raw = _readRegister(AD7190_REG_DATA, 4);
-            const uint8_t data_status = (uint8_t)(raw & 0xffu);
-            if (!_validateDataStatus(data_status, expected_channel)) {
+            const uint8_t data_status = (uint8_t)(word & 0xffu);
+            if (!_validateDataStatus(data_status, expected_channel,
+                                     word >> 8)) {
                 return false;
             }
-            raw >>= 8;
-        } else {
-            raw = _readRegister(AD7190_REG_DATA, 3);
+            channel = AD7190_STAT_CH(data_status);
+            word >>= 8;
         }
-        value = raw;
+        value = word;
         _status = AD7190_STATUS_OK;
         return true;
     }
 
+    /* DOUT/RDY shares MISO, so a pin-change interrupt on the ready pin can
+     * signal the end of a conversion.  The pin only carries RDY while CS is
+     * asserted and toggles with every SPI transfer, so the caller arms it
+     * only while the AD7190 is selected and the bus is otherwise idle.
+     * Without pin-change support (host builds) these are no-ops. */
+    void armReadyInterrupt()
+    {
+#if defined(digitalPinToPCMSK)
+        const uint8_t sreg = SREG;
+        cli();
+        *digitalPinToPCICR(_ready_pin) |=
+            (uint8_t)(1u << digitalPinToPCICRbit(_ready_pin));
+        // Drop an edge latched while the pin carried SPI traffic.
+        PCIFR = (uint8_t)(1u << digitalPinToPCICRbit(_ready_pin));
+        *digitalPinToPCMSK(_ready_pin) |=
+            (uint8_t)(1u << digitalPinToPCMSKbit(_ready_pin));
+        SREG = sreg;
+#endif
+    }
+
+    void disarmReadyInterrupt()
+    {
+#if defined(digitalPinToPCMSK)
+        *digitalPinToPCMSK(_ready_pin) &=
+            (uint8_t)~(1u << digitalPinToPCMSKbit(_ready_pin));
+#endif
+    }
+
+    /* Continuous sequencing alternates channels on its own, so the caller
+     * learns which channel a result belongs to from the appended status
+     * byte.  configDataStatus(1) must be active. */
+    bool readTaggedDataRegister(uint32_t& value, uint8_t& channel)
+    {
+        if (!_data_sta) {
+            _status = AD7190_STATUS_WRONG_CHANNEL;
+            return false;
+        }
+        return _readDataRegister(value, channel, -1);
+    }
+
     AD7190Status status() const
     {
         return _status;
     }
 
+    // The read* accessors always go to the device and resync the shadow.
     uint32_t readModeRegister()
     {
-        return _readRegister(AD7190_REG_MODE, 3);
+        _setShadow(AD7190_REG_MODE, _readRegister(AD7190_REG_MODE, 3));
+        return _mode_reg;
     }
 
     uint32_t readConfigRegister()
     {
-        return _readRegister(AD7190_REG_CONF, 3);
+        _setShadow(AD7190_REG_CONF, _readRegister(AD7190_REG_CONF, 3));
+        return _conf_reg;
     }
 
     uint8_t getMode()
     {
-        uint32_t val = _readRegister(AD7190_REG_MODE, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_MODE);
         val &= AD7190_MODE_SEL(7ul);
         return (uint8_t)(val >> 21);
     }
 
     void setMode(uint8_t mode)
     {
-        uint32_t val = _readRegister(AD7190_REG_MODE, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_MODE);
         val &= ~AD7190_MODE_SEL(7ul);  // clear current mode
         val |= AD7190_MODE_SEL(mode);
-        _writeRegister(AD7190_REG_MODE, val, 3);
+
+        // Single conversions and calibrations are commands: they are always
+        // written, and the AD7190 leaves them on its own when done (single
+        // conversion to power-down, calibration to idle).  Record that end
+        // state so a later field update does not restart the command.
+        uint8_t settled = mode;
+        if (mode == AD7190_MODE_SINGLE) {
+            settled = AD7190_MODE_PWRDN;
+        } else if (mode >= AD7190_MODE_CAL_INT_ZERO) {
+            settled = AD7190_MODE_IDLE;
+        }
+        if (settled == mode) {
+            _writeShadowed(AD7190_REG_MODE, val);
+            return;
+        }
+        _writeShadowed(AD7190_REG_MODE, val);
+        val &= ~AD7190_MODE_SEL(7ul);
+        _setShadow(AD7190_REG_MODE, val | AD7190_MODE_SEL(settled));
     }
 
     void configClock(int src)
     {
-        uint32_t val = _readRegister(AD7190_REG_MODE, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_MODE);
         val ^= AD7190_MODE_CLKMSK(val);
         val |= AD7190_MODE_CLKSRC(src);
-        _writeRegister(AD7190_REG_MODE, val, 3);
+        _writeShadowed(AD7190_REG_MODE, val);
     }
 
     void configFilter(uint16_t rate)
     {
-        uint32_t val = _readRegister(AD7190_REG_MODE, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_MODE);
         val ^= AD7190_MODE_RATE(val);
         val |= AD7190_MODE_RATE(rate);
-        _writeRegister(AD7190_REG_MODE, val, 3);
+        _writeShadowed(AD7190_REG_MODE, val);
     }
 
     // Config Reg
     void configChop(int enable)
     {
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
         if (enable) {
             val |= AD7190_CONF_CHOP;
         } else {
             val &= ~AD7190_CONF_CHOP;
         }
-        _writeRegister(AD7190_REG_CONF, val, 3);
+        _writeShadowed(AD7190_REG_CONF, val);
     }
 
     void configBuffer(int enable)
     {
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
         if (enable) {
             val |= AD7190_CONF_BUF;
         } else {
             val &= ~AD7190_CONF_BUF;
         }
-        _writeRegister(AD7190_REG_CONF, val, 3);
+        _writeShadowed(AD7190_REG_CONF, val);
     }
 
     void configUnipolar(int enable)
     {
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
         if (enable) {
             val |= AD7190_CONF_UNIPOLAR;
         } else {
             val &= ~AD7190_CONF_UNIPOLAR;
         }
-        _writeRegister(AD7190_REG_CONF, val, 3);
+        _writeShadowed(AD7190_REG_CONF, val);
     }
 
     void configReferenceDetection(int enable)
     {
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
         if (enable) {
             val |= AD7190_CONF_REFDET;
         } else {
             val &= ~AD7190_CONF_REFDET;
         }
-        _writeRegister(AD7190_REG_CONF, val, 3);
+        _writeShadowed(AD7190_REG_CONF, val);
     }
 
     bool setGain(uint8_t gain)
     {
-        if (_gain == gain) {
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
+        uint8_t g = AD7190_CONF_GAIN(val);
+        if (g == gain && _gain == gain) {
             return false;
         }
 
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
-        uint8_t g = AD7190_CONF_GAIN(val);
         val ^= g;
         val |= AD7190_CONF_GAIN(gain);
-        _writeRegister(AD7190_REG_CONF, val, 3);
+        _writeShadowed(AD7190_REG_CONF, val);
 
         switch (gain) {
             case AD7190_CONF_GAIN_1:
@@ -432,7 +622,7 @@ public:
 
     uint8_t getGain()
     {
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
         _gain = (uint8_t)(AD7190_CONF_GAIN(val));
         return _gain;
     }
@@ -465,26 +655,55 @@ public:
         return calibrateInternalScale();
     }
 
+    /* Calibration coefficients of the channel selected in the configuration
+     * register; each channel has its own pair.  Write them only while the
+     * AD7190 is idle or powered down. */
+    uint32_t readOffsetRegister()
+    {
+        return _readRegister(AD7190_REG_OFFSET, 3);
+    }
+
+    uint32_t readFullScaleRegister()
+    {
+        return _readRegister(AD7190_REG_FULLSCALE, 3);
+    }
+
+    void writeOffsetRegister(uint32_t val)
+    {
+        _writeRegister(AD7190_REG_OFFSET, val, 3);
+    }
+
+    void writeFullScaleRegister(uint32_t val)
+    {
+        _writeRegister(AD7190_REG_FULLSCALE, val, 3);
+    }
+
+    // GPOCON
+    void configGPOCON(uint8_t val)
+    {
+        _writeShadowed(AD7190_REG_GPOCON, val);
+    }
+
     void enableChannel(int chn)
     {
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
         val |= AD7190_CONF_CHAN(chn);
-        _writeRegister(AD7190_REG_CONF, val, 3);
+        _writeShadowed(AD7190_REG_CONF, val);
     }
 
     void disableChannel(int chn)
     {
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
         val &= ~AD7190_CONF_CHAN(chn);
-        _writeRegister(AD7190_REG_CONF, val, 3);
+        _writeShadowed(AD7190_REG_CONF, val);
     }
 
     void configChannel(int chn)
     {
-        uint32_t val = _readRegister(AD7190_REG_CONF, 3);
+        uint32_t val = _shadowRegister(AD7190_REG_CONF);
         val &= ~(0xfflu << 8);
         val |= AD7190_CONF_CHAN(chn);
-        _writeRegister(AD7190_REG_CONF, val, 3);
+        _writeShadowed(AD7190_REG_CONF, val);
     }
 };
 
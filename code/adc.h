@@ -3,36 +3,68 @@
 
 #include "ad7190.h"
 #include "control.h"
+#include "spi_bus.h"
 
-//
-const double GAIN_8_HIGH = 600.0;
-const double GAIN_1_LOW = 550.0;
+// Hysteresis band of every step of the gain ladder, as fractions of that
+// gain's full scale: a channel leaves a gain above 24/25 of its full scale
+// and only enters it below 22/25 (600 mV and 550 mV at gain 8).
+const int32_t GAIN_RANGE_HIGH_NUM = 24;
+const int32_t GAIN_RANGE_LOW_NUM = 22;
+const int32_t GAIN_RANGE_DEN = 25;
+// A result at full scale may be clipped and has to be repeated at gain 1.
+const uint32_t ADC_FULL_SCALE_CODE = 0xFFFFFFUL;
 const int DIGITAL_FILTER_WORDS = 48;
 
-// Calibrate Data for different gains
+// Calibrate Data for different gains, kept in fixed point so applying it
+// costs no soft-float work per sample.
 struct GainCalibData
 {
-    double offset;
-    double scale;
+    int32_t offset_uv;
+    int32_t scale_q24;
 };
 
+// AD7190 internal calibration coefficients of one channel, taken at gain 1.
+struct ChannelCalibration
+{
+    uint32_t offset;
+    uint32_t full_scale;
+};
+
+// Multiply by a Q24 factor, rounding to nearest.
+inline int32_t ScaleQ24(int32_t value, int32_t factor_q24)
+{
+    return (int32_t)(((int64_t)value * factor_q24 + (1L << 23)) >> 24);
+}
+
+// The input-divider display trim: (V + 6 mV) * 0.9994.
+const int32_t VOLTAGE_TRIM_OFFSET_UV = 6000L;
+const int32_t VOLTAGE_TRIM_SCALE_Q24 = 16767150L;
+
 
 // Helper function for hold the CS pin
 class ADTransaction
 {
 private:
     AD7190& _device;
+    SPIBus* _bus;
 
 public:
-    ADTransaction(AD7190& dev) :
-        _device(dev)
+    ADTransaction(AD7190& dev, SPIBus* bus = 0) :
+        _device(dev),
+        _bus(bus)
     {
+        if (_bus) {
+            _bus->lock();
+        }
         _device.beginTransaction();
     }
 
     ~ADTransaction()
     {
         _device.endTransaction();
+        if (_bus) {
+            _bus->unlock();
+        }
     }
 };
 
@@ -46,12 +78,40 @@ enum
     MAX_CHANNELS = 2,
 };
 
+// Steps of the gain ladder.  Calibration and thresholds are indexed by these.
 enum
 {
     GAIN_1 = 0,
     GAIN_8 = 1,
+    GAIN_16 = 2,
+    GAIN_32 = 3,
+    GAIN_64 = 4,
+    GAIN_128 = 5,
 
-    MAX_GAINS = 2,
+    MAX_GAINS = 6,
+};
+
+// One conversion latched by the ready interrupt
+struct ReadySample
+{
+    uint32_t word;
+    uint32_t timestamp_us;
+};
+
+// Power of two, so the indices wrap with a mask.
+#define ADC_READY_QUEUE_SIZE 4
+
+// Called as soon as a raw conversion word crosses a hard safety threshold,
+// with the AD7190 already deselected so the handler may use the SPI bus.
+typedef void (*SafetyTripHandler)(control::FaultReason reason);
+
+// Non-blocking acquisition states
+enum AcquisitionState
+{
+    ACQ_IDLE = 0,
+    ACQ_PENDING,
+    ACQ_READY,
+    ACQ_FAILED,
 };
 
 
@@ -60,29 +120,422 @@ class ADConverter
 {
 private:
 
-    double _vref;
+    int32_t _vref_uv;
 
+    // value/nominal_value are microamps for the current channel and
+    // microvolts for the voltage channel.
+    // input_uv/input_step_uv track the converter input for gain prediction.
     struct {
-        double value;
-        double nominal_value;
+        int32_t value;
+        int32_t nominal_value;
+        uint32_t timestamp_us;
+        int32_t input_uv;
+        int32_t input_step_uv;
+        bool tracked;
         uint8_t gain;
         uint8_t channel;
     } _chan[MAX_CHANNELS];
 
+    // Sense voltage expected from the DAC command.  The analog loop settles
+    // far faster than a conversion and cannot sink more than commanded.
+    int32_t _commanded_uv;
+    bool _commanded_valid;
+    uint32_t _range_retries;
+
     GainCalibData _gain_cal[MAX_GAINS];
+    ChannelCalibration _adc_cal[MAX_CHANNELS];
+    // Offset register change of the latest background calibration.
+    int32_t _offset_drift[MAX_CHANNELS];
+    int32_t _range_high_uv[MAX_GAINS];
+    int32_t _range_low_uv[MAX_GAINS];
 
     AD7190 _ad7190;
     AD7190Status _status;
 
-public:
+    // Continuous channel sequencing state.  _sequence_fresh has one bit per
+    // channel that has delivered a conversion since the sequence started.
+    bool _sequencing;
+    uint8_t _sequence_fresh;
 
-    template<int chn>
-    bool _read(double& result, double& nominal_result)
+    // Non-blocking single conversion state.  A background internal
+    // calibration occupies the same slot while _calibrating; zero-scale
+    // unless _calibrating_full.
+    AcquisitionState _acq_state;
+    bool _calibrating;
+    bool _calibrating_full;
+    uint8_t _acq_channel;
+    uint32_t _acq_started_ms;
+
+    // Interrupt-driven ready detection.  While _parked the AD7190 is selected
+    // so RDY is visible on MISO, and the pin-change interrupt latches the
+    // data word with its micros() timestamp into a single-producer queue.
+    bool _ready_irq;
+    volatile bool _parked;
+    ReadySample _ready_queue[ADC_READY_QUEUE_SIZE];
+    volatile uint8_t _ready_head;
+    volatile uint8_t _ready_tail;
+    // Optional shared bus: a parked conversion yields to its priority users.
+    SPIBus* _bus;
+    bool _bus_preempted;
+
+    // Hard limits precomputed into raw 24-bit codes for each channel and
+    // gain, so a trip is detected on the data word before any conversion.
+    uint32_t _trip_code[MAX_CHANNELS][MAX_GAINS];
+    /* Bit g: a current conversion that clips at ladder step g trips.  Above
+     * gain 1 the current limit is past full scale and the trip code
+     * saturates, so a clip is all a word can show.  It counts while the DAC
+     * commands a current inside the step's band: the current then exceeds
+     * the command, which the analog loop never allows.  A clip during a
+     * commanded step up is repeated at gain 1 as before.  One byte, so the
+     * ready interrupt reads it whole. */
+    volatile uint8_t _clip_trip_gains;
+    SafetyTripHandler _trip_handler;
+    control::FaultReason _trip_reason;
+    bool _trip_pending;
+    // Priority write of the ready interrupt on a word over the trip code.
+    SPIBusDeferredWrite _trip_write;
+    void* _trip_write_owner;
+    volatile bool _trip_written;
+
+    // The AD7190 has no gains 2 and 4, so the ladder skips codes 1 and 2.
+    // Codes for gains 8 and up equal log2(gain), so the code doubles as the
+    // gain shift.
+    static uint8_t _gainIndex(uint8_t gain)
+    {
+        return gain < AD7190_CONF_GAIN_8 ? (uint8_t)GAIN_1 :
+            (uint8_t)(gain - AD7190_CONF_GAIN_8 + GAIN_8);
+    }
+
+    static uint8_t _gainCode(uint8_t index)
+    {
+        return index == GAIN_1 ? AD7190_CONF_GAIN_1 :
+            (uint8_t)(index - GAIN_8 + AD7190_CONF_GAIN_8);
+    }
+
+    bool _tripWord(int chn, uint8_t gain_index, uint32_t value) const
+    {
+        return value > _trip_code[chn][gain_index] ||
+            (chn == CHANNEL_CURRENT && value >= ADC_FULL_SCALE_CODE &&
+             (_clip_trip_gains & (1u << gain_index)) != 0);
+    }
+
+    // Ladder steps whose band holds `commanded_uv`, gain 1 aside.
+    uint8_t _clipTripGains(int32_t commanded_uv) const
     {
-        ADTransaction trans(_ad7190);
+        uint8_t gains = 0;
+        for (uint8_t g = GAIN_8; g < MAX_GAINS; g++) {
+            if (commanded_uv <= _range_high_uv[g]) {
+                gains |= (uint8_t)(1u << g);
+            }
+        }
+        return gains;
+    }
+
+    // Only latches; the handler runs from _dispatchTrip() once CS is high.
+    void _checkTrip(int chn, uint8_t gain, uint32_t value)
+    {
+        if (!_tripWord(chn, _gainIndex(gain), value) ||
+            _trip_reason != control::FaultReason::None) {
+            return;
+        }
+        _trip_reason = chn == CHANNEL_CURRENT ?
+            control::FaultReason::Overcurrent :
+            control::FaultReason::Overvoltage;
+        _trip_pending = true;
+    }
+
+    void _dispatchTrip()
+    {
+        if (!_trip_pending) {
+            return;
+        }
+        _trip_pending = false;
+        if (_trip_handler) {
+            _trip_handler(_trip_reason);
+        }
+    }
+
+    // CS and _parked change together, so an interrupt that writes the DAC
+    // never finds the AD7190 selected without it being parked.
+    void _park()
+    {
+        if (!_ready_irq || _parked) {
+            return;
+        }
+        InterruptGuard guard;
+        _ad7190.beginTransaction();
+        _parked = true;
+        _ad7190.armReadyInterrupt();
+        // RDY may already be low, in which case no edge will follow.
+        onReadyInterrupt();
+    }
+
+    // Must precede any other SPI traffic: with the AD7190 parked, MISO
+    // carries data bits and would trigger the ready interrupt.
+    void _unpark()
+    {
+        if (!_parked) {
+            return;
+        }
+        InterruptGuard guard;
+        _ad7190.disarmReadyInterrupt();
+        _parked = false;
+        _ad7190.endTransaction();
+    }
+
+    // SPIBus park handler.  Only a conversion that was actually parked is
+    // parked again: the priority user may have interrupted the main loop in
+    // the middle of changing the acquisition state.
+    static void _busPark(void* owner, bool release)
+    {
+        ADConverter* adc = static_cast<ADConverter*>(owner);
+        if (release) {
+            adc->_bus_preempted = adc->_parked;
+            adc->releaseBus();
+        } else if (adc->_bus_preempted) {
+            adc->_bus_preempted = false;
+            adc->reclaimBus();
+        }
+    }
+
+    bool _popReady(ReadySample& sample)
+    {
+        const uint8_t tail = _ready_tail;
+        if (tail == _ready_head) {
+            return false;
+        }
+        sample = _ready_queue[tail];
+        _ready_tail = (uint8_t)((tail + 1) & (ADC_READY_QUEUE_SIZE - 1));
+        return true;
+    }
+
+    int32_t _calibrate(uint8_t gain, int32_t nominal_uv)
+    {
+        const GainCalibData& cal = _gain_cal[_gainIndex(gain)];
+        return ScaleQ24(nominal_uv, cal.scale_q24) + cal.offset_uv;
+    }
+
+    void _store(int chn,
+                int32_t uv,
+                int32_t nominal_uv,
+                uint32_t timestamp_us)
+    {
+        _chan[chn].timestamp_us = timestamp_us;
+        if (chn == CHANNEL_VOLTAGE) {
+            _chan[CHANNEL_VOLTAGE].nominal_value =
+                control::theoreticalMicrovoltsFromDivider(nominal_uv);
+            _chan[CHANNEL_VOLTAGE].value = ScaleQ24(
+                control::theoreticalMicrovoltsFromDivider(uv) +
+                    VOLTAGE_TRIM_OFFSET_UV,
+                VOLTAGE_TRIM_SCALE_Q24);
+        } else {
+            _chan[CHANNEL_CURRENT].nominal_value =
+                control::theoreticalMicroampsFromSenseMicrovolts(nominal_uv);
+            _chan[CHANNEL_CURRENT].value =
+                control::theoreticalMicroampsFromSenseMicrovolts(uv);
+        }
+    }
+
+    static uint8_t _gainShift(uint8_t gain_factor)
+    {
+        uint8_t shift = 0;
+        while ((1u << shift) < gain_factor) {
+            shift++;
+        }
+        return shift;
+    }
+
+    // Picks the gain for the next conversion of a channel from its last
+    // reading plus its last rise, and for the current channel from the DAC
+    // command.  The larger prediction wins, so a load step up does not clip
+    // a high gain; inside a step's hysteresis band the gain is kept.
+    void _selectGain(int chn)
+    {
+        if (!_chan[chn].tracked) {
+            return;
+        }
+        int32_t predicted_uv = _chan[chn].input_uv;
+        if (_chan[chn].input_step_uv > 0) {
+            predicted_uv += _chan[chn].input_step_uv;
+        }
+        if (chn == CHANNEL_CURRENT && _commanded_valid &&
+            _commanded_uv > predicted_uv) {
+            predicted_uv = _commanded_uv;
+        }
+        // Several steps at once if needed: a conversion costs far more
+        // than walking the ladder.
+        uint8_t index = _gainIndex(_chan[chn].gain);
+        while (index > GAIN_1 && predicted_uv > _range_high_uv[index]) {
+            index--;
+        }
+        while (index + 1 < MAX_GAINS &&
+               predicted_uv < _range_low_uv[index + 1]) {
+            index++;
+        }
+        _chan[chn].gain = _gainCode(index);
+    }
+
+    void _track(int chn, int32_t nominal_uv)
+    {
+        _chan[chn].input_step_uv = _chan[chn].tracked ?
+            nominal_uv - _chan[chn].input_uv : 0;
+        _chan[chn].input_uv = nominal_uv;
+        _chan[chn].tracked = true;
+        _selectGain(chn);
+    }
+
+    // Converts one raw result taken at the channel's gain.  A result outside
+    // the gain's band is still valid and kept; only the next conversion
+    // changes gain.  Returns false if the result clipped at full scale, in
+    // which case it is repeated at gain 1.
+    bool _range(int chn,
+                uint32_t value,
+                int32_t& uv,
+                int32_t& nominal_uv)
+    {
+        const uint8_t shift = _gainShift(_ad7190.getGainFactor());
+        if (value >= ADC_FULL_SCALE_CODE &&
+            _chan[chn].gain != AD7190_CONF_GAIN_1) {
+            // Nothing is known above this gain's full scale, so assume the
+            // worst and repeat at gain 1.
+            _track(chn, _vref_uv);
+            _chan[chn].gain = AD7190_CONF_GAIN_1;
+            _range_retries++;
+            return false;
+        }
+        nominal_uv = control::adcMicrovoltsFromCode(value, _vref_uv, shift);
+        uv = _calibrate(_chan[chn].gain, nominal_uv);
+        _track(chn, nominal_uv);
+        return true;
+    }
+
+    void _beginConversion()
+    {
+        _unpark();
+        _ready_tail = _ready_head;
+        _selectGain(_acq_channel);
+        {
+            ADTransaction trans(_ad7190, _bus);
+            _ad7190.configChannel(_chan[_acq_channel].channel);
+            _ad7190.setGain(_chan[_acq_channel].gain);
+            _ad7190.setMode(AD7190_MODE_SINGLE);
+        }
+        _acq_started_ms = millis();
+        _acq_state = ACQ_PENDING;
+        _park();
+    }
+
+    int _channelFromTag(uint8_t tag) const
+    {
+        if (tag == AD7190_STAT_CH(_chan[CHANNEL_VOLTAGE].channel)) {
+            return CHANNEL_VOLTAGE;
+        }
+        if (tag == AD7190_STAT_CH(_chan[CHANNEL_CURRENT].channel)) {
+            return CHANNEL_CURRENT;
+        }
+        return -1;
+    }
+
+    bool _readSequenced()
+    {
+        uint32_t value = 0;
+        uint8_t tag = 0;
+        if (!_ad7190.readTaggedDataRegister(value, tag)) {
+            _status = _ad7190.status();
+            return false;
+        }
+        // The read follows RDY immediately, so this is the conversion time.
+        const uint32_t timestamp_us = micros();
+        const int chn = _channelFromTag(tag);
+        if (chn < 0) {
+            _status = AD7190_STATUS_WRONG_CHANNEL;
+            return false;
+        }
+
+        // Sequencing only runs at gain 1.
+        _checkTrip(chn, AD7190_CONF_GAIN_1, value);
+        const int32_t nominal_uv =
+            control::adcMicrovoltsFromCode(value, _vref_uv, 0);
+        _store(chn, _calibrate(AD7190_CONF_GAIN_1, nominal_uv),
+               nominal_uv, timestamp_us);
+        _sequence_fresh |= (uint8_t)(1u << chn);
+
+        // A gain-1 reading below the range threshold is still valid, so keep
+        // it and move that channel to gain 8 for the next conversion.
+        _track(chn, nominal_uv);
+        return true;
+    }
+
+    // Register setup shared by init() and restoreCalibration().
+    void _configure()
+    {
+        _sequencing = false;
+        _acq_state = ACQ_IDLE;
+        _calibrating = false;
+        // we are running AD7190 in single convert mode.
+        // this is to workaround the different gains
+        // of current and voltage.
+        _ad7190.configUnipolar(1);
+        _ad7190.configReferenceDetection(1);
+        _ad7190.configDataStatus(1);
+        _ad7190.configFilter(DIGITAL_FILTER_WORDS);
+        _ad7190.setGain(AD7190_CONF_GAIN_1);
+    }
+
+    AcquisitionState _pollCalibration()
+    {
+        ADTransaction trans(_ad7190, _bus);
+        if (!_ad7190.isDataReady()) {
+            if (control::hasElapsed(millis(), _acq_started_ms,
+                                    AD7190_CALIBRATION_TIMEOUT_MS)) {
+                _status = AD7190_STATUS_TIMEOUT;
+                _acq_state = ACQ_FAILED;
+            }
+            return _acq_state;
+        }
+        ChannelCalibration& cal = _adc_cal[_acq_channel];
+        if (_calibrating_full) {
+            cal.full_scale = _ad7190.readFullScaleRegister();
+            _status = AD7190_STATUS_OK;
+            _acq_state = ACQ_READY;
+            return _acq_state;
+        }
+        const uint32_t offset = _ad7190.readOffsetRegister();
+        // A zero full scale means no coefficients are known yet.
+        _offset_drift[_acq_channel] = cal.full_scale != 0 ?
+            (int32_t)(offset - cal.offset) : 0;
+        cal.offset = offset;
+        _status = AD7190_STATUS_OK;
+        _acq_state = ACQ_READY;
+        return _acq_state;
+    }
+
+    void _startCalibration(int chn, uint8_t mode)
+    {
+        _unpark();
+        _sequencing = false;
+        _acq_channel = (uint8_t)chn;
+        {
+            ADTransaction trans(_ad7190, _bus);
+            _ad7190.configChannel(_chan[chn].channel);
+            _ad7190.setGain(AD7190_CONF_GAIN_1);
+            _ad7190.setMode(mode);
+        }
+        _acq_started_ms = millis();
+        _acq_state = ACQ_PENDING;
+        _calibrating = true;
+        _calibrating_full = mode == AD7190_MODE_CAL_INT_FULL;
+    }
+
+    bool _convert(int chn, int32_t& result_uv, int32_t& nominal_result_uv)
+    {
+        ADTransaction trans(_ad7190, _bus);
+        // a single conversion ends any running sequence
+        _sequencing = false;
         // setup channel
         _ad7190.configChannel(_chan[chn].channel);
-        // sample until we have the best value
+        _selectGain(chn);
+        // repeated only if the result clipped at the predicted gain
         do {
             _ad7190.setGain(_chan[chn].gain);
             _ad7190.setMode(AD7190_MODE_SINGLE);
@@ -91,69 +544,105 @@ public:
                 _status = _ad7190.status();
                 return false;
             }
-            uint8_t gain_factor = _ad7190.getGainFactor();
-            const double nominal_voltage =
-                (double)value * _vref / AD7190_CODES / gain_factor;
-            double voltage = nominal_voltage;
-
-            // FIXME: we need to find a better solution for gain to calib mapping
-            if (_chan[chn].gain == AD7190_CONF_GAIN_1) {
-                voltage *= _gain_cal[0].scale;
-                voltage += _gain_cal[0].offset;
-            } else {
-                voltage *= _gain_cal[1].scale;
-                voltage += _gain_cal[1].offset;
-            }
-
-            if (nominal_voltage > GAIN_8_HIGH &&
-                _chan[chn].gain != AD7190_CONF_GAIN_1) {
-                _chan[chn].gain = AD7190_CONF_GAIN_1;
-            } else if (nominal_voltage < GAIN_1_LOW &&
-                       _chan[chn].gain != AD7190_CONF_GAIN_8) {
-                _chan[chn].gain = AD7190_CONF_GAIN_8;
-            } else {
-                result = voltage;
-                nominal_result = nominal_voltage;
+            _checkTrip(chn, _chan[chn].gain, value);
+            int32_t uv = 0;
+            int32_t nominal_uv = 0;
+            if (_range(chn, value, uv, nominal_uv)) {
+                _chan[chn].timestamp_us = micros();
+                result_uv = uv;
+                nominal_result_uv = nominal_uv;
                 _status = AD7190_STATUS_OK;
                 return true;
             }
         } while (1);
     }
 
-    /* Keep the original helper available to existing callers that only need
-     * the calibrated operating reading. */
+public:
+
+    // Results are microvolts at the converter input.
     template<int chn>
-    bool _read(double& result)
+    bool _read(int32_t& result_uv, int32_t& nominal_result_uv)
     {
-        double nominal_result = 0.0;
-        return _read<chn>(result, nominal_result);
+        _unpark();
+        _acq_state = ACQ_IDLE;
+        _calibrating = false;
+        const bool ok = _convert(chn, result_uv, nominal_result_uv);
+        _dispatchTrip();
+        return ok;
     }
 
-public:
-
     ADConverter(uint8_t cs_pin,
                 uint8_t voltage_channel,
                 uint8_t current_channel,
                 double vref,
                 uint8_t ready_pin = MISO) :
-        _vref(vref),
+        _vref_uv((int32_t)(vref * 1000.0)),
+        _commanded_uv(0),
+        _commanded_valid(false),
+        _range_retries(0),
         _ad7190(cs_pin, ready_pin),
-        _status(AD7190_STATUS_OK)
+        _status(AD7190_STATUS_OK),
+        _sequencing(false),
+        _sequence_fresh(0),
+        _acq_state(ACQ_IDLE),
+        _calibrating(false),
+        _calibrating_full(false),
+        _acq_channel(CHANNEL_CURRENT),
+        _acq_started_ms(0),
+        _ready_irq(false),
+        _parked(false),
+        _ready_head(0),
+        _ready_tail(0),
+        _bus(0),
+        _bus_preempted(false),
+        _trip_handler(0),
+        _trip_reason(control::FaultReason::None),
+        _trip_pending(false),
+        _trip_write(0),
+        _trip_write_owner(0),
+        _trip_written(false)
     {
-        _chan[CHANNEL_VOLTAGE].value = 0.0;
-        _chan[CHANNEL_VOLTAGE].nominal_value = 0.0;
+        _chan[CHANNEL_VOLTAGE].value = 0;
+        _chan[CHANNEL_VOLTAGE].nominal_value = 0;
+        _chan[CHANNEL_VOLTAGE].timestamp_us = 0;
+        _chan[CHANNEL_VOLTAGE].input_uv = 0;
+        _chan[CHANNEL_VOLTAGE].input_step_uv = 0;
+        _chan[CHANNEL_VOLTAGE].tracked = false;
         _chan[CHANNEL_VOLTAGE].gain = 0;
         _chan[CHANNEL_VOLTAGE].channel = voltage_channel;
 
-        _chan[CHANNEL_CURRENT].value = 0.0;
-        _chan[CHANNEL_CURRENT].nominal_value = 0.0;
+        _chan[CHANNEL_CURRENT].value = 0;
+        _chan[CHANNEL_CURRENT].nominal_value = 0;
+        _chan[CHANNEL_CURRENT].timestamp_us = 0;
+        _chan[CHANNEL_CURRENT].input_uv = 0;
+        _chan[CHANNEL_CURRENT].input_step_uv = 0;
+        _chan[CHANNEL_CURRENT].tracked = false;
         _chan[CHANNEL_CURRENT].gain = 0;
         _chan[CHANNEL_CURRENT].channel = current_channel;
 
-        _gain_cal[0].scale = 1.0;
-        _gain_cal[0].offset = 0.0;
-        _gain_cal[1].scale = 1.0;
-        _gain_cal[1].offset = 0.0;
+        // Unknown until init() or restoreCalibration().
+        for (uint8_t chn = 0; chn < MAX_CHANNELS; chn++) {
+            _adc_cal[chn].offset = 0;
+            _adc_cal[chn].full_scale = 0;
+            _offset_drift[chn] = 0;
+        }
+
+        for (uint8_t g = 0; g < MAX_GAINS; g++) {
+            _gain_cal[g].scale_q24 = 1L << 24;
+            _gain_cal[g].offset_uv = 0;
+            const int32_t full_scale_uv = _vref_uv >> _gainCode(g);
+            _range_high_uv[g] =
+                full_scale_uv / GAIN_RANGE_DEN * GAIN_RANGE_HIGH_NUM;
+            _range_low_uv[g] =
+                full_scale_uv / GAIN_RANGE_DEN * GAIN_RANGE_LOW_NUM;
+        }
+
+        for (uint8_t chn = 0; chn < MAX_CHANNELS; chn++) {
+            for (uint8_t g = 0; g < MAX_GAINS; g++) {
+                _trip_code[chn][g] = 0xFFFFFFUL;
+            }
+        }
+        _clip_trip_gains = _clipTripGains(0);
     }
 
     void begin()
@@ -164,120 +653,558 @@ public:
 
     bool detectDevice()
     {
-        ADTransaction trans(_ad7190);
+        _unpark();
+        ADTransaction trans(_ad7190, _bus);
         bool detected = _ad7190.init();
         _status = _ad7190.status();
         return detected;
     }
 
+    // offset is in millivolts.  Converted to fixed point once, here.
     void setCalibData(uint8_t gain, double scale, double offset)
     {
-        if (gain == AD7190_CONF_GAIN_1) {
-            _gain_cal[0].scale = scale;
-            _gain_cal[0].offset = offset;
-        } else {
-            _gain_cal[1].scale = scale;
-            _gain_cal[1].offset = offset;
+        GainCalibData& cal = _gain_cal[_gainIndex(gain)];
+        cal.scale_q24 = (int32_t)(scale * 16777216.0 + 0.5);
+        cal.offset_uv = (int32_t)(offset * 1000.0 + (offset < 0 ? -0.5 : 0.5));
+    }
+
+    // gain is the AD7190 gain code, as above.
+    void setCalibData(uint8_t gain, const GainCalibData& cal)
+    {
+        _gain_cal[_gainIndex(gain)] = cal;
+    }
+
+    const GainCalibData& getCalibData(uint8_t gain) const
+    {
+        return _gain_cal[_gainIndex(gain)];
+    }
+
+    uint8_t channelGain(int chn) const
+    {
+        return _chan[chn].gain;
+    }
+
+    /* Overcurrent and overvoltage are compared against the nominal
+     * schematic readings, so their thresholds translate exactly into raw
+     * codes.  Power and temperature need both channels or another sensor and
+     * stay with control::evaluateSafety(); undervoltage is not a fault. */
+    void setSafetyLimits(const control::FixedSafetyLimits& limits)
+    {
+        const int32_t sense_uv =
+            control::theoreticalSenseMicrovoltsForMicroamps(
+                limits.max_current_ua);
+        const int32_t divider_uv =
+            control::theoreticalDividerMicrovoltsForMicrovolts(
+                limits.max_voltage_uv);
+        for (uint8_t g = 0; g < MAX_GAINS; g++) {
+            _trip_code[CHANNEL_CURRENT][g] = control::adcCodeForMicrovolts(
+                sense_uv, _vref_uv, _gainCode(g));
+            _trip_code[CHANNEL_VOLTAGE][g] = control::adcCodeForMicrovolts(
+                divider_uv, _vref_uv, _gainCode(g));
         }
     }
 
+    // Current the DAC now commands; used to range the current channel
+    // before the load step shows up in a reading.
+    void predictCurrent(int32_t commanded_ua)
+    {
+        _commanded_uv =
+            control::theoreticalSenseMicrovoltsForMicroamps(commanded_ua);
+        _commanded_valid = true;
+        _clip_trip_gains = _clipTripGains(_commanded_uv);
+    }
+
+    // Conversions repeated because the predicted gain clipped.
+    uint32_t rangeRetries() const
+    {
+        return _range_retries;
+    }
+
+    void resetRangeRetries()
+    {
+        _range_retries = 0;
+    }
+
+    void setSafetyTripHandler(SafetyTripHandler handler)
+    {
+        _trip_handler = handler;
+    }
+
+    // The first trip is latched until cleared, so the handler runs once.
+    control::FaultReason safetyTrip() const
+    {
+        return _trip_reason;
+    }
+
+    void clearSafetyTrip()
+    {
+        _trip_reason = control::FaultReason::None;
+        _trip_pending = false;
+        _trip_written = false;
+    }
+
+    /* With an attached bus, the ready interrupt compares the raw word with
+     * the trip code itself and hands `write` to SPIBus::priorityWrite() on
+     * a word over it, so the output can be cut before the main loop gets
+     * to the conversion.  The trip handler still follows from there. */
+    void setSafetyTripWrite(SPIBusDeferredWrite write, void* owner)
+    {
+        _trip_write = write;
+        _trip_write_owner = owner;
+    }
+
+    // The ready interrupt has issued the trip write since the last clear.
+    bool safetyTripWritten() const
+    {
+        return _trip_written;
+    }
+
     bool init()
     {
-        ADTransaction trans(_ad7190);
-        // we are running AD7190 in single convert mode.
-        // this is to workaround the different gains
-        // of current and voltage.
-        _ad7190.configUnipolar(1);
-        _ad7190.configReferenceDetection(1);
-        _ad7190.configDataStatus(1);
-        _ad7190.configFilter(DIGITAL_FILTER_WORDS);
-        _ad7190.setGain(AD7190_CONF_GAIN_1);
-        if (!_ad7190.calibrate(_chan[CHANNEL_VOLTAGE].channel)) {
-            _status = _ad7190.status();
-            return false;
+        _unpark();
+        ADTransaction trans(_ad7190, _bus);
+        _configure();
+        for (uint8_t chn = 0; chn < MAX_CHANNELS; chn++) {
+            if (!_ad7190.calibrate(_chan[chn].channel)) {
+                _status = _ad7190.status();
+                return false;
+            }
+            // Keep the result so the next boot can restore it.
+            _adc_cal[chn].offset = _ad7190.readOffsetRegister();
+            _adc_cal[chn].full_scale = _ad7190.readFullScaleRegister();
         }
-        if (!_ad7190.calibrate(_chan[CHANNEL_CURRENT].channel)) {
-            _status = _ad7190.status();
-            return false;
+        _ad7190.setMode(AD7190_MODE_PWRDN);
+        _status = AD7190_STATUS_OK;
+        return true;
+    }
+
+    /* Same as init(), but leaves the calibration registers at their
+     * power-on values and returns at once.  The background zero-scale and
+     * full-scale calibrations then calibrate one channel at a time. */
+    bool initUncalibrated()
+    {
+        _unpark();
+        ADTransaction trans(_ad7190, _bus);
+        _configure();
+        _ad7190.setMode(AD7190_MODE_PWRDN);
+        for (uint8_t chn = 0; chn < MAX_CHANNELS; chn++) {
+            _ad7190.configChannel(_chan[chn].channel);
+            _adc_cal[chn].offset = _ad7190.readOffsetRegister();
+            _adc_cal[chn].full_scale = _ad7190.readFullScaleRegister();
         }
+        _status = AD7190_STATUS_OK;
+        return true;
+    }
+
+    /* Same as init(), but writes coefficients from an earlier calibration
+     * instead of running the internal zero/full-scale calibrations.  Each
+     * register is read back, so a failed write is reported. */
+    bool restoreCalibration(const ChannelCalibration cal[MAX_CHANNELS])
+    {
+        _unpark();
+        ADTransaction trans(_ad7190, _bus);
+        _configure();
+        // The calibration registers only accept writes while not converting.
         _ad7190.setMode(AD7190_MODE_PWRDN);
+        for (uint8_t chn = 0; chn < MAX_CHANNELS; chn++) {
+            _ad7190.configChannel(_chan[chn].channel);
+            _ad7190.writeOffsetRegister(cal[chn].offset);
+            _ad7190.writeFullScaleRegister(cal[chn].full_scale);
+            if (_ad7190.readOffsetRegister() != cal[chn].offset ||
+                _ad7190.readFullScaleRegister() != cal[chn].full_scale) {
+                _status = AD7190_STATUS_DEVICE_ERROR;
+                return false;
+            }
+            _adc_cal[chn] = cal[chn];
+        }
         _status = AD7190_STATUS_OK;
         return true;
     }
 
+    const ChannelCalibration& channelCalibration(int chn) const
+    {
+        return _adc_cal[chn];
+    }
+
     bool updateVoltage() __attribute__((always_inline))
     {
-        double voltage = 0.0;
-        double nominal_voltage = 0.0;
+        int32_t voltage = 0;
+        int32_t nominal_voltage = 0;
         if (!_read<CHANNEL_VOLTAGE>(voltage, nominal_voltage)) {
             return false;
         }
-        _chan[CHANNEL_VOLTAGE].nominal_value =
-            control::theoreticalVoltageFromDivider(nominal_voltage / 1000.0);
-        _chan[CHANNEL_VOLTAGE].value =
-            (control::theoreticalVoltageFromDivider(voltage / 1000.0) +
-             0.006) * 0.9994;
+        _store(CHANNEL_VOLTAGE, voltage, nominal_voltage,
+               _chan[CHANNEL_VOLTAGE].timestamp_us);
         return true;
     }
 
     bool updateCurrent() __attribute__((always_inline))
     {
-        double current = 0.0;
-        double nominal_current = 0.0;
+        int32_t current = 0;
+        int32_t nominal_current = 0;
         if (!_read<CHANNEL_CURRENT>(current, nominal_current)) {
             return false;
         }
-        _chan[CHANNEL_CURRENT].nominal_value =
-            control::theoreticalCurrentFromSenseVoltage(
-                nominal_current / 1000.0);
-        _chan[CHANNEL_CURRENT].value =
-            control::theoreticalCurrentFromSenseVoltage(current / 1000.0);
+        _store(CHANNEL_CURRENT, current, nominal_current,
+               _chan[CHANNEL_CURRENT].timestamp_us);
         return true;
     }
 
+    /* Non-blocking acquisition: startConversion() issues a single
+     * conversion and releases CS, pollConversion() briefly selects the AD7190
+     * to look at RDY, and collectConversion() hands the stored result over.
+     * A clipped result restarts the conversion and keeps it pending. */
+    void startConversion(int chn)
+    {
+        _sequencing = false;
+        _calibrating = false;
+        _acq_channel = (uint8_t)chn;
+        _beginConversion();
+    }
+
+    AcquisitionState pollConversion()
+    {
+        if (_acq_state != ACQ_PENDING) {
+            return _acq_state;
+        }
+        if (_calibrating) {
+            return _pollCalibration();
+        }
+
+        uint32_t value = 0;
+        uint32_t timestamp_us = 0;
+        if (_ready_irq) {
+            ReadySample sample;
+            if (!_popReady(sample)) {
+                if (control::hasElapsed(millis(), _acq_started_ms,
+                                        AD7190_CONVERSION_TIMEOUT_MS)) {
+                    _unpark();
+                    _status = AD7190_STATUS_TIMEOUT;
+                    _acq_state = ACQ_FAILED;
+                }
+                return _acq_state;
+            }
+            uint8_t channel = 0;
+            if (!_ad7190.decodeDataWord(sample.word, value, channel,
+                                        _chan[_acq_channel].channel)) {
+                _status = _ad7190.status();
+                _acq_state = ACQ_FAILED;
+                return _acq_state;
+            }
+            timestamp_us = sample.timestamp_us;
+        } else {
+            ADTransaction trans(_ad7190, _bus);
+            if (!_ad7190.isDataReady()) {
+                if (control::hasElapsed(millis(), _acq_started_ms,
+                                        AD7190_CONVERSION_TIMEOUT_MS)) {
+                    _status = AD7190_STATUS_TIMEOUT;
+                    _acq_state = ACQ_FAILED;
+                }
+                return _acq_state;
+            }
+            // Polled detection: accurate to the poll interval only.
+            timestamp_us = micros();
+            if (!_ad7190.readReadyData(value, _chan[_acq_channel].channel)) {
+                _status = _ad7190.status();
+                _acq_state = ACQ_FAILED;
+                return _acq_state;
+            }
+        }
+        _checkTrip(_acq_channel, _chan[_acq_channel].gain, value);
+
+        int32_t voltage = 0;
+        int32_t nominal_voltage = 0;
+        if (!_range(_acq_channel, value, voltage, nominal_voltage)) {
+            _beginConversion();
+        } else {
+            _store(_acq_channel, voltage, nominal_voltage, timestamp_us);
+            _status = AD7190_STATUS_OK;
+            _acq_state = ACQ_READY;
+        }
+        // After the state update, so a handler that writes the DAC through
+        // releaseBus()/reclaimBus() sees a consistent acquisition.
+        _dispatchTrip();
+        return _acq_state;
+    }
+
+    // Returns true if the finished conversion was valid and returns to idle.
+    bool collectConversion()
+    {
+        const bool valid = _acq_state == ACQ_READY;
+        if (_acq_state != ACQ_PENDING) {
+            _acq_state = ACQ_IDLE;
+            _calibrating = false;
+        }
+        return valid;
+    }
+
+    // Forget a pending conversion; the next start overrides it.
+    void cancelConversion()
+    {
+        _unpark();
+        _acq_state = ACQ_IDLE;
+        _calibrating = false;
+    }
+
+    /* Background zero-scale self-calibration of one channel at the gain it
+     * was calibrated at in init().  It runs through the acquisition slot:
+     * pollConversion() and collectConversion() finish it, and only the
+     * channel's offset register changes.  RDY is polled; the ready
+     * interrupt would latch a meaningless data word. */
+    void startZeroCalibration(int chn)
+    {
+        _startCalibration(chn, AD7190_MODE_CAL_INT_ZERO);
+    }
+
+    /* The internal full-scale calibration init() follows the zero-scale one
+     * with, in the same slot; only the full-scale register changes.  Run
+     * it after a zero-scale calibration of the same channel. */
+    void startFullScaleCalibration(int chn)
+    {
+        _startCalibration(chn, AD7190_MODE_CAL_INT_FULL);
+    }
+
+    bool isCalibrating() const
+    {
+        return _calibrating;
+    }
+
+    // Offset register codes moved by the latest background calibration.
+    int32_t offsetDrift(int chn) const
+    {
+        return _offset_drift[chn];
+    }
+
+    /* Ready interrupt mode: a pending conversion keeps the AD7190 selected
+     * and the pin-change ISR must call onReadyInterrupt().  Other SPI users
+     * bracket their transfers with releaseBus()/reclaimBus(), or go through
+     * the priority path of an attached SPIBus. */
+    void enableReadyInterrupt(bool enable)
+    {
+        _unpark();
+        _ready_irq = enable;
+        if (_acq_state == ACQ_PENDING && !_calibrating) {
+            _park();
+        }
+    }
+
+    // ISR context.  Reads the finished word while the bus is still parked
+    // and queues it with the time RDY fell.
+    void onReadyInterrupt()
+    {
+        if (!_parked || !_ad7190.isDataReady()) {
+            return;
+        }
+        const uint32_t timestamp_us = micros();
+        _ad7190.disarmReadyInterrupt();
+        _parked = false;
+        if (_bus) {
+            _bus->lock();
+        }
+        const uint32_t word = _ad7190.readDataWord();
+        _ad7190.endTransaction();
+        if (_bus) {
+            _bus->unlock();
+        }
+        if (_bus && _trip_write && !_trip_written &&
+            _tripWord(_acq_channel, _gainIndex(_chan[_acq_channel].gain),
+                      _ad7190.dataOfWord(word))) {
+            _trip_written = true;
+            _bus->priorityWrite(_trip_write, _trip_write_owner);
+        }
+
+        const uint8_t head = _ready_head;
+        const uint8_t next =
+            (uint8_t)((head + 1) & (ADC_READY_QUEUE_SIZE - 1));
+        if (next != _ready_tail) {
+            _ready_queue[head].word = word;
+            _ready_queue[head].timestamp_us = timestamp_us;
+            _ready_head = next;
+        }
+    }
+
+    void releaseBus()
+    {
+        _unpark();
+    }
+
+    void reclaimBus()
+    {
+        if (_acq_state == ACQ_PENDING && !_calibrating &&
+            _ready_tail == _ready_head) {
+            _park();
+        }
+    }
+
+    /* Share the SPI bus through an arbiter.  Register transfers lock it, and
+     * its priority users take over a parked conversion. */
+    void attachBus(SPIBus& bus)
+    {
+        _bus = &bus;
+        bus.setParkHandler(_busPark, this);
+    }
+
+    bool isConverting() const
+    {
+        return _acq_state == ACQ_PENDING;
+    }
+
+    int conversionChannel() const
+    {
+        return _acq_channel;
+    }
+
+    /* Both channels share the configuration register, so continuous
+     * sequencing is only possible while both are ranged at gain 1.  Below
+     * that the single-conversion path above keeps the gain 8 resolution. */
+    bool canSequence() const
+    {
+        return _chan[CHANNEL_VOLTAGE].gain == AD7190_CONF_GAIN_1 &&
+               _chan[CHANNEL_CURRENT].gain == AD7190_CONF_GAIN_1;
+    }
+
+    bool isSequencing() const
+    {
+        return _sequencing;
+    }
+
+    // Enable both channels and let the AD7190 alternate between them in
+    // continuous mode.  Results are identified by the status byte.
+    void startSequence()
+    {
+        _unpark();
+        ADTransaction trans(_ad7190, _bus);
+        _ad7190.configChannel(_chan[CHANNEL_VOLTAGE].channel);
+        _ad7190.enableChannel(_chan[CHANNEL_CURRENT].channel);
+        _ad7190.setGain(AD7190_CONF_GAIN_1);
+        _ad7190.setMode(AD7190_MODE_CONT);
+        _acq_state = ACQ_IDLE;
+        _acq_started_ms = millis();
+        _sequencing = true;
+        _sequence_fresh = 0;
+    }
+
+    void stopSequence()
+    {
+        if (!_sequencing) {
+            return;
+        }
+        ADTransaction trans(_ad7190, _bus);
+        _ad7190.setMode(AD7190_MODE_IDLE);
+        _sequencing = false;
+    }
+
+    /* Pick up the next tagged conversion.  The first call after a start also
+     * waits for the other channel, so both readings are always populated.
+     * A failure or a range change stops the sequence; the next update then
+     * goes through the single-conversion path. */
+    bool updateSequence()
+    {
+        if (!_sequencing) {
+            return false;
+        }
+        const uint8_t all_channels = (1u << MAX_CHANNELS) - 1u;
+        do {
+            bool ok = false;
+            {
+                ADTransaction trans(_ad7190, _bus);
+                ok = _readSequenced();
+            }
+            _dispatchTrip();
+            if (!ok || !canSequence()) {
+                stopSequence();
+            }
+            if (!ok) {
+                return false;
+            }
+        } while (_sequencing && _sequence_fresh != all_channels);
+        _status = AD7190_STATUS_OK;
+        return true;
+    }
+
+    /* Non-blocking counterpart of updateSequence() for a scheduled caller.
+     * The tagged conversion is only read once RDY is low.  ACQ_READY means
+     * a new conversion arrived and both channels hold one from this
+     * sequence; a failure, including no conversion within the timeout,
+     * stops the sequence and returns ACQ_FAILED. */
+    AcquisitionState pollSequence()
+    {
+        if (!_sequencing) {
+            return ACQ_IDLE;
+        }
+        bool ready = false;
+        bool ok = false;
+        {
+            ADTransaction trans(_ad7190, _bus);
+            ready = _ad7190.isDataReady();
+            if (ready) {
+                ok = _readSequenced();
+            }
+        }
+        if (!ready) {
+            if (control::hasElapsed(millis(), _acq_started_ms,
+                                    AD7190_CONVERSION_TIMEOUT_MS)) {
+                _status = AD7190_STATUS_TIMEOUT;
+                stopSequence();
+                return ACQ_FAILED;
+            }
+            return ACQ_PENDING;
+        }
+        _acq_started_ms = millis();
+        _dispatchTrip();
+        if (!ok || !canSequence()) {
+            stopSequence();
+        }
+        if (!ok) {
+            return ACQ_FAILED;
+        }
+        _status = AD7190_STATUS_OK;
+        const uint8_t all_channels = (1u << MAX_CHANNELS) - 1u;
+        return _sequence_fresh == all_channels ? ACQ_READY : ACQ_PENDING;
+    }
+
     AD7190Status status() const
     {
         return _status;
     }
 
-    double readVoltage() __attribute__((always_inline))
+    int32_t readVoltageMicrovolts() __attribute__((always_inline))
     {
         return _chan[CHANNEL_VOLTAGE].value;
     }
 
-    double readCurrent() __attribute__((always_inline))
+    int32_t readCurrentMicroamps() __attribute__((always_inline))
     {
         return _chan[CHANNEL_CURRENT].value;
     }
 
-    /* Nominal readings are derived directly from the schematic transfer
-     * values. They intentionally do not include calibration scale/offset. */
-    double readNominalVoltage() __attribute__((always_inline))
+    /* The safety readings use the schematic transfer values only, without
+     * the calibration scale and offset. */
+    int32_t readSafetyVoltageMicrovolts() __attribute__((always_inline))
     {
         return _chan[CHANNEL_VOLTAGE].nominal_value;
     }
 
-    double readNominalCurrent() __attribute__((always_inline))
+    int32_t readSafetyCurrentMicroamps() __attribute__((always_inline))
     {
         return _chan[CHANNEL_CURRENT].nominal_value;
     }
 
-    /* Safety-oriented aliases make the calibration boundary explicit at the
-     * call site while retaining the nominal names for diagnostics. */
-    double readSafetyVoltage() __attribute__((always_inline))
+    /* micros() at which the latest reading of each channel completed. */
+    uint32_t readVoltageTimestamp() __attribute__((always_inline))
     {
-        return readNominalVoltage();
+        return _chan[CHANNEL_VOLTAGE].timestamp_us;
     }
 
-    double readSafetyCurrent() __attribute__((always_inline))
+    uint32_t readCurrentTimestamp() __attribute__((always_inline))
     {
-        return readNominalCurrent();
+        return _chan[CHANNEL_CURRENT].timestamp_us;
     }
 
     void resetCurrent()
     {
-        _chan[CHANNEL_CURRENT].value = 0.0;
-        _chan[CHANNEL_CURRENT].nominal_value = 0.0;
+        _chan[CHANNEL_CURRENT].value = 0;
+        _chan[CHANNEL_CURRENT].nominal_value = 0;
     }
 
 };
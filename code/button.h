@@ -1,60 +1,118 @@
 #ifndef __BUTTON_H__
 #define __BUTTON_H__
 
+#include <stdint.h>
 
-#define ACTIVE_TICK_COUNT   1
+
+// Events of one sample, bit i for button i.
+struct ButtonEvents
+{
+    uint8_t press;
+    uint8_t release;
+    // Once per press, when it has been held for the hold time.
+    uint8_t hold;
+    // With the hold, and every repeat interval while still held.
+    uint8_t repeat;
+};
 
 
-class Button
+/* Debounces up to eight buttons sampled together, one sample per timer
+ * tick, so all timing is in ticks rather than loop passes.
+ *
+ * The debounce is a vertical counter: bit i of each of the three count
+ * bytes is a bit of button i's counter, so every button is counted with a
+ * few byte operations.  A button changes state after eight samples in a
+ * row that differ from its debounced state; a sample that agrees starts
+ * the count again.  While nothing is pressed a sample is only that. */
+template <uint8_t BUTTONS>
+class ButtonDebouncer
 {
 private:
-    uint8_t _pin;
-    uint8_t _active;
-    uint8_t _active_tick;
-    uint32_t _time;
+    uint8_t _state;
+    uint8_t _count0;
+    uint8_t _count1;
+    uint8_t _count2;
+    // Past the hold time.
+    uint8_t _holding;
+    uint16_t _hold_ticks;
+    uint16_t _repeat_ticks;
+    // Ticks held, then ticks since the last repeat.
+    uint16_t _held[BUTTONS];
 
 public:
-
-    Button(uint8_t pin) :
-        _pin(pin)
-    {
-    }
-
-    void init()
+    // A zero time disables the hold and repeat events.
+    ButtonDebouncer(uint16_t hold_ticks, uint16_t repeat_ticks) :
+        _hold_ticks(hold_ticks),
+        _repeat_ticks(repeat_ticks)
     {
-        pinMode(_pin, INPUT);
+        reset(0);
     }
 
-    void update()
+    // Takes `pressed` as the debounced state without events.
+    void reset(uint8_t pressed)
     {
-        uint32_t now = millis();
-        if (!_active && !digitalRead(_pin)) {
-            _active = 1;
-            _time = now;
-            _active_tick = 0;
-        } else if (_active && digitalRead(_pin)) {
-            _active = 0;
-            _time = now;
-        } else if (_active && !digitalRead(_pin)) {
-            _active_tick++;
+        _state = pressed;
+        _count0 = 0xFF;
+        _count1 = 0xFF;
+        _count2 = 0xFF;
+        _holding = 0;
+        for (uint8_t index = 0; index < BUTTONS; index++) {
+            _held[index] = 0;
         }
     }
 
-    uint32_t getEventTime() __attribute__((always_inline))
+    // `pressed` has bit i set while button i reads pressed.
+    ButtonEvents sample(uint8_t pressed)
     {
-        return _time;
-    }
+        // Count down the buttons that differ, reset the others to 7, and
+        // toggle the ones that wrapped.
+        uint8_t changed = _state ^ pressed;
+        _count0 = (uint8_t)~(_count0 & changed);
+        _count1 = (uint8_t)(_count0 ^ (_count1 & changed));
+        _count2 = (uint8_t)((_count2 & changed) ^ (_count0 & _count1));
+        changed &= _count0 & _count1 & _count2;
+        _state ^= changed;
+        _holding &= _state;
 
-    uint8_t isActive() __attribute__((always_inline))
-    {
-        return _active;
+        ButtonEvents events = {
+            (uint8_t)(_state & changed),
+            (uint8_t)(~_state & changed),
+            0,
+            0
+        };
+        if (!_state) {
+            return events;
+        }
+        for (uint8_t index = 0; index < BUTTONS; index++) {
+            const uint8_t mask = (uint8_t)(1u << index);
+            if (!(_state & mask)) {
+                continue;
+            }
+            if (events.press & mask) {
+                _held[index] = 0;
+            }
+            _held[index]++;
+            if (!(_holding & mask)) {
+                if (_hold_ticks != 0 && _held[index] >= _hold_ticks) {
+                    events.hold |= mask;
+                    events.repeat |= mask;
+                    _holding |= mask;
+                    _held[index] = 0;
+                }
+            } else if (_repeat_ticks != 0 &&
+                       _held[index] >= _repeat_ticks) {
+                events.repeat |= mask;
+                _held[index] = 0;
+            }
+        }
+        return events;
     }
 
-    bool isRaisingEdge() __attribute__ ((always_inline))
+    // Debounced state, bit i while button i is pressed.
+    uint8_t pressed() const
     {
-        return _active && _active_tick < ACTIVE_TICK_COUNT;
+        return _state;
     }
-
 };
 
 
@@ -0,0 +1,227 @@
+#ifndef __CALIBRATION_H__
+#define __CALIBRATION_H__
+
+#include <EEPROM.h>
+#include <stdlib.h>
+
+#include "adc.h"
+
+
+#define CALIBRATION_VERSION 0x01
+
+// EEPROM image of the per-gain calibration table: 8 bytes per ladder step
+// behind a CRC, a version byte and the number of steps.  The layout has no
+// padding, so the CRC covers every byte that follows it.
+struct CalibrationRecord
+{
+    uint16_t crc;
+    uint8_t version;
+    uint8_t gains;
+    GainCalibData gain[MAX_GAINS];
+};
+
+
+// CRC-16/CCITT-FALSE, bitwise: the record is only checked at boot.
+inline uint16_t CalibrationCrc(const uint8_t* data, size_t length)
+{
+    uint16_t crc = 0xffff;
+    while (length--) {
+        crc ^= (uint16_t)(*data++) << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) :
+                (uint16_t)(crc << 1);
+        }
+    }
+    return crc;
+}
+
+
+inline uint16_t CalibrationRecordCrc(const CalibrationRecord& record)
+{
+    return CalibrationCrc(
+        reinterpret_cast<const uint8_t*>(&record) +
+            offsetof(CalibrationRecord, version),
+        sizeof(record) - offsetof(CalibrationRecord, version));
+}
+
+
+/* Gains are AD7190 gain codes, stored in ladder order.  The firmware has no
+ * reference to measure the trims against; they are measured on the bench
+ * and sent over the serial calibration console (see BUILDING.md). */
+inline void SaveCalibration(int addr, const ADConverter& adc)
+{
+    CalibrationRecord record;
+    memset(&record, 0, sizeof(record));
+    record.version = CALIBRATION_VERSION;
+    record.gains = MAX_GAINS;
+    record.gain[GAIN_1] = adc.getCalibData(AD7190_CONF_GAIN_1);
+    for (uint8_t code = AD7190_CONF_GAIN_8;
+         code <= AD7190_CONF_GAIN_128; code++) {
+        record.gain[code - AD7190_CONF_GAIN_8 + GAIN_8] =
+            adc.getCalibData(code);
+    }
+    record.crc = CalibrationRecordCrc(record);
+    EEPROM.put(addr, record);
+}
+
+
+// Leaves the converter untouched unless the whole record is intact.
+inline bool LoadCalibration(int addr, ADConverter& adc)
+{
+    CalibrationRecord record;
+    EEPROM.get(addr, record);
+    if (record.version != CALIBRATION_VERSION ||
+        record.gains != MAX_GAINS ||
+        record.crc != CalibrationRecordCrc(record)) {
+        return false;
+    }
+
+    adc.setCalibData(AD7190_CONF_GAIN_1, record.gain[GAIN_1]);
+    for (uint8_t code = AD7190_CONF_GAIN_8;
+         code <= AD7190_CONF_GAIN_128; code++) {
+        adc.setCalibData(code, record.gain[code - AD7190_CONF_GAIN_8 + GAIN_8]);
+    }
+    return true;
+}
+
+
+// Longest console line, without its terminator.
+#define CALIBRATION_LINE_MAX 40
+
+/* One line of the serial calibration console, either
+ *   gain <1|8|16|32|64|128> <offset_uv> <scale_q24>
+ * to set the trim of one ladder step, or
+ *   save
+ * to write the whole table. */
+struct CalibrationCommand
+{
+    bool save;
+    uint8_t gain;
+    GainCalibData cal;
+};
+
+
+// Parses one decimal field and the blanks after it.
+inline bool ParseCalibrationField(const char*& text, long low, long high,
+                                  long& value)
+{
+    char* end;
+    value = strtol(text, &end, 10);
+    if (end == text || (*end != ' ' && *end != '\0') ||
+        value < low || value > high) {
+        return false;
+    }
+    while (*end == ' ') {
+        end++;
+    }
+    text = end;
+    return true;
+}
+
+
+// gain is left as an AD7190 gain code.  A zero or negative scale is refused.
+inline bool ParseCalibrationCommand(const char* line,
+                                    CalibrationCommand& command)
+{
+    memset(&command, 0, sizeof(command));
+    if (strcmp(line, "save") == 0) {
+        command.save = true;
+        return true;
+    }
+    if (strncmp(line, "gain ", 5) != 0) {
+        return false;
+    }
+
+    const char* text = line + 5;
+    long gain;
+    long offset_uv;
+    long scale_q24;
+    if (!ParseCalibrationField(text, 1, 128, gain) ||
+        !ParseCalibrationField(text, -2147483647L, 2147483647L, offset_uv) ||
+        !ParseCalibrationField(text, 1, 2147483647L, scale_q24) ||
+        *text != '\0') {
+        return false;
+    }
+
+    if (gain == 1) {
+        command.gain = AD7190_CONF_GAIN_1;
+    } else {
+        // 8 and the powers of two above it are the consecutive codes 3..7.
+        uint8_t code = AD7190_CONF_GAIN_8;
+        long step = 8;
+        while (step < gain) {
+            step <<= 1;
+            code++;
+        }
+        if (step != gain) {
+            return false;
+        }
+        command.gain = code;
+    }
+    command.cal.offset_uv = (int32_t)offset_uv;
+    command.cal.scale_q24 = (int32_t)scale_q24;
+    return true;
+}
+
+
+#define ADC_CALIBRATION_VERSION 0x01
+// Restore the AD7190 coefficients only within this distance of the
+// temperature they were taken at; further away they count as drifted.
+#define ADC_CALIBRATION_TEMPERATURE_MC 5000L
+
+// AD7190 internal calibration of both channels and the LM35 temperature it
+// was taken at, laid out like CalibrationRecord.
+struct AdcCalibrationRecord
+{
+    uint16_t crc;
+    uint8_t version;
+    uint8_t channels;
+    int32_t temperature_mc;
+    ChannelCalibration channel[MAX_CHANNELS];
+};
+
+
+inline uint16_t AdcCalibrationRecordCrc(const AdcCalibrationRecord& record)
+{
+    return CalibrationCrc(
+        reinterpret_cast<const uint8_t*>(&record) +
+            offsetof(AdcCalibrationRecord, version),
+        sizeof(record) - offsetof(AdcCalibrationRecord, version));
+}
+
+
+inline void SaveAdcCalibration(int addr,
+                               const ADConverter& adc,
+                               int32_t temperature_mc)
+{
+    AdcCalibrationRecord record;
+    memset(&record, 0, sizeof(record));
+    record.version = ADC_CALIBRATION_VERSION;
+    record.channels = MAX_CHANNELS;
+    record.temperature_mc = temperature_mc;
+    for (uint8_t chn = 0; chn < MAX_CHANNELS; chn++) {
+        record.channel[chn] = adc.channelCalibration(chn);
+    }
+    record.crc = AdcCalibrationRecordCrc(record);
+    EEPROM.put(addr, record);
+}
+
+
+inline bool LoadAdcCalibration(int addr, AdcCalibrationRecord& record)
+{
+    EEPROM.get(addr, record);
+    return record.version == ADC_CALIBRATION_VERSION &&
+        record.channels == MAX_CHANNELS &&
+        record.crc == AdcCalibrationRecordCrc(record);
+}
+
+
+inline bool AdcCalibrationTemperatureClose(int32_t calibrated_mc,
+                                           int32_t temperature_mc)
+{
+    const int32_t difference = temperature_mc - calibrated_mc;
+    return difference <= ADC_CALIBRATION_TEMPERATURE_MC &&
+        difference >= -ADC_CALIBRATION_TEMPERATURE_MC;
+}
+
+#endif
@@ -47,6 +47,11 @@ struct MeasurementSnapshot {
     bool safety_current_valid;
     bool safety_voltage_valid;
 
+    // micros() at which each conversion completed.  timestamp_ms is when the
+    // snapshot was assembled; these are the instants the values describe.
+    uint32_t current_timestamp_us;
+    uint32_t voltage_timestamp_us;
+
     bool adcValid() const
     {
         return safety_current_valid && safety_voltage_valid;
@@ -61,6 +66,57 @@ struct SafetyLimits {
     double max_power;
 };
 
+// Both channels at one instant.  The AD7190 converts current and voltage one
+// after the other, a filter period apart, so while the load changes the two
+// latest readings describe different moments.  Anything that combines them,
+// power, energy, CP and CR, uses these instead: the channel converted
+// earlier as it is, the other interpolated to its instant.
+struct AlignedMeasurement {
+    int32_t current_ua;
+    int32_t voltage_uv;
+    int32_t safety_current_ua;
+    int32_t safety_voltage_uv;
+    uint32_t timestamp_us;
+};
+
+// Fixed-point counterpart of MeasurementSnapshot.  double is a 32-bit soft
+// float on the ATmega328P, so the firmware control path runs on integers:
+// microamps, microvolts and millidegrees Celsius.  int32_t covers +-2147 A
+// and +-2147 V, far beyond anything the ADC can report.
+struct FixedMeasurementSnapshot {
+    int32_t current_ua;
+    int32_t voltage_uv;
+    int32_t temperature_mc;
+    bool current_valid;
+    bool voltage_valid;
+    bool temperature_valid;
+    uint32_t timestamp_ms;
+
+    // Nominal schematic values, as for MeasurementSnapshot.
+    int32_t safety_current_ua;
+    int32_t safety_voltage_uv;
+    bool safety_current_valid;
+    bool safety_voltage_valid;
+
+    uint32_t current_timestamp_us;
+    uint32_t voltage_timestamp_us;
+
+    AlignedMeasurement aligned;
+
+    bool adcValid() const
+    {
+        return safety_current_valid && safety_voltage_valid;
+    }
+};
+
+struct FixedSafetyLimits {
+    int32_t max_current_ua;
+    int32_t min_voltage_uv;
+    int32_t max_temperature_mc;
+    int32_t max_voltage_uv;
+    int32_t max_power_mw;
+};
+
 // Checks are ordered deliberately: an ADC failure, then a temperature sensor
 // failure, then electrical limits, then the thermal limit.  Invalid safety
 // measurements are unsafe in every state.  Undervoltage is intentionally not
@@ -94,6 +150,38 @@ inline FaultReason evaluateSafety(const MeasurementSnapshot& measurement,
     return FaultReason::None;
 }
 
+// Same checks and order as above.  uA * uV is in picowatts, so the power
+// check needs one 64-bit product; it is taken at one instant.
+inline FaultReason evaluateSafety(const FixedMeasurementSnapshot& measurement,
+                                  const FixedSafetyLimits& limits,
+                                  OperationState state)
+{
+    if (!measurement.adcValid()) {
+        return FaultReason::AdcFailure;
+    }
+    if (!measurement.temperature_valid) {
+        return FaultReason::TemperatureSensorFailure;
+    }
+    if (measurement.safety_current_ua > limits.max_current_ua) {
+        return FaultReason::Overcurrent;
+    }
+    if (measurement.safety_voltage_uv > limits.max_voltage_uv &&
+        limits.max_voltage_uv > 0) {
+        return FaultReason::Overvoltage;
+    }
+    if (limits.max_power_mw > 0 &&
+        static_cast<int64_t>(measurement.aligned.safety_current_ua) *
+                measurement.aligned.safety_voltage_uv >
+            static_cast<int64_t>(limits.max_power_mw) * 1000000000LL) {
+        return FaultReason::Overpower;
+    }
+    if (measurement.temperature_mc > limits.max_temperature_mc) {
+        return FaultReason::Overtemperature;
+    }
+    (void)state;
+    return FaultReason::None;
+}
+
 // Unsigned subtraction gives the intended result across a uint32_t millis()
 // rollover, provided an interval is shorter than one full timer cycle.
 inline uint32_t elapsedMilliseconds(uint32_t now_ms, uint32_t then_ms)
@@ -108,6 +196,136 @@ inline bool hasElapsed(uint32_t now_ms,
     return elapsedMilliseconds(now_ms, then_ms) >= interval_ms;
 }
 
+// The last few conversions of one channel, oldest overwritten first.  Power
+// of two, so the indices wrap with a mask.
+static const uint8_t kSampleHistoryLength = 4;
+
+struct ChannelSample {
+    int32_t value;
+    int32_t safety_value;
+    uint32_t timestamp_us;
+};
+
+struct SampleHistory {
+    ChannelSample samples[kSampleHistoryLength];
+    uint8_t newest;
+    uint8_t count;
+
+    SampleHistory() : samples(), newest(0), count(0)
+    {
+    }
+};
+
+inline void resetSampleHistory(SampleHistory& history)
+{
+    history.newest = 0;
+    history.count = 0;
+}
+
+// A conversion already recorded, i.e. the same timestamp, is ignored.
+inline void recordSample(SampleHistory& history,
+                         int32_t value,
+                         int32_t safety_value,
+                         uint32_t timestamp_us)
+{
+    if (history.count != 0 &&
+        history.samples[history.newest].timestamp_us == timestamp_us) {
+        return;
+    }
+    history.newest = (history.newest + 1) & (kSampleHistoryLength - 1);
+    ChannelSample& sample = history.samples[history.newest];
+    sample.value = value;
+    sample.safety_value = safety_value;
+    sample.timestamp_us = timestamp_us;
+    if (history.count < kSampleHistoryLength) {
+        history.count++;
+    }
+}
+
+inline bool newestSample(const SampleHistory& history, ChannelSample& sample)
+{
+    if (history.count == 0) {
+        return false;
+    }
+    sample = history.samples[history.newest];
+    return true;
+}
+
+/* The channel at `at_us`, linear between the two samples around it.  False
+ * outside the history: it never extrapolates past the newest sample.  The
+ * weight is Q16 with the span brought under 2^16 us, so the division stays
+ * 32-bit on the AVR. */
+inline bool interpolateSample(const SampleHistory& history,
+                              uint32_t at_us,
+                              ChannelSample& sample)
+{
+    uint8_t index = history.newest;
+    for (uint8_t age = 0; age < history.count; age++) {
+        const ChannelSample& earlier = history.samples[index];
+        const int32_t offset =
+            static_cast<int32_t>(at_us - earlier.timestamp_us);
+        if (offset >= 0) {
+            if (age == 0) {
+                if (offset != 0) {
+                    return false;
+                }
+                sample = earlier;
+                return true;
+            }
+            const ChannelSample& later = history.samples[
+                (index + 1) & (kSampleHistoryLength - 1)];
+            uint32_t span_us = later.timestamp_us - earlier.timestamp_us;
+            uint32_t into_us = static_cast<uint32_t>(offset);
+            while (span_us > 0xFFFFUL) {
+                span_us >>= 1;
+                into_us >>= 1;
+            }
+            const int32_t weight_q16 =
+                static_cast<int32_t>((into_us << 16) / span_us);
+            sample.value = earlier.value + static_cast<int32_t>(
+                (static_cast<int64_t>(later.value - earlier.value) *
+                 weight_q16) / 65536);
+            sample.safety_value = earlier.safety_value + static_cast<int32_t>(
+                (static_cast<int64_t>(later.safety_value -
+                                      earlier.safety_value) *
+                 weight_q16) / 65536);
+            sample.timestamp_us = at_us;
+            return true;
+        }
+        index = (index + kSampleHistoryLength - 1) &
+            (kSampleHistoryLength - 1);
+    }
+    return false;
+}
+
+/* Both channels at the instant of the older of their newest samples, the
+ * latest instant both histories cover.  False until each channel has a
+ * sample. */
+inline bool alignMeasurement(const SampleHistory& current,
+                             const SampleHistory& voltage,
+                             AlignedMeasurement& aligned)
+{
+    ChannelSample current_sample;
+    ChannelSample voltage_sample;
+    if (!newestSample(current, current_sample) ||
+        !newestSample(voltage, voltage_sample)) {
+        return false;
+    }
+    const uint32_t at_us = static_cast<int32_t>(
+        current_sample.timestamp_us - voltage_sample.timestamp_us) < 0 ?
+        current_sample.timestamp_us : voltage_sample.timestamp_us;
+    if (!interpolateSample(current, at_us, current_sample) ||
+        !interpolateSample(voltage, at_us, voltage_sample)) {
+        return false;
+    }
+    aligned.current_ua = current_sample.value;
+    aligned.voltage_uv = voltage_sample.value;
+    aligned.safety_current_ua = current_sample.safety_value;
+    aligned.safety_voltage_uv = voltage_sample.safety_value;
+    aligned.timestamp_us = at_us;
+    return true;
+}
+
 // Schematic-derived transfer functions.  These are nominal safety values and
 // must not be replaced by calibration when checking absolute limits.
 static const double kDacReferenceVolts = 5.0;
@@ -234,9 +452,554 @@ inline double boundedCurrentTarget(double requested_current,
     return target < 0.0 ? 0.0 : target;
 }
 
+// Fixed-point transfer functions.  Each matches its double counterpart above
+// to within one unit of its result (control_test checks the whole range);
+// the scale factors are the same schematic values expressed as integers.
+
+// Sense amplifier: 1 / (50 V/V * 5 mOhm) = 4 A/V, i.e. 4 uA per uV.
+static const int32_t kSenseMicroampsPerMicrovolt = 4;
+// Input divider 10.09:1 as Q24.
+static const int32_t kInputDividerRatioQ24 = 169282109L;
+// DAC codes per uA as Q32, and uA per DAC code as Q16.
+static const int64_t kDacCodesPerMicroampQ32 = 1379227LL;
+static const int64_t kMicroampsPerDacCodeQ16 = 204081633LL;
+static const int32_t kMaximumTheoreticalCurrentMicroamps = 15000000L;
+static const int32_t kDefaultSlewRateMilliampsPerSecond = 5000L;
+
+// AD7190 result to microvolts at the converter input.  The AD7190 gains are
+// powers of two, so the gain is applied as a shift.  The 24-bit code is
+// multiplied a byte at a time, lowest first, keeping only 8 fraction bits
+// between steps: every product fits in 32 bits for a reference below 2^23 uV
+// (the AD7190 takes at most 5.25 V), and the dropped bits are worth less
+// than 1/128 uV.
+inline int32_t adcMicrovoltsFromCode(uint32_t code,
+                                     int32_t reference_uv,
+                                     uint8_t gain_shift)
+{
+    const uint32_t reference = static_cast<uint32_t>(reference_uv);
+    uint32_t scaled = (code & 0xFFU) * reference;
+    scaled = (scaled >> 8) + ((code >> 8) & 0xFFU) * reference;
+    scaled = (scaled >> 8) + ((code >> 16) & 0xFFU) * reference;
+    const uint8_t shift = static_cast<uint8_t>(8U + gain_shift);
+    return static_cast<int32_t>(
+        (scaled + (static_cast<uint32_t>(1) << (shift - 1U))) >> shift);
+}
+
+// Inverse of adcMicrovoltsFromCode(), rounded down and saturated to the
+// 24-bit full scale.  Used to move limits into raw code space once instead
+// of converting every sample.  Long division a bit at a time, so the
+// remainder never needs more than 32 bits.
+inline uint32_t adcCodeForMicrovolts(int32_t microvolts,
+                                     int32_t reference_uv,
+                                     uint8_t gain_shift)
+{
+    if (microvolts <= 0 || reference_uv <= 0) {
+        return 0U;
+    }
+    const uint32_t reference = static_cast<uint32_t>(reference_uv);
+    uint32_t code = static_cast<uint32_t>(microvolts) / reference;
+    uint32_t remainder = static_cast<uint32_t>(microvolts) % reference;
+    for (uint8_t bit = 0; bit < 24U + gain_shift; bit++) {
+        if (code > 0x7FFFFFUL) {
+            return 0xFFFFFFUL;
+        }
+        code <<= 1;
+        remainder <<= 1;
+        if (remainder >= reference) {
+            remainder -= reference;
+            code |= 1U;
+        }
+    }
+    return code > 0xFFFFFFUL ? 0xFFFFFFUL : code;
+}
+
+inline int32_t theoreticalMicroampsFromSenseMicrovolts(int32_t sense_uv)
+{
+    return sense_uv * kSenseMicroampsPerMicrovolt;
+}
+
+inline int32_t theoreticalMicrovoltsFromDivider(int32_t divider_uv)
+{
+    return static_cast<int32_t>(
+        (static_cast<int64_t>(divider_uv) * kInputDividerRatioQ24 +
+         (1LL << 23)) >> 24);
+}
+
+inline int32_t theoreticalSenseMicrovoltsForMicroamps(int32_t current_ua)
+{
+    return current_ua / kSenseMicroampsPerMicrovolt;
+}
+
+inline int32_t theoreticalDividerMicrovoltsForMicrovolts(int32_t voltage_uv)
+{
+    return static_cast<int32_t>(
+        (static_cast<int64_t>(voltage_uv) << 24) / kInputDividerRatioQ24);
+}
+
+inline int32_t theoreticalMicroampsFromDacCode(uint16_t dac_code)
+{
+    return static_cast<int32_t>(
+        (dac_code * kMicroampsPerDacCodeQ16 + (1LL << 15)) >> 16);
+}
+
+inline uint16_t theoreticalDacCodeForMicroamps(int32_t current_ua)
+{
+    if (current_ua <= 0) {
+        return 0U;
+    }
+    if (current_ua >= kMaximumTheoreticalCurrentMicroamps) {
+        return kTheoreticalDacHardCapCode;
+    }
+    const uint32_t rounded = static_cast<uint32_t>(
+        (current_ua * kDacCodesPerMicroampQ32 + (1LL << 31)) >> 32);
+    return rounded > kTheoreticalDacHardCapCode ?
+        kTheoreticalDacHardCapCode : static_cast<uint16_t>(rounded);
+}
+
+// Same policy as slewDacCode(); the rate is given in mA/s (= uA/ms).
+inline uint16_t slewDacCodeFixed(uint16_t current_code,
+                                 uint16_t target_code,
+                                 uint32_t now_ms,
+                                 uint32_t then_ms,
+                                 int32_t rate_milliamps_per_second =
+                                     kDefaultSlewRateMilliampsPerSecond)
+{
+    if (target_code > kTheoreticalDacHardCapCode) {
+        target_code = kTheoreticalDacHardCapCode;
+    }
+    if (current_code == target_code) {
+        return current_code;
+    }
+    if (target_code < current_code) {
+        return target_code;
+    }
+    if (rate_milliamps_per_second <= 0) {
+        return current_code;
+    }
+
+    uint32_t elapsed_ms = elapsedMilliseconds(now_ms, then_ms);
+    if (elapsed_ms > 100UL) {
+        elapsed_ms = 100UL;
+    }
+    const int64_t allowed_ua =
+        static_cast<int64_t>(rate_milliamps_per_second) * elapsed_ms;
+    const uint32_t step = static_cast<uint32_t>(
+        (allowed_ua * kDacCodesPerMicroampQ32) >> 32);
+    if (step == 0U) {
+        return current_code;
+    }
+    const uint32_t difference = target_code - current_code;
+    return static_cast<uint16_t>(current_code +
+        (difference < step ? difference : step));
+}
+
+/* Slew engine for a loop of any period.  slewDacCode() turns each call's
+ * allowance into whole codes and drops the remainder, so the faster it is
+ * called the slower the ramp, and below about 0.6 ms per call at 5 A/s it
+ * never moves.  This keeps the remainder, in Q16 codes, in SlewState and
+ * carries it into the next call: the output after N milliseconds is the
+ * same however they were split between calls.  The 100 ms stall cap and
+ * the immediate downward step are kept. */
+enum class SlewProfile : uint8_t {
+    Linear = 0,
+    // Rate rises and falls at `acceleration`, so the ramp starts and ends
+    // without a step in di/dt.
+    SCurve,
+};
+
+struct SlewSettings {
+    SlewProfile profile;
+    int32_t rate_ma_per_s;
+    // S-curve only.
+    int32_t acceleration_ma_per_s2;
+};
+
+struct SlewState {
+    uint16_t code;
+    // Progress towards the next code, Q16.
+    uint16_t fraction;
+    // Present S-curve rate, Q16 codes per millisecond.
+    uint32_t rate_q16;
+    uint32_t last_ms;
+
+    SlewState() : code(0), fraction(0), rate_q16(0), last_ms(0)
+    {
+    }
+};
+
+inline void resetSlew(SlewState& state, uint16_t code, uint32_t now_ms)
+{
+    state.code = code;
+    state.fraction = 0;
+    state.rate_q16 = 0;
+    state.last_ms = now_ms;
+}
+
+// mA/s is uA/ms; Q16 codes per ms from the Q32 codes per uA.
+inline uint32_t slewCodesPerMillisecondQ16(int32_t rate_ma_per_s)
+{
+    return rate_ma_per_s <= 0 ? 0U : static_cast<uint32_t>(
+        (static_cast<int64_t>(rate_ma_per_s) * kDacCodesPerMicroampQ32) >> 16);
+}
+
+/* One millisecond of S-curve towards `remaining_q16`.  The rate grows by
+ * the acceleration while it can still brake to a stop inside what is left
+ * (v^2 <= 2 a d), shrinks once it cannot, and never falls below one
+ * acceleration step so the ramp always arrives.  Farther than
+ * `free_q16` away no rate up to the peak needs braking, which spares the
+ * 64-bit products on the AVR for most of a ramp. */
+inline uint32_t sCurveStepQ16(uint32_t& rate_q16,
+                              uint32_t remaining_q16,
+                              uint32_t peak_q16,
+                              uint32_t acceleration_q16,
+                              uint32_t free_q16)
+{
+    if (remaining_q16 >= free_q16) {
+        rate_q16 += acceleration_q16;
+        if (rate_q16 > peak_q16) {
+            rate_q16 = peak_q16;
+        }
+        return rate_q16;
+    }
+    const uint64_t braking = 2ULL * acceleration_q16 * remaining_q16;
+    const uint32_t faster = rate_q16 + acceleration_q16;
+    if (static_cast<uint64_t>(faster) * faster <= braking) {
+        rate_q16 = faster;
+    } else if (static_cast<uint64_t>(rate_q16) * rate_q16 > braking) {
+        rate_q16 = rate_q16 > 2U * acceleration_q16 ?
+            rate_q16 - acceleration_q16 : acceleration_q16;
+    }
+    if (rate_q16 > peak_q16) {
+        rate_q16 = peak_q16;
+    }
+    return rate_q16;
+}
+
+/* The next output code on the way from `current_code` to `target_code`.
+ * `current_code` is what the DAC holds; if anything else has written it
+ * since the last call, the carried remainder and rate start again. */
+inline uint16_t slewDacCodeCarried(SlewState& state,
+                                   uint16_t current_code,
+                                   uint16_t target_code,
+                                   uint32_t now_ms,
+                                   const SlewSettings& settings)
+{
+    uint32_t elapsed_ms = elapsedMilliseconds(now_ms, state.last_ms);
+    state.last_ms = now_ms;
+    if (elapsed_ms > 100UL) {
+        elapsed_ms = 100UL;
+    }
+    if (current_code != state.code) {
+        resetSlew(state, current_code, now_ms);
+    }
+    if (target_code > kTheoreticalDacHardCapCode) {
+        target_code = kTheoreticalDacHardCapCode;
+    }
+    if (target_code <= current_code) {
+        resetSlew(state, target_code, now_ms);
+        return target_code;
+    }
+
+    const uint32_t peak_q16 = slewCodesPerMillisecondQ16(
+        settings.rate_ma_per_s);
+    const uint32_t remaining_q16 =
+        (static_cast<uint32_t>(target_code - current_code) << 16) -
+        state.fraction;
+    uint32_t step_q16 = 0;
+    if (settings.profile == SlewProfile::SCurve &&
+        settings.acceleration_ma_per_s2 > 0) {
+        // mA/s^2 is uA/ms per 1000 ms.
+        uint32_t acceleration_q16 = static_cast<uint32_t>(
+            (static_cast<int64_t>(settings.acceleration_ma_per_s2) *
+             kDacCodesPerMicroampQ32 / 1000) >> 16);
+        if (acceleration_q16 == 0U) {
+            acceleration_q16 = 1U;
+        }
+        const uint64_t fastest = static_cast<uint64_t>(peak_q16) +
+            acceleration_q16;
+        const uint64_t free_q16 = fastest * fastest / (2U * acceleration_q16);
+        const uint32_t free_limited_q16 = free_q16 > 0xFFFFFFFFULL ?
+            0xFFFFFFFFUL : static_cast<uint32_t>(free_q16);
+        for (uint32_t ms = 0; ms < elapsed_ms && step_q16 < remaining_q16;
+             ms++) {
+            step_q16 += sCurveStepQ16(state.rate_q16,
+                                      remaining_q16 - step_q16, peak_q16,
+                                      acceleration_q16, free_limited_q16);
+        }
+    } else {
+        step_q16 = peak_q16 * elapsed_ms;
+    }
+
+    if (step_q16 >= remaining_q16) {
+        resetSlew(state, target_code, now_ms);
+        return target_code;
+    }
+    const uint32_t position_q16 = state.fraction + step_q16;
+    state.code = static_cast<uint16_t>(current_code + (position_q16 >> 16));
+    state.fraction = static_cast<uint16_t>(position_q16 & 0xFFFFU);
+    return state.code;
+}
+
+/* value * numerator / denominator, rounded and saturated to the maximum
+ * current, in 32-bit arithmetic.  With value = q * denominator + r only
+ * r * numerator has to fit, which takes a numerator from 1 to 2^16 - 1 and
+ * (denominator - 1) * numerator + denominator / 2 below 2^32. */
+inline int32_t scaleMicroamps(uint32_t value,
+                              uint32_t numerator,
+                              uint32_t denominator)
+{
+    const uint32_t maximum =
+        static_cast<uint32_t>(kMaximumTheoreticalCurrentMicroamps);
+    const uint32_t quotient = value / denominator;
+    const uint32_t remainder = value % denominator;
+    // Past 2^16 the quotient only stays below the maximum times a
+    // numerator below 2^8.
+    if (quotient > 0xFFFFU && (numerator > 0xFFU || quotient > maximum)) {
+        return kMaximumTheoreticalCurrentMicroamps;
+    }
+    const uint32_t scaled = quotient * numerator +
+        (remainder * numerator + denominator / 2U) / denominator;
+    return scaled > maximum ? kMaximumTheoreticalCurrentMicroamps :
+        static_cast<int32_t>(scaled);
+}
+
+// Power above this is far past the load's rating and is taken as this.
+static const int32_t kMaximumPowerMilliwatts = 4294967L;
+
+/* I = P / V, saturated to the maximum current.  mW * 1e6 / mV is uA; the
+ * voltage is rounded to millivolts first, which keeps the division in 32
+ * bits at a cost of at most 0.05 % at 1 V. */
+inline int32_t powerLimitMicroamps(int32_t power_mw, int32_t voltage_uv)
+{
+    if (power_mw <= 0) {
+        return 0;
+    }
+    const uint32_t voltage_mv =
+        (static_cast<uint32_t>(voltage_uv) + 500U) / 1000U;
+    if (voltage_mv == 0) {
+        return kMaximumTheoreticalCurrentMicroamps;
+    }
+    const uint32_t power_uw = static_cast<uint32_t>(
+        power_mw > kMaximumPowerMilliwatts ?
+            kMaximumPowerMilliwatts : power_mw) * 1000U;
+    return scaleMicroamps(power_uw, 1000U, voltage_mv);
+}
+
+inline int32_t boundedCurrentTargetMicroamps(int32_t requested_ua,
+                                             int32_t safety_voltage_uv,
+                                             int32_t temperature_mc,
+                                             int32_t continuous_power_mw,
+                                             int32_t thermal_derate_start_mc,
+                                             int32_t maximum_temperature_mc)
+{
+    if (requested_ua <= 0 || safety_voltage_uv <= 0 ||
+        temperature_mc >= maximum_temperature_mc) {
+        return 0;
+    }
+
+    int32_t target = requested_ua > kMaximumTheoreticalCurrentMicroamps ?
+        kMaximumTheoreticalCurrentMicroamps : requested_ua;
+    if (continuous_power_mw > 0) {
+        const int32_t power_ua =
+            powerLimitMicroamps(continuous_power_mw, safety_voltage_uv);
+        if (target > power_ua) {
+            target = power_ua;
+        }
+    }
+    if (temperature_mc > thermal_derate_start_mc &&
+        maximum_temperature_mc > thermal_derate_start_mc) {
+        // The remaining headroom is below the span; a span past 65 C is
+        // coarsened until scaleMicroamps() can take it.
+        uint32_t span_mc = static_cast<uint32_t>(
+            maximum_temperature_mc - thermal_derate_start_mc);
+        uint32_t headroom_mc = static_cast<uint32_t>(
+            maximum_temperature_mc - temperature_mc);
+        while (span_mc > 0xFFFFU) {
+            span_mc >>= 1;
+            headroom_mc >>= 1;
+        }
+        target = scaleMicroamps(static_cast<uint32_t>(target), headroom_mc,
+                                span_mc);
+    }
+    return target;
+}
+
+enum class LoadMode : uint8_t {
+    ConstantCurrent = 0,
+    ConstantPower,
+    ConstantResistance,
+    ConstantVoltage,
+};
+
+static const uint8_t kLoadModeCount = 4;
+
+// CR and CV close a loop around the measured voltage, so the regulation
+// runs at this fixed period rather than once per main loop pass.
+static const uint32_t kRegulationPeriodMilliseconds = 20UL;
+static const uint32_t kRegulationPeriodMicroseconds =
+    kRegulationPeriodMilliseconds * 1000UL;
+
+// Integral gain of CV: the current change per regulation period for every
+// millivolt the source is above the set point.  50 uA/mV per 20 ms is
+// 2.5 A/s per V.
+static const int32_t kConstantVoltageGainMicroampsPerMillivolt = 50L;
+
+// Fixed-rate gate: true once per `period_ms`, with `next_ms` advanced by
+// whole periods so the caller's jitter does not accumulate.  A caller more
+// than a period late skips the missed updates instead of bursting them.
+inline bool fixedRateDue(uint32_t now_ms, uint32_t& next_ms, uint32_t period_ms)
+{
+    if (static_cast<int32_t>(now_ms - next_ms) < 0) {
+        return false;
+    }
+    next_ms += period_ms;
+    if (static_cast<int32_t>(now_ms - next_ms) >= 0) {
+        next_ms = now_ms + period_ms;
+    }
+    return true;
+}
+
+inline int32_t limitMicroamps(int64_t current_ua)
+{
+    if (current_ua <= 0) {
+        return 0;
+    }
+    return current_ua > kMaximumTheoreticalCurrentMicroamps ?
+        kMaximumTheoreticalCurrentMicroamps : static_cast<int32_t>(current_ua);
+}
+
+// CP: I = P / V.
+inline int32_t constantPowerTargetMicroamps(int32_t power_mw,
+                                            int32_t voltage_uv)
+{
+    if (power_mw <= 0 || voltage_uv <= 0) {
+        return 0;
+    }
+    return powerLimitMicroamps(power_mw, voltage_uv);
+}
+
+// CR: I = V / R.  uV * 1000 / mOhm is uA.  Past 4000 Ohm both are halved
+// until scaleMicroamps() can take the resistance.
+inline int32_t constantResistanceTargetMicroamps(int32_t resistance_mohm,
+                                                 int32_t voltage_uv)
+{
+    if (resistance_mohm <= 0 || voltage_uv <= 0) {
+        return 0;
+    }
+    uint32_t voltage = static_cast<uint32_t>(voltage_uv);
+    uint32_t resistance = static_cast<uint32_t>(resistance_mohm);
+    while (resistance > 4000000UL) {
+        voltage >>= 1;
+        resistance >>= 1;
+    }
+    return scaleMicroamps(voltage, 1000U, resistance);
+}
+
+// CV: the load sinks more current while the source is above the set point
+// and less while below.  The step integrates the error over `elapsed_us`,
+// the time since the voltage integrated before, so the gain per second is
+// the same whatever the sample rate.  `previous_ua` should be the bounded
+// target actually applied, which keeps the integrator from winding up
+// against the power or thermal limits.
+inline int32_t constantVoltageTargetMicroamps(int32_t previous_ua,
+                                              int32_t set_point_uv,
+                                              int32_t voltage_uv,
+                                              uint32_t elapsed_us =
+                                                  kRegulationPeriodMicroseconds,
+                                              int32_t gain_ua_per_mv =
+                                                  kConstantVoltageGainMicroampsPerMillivolt)
+{
+    const int64_t error_mv = (static_cast<int64_t>(voltage_uv) -
+                              set_point_uv) / 1000;
+    return limitMicroamps(
+        previous_ua + error_mv * gain_ua_per_mv *
+            static_cast<int64_t>(elapsed_us) /
+            static_cast<int64_t>(kRegulationPeriodMicroseconds));
+}
+
+// A longer gap between two voltages, across a background calibration or a
+// failed conversion, is integrated as this long.
+static const uint32_t kConstantVoltageMaxIntervalMicroseconds = 250000UL;
+
+/* The voltage conversion CV integrated last.  The regulation runs every
+ * 20 ms but a voltage arrives only with every measurement; each one is
+ * integrated once, over the time since the one before. */
+struct ConstantVoltageIntegrator {
+    uint32_t voltage_timestamp_us;
+    bool started;
+
+    ConstantVoltageIntegrator() : voltage_timestamp_us(0), started(false)
+    {
+    }
+};
+
+inline void resetConstantVoltage(ConstantVoltageIntegrator& integrator)
+{
+    integrator.voltage_timestamp_us = 0;
+    integrator.started = false;
+}
+
+// The first voltage after a reset counts as one regulation period.
+inline int32_t integrateConstantVoltage(ConstantVoltageIntegrator& integrator,
+                                        int32_t previous_ua,
+                                        int32_t set_point_uv,
+                                        int32_t voltage_uv,
+                                        uint32_t voltage_timestamp_us)
+{
+    uint32_t elapsed_us = kRegulationPeriodMicroseconds;
+    if (integrator.started) {
+        elapsed_us = voltage_timestamp_us - integrator.voltage_timestamp_us;
+        if (elapsed_us == 0) {
+            return previous_ua;
+        }
+        if (elapsed_us > kConstantVoltageMaxIntervalMicroseconds) {
+            elapsed_us = kConstantVoltageMaxIntervalMicroseconds;
+        }
+    }
+    integrator.voltage_timestamp_us = voltage_timestamp_us;
+    integrator.started = true;
+    return constantVoltageTargetMicroamps(previous_ua, set_point_uv,
+                                          voltage_uv, elapsed_us);
+}
+
+/* Requested current of `mode` for the latest measurement, before the power
+ * and thermal bound.  The set point is in uA, mW, mOhm or uV.  An invalid
+ * voltage reading requests no current in the voltage-dependent modes.  CP
+ * and CR use the voltage aligned with the current; CV regulates the newest
+ * voltage, once per conversion. */
+inline int32_t modeTargetMicroamps(LoadMode mode,
+                                   int32_t set_point,
+                                   int32_t previous_ua,
+                                   const FixedMeasurementSnapshot& measurement,
+                                   ConstantVoltageIntegrator& integrator)
+{
+    if (mode == LoadMode::ConstantCurrent) {
+        return limitMicroamps(set_point);
+    }
+    if (!measurement.voltage_valid) {
+        resetConstantVoltage(integrator);
+        return 0;
+    }
+    switch (mode) {
+    case LoadMode::ConstantPower:
+        return constantPowerTargetMicroamps(set_point,
+                                            measurement.aligned.voltage_uv);
+    case LoadMode::ConstantResistance:
+        return constantResistanceTargetMicroamps(
+            set_point, measurement.aligned.voltage_uv);
+    case LoadMode::ConstantVoltage:
+        return integrateConstantVoltage(integrator, previous_ua, set_point,
+                                        measurement.voltage_uv,
+                                        measurement.voltage_timestamp_us);
+    default:
+        return 0;
+    }
+}
+
 static const uint32_t kStartHoldMilliseconds = 3000UL;
 static const uint32_t kUndervoltageDebounceMilliseconds = 500UL;
 static const double kUndervoltageHysteresisVolts = 0.1;
+static const int32_t kUndervoltageHysteresisMicrovolts = 100000L;
 
 // `held_since_ms` must be reset by the input adapter when the button is
 // released.  This leaves button/interrupt handling outside this pure model.
@@ -248,6 +1011,25 @@ inline bool startHoldSatisfied(uint32_t now_ms,
     return held && hasElapsed(now_ms, held_since_ms, required_ms);
 }
 
+// A background ADC calibration is always allowed while Idle.  While Running
+// it delays the next current sample by its duration, so it is only allowed
+// when the sample gap stays within `max_sample_gap_ms`.  An unmeasured
+// duration (0) is never allowed while Running.
+inline bool calibrationWindowAvailable(OperationState state,
+                                       uint32_t sample_interval_ms,
+                                       uint32_t calibration_ms,
+                                       uint32_t max_sample_gap_ms)
+{
+    if (state == OperationState::Idle) {
+        return true;
+    }
+    if (state != OperationState::Running || calibration_ms == 0) {
+        return false;
+    }
+    return sample_interval_ms <= max_sample_gap_ms &&
+        calibration_ms <= max_sample_gap_ms - sample_interval_ms;
+}
+
 struct ControllerState {
     OperationState state;
     FaultReason fault;
@@ -315,6 +1097,37 @@ inline bool qualifyUndervoltage(UndervoltageQualification& qualification,
     return qualification.completed;
 }
 
+inline bool qualifyUndervoltageMicrovolts(
+    UndervoltageQualification& qualification,
+    int32_t voltage_uv,
+    bool voltage_valid,
+    int32_t cutoff_uv,
+    uint32_t now_ms,
+    uint32_t debounce_ms = kUndervoltageDebounceMilliseconds,
+    int32_t hysteresis_uv = kUndervoltageHysteresisMicrovolts)
+{
+    if (qualification.completed) {
+        return true;
+    }
+    if (!voltage_valid) {
+        qualification.below_cutoff = false;
+        return false;
+    }
+    if (voltage_uv > cutoff_uv + hysteresis_uv) {
+        qualification.below_cutoff = false;
+        return false;
+    }
+    if (voltage_uv <= cutoff_uv && !qualification.below_cutoff) {
+        qualification.below_cutoff = true;
+        qualification.below_since_ms = now_ms;
+    }
+    if (qualification.below_cutoff &&
+        hasElapsed(now_ms, qualification.below_since_ms, debounce_ms)) {
+        qualification.completed = true;
+    }
+    return qualification.completed;
+}
+
 // The first fault is retained until an explicit acknowledgement.  Repeated
 // sensor failures cannot replace the reason that originally stopped the load.
 inline bool latchFault(ControllerState& controller,
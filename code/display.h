@@ -0,0 +1,169 @@
+#ifndef __DISPLAY_H__
+#define __DISPLAY_H__
+
+#include <Arduino.h>
+#include <stdint.h>
+
+
+/* The text the LCD should show, and what it shows.
+ *
+ * A refresh prints the whole screen into the frame, which costs only CPU
+ * time.  step() then sends at most one LCD byte, a changed character or
+ * the command that reaches one, so the I2C time of a refresh is spread
+ * over many short calls and characters that did not change are not sent
+ * at all.  The cursor is hidden while characters go out, as a refresh
+ * straight to the LCD would, and shown again at the end. */
+template <uint8_t COLS, uint8_t ROWS>
+class DisplayFrame : public Print
+{
+private:
+    char _text[ROWS][COLS];
+    char _shown[ROWS][COLS];
+    uint8_t _col;
+    uint8_t _row;
+    bool _cursor;
+    uint8_t _cursor_col;
+    uint8_t _cursor_row;
+    // Where the LCD puts the next character; COLS once past the row.
+    uint8_t _lcd_col;
+    uint8_t _lcd_row;
+    bool _lcd_cursor;
+
+    // The first character that differs from the LCD, in row order.
+    bool _nextChange(uint8_t& col, uint8_t& row) const
+    {
+        for (row = 0; row < ROWS; row++) {
+            for (col = 0; col < COLS; col++) {
+                if (_text[row][col] != _shown[row][col]) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    template <class Lcd>
+    void _moveTo(Lcd& lcd, uint8_t col, uint8_t row)
+    {
+        lcd.setCursor(col, row);
+        _lcd_col = col;
+        _lcd_row = row;
+    }
+
+public:
+    using Print::write;
+
+    DisplayFrame()
+    {
+        reset();
+    }
+
+    // The LCD was just cleared, with its cursor hidden and at home.
+    void reset()
+    {
+        for (uint8_t row = 0; row < ROWS; row++) {
+            for (uint8_t col = 0; col < COLS; col++) {
+                _text[row][col] = ' ';
+                _shown[row][col] = ' ';
+            }
+        }
+        _col = 0;
+        _row = 0;
+        _cursor = false;
+        _cursor_col = 0;
+        _cursor_row = 0;
+        _lcd_col = 0;
+        _lcd_row = 0;
+        _lcd_cursor = false;
+    }
+
+    // As LiquidCrystal_I2C, on the frame.
+    void setCursor(uint8_t col, uint8_t row)
+    {
+        _col = col;
+        _row = row < ROWS ? row : ROWS - 1;
+    }
+
+    // Shows the cursor where the frame was last positioned.
+    void cursor()
+    {
+        _cursor = true;
+        _cursor_col = _col;
+        _cursor_row = _row;
+    }
+
+    void noCursor()
+    {
+        _cursor = false;
+    }
+
+    // Text past the end of a row is dropped, as the LCD does not show it.
+    size_t write(uint8_t value)
+    {
+        if (_col < COLS) {
+            _text[_row][_col] = (char)value;
+        }
+        _col++;
+        return 1;
+    }
+
+    // Frame text, for a test.
+    char at(uint8_t col, uint8_t row) const
+    {
+        return _text[row][col];
+    }
+
+    /* Sends the next LCD byte the frame needs.  Returns false when the LCD
+     * already shows the frame and nothing was sent. */
+    template <class Lcd>
+    bool step(Lcd& lcd)
+    {
+        uint8_t col = 0;
+        uint8_t row = 0;
+        if (_nextChange(col, row)) {
+            if (_lcd_cursor) {
+                lcd.noCursor();
+                _lcd_cursor = false;
+            } else if (_lcd_col != col || _lcd_row != row) {
+                _moveTo(lcd, col, row);
+            } else {
+                lcd.write((uint8_t)_text[row][col]);
+                _shown[row][col] = _text[row][col];
+                _lcd_col++;
+            }
+            return true;
+        }
+
+        if (!_cursor) {
+            if (!_lcd_cursor) {
+                return false;
+            }
+            lcd.noCursor();
+            _lcd_cursor = false;
+            return true;
+        }
+        if (_lcd_col != _cursor_col || _lcd_row != _cursor_row) {
+            _moveTo(lcd, _cursor_col, _cursor_row);
+            return true;
+        }
+        if (_lcd_cursor) {
+            return false;
+        }
+        lcd.cursor();
+        _lcd_cursor = true;
+        return true;
+    }
+
+    // Nothing left to send.
+    bool idle() const
+    {
+        uint8_t col = 0;
+        uint8_t row = 0;
+        return !_nextChange(col, row) && _cursor == _lcd_cursor &&
+            (!_cursor || (_lcd_col == _cursor_col &&
+                          _lcd_row == _cursor_row));
+    }
+};
+
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef __ENERGY_H__
+#define __ENERGY_H__
+
+#include <stdint.h>
+
+/* Charge and energy drawn from the source, counted in integers.  A float
+ * (double on the AVR) holding thousands of mAh keeps only about three of
+ * the significant digits of each sample's few uAh; here every sample adds
+ * exactly.
+ *
+ * Each new sample adds the trapezoid between it and the previous one, so a
+ * ramp between samples is counted as a ramp.  Charge is kept in doubled
+ * picocoulombs (uA * us * 2), which holds about 2562 Ah.  Power is taken
+ * in units of 2^20 pW, about 1 uW, so the products stay within 64 bits
+ * without a division per sample, and energy carries into a coarse count of
+ * 2^24 such units times microseconds, doubled.  The coarse count holds
+ * 2^64 * 2^24 * 2^19 pW * us, about 4.5e10 Wh.  Conversion to uAh and uWh
+ * is done only when asked, for the display. */
+
+// uA * us * 2 per uAh: 3.6e9 pC, doubled.
+#define ENERGY_HALF_PC_PER_UAH    7200000000ULL
+// 3.6e15 / 2^16: the odd part of the pW * us per uWh.
+#define ENERGY_UWH_DIVISOR        54931640625ULL
+#define ENERGY_FINE_BITS          24
+
+class EnergyCounter
+{
+private:
+    uint64_t _charge;
+    uint64_t _energy_coarse;
+    uint64_t _energy_fine;
+    uint32_t _last_current_ua;
+    uint32_t _last_power;
+    uint32_t _last_us;
+    bool _started;
+
+    // 2^20 pW units, rounded.  A load cannot source current, so a negative
+    // reading is offset noise and counts as none.
+    static uint32_t _power(uint32_t current_ua, int32_t voltage_uv)
+    {
+        if (voltage_uv <= 0) {
+            return 0;
+        }
+        return (uint32_t)(((uint64_t)current_ua * (uint32_t)voltage_uv +
+                           (1ULL << 19)) >> 20);
+    }
+
+public:
+    EnergyCounter()
+    {
+        reset();
+    }
+
+    // Clears the totals; the next sample only sets the starting point.
+    void reset()
+    {
+        _charge = 0;
+        _energy_coarse = 0;
+        _energy_fine = 0;
+        _last_current_ua = 0;
+        _last_power = 0;
+        _last_us = 0;
+        _started = false;
+    }
+
+    /* Adds the interval since the previous sample.  A sample with the same
+     * timestamp as the previous one is ignored, so it is safe to call on
+     * every pass with the latest measurement.  Intervals up to the
+     * micros() period (71 minutes) are integrated as they are. */
+    void add(int32_t current_ua, int32_t voltage_uv, uint32_t timestamp_us)
+    {
+        const uint32_t current = current_ua > 0 ? (uint32_t)current_ua : 0;
+        const uint32_t power = _power(current, voltage_uv);
+        if (_started) {
+            const uint32_t elapsed_us = timestamp_us - _last_us;
+            if (elapsed_us == 0) {
+                return;
+            }
+            _charge += (uint64_t)(current + _last_current_ua) * elapsed_us;
+            _energy_fine += ((uint64_t)power + _last_power) * elapsed_us;
+            _energy_coarse += _energy_fine >> ENERGY_FINE_BITS;
+            _energy_fine &= (1ULL << ENERGY_FINE_BITS) - 1;
+        }
+        _last_current_ua = current;
+        _last_power = power;
+        _last_us = timestamp_us;
+        _started = true;
+    }
+
+    uint64_t microampHours() const
+    {
+        return _charge / ENERGY_HALF_PC_PER_UAH;
+    }
+
+    /* Doubled 2^20 pW * us is 2^19 pW * us, and a uWh is 3.6e15 pW * us,
+     * so uWh = (coarse * 2^24 + fine) * 2^3 / ENERGY_UWH_DIVISOR.  The
+     * coarse count is divided first so the products fit in 64 bits. */
+    uint64_t microwattHours() const
+    {
+        const uint64_t whole = _energy_coarse / ENERGY_UWH_DIVISOR;
+        const uint64_t rest = _energy_coarse % ENERGY_UWH_DIVISOR;
+        return (whole << (ENERGY_FINE_BITS + 3)) +
+            ((rest << (ENERGY_FINE_BITS + 3)) + (_energy_fine << 3)) /
+            ENERGY_UWH_DIVISOR;
+    }
+};
+
+
+/* `thousandths` / 1000 with `prec` (0 - 3) decimals, rounded, padded with
+ * leading zeros to `width` and cut to `width` if longer, as the LCD shows
+ * it.  `text` needs room for 16 characters. */
+inline void FormatThousandths(char* text, uint32_t thousandths,
+                              uint8_t width, uint8_t prec)
+{
+    static const uint16_t scale[] = {1, 10, 100, 1000};
+    if (prec > 3) {
+        prec = 3;
+    }
+    const uint32_t divisor = scale[3 - prec];
+    const uint32_t value = thousandths / divisor +
+        (thousandths % divisor >= divisor / 2 && divisor > 1 ? 1 : 0);
+
+    char digits[16];
+    uint8_t length = 0;
+    uint32_t rest = value;
+    for (uint8_t place = 0; place < prec; place++) {
+        digits[length++] = (char)('0' + rest % 10);
+        rest /= 10;
+    }
+    if (prec > 0) {
+        digits[length++] = '.';
+    }
+    do {
+        digits[length++] = (char)('0' + rest % 10);
+        rest /= 10;
+    } while (rest != 0);
+    while (length < width && length < sizeof(digits) - 1) {
+        digits[length++] = '0';
+    }
+
+    uint8_t out = 0;
+    while (length > 0 && out < width) {
+        text[out++] = digits[--length];
+    }
+    text[out] = '\0';
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+#include <stdint.h>
+
+// Events waiting between two control passes; a power of two.
+#define INPUT_QUEUE_SIZE     16
+
+// Keeps the compiler from moving the event stores past the index store.
+#define INPUT_QUEUE_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+enum InputEventType
+{
+    // value: encoder detents, signed
+    INPUT_ENCODER_TURN = 0,
+    // value: 0; the switch was released before the hold time
+    INPUT_ENCODER_CLICK,
+    // value: button index
+    INPUT_BUTTON_PRESS,
+    INPUT_BUTTON_RELEASE,
+    INPUT_BUTTON_HOLD,
+    INPUT_BUTTON_REPEAT
+};
+
+struct InputEvent
+{
+    uint8_t type;
+    int8_t value;
+    // Low bits of millis() when the interrupt saw it.
+    uint16_t timestamp_ms;
+};
+
+/* Input events from the interrupts to the main loop.
+ *
+ * One producer and one consumer: the interrupts only push and the main
+ * loop only pops, so neither side ever disables interrupts.  Each index is
+ * a single byte written by one side only, which the AVR stores atomically.
+ * Several interrupt handlers count as one producer as long as none of them
+ * pushes with interrupts enabled.  A full queue drops the new event and
+ * counts it. */
+class InputQueue
+{
+private:
+    InputEvent _events[INPUT_QUEUE_SIZE];
+    volatile uint8_t _head;
+    volatile uint8_t _tail;
+    volatile uint8_t _dropped;
+
+public:
+    InputQueue() :
+        _head(0),
+        _tail(0),
+        _dropped(0)
+    {
+    }
+
+    // Producer side.
+    bool push(uint8_t type, int8_t value, uint16_t timestamp_ms)
+    {
+        const uint8_t head = _head;
+        const uint8_t next = (uint8_t)((head + 1) & (INPUT_QUEUE_SIZE - 1));
+        if (next == _tail) {
+            if (_dropped != 0xFF) {
+                _dropped++;
+            }
+            return false;
+        }
+        _events[head].type = type;
+        _events[head].value = value;
+        _events[head].timestamp_ms = timestamp_ms;
+        INPUT_QUEUE_BARRIER();
+        _head = next;
+        return true;
+    }
+
+    bool full() const
+    {
+        return ((_head + 1) & (INPUT_QUEUE_SIZE - 1)) == _tail;
+    }
+
+    // Consumer side.
+    bool pop(InputEvent& event)
+    {
+        const uint8_t tail = _tail;
+        if (tail == _head) {
+            return false;
+        }
+        INPUT_QUEUE_BARRIER();
+        event = _events[tail];
+        INPUT_QUEUE_BARRIER();
+        _tail = (uint8_t)((tail + 1) & (INPUT_QUEUE_SIZE - 1));
+        return true;
+    }
+
+    // Events lost to a full queue, saturating.
+    uint8_t dropped() const
+    {
+        return _dropped;
+    }
+};
+
+// ClickEncoder's acceleration, in 1/256 detents: a fast turn counts up to
+// 1 + TOP / 256 per detent.
+#define ROTARY_ACCEL_TOP     3072
+#define ROTARY_ACCEL_INC     25
+#define ROTARY_ACCEL_DEC     2
+
+/* Detents of the quadrature encoder, decoded from its two pins on the 1 ms
+ * tick.  It decodes and accelerates the way ClickEncoder::service() and
+ * getValue() do, but getValue() ends with sei(), which must not run inside
+ * the timer interrupt, so the firmware does not use ClickEncoder at all.
+ * The count here belongs to the interrupt alone, so reading it needs no
+ * masking at all. */
+class RotaryDecoder
+{
+private:
+    uint8_t _steps;
+    int8_t _last;
+    int16_t _delta;
+    uint16_t _acceleration;
+
+    // Gray code to a binary quarter-step position.
+    static int8_t _position(bool a, bool b)
+    {
+        int8_t position = a ? 3 : 0;
+        if (b) {
+            position ^= 1;
+        }
+        return position;
+    }
+
+public:
+    // `steps`: quadrature steps per detent, 1, 2 or 4.
+    RotaryDecoder(uint8_t steps) :
+        _steps(steps),
+        _last(0),
+        _delta(0),
+        _acceleration(0)
+    {
+    }
+
+    // `a` and `b` are true while that pin reads active.
+    void reset(bool a, bool b)
+    {
+        _last = _position(a, b);
+        _delta = 0;
+        _acceleration = 0;
+    }
+
+    // One sample per tick; returns the detents it completed, accelerated.
+    int16_t sample(bool a, bool b)
+    {
+        _acceleration = _acceleration > ROTARY_ACCEL_DEC ?
+            (uint16_t)(_acceleration - ROTARY_ACCEL_DEC) : 0;
+
+        const int8_t position = _position(a, b);
+        const int8_t diff = (int8_t)(_last - position);
+        if (diff & 1) {
+            _last = position;
+            _delta = (int16_t)(_delta + (diff & 2) - 1);
+            if (_acceleration <= ROTARY_ACCEL_TOP - ROTARY_ACCEL_INC) {
+                _acceleration += ROTARY_ACCEL_INC;
+            }
+        }
+
+        // Whole detents out, the quarter steps towards the next one kept.
+        int16_t detents = _delta;
+        if (_steps == 4) {
+            _delta = (int16_t)(detents & 3);
+            detents = (int16_t)(detents >> 2);
+        } else if (_steps == 2) {
+            _delta = (int16_t)(detents & 1);
+            detents = (int16_t)(detents >> 1);
+        } else {
+            _delta = 0;
+        }
+        if (detents == 0) {
+            return 0;
+        }
+        const int16_t step = (int16_t)(1 + (_acceleration >> 8));
+        return detents < 0 ? (int16_t)-step : step;
+    }
+};
+
+#endif
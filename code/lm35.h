@@ -2,11 +2,19 @@
 #define __LM35_H__
 
 
-#define LM35_SAMPLES 64
+// The average is over 2^LM35_SAMPLES_LOG2 samples, so it is a shift.
+#define LM35_SAMPLES_LOG2 6
+#define LM35_SAMPLES (1 << LM35_SAMPLES_LOG2)
 #define LM35_ADC_RAIL_LOW 0
 #define LM35_ADC_RAIL_HIGH 1023
 #define LM35_RAIL_FAULT_SAMPLES 4
 
+// The sum times a 5 V reference in mV must fit 32 bits, and the
+// millicelsius scaling shifts by LM35_SAMPLES_LOG2 - 2.
+#if LM35_SAMPLES_LOG2 < 2 || LM35_SAMPLES_LOG2 > 9
+#error "LM35_SAMPLES_LOG2 must be between 2 and 9"
+#endif
+
 
 class LM35
 {
@@ -16,7 +24,7 @@ private:
     int _index;
     long _sum;
     int _vref;
-    double _temperature;
+    int32_t _temperature_mc;
     bool _valid;
     bool _initialized;
     uint8_t _rail_samples;
@@ -48,8 +56,7 @@ protected:
 
 public:
     LM35(uint8_t pin, double vref) :
-        _pin(pin), _index(0), _sum(0), _vref(vref), _temperature(0.0),
-        _valid(false), _initialized(false), _rail_samples(0)
+        _pin(pin), _index(0), _sum(0), _vref(vref), _temperature_mc(0), _valid(false), _initialized(false), _rail_samples(0)
     {
         memset(_samples, 0, sizeof(_samples));
     }
@@ -70,7 +77,7 @@ public:
     void update()
     {
         _update();
-        _temperature = calcTemperature();
+        _temperature_mc = calcTemperatureMilliCelsius();
         _valid = _initialized && _isPlausible() &&
             _rail_samples < LM35_RAIL_FAULT_SAMPLES;
     }
@@ -80,9 +87,26 @@ public:
         return (double)_sum * _vref / 1024 / 10.0 / LM35_SAMPLES;
     }
 
-    double getTemperature() __attribute__((always_inline))
+    // 10 mV/C: sum * vref(mV) / 1024 / samples * 100 mC/mV, which is
+    // sum * vref * 25 / 2^(8 + LM35_SAMPLES_LOG2).  All but 2^10 of the
+    // divisor is taken first so the product stays within 32 bits.
+    int32_t calcTemperatureMilliCelsius()
+    {
+        const uint32_t scaled = static_cast<uint32_t>(_sum) *
+            static_cast<uint32_t>(_vref);
+        return static_cast<int32_t>(
+            ((scaled >> (LM35_SAMPLES_LOG2 - 2)) * 25UL + 512UL) >> 10);
+    }
+
+    // Computed when asked; the firmware only uses the millicelsius value.
+    double getTemperature()
+    {
+        return calcTemperature();
+    }
+
+    int32_t getTemperatureMilliCelsius() __attribute__((always_inline))
     {
-        return _temperature;
+        return _temperature_mc;
     }
 
     bool isValid() __attribute__((always_inline))
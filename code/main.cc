@@ -3,16 +3,23 @@
 #include <SPI.h>
 #include <TimerOne.h>
 #include <LiquidCrystal_I2C.h>
-#include <ClickEncoder.h>
 #include <EEPROM.h>
 
 #include "ad5541.h"
 #include "adc.h"
+#include "calibration.h"
+#include "energy.h"
 #include "button.h"
+#include "display.h"
 #include "fan.h"
+#include "input.h"
 #include "setter.h"
 #include "lm35.h"
 #include "control.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "spi_bus.h"
+#include "waveform.h"
 
 
 // Hardware Configuration
@@ -42,40 +49,149 @@
 #define ADC_CURRENT_CHN      AD7190_CH_AIN2P_AINCOM
 #define ADC_VOLTAGE_CHN      AD7190_CH_AIN1P_AINCOM
 
+/* The version covers the mode byte and the set points, which a new version
+ * resets to their defaults.  The two calibration records carry their own
+ * version and CRC and are left alone. */
 #define EEPROM_VERSION_ADDR  0x00
-#define EEPROM_VERSION       0x0a
+#define EEPROM_VERSION       0x0b
+#define EEPROM_MODE_ADDR     0x01
 
 #define EEPROM_CURRENT_ADDR  0x10
 #define EEPROM_VOLTAGE_ADDR  0x20
+#define EEPROM_POWER_ADDR    0x24
+#define EEPROM_RESISTANCE_ADDR 0x28
+#define EEPROM_CV_ADDR       0x2c
+#define EEPROM_CALIBRATION_ADDR 0x30
+#define EEPROM_ADC_CALIBRATION_ADDR 0x70
 
 
 // Constants
 const double VREF_VOLTAGE = 5000.0;  // mV
 
-const double MAX_WATTAGE = 200.0;
-const double CONTINUOUS_WATTAGE = 180.0;
-const double MAX_INPUT_VOLTAGE = 50.0;
-const double MIN_SOURCE_VOLTAGE = 0.1;
+// The control path works in uA, uV, mW and m°C; see control.h.
+const int32_t MAX_WATTAGE_MW = 200000L;
+const int32_t CONTINUOUS_WATTAGE_MW = 180000L;
+constexpr int32_t MAX_POWER_CENTIWATTS = CONTINUOUS_WATTAGE_MW / 10;
+const int32_t MAX_INPUT_MICROVOLTS = 50000000L;
+const int32_t MIN_SOURCE_MICROVOLTS = 100000L;
 
 constexpr int32_t MAX_CURRENT_MILLIAMPS = 15000;
-constexpr double MAX_CURRENT = MAX_CURRENT_MILLIAMPS / 1000.0;
+constexpr int32_t OVERCURRENT_MICROAMPS = MAX_CURRENT_MILLIAMPS * 1100L;
+
+const int32_t MAX_TEMPERATURE_MC = 95000L;
+const int32_t THERMAL_DERATE_START_MC = 80000L;
+const int32_t FAN_ON_TEMPERATURE_MC = 40000L;
+const int32_t FAN_OFF_TEMPERATURE_MC = 35000L;
+
+// Upward slew of each load mode, in control::LoadMode order, none faster
+// than 5 A/s.  Every mode ramps linearly.  Building with -DCC_SCURVE_SLEW
+// ramps a CC step on an S-curve instead, so it starts and ends without a
+// step in di/dt; CP, CR and CV already follow the source through the
+// regulation and stay linear.
+const control::SlewSettings MODE_SLEW[control::kLoadModeCount] = {
+#ifdef CC_SCURVE_SLEW
+    {control::SlewProfile::SCurve, 5000L, 25000L},
+#else
+    {control::SlewProfile::Linear, 5000L, 0},
+#endif
+    {control::SlewProfile::Linear, 5000L, 0},
+    {control::SlewProfile::Linear, 5000L, 0},
+    {control::SlewProfile::Linear, 5000L, 0},
+};
 
-const double MAX_TEMPERATURE = 95.0;
-const double THERMAL_DERATE_START = 80.0;
+// Limits that apply in every state.  The ADC also trips on the current and
+// voltage limits directly in raw code space.
+const control::FixedSafetyLimits HARD_SAFETY_LIMITS = {
+    OVERCURRENT_MICROAMPS, 0, MAX_TEMPERATURE_MC,
+    MAX_INPUT_MICROVOLTS, MAX_WATTAGE_MW
+};
 
-const int MAX_PAGE = 4;
+// Background zero-scale calibration, one AD7190 channel per interval.
+const uint32_t ADC_ZERO_CALIBRATION_INTERVAL_MS = 30000UL;
+// A drifted ADC recalibrates both channels, zero-scale then full-scale, one
+// calibration in place of one current conversion at a time.
+const uint8_t ADC_RECALIBRATION_STEPS = 2 * MAX_CHANNELS;
+// While Running a background calibration may stretch the gap between two
+// current samples up to this.
+const uint32_t MAX_CURRENT_SAMPLE_GAP_MS = 150UL;
+
+// Dynamic load: one period of the selected shape between a tenth of the
+// current set point and the set point, 50 entries of 2 ms each (10 Hz).
+const uint8_t WAVEFORM_POINTS = 50;
+const uint16_t WAVEFORM_PERIOD_MS = 100;
+const int32_t WAVEFORM_LOW_DIVISOR = 10;
+// Shape selection past the last waveform: static constant current.
+const uint8_t DYNAMIC_OFF = MAX_WAVEFORM_SHAPES;
+
+const int DYNAMIC_PAGE = 5;
+const int MODE_PAGE = 6;
+#ifdef LOAD_PROFILE
+const int DIAG_PAGE = 7;
+const int MAX_PAGE = 8;
+// One phase per report, so every phase is reported once a second.
+const uint32_t PROFILE_REPORT_PERIOD_US = 1000000UL / MAX_PROFILE_PHASES;
+#else
+const int MAX_PAGE = 7;
+#endif
 const uint32_t DISPLAY_UPDATE_INTERVAL_MS = 200UL;
 const uint32_t WIRE_TIMEOUT_US = 1000UL;
+const uint32_t SAFETY_TASK_PERIOD_US = 1000UL;
+// 115200 baud fills the 64-byte receive buffer in about 5.6 ms.
+const unsigned long SERIAL_BAUD = 115200UL;
+const uint32_t CALIBRATION_TASK_PERIOD_US = 5000UL;
+// The LM35 average spans 64 updates, 6.4 s at this rate.
+const uint32_t TEMPERATURE_TASK_PERIOD_US = 100000UL;
 
 
 ///////////////////////
 // Devices
 ///////////////////////
 
+// SPI bus shared by the DAC and the ADC; DAC writes have priority.
+SPIBus spi_bus;
+
+
 // DAC
 AD5541 ad5541(DAC_CS_PIN);
 
 
+// Dynamic load table, played from the Timer1 interrupt
+WaveformTable waveform_table;
+WaveformPlayer waveform;
+
+
+// Encoder switch stop.  The main loop arms it while running; the INT0
+// handler zeroes the DAC and leaves the state change to the main loop.
+volatile bool stop_armed = false;
+volatile bool stop_pressed = false;
+
+
+// Input events from the Timer1 interrupt to the control pass, and what
+// the interrupt keeps between events.
+InputQueue input_queue;
+int16_t encoder_turn = 0;
+// The encoder switch has been held past ENCODER_CLICK_MS since its press.
+bool encoder_switch_held = false;
+
+
+// Phase run times, empty unless built with LOAD_PROFILE
+PhaseProfiler profiler;
+#ifdef LOAD_PROFILE
+static const char* const PROFILE_PHASE_NAMES[] = {
+    "ADC", "TMP", "CTL", "LCD", "I2C"
+};
+// Diagnostics page view: phase * 2, plus 1 for its histogram.
+uint8_t profile_view = 0;
+uint8_t profile_report_phase = 0;
+#endif
+
+
+// The calibration console line being received, and whether it overflowed.
+char calibration_line[CALIBRATION_LINE_MAX + 1];
+uint8_t calibration_line_length = 0;
+bool calibration_line_overflow = false;
+
+
 // ADC
 ADConverter adc(ADC_CS_PIN,
                 ADC_VOLTAGE_CHN,
@@ -87,22 +203,38 @@ ADConverter adc(ADC_CS_PIN,
 LiquidCrystal_I2C lcd(LCD_IIC_ADDRESS,
                       LCD_IIC_COLS,
                       LCD_IIC_ROWS);
+// What it should show; DisplayTask() sends it a byte at a time.
+DisplayFrame<LCD_IIC_COLS, LCD_IIC_ROWS> display;
 
 
-// encoder
-ClickEncoder encoder(ENCODER_PIN_1,
-                     ENCODER_PIN_2,
-                     ENCODER_SW_PIN,
-                     ENCODER_UPDATE_RATE);
+// encoder: the turns and the switch are both decoded here.  ClickEncoder
+// is not used: its service() decodes the turns as well, and its getValue()
+// ends with sei(), so it must never be called from the timer interrupt.
+RotaryDecoder encoder_turns(ENCODER_UPDATE_RATE);
+// A release before this is a click; a longer press, such as the start
+// hold, is not.  ClickEncoder's hold time.
+const uint16_t ENCODER_CLICK_MS = 1200;
+ButtonDebouncer<1> encoder_switch(ENCODER_CLICK_MS, 0);
 
 
-// Buttons
-Button buttons[MAX_BUTTON] {
+// Buttons, pressed low
+const uint8_t BUTTON_PINS[MAX_BUTTON] = {
     BUTTON_1_PIN,
     BUTTON_2_PIN,
     BUTTON_3_PIN,
     BUTTON_4_PIN,
 };
+// Auto-repeat of a held button, in Timer1 ticks of 1 ms.
+const uint16_t BUTTON_HOLD_MS = 600;
+const uint16_t BUTTON_REPEAT_MS = 200;
+// Sampled every Timer1 tick, so a press counts 8 ms after it settles.
+ButtonDebouncer<MAX_BUTTON> button_debouncer(BUTTON_HOLD_MS,
+                                             BUTTON_REPEAT_MS);
+#if defined(__AVR__)
+// Input register of port D, which has all four, and their bits in it.
+volatile uint8_t* button_port = 0;
+uint8_t button_bits[MAX_BUTTON];
+#endif
 
 
 // FAN
@@ -115,10 +247,16 @@ LM35 lm35(LM35_PIN, VREF_VOLTAGE);
 
 // Setter (max 15000mA)
 Setter<MAX_CURRENT_MILLIAMPS> current_set_point;
+// Constant power set point, 10mW steps
+Setter<MAX_POWER_CENTIWATTS> power_set_point;
+// Constant resistance set point, mOhm
+Setter<99999l> resistance_set_point;
+// Constant voltage set point, mV
+Setter<99999l> cv_set_point;
 // Cut off voltage set
 Setter<99999l> voltage_set_point;
 
-// 0 - 4 current 5 - 9 cut off voltage
+// 0 - 4 set point of the load mode 5 - 9 cut off voltage
 int8_t setter_position = 4;
 const int MAX_SET_POSITION = 10;
 
@@ -130,123 +268,556 @@ const int MAX_SET_POSITION = 10;
 // Global Data
 struct {
     control::ControllerState controller;
-    control::MeasurementSnapshot measurement;
+    control::FixedMeasurementSnapshot measurement;
 
-    double mah;
-    double watt_h;
-    uint32_t update_last;
+    EnergyCounter energy;
     bool adc_initialized;
     bool display_available;
-    bool stop_armed;
     bool start_press_active;
     uint32_t start_pressed_ms;
-    uint32_t output_last;
     uint32_t display_last;
+    int32_t adc_calibrated_mc;
+    uint32_t zero_cal_last;
+    uint32_t zero_cal_started;
+    uint32_t zero_cal_ms;
+    uint32_t sample_interval_ms;
+    uint8_t zero_cal_channel;
+    // Calibrations left of a drift recalibration, and its temperature.
+    uint8_t recalibration_steps;
+    int32_t recalibration_mc;
+    uint8_t dynamic_shape;
+    control::LoadMode mode;
+    uint32_t regulation_next;
+    int32_t target_ua;
+    control::ConstantVoltageIntegrator constant_voltage;
+    bool sample_gap;
+    // No measurement since the ADC was (re)initialized.
+    bool awaiting_measurement;
     control::UndervoltageQualification undervoltage;
+    control::SlewState slew;
+    control::SampleHistory current_history;
+    control::SampleHistory voltage_history;
 
     // page
     int page;
 
 } g_cb {
     control::ControllerState(),
-    control::MeasurementSnapshot(),
-    0.0, 0.0, 0, false, true, false, false, 0, 0, 0,
-    control::UndervoltageQualification(), 0
+    control::FixedMeasurementSnapshot(),
+    EnergyCounter(), false, true, false, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    DYNAMIC_OFF, control::LoadMode::ConstantCurrent, 0, 0,
+    control::ConstantVoltageIntegrator(), false, false,
+    control::UndervoltageQualification(), control::SlewState(),
+    control::SampleHistory(), control::SampleHistory(), 0
 };
 
 
-void SetLoadOutput(uint16_t code)
+// Cursor positions 0 - 4 edit the set point of the load mode.
+void ChangeModeSetPoint(int16_t value)
 {
+    switch (g_cb.mode) {
+    case control::LoadMode::ConstantPower:
+        power_set_point.change(value);
+        break;
+    case control::LoadMode::ConstantResistance:
+        resistance_set_point.change(value);
+        break;
+    case control::LoadMode::ConstantVoltage:
+        cv_set_point.change(value);
+        break;
+    default:
+        current_set_point.change(value);
+    }
+}
+
+
+void SetModeSetPointPosition(int position)
+{
+    switch (g_cb.mode) {
+    case control::LoadMode::ConstantPower:
+        power_set_point.set_position(position);
+        break;
+    case control::LoadMode::ConstantResistance:
+        resistance_set_point.set_position(position);
+        break;
+    case control::LoadMode::ConstantVoltage:
+        cv_set_point.set_position(position);
+        break;
+    default:
+        current_set_point.set_position(position);
+    }
+}
+
+
+// In the units of control::modeTargetMicroamps(): uA, mW, mOhm or uV.
+int32_t ModeSetPoint()
+{
+    switch (g_cb.mode) {
+    case control::LoadMode::ConstantPower:
+        return power_set_point.get_value() * 10L;
+    case control::LoadMode::ConstantResistance:
+        return resistance_set_point.get_value();
+    case control::LoadMode::ConstantVoltage:
+        return cv_set_point.get_value() * 1000L;
+    default:
+        return current_set_point.get_value() * 1000L;
+    }
+}
+
+
+// Digits before the decimal point of the set point display.
+uint8_t ModeSetPointIntegerDigits()
+{
+    return g_cb.mode == control::LoadMode::ConstantPower ? 3 : 2;
+}
+
+
+// Called on every control pass.  An unchanged code is only re-sent at the
+// DAC refresh interval, unless `force` asks for an immediate write.  Any
+// output set here ends a running waveform.
+void SetLoadOutput(uint16_t code, bool force = false)
+{
+    waveform.stop();
     if (code > control::kTheoreticalDacHardCapCode) {
         code = control::kTheoreticalDacHardCapCode;
     }
+    if (!force && !ad5541.needsWrite(code)) {
+        return;
+    }
+    // Never waits for a pending conversion: a parked AD7190 steps off the
+    // bus for the write.  A stop pressed, or a trip seen by the ready
+    // interrupt, since the code was worked out has either zeroed the DAC
+    // already or will as the bus unlocks; either way nothing but 0 goes out
+    // after it.
+    spi_bus.beginPriority();
+    if (stop_pressed || adc.safetyTripWritten()) {
+        code = 0;
+    }
     ad5541.setValue(code);
+    spi_bus.endPriority();
+    // Range the next current conversion for the commanded load.
+    adc.predictCurrent(control::theoreticalMicroampsFromDacCode(code));
 }
 
 
 
+// Pressed buttons as a mask of bit i for BUTTON_PINS[i].  On the AVR one
+// port read samples all four at the same instant.
+uint8_t ReadButtonLevels()
+{
+    uint8_t levels = 0;
+#if defined(__AVR__)
+    const uint8_t port = *button_port;
+    for (uint8_t index = 0; index < MAX_BUTTON; index++) {
+        if (!(port & button_bits[index])) {
+            levels |= (uint8_t)(1u << index);
+        }
+    }
+#else
+    for (uint8_t index = 0; index < MAX_BUTTON; index++) {
+        if (digitalRead(BUTTON_PINS[index]) == LOW) {
+            levels |= (uint8_t)(1u << index);
+        }
+    }
+#endif
+    return levels;
+}
+
+
+// Before the timer interrupt starts sampling them.
+void InitButtons()
+{
+    for (uint8_t index = 0; index < MAX_BUTTON; index++) {
+        pinMode(BUTTON_PINS[index], INPUT);
+    }
+#if defined(__AVR__)
+    button_port = portInputRegister(digitalPinToPort(BUTTON_PINS[0]));
+    for (uint8_t index = 0; index < MAX_BUTTON; index++) {
+        button_bits[index] = digitalPinToBitMask(BUTTON_PINS[index]);
+    }
+#endif
+    button_debouncer.reset(ReadButtonLevels());
+}
+
+
+// Timer1 interrupt: one sample of the buttons, and their events to the
+// queue.  Nothing is queued while no button changes or is held.
+void QueueButtonInput()
+{
+    const ButtonEvents events = button_debouncer.sample(ReadButtonLevels());
+    if (!(events.press | events.release | events.hold | events.repeat)) {
+        return;
+    }
+    const uint16_t now = (uint16_t)millis();
+    for (uint8_t index = 0; index < MAX_BUTTON; index++) {
+        const uint8_t mask = (uint8_t)(1u << index);
+        if (events.press & mask) {
+            input_queue.push(INPUT_BUTTON_PRESS, (int8_t)index, now);
+        }
+        if (events.hold & mask) {
+            input_queue.push(INPUT_BUTTON_HOLD, (int8_t)index, now);
+        }
+        if (events.repeat & mask) {
+            input_queue.push(INPUT_BUTTON_REPEAT, (int8_t)index, now);
+        }
+        if (events.release & mask) {
+            input_queue.push(INPUT_BUTTON_RELEASE, (int8_t)index, now);
+        }
+    }
+}
+
+
+/* Timer1 interrupt: one sample of the encoder pins.  Detents the queue
+ * has no room for are carried to the next tick; a click it has no room for
+ * is dropped and counted, as a button event is. */
+void QueueEncoderInput()
+{
+    encoder_turn += encoder_turns.sample(
+        digitalRead(ENCODER_PIN_1) == LOW,
+        digitalRead(ENCODER_PIN_2) == LOW);
+    const uint16_t now = (uint16_t)millis();
+    if (encoder_turn != 0) {
+        const int8_t turn = (int8_t)constrain(encoder_turn, -128, 127);
+        if (input_queue.push(INPUT_ENCODER_TURN, turn, now)) {
+            encoder_turn -= turn;
+        }
+    }
+
+    const ButtonEvents events = encoder_switch.sample(
+        digitalRead(ENCODER_SW_PIN) == LOW ? 1 : 0);
+    if (events.press) {
+        encoder_switch_held = false;
+    }
+    if (events.hold) {
+        encoder_switch_held = true;
+    }
+    if (events.release && !encoder_switch_held) {
+        input_queue.push(INPUT_ENCODER_CLICK, 0, now);
+    }
+}
+
+
 // timer service
 void timer_one_isr()
 {
-    encoder.service();
+    // The table is clamped when it is built; only copy the code out.  An
+    // AD7190 transfer in progress owns the bus, so the write waits a tick.
+    uint16_t code;
+    if (waveform.tick(code)) {
+        if (spi_bus.tryBeginPriority()) {
+            ad5541.setValue(code);
+            spi_bus.endPriority();
+        } else {
+            waveform.defer();
+        }
+    }
+
+    QueueButtonInput();
+    QueueEncoderInput();
+}
+
+
+void ZeroLoadOutput(void*)
+{
+    ad5541.zero();
+}
+
+
+// AD7190 ready interrupt, on a raw word over the hard current or voltage
+// limit.  The fault is latched once the main loop collects the word.
+void TripLoadOutput(void*)
+{
+    waveform.stop();
+    ad5541.zero();
+}
+
+
+// Encoder switch (D2, INT0) falling edge.  The DAC goes to 0 here, ahead of
+// everything the main loop may be busy with; an AD7190 transfer in
+// progress is finished first and the write follows as it unlocks the bus.
+void encoder_switch_isr()
+{
+    if (!stop_armed) {
+        return;
+    }
+    stop_armed = false;
+    stop_pressed = true;
+    waveform.stop();
+    spi_bus.priorityWrite(ZeroLoadOutput, 0);
 }
 
 
-void UpdateButtons()
+// What the interrupts saw since the last control pass.
+struct InputSummary
 {
-    for (int i = MAX_BUTTON; i > 0; i--) {
-        buttons[i - 1].update();
+    int16_t turn;
+    // Presses and auto-repeats.
+    uint8_t presses[MAX_BUTTON];
+    bool clicked;
+};
+
+
+InputSummary DrainInput()
+{
+    InputSummary input = {0, {0, 0, 0, 0}, false};
+    InputEvent event;
+    while (input_queue.pop(event)) {
+        switch (event.type) {
+        case INPUT_ENCODER_TURN:
+            input.turn += event.value;
+            break;
+        case INPUT_ENCODER_CLICK:
+            input.clicked = true;
+            break;
+        case INPUT_BUTTON_PRESS:
+        case INPUT_BUTTON_REPEAT:
+            if (event.value >= 0 && event.value < MAX_BUTTON &&
+                input.presses[event.value] != 0xFF) {
+                input.presses[event.value]++;
+            }
+            break;
+        default:
+            break;
+        }
     }
+    return input;
+}
+
+
+// `value` moved by `steps` within 0 .. count - 1.
+int WrapStep(int value, int steps, int count)
+{
+    value = (value + steps) % count;
+    return value < 0 ? value + count : value;
+}
+
+
+// AD7190 DOUT/RDY is MISO (D12, PCINT4).  The converter only arms this while
+// a conversion is parked on an otherwise idle bus.
+ISR(PCINT0_vect)
+{
+    adc.onReadyInterrupt();
 }
 
 
 bool HandleImmediateStop();
+void LatchFault(control::FaultReason reason, uint32_t now);
 
 
-bool UpdateCurrentVoltage()
+// Start the next current conversion unless the AD7190 is already busy.
+void StartCurrentConversion()
 {
-    if (!g_cb.adc_initialized) {
-        adc.resetCurrent();
-        g_cb.measurement.current = 0.0;
-        g_cb.measurement.voltage = 0.0;
-        g_cb.measurement.safety_current = 0.0;
-        g_cb.measurement.safety_voltage = 0.0;
-        g_cb.measurement.current_valid = false;
-        g_cb.measurement.voltage_valid = false;
-        g_cb.measurement.safety_current_valid = false;
-        g_cb.measurement.safety_voltage_valid = false;
-        return true;
+    if (g_cb.adc_initialized && !adc.isSequencing() && !adc.isConverting()) {
+        adc.startConversion(CHANNEL_CURRENT);
     }
+}
 
-    const bool current_valid = adc.updateCurrent();
-    if (!current_valid) {
-        g_cb.measurement.current = adc.readCurrent();
-        g_cb.measurement.voltage = adc.readVoltage();
-        g_cb.measurement.current_valid = false;
-        g_cb.measurement.voltage_valid = false;
-        g_cb.measurement.safety_current_valid = false;
-        g_cb.measurement.safety_voltage_valid = false;
+
+// Starts the next background zero-scale calibration in place of the next
+// current conversion.  The safety task polls it like a conversion, so the
+// control loop never waits for it.  While Idle the steps of a pending drift
+// recalibration go first, with no interval.
+bool StartZeroCalibration()
+{
+    if (!g_cb.adc_initialized || adc.isConverting()) {
+        return false;
+    }
+    if (g_cb.recalibration_steps != 0 &&
+        g_cb.controller.state == control::OperationState::Idle) {
+        const uint8_t step =
+            ADC_RECALIBRATION_STEPS - g_cb.recalibration_steps;
+        adc.stopSequence();
+        g_cb.zero_cal_started = millis();
+        if (step % 2 == 0) {
+            adc.startZeroCalibration(step / 2);
+        } else {
+            adc.startFullScaleCalibration(step / 2);
+        }
         return true;
     }
-
-    // Do not make an intentional stop wait for the second ADC conversion.
-    if (HandleImmediateStop()) {
+    if (!control::hasElapsed(millis(), g_cb.zero_cal_last,
+                             ADC_ZERO_CALIBRATION_INTERVAL_MS) ||
+        !control::calibrationWindowAvailable(g_cb.controller.state,
+                                             g_cb.sample_interval_ms,
+                                             g_cb.zero_cal_ms,
+                                             MAX_CURRENT_SAMPLE_GAP_MS)) {
         return false;
     }
+    adc.stopSequence();
+    g_cb.zero_cal_started = millis();
+    adc.startZeroCalibration(g_cb.zero_cal_channel);
+    return true;
+}
 
-    const bool voltage_valid = adc.updateVoltage();
 
-    g_cb.measurement.current = adc.readCurrent();
-    g_cb.measurement.voltage = adc.readVoltage();
-    g_cb.measurement.safety_current = adc.readSafetyCurrent();
-    g_cb.measurement.safety_voltage = adc.readSafetyVoltage();
+// Records how long the finished calibration held the converter.  The last
+// step of a drift recalibration stores the coefficients with the
+// temperature they were taken at.
+void FinishZeroCalibration(bool valid)
+{
+    const uint32_t now = millis();
+    if (!valid) {
+        g_cb.adc_initialized = false;
+        LatchFault(control::FaultReason::AdcFailure, now);
+        return;
+    }
+    g_cb.sample_gap = true;
+    if (g_cb.recalibration_steps != 0) {
+        if (--g_cb.recalibration_steps == 0) {
+            g_cb.adc_calibrated_mc = g_cb.recalibration_mc;
+            if (lm35.isValid()) {
+                SaveAdcCalibration(EEPROM_ADC_CALIBRATION_ADDR, adc,
+                                   g_cb.recalibration_mc);
+            }
+            g_cb.zero_cal_last = now;
+        }
+        return;
+    }
+    g_cb.zero_cal_ms = now - g_cb.zero_cal_started;
+    g_cb.zero_cal_last = now;
+    g_cb.zero_cal_channel = (g_cb.zero_cal_channel + 1) % MAX_CHANNELS;
+}
+
+
+void ClearMeasurement()
+{
+    adc.resetCurrent();
+    g_cb.measurement.current_ua = 0;
+    g_cb.measurement.voltage_uv = 0;
+    g_cb.measurement.safety_current_ua = 0;
+    g_cb.measurement.safety_voltage_uv = 0;
+    g_cb.measurement.current_valid = false;
+    g_cb.measurement.voltage_valid = false;
+    g_cb.measurement.safety_current_valid = false;
+    g_cb.measurement.safety_voltage_valid = false;
+    control::resetSampleHistory(g_cb.current_history);
+    control::resetSampleHistory(g_cb.voltage_history);
+}
+
+
+void StoreMeasurement(bool current_valid, bool voltage_valid)
+{
+    const uint32_t current_last_us = g_cb.measurement.current_timestamp_us;
+    g_cb.awaiting_measurement = false;
+    g_cb.measurement.current_ua = adc.readCurrentMicroamps();
+    g_cb.measurement.voltage_uv = adc.readVoltageMicrovolts();
     g_cb.measurement.current_valid = current_valid;
     g_cb.measurement.voltage_valid = voltage_valid;
     g_cb.measurement.safety_current_valid = current_valid;
     g_cb.measurement.safety_voltage_valid = voltage_valid;
-    return true;
+    if (!current_valid) {
+        return;
+    }
+    g_cb.measurement.safety_current_ua = adc.readSafetyCurrentMicroamps();
+    g_cb.measurement.safety_voltage_uv = adc.readSafetyVoltageMicrovolts();
+    g_cb.measurement.current_timestamp_us = adc.readCurrentTimestamp();
+    g_cb.measurement.voltage_timestamp_us = adc.readVoltageTimestamp();
+    control::recordSample(g_cb.current_history,
+                          g_cb.measurement.current_ua,
+                          g_cb.measurement.safety_current_ua,
+                          g_cb.measurement.current_timestamp_us);
+    if (voltage_valid) {
+        control::recordSample(g_cb.voltage_history,
+                              g_cb.measurement.voltage_uv,
+                              g_cb.measurement.safety_voltage_uv,
+                              g_cb.measurement.voltage_timestamp_us);
+    }
+    // Until both channels have history, the latest pair as it is.
+    control::AlignedMeasurement& aligned = g_cb.measurement.aligned;
+    if (!control::alignMeasurement(g_cb.current_history,
+                                   g_cb.voltage_history, aligned)) {
+        aligned.current_ua = g_cb.measurement.current_ua;
+        aligned.voltage_uv = g_cb.measurement.voltage_uv;
+        aligned.safety_current_ua = g_cb.measurement.safety_current_ua;
+        aligned.safety_voltage_uv = g_cb.measurement.safety_voltage_uv;
+        aligned.timestamp_us = g_cb.measurement.current_timestamp_us;
+    }
+
+    // The undisturbed current sample interval, which a calibration stretches.
+    if (!g_cb.sample_gap) {
+        g_cb.sample_interval_ms =
+            (g_cb.measurement.current_timestamp_us - current_last_us) / 1000UL;
+    }
+    g_cb.sample_gap = false;
 }
 
 
-void UpdateTemperature()
+// The next current conversion, or a due background calibration.
+void StartNextAcquisition()
 {
-    lm35.update();
+    if (!StartZeroCalibration()) {
+        StartCurrentConversion();
+    }
 }
 
 
-bool UpdateSensors()
+/* Advances the AD7190 by at most one conversion and never waits for one.
+ * A measurement is a current conversion followed by a voltage conversion,
+ * or, while both channels sit in the gain 1 range, the AD7190 sequences
+ * them in continuous mode and every tagged conversion refreshes it. */
+void ServiceAcquisition()
 {
-    // update inputs
-    UpdateButtons();
+    PhaseTimer timer(profiler, PHASE_ACQUISITION);
+    if (!g_cb.adc_initialized) {
+        ClearMeasurement();
+        return;
+    }
 
-    // sensors
-    const bool control_processing_allowed = UpdateCurrentVoltage();
-    UpdateTemperature();
+    if (adc.isSequencing()) {
+        const AcquisitionState state = adc.pollSequence();
+        if (state == ACQ_PENDING) {
+            return;
+        }
+        const bool valid = state == ACQ_READY;
+        StoreMeasurement(valid, valid);
+        // A due calibration takes over between two tagged conversions.
+        StartNextAcquisition();
+        return;
+    }
 
-    g_cb.measurement.temperature = lm35.getTemperature();
-    g_cb.measurement.temperature_valid = lm35.isValid();
-    g_cb.measurement.timestamp_ms = millis();
-    return control_processing_allowed;
+    if (adc.isConverting()) {
+        const bool calibrating = adc.isCalibrating();
+        const int channel = adc.conversionChannel();
+        if (adc.pollConversion() == ACQ_PENDING) {
+            return;
+        }
+        const bool valid = adc.collectConversion();
+        if (calibrating) {
+            // A measurement follows every calibration, so the steps of a
+            // recalibration never hold the converter back to back.
+            FinishZeroCalibration(valid);
+            StartCurrentConversion();
+            return;
+        } else if (channel == CHANNEL_CURRENT && valid) {
+            adc.startConversion(CHANNEL_VOLTAGE);
+            return;
+        } else if (channel == CHANNEL_CURRENT) {
+            StoreMeasurement(false, false);
+        } else {
+            StoreMeasurement(true, valid);
+            if (valid && adc.canSequence()) {
+                adc.startSequence();
+                return;
+            }
+        }
+    }
+    StartNextAcquisition();
+}
+
+
+void UpdateTemperature()
+{
+    PhaseTimer timer(profiler, PHASE_TEMPERATURE);
+    lm35.update();
+
+    const int32_t temperature_mc = lm35.getTemperatureMilliCelsius();
+    if (!lm35.isValid() || temperature_mc > MAX_TEMPERATURE_MC) {
+        fan.turn_on();
+    } else if (temperature_mc > FAN_ON_TEMPERATURE_MC && !fan.isOn()) {
+        fan.turn_on();
+    } else if (temperature_mc < FAN_OFF_TEMPERATURE_MC && fan.isOn()) {
+        fan.turn_off();
+    }
 }
 
 
@@ -267,119 +838,221 @@ void DisplayFixedDouble(double value, int width, int prec)
             }
         }
     }
-    lcd.print(line);
+    display.print(line);
 }
 
 
-bool UpdateDisplay()
+// As DisplayFixedDouble(), without floating point.
+void DisplayThousandths(uint64_t thousandths, uint8_t width, uint8_t prec)
 {
-    lcd.noCursor();
-    if (Wire.getWireTimeoutFlag()) {
-        return false;
+    char line[16];
+    FormatThousandths(line,
+                      thousandths > 0xFFFFFFFFULL ?
+                          0xFFFFFFFFUL : (uint32_t)thousandths,
+                      width, prec);
+    display.print(line);
+}
+
+
+//   aa.aaaA, ppp.ppW, rr.rrrR or vv.vvvV
+void DisplayModeSetPoint()
+{
+    switch (g_cb.mode) {
+    case control::LoadMode::ConstantPower:
+        DisplayFixedDouble(power_set_point.get_value() / 100.0, 6, 2);
+        display.print("W ");
+        break;
+    case control::LoadMode::ConstantResistance:
+        DisplayFixedDouble(resistance_set_point.as_double(), 6, 3);
+        display.print("R ");
+        break;
+    case control::LoadMode::ConstantVoltage:
+        DisplayFixedDouble(cv_set_point.as_double(), 6, 3);
+        display.print("V ");
+        break;
+    default:
+        DisplayFixedDouble(current_set_point.as_double(), 6, 3);
+        display.print("A ");
     }
+}
+
+
+#ifdef LOAD_PROFILE
+// Right aligned in `width` columns, saturated to the largest value that fits.
+void DisplayPaddedUnsigned(uint32_t value, uint8_t width)
+{
+    char digits[10];
+    uint8_t length = 0;
+    do {
+        digits[length++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    for (uint8_t index = 0; index < width; index++) {
+        if (length > width) {
+            display.print('9');
+        } else if (index < width - length) {
+            display.print(' ');
+        } else {
+            display.print(digits[width - 1 - index]);
+        }
+    }
+}
+
+
+// Line 2 of the diagnostics page, one of:
+//   CTL mmmm/MMMMMus   mean/max
+//   CTL h.1395...      histogram, see ProfileBucket()
+void DisplayProfile()
+{
+    const uint8_t phase = profile_view / 2;
+    display.print(PROFILE_PHASE_NAMES[phase]);
+    if (profile_view % 2 == 0) {
+        display.print(' ');
+        DisplayPaddedUnsigned(profiler.mean(phase), 4);
+        display.print('/');
+        DisplayPaddedUnsigned(profiler.stats(phase).max_us, 5);
+        display.print("us");
+        return;
+    }
+    display.print(" h");
+    const uint16_t peak = profiler.peakBucket(phase);
+    for (uint8_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        display.print(ProfileHistogramDigit(
+            profiler.stats(phase).histogram[bucket], peak));
+    }
+    display.print("   ");
+}
+#endif
+
+
+// The whole screen into the frame; DisplayTask() sends it.
+void RenderDisplay()
+{
+    display.noCursor();
 
     if (g_cb.controller.state == control::OperationState::Fault) {
-        lcd.setCursor(0, 0);
+        display.setCursor(0, 0);
         switch (g_cb.controller.fault) {
             case control::FaultReason::AdcFailure:
-                lcd.print(F("FAULT ADC       "));
+                display.print(F("FAULT ADC       "));
                 break;
             case control::FaultReason::TemperatureSensorFailure:
-                lcd.print(F("FAULT TEMP SNS  "));
+                display.print(F("FAULT TEMP SNS  "));
                 break;
             case control::FaultReason::Overcurrent:
-                lcd.print(F("FAULT OVERCUR   "));
+                display.print(F("FAULT OVERCUR   "));
                 break;
             case control::FaultReason::Undervoltage:
-                lcd.print(F("FAULT UNDERVOLT "));
+                display.print(F("FAULT UNDERVOLT "));
                 break;
             case control::FaultReason::Overtemperature:
-                lcd.print(F("FAULT OVERTEMP  "));
+                display.print(F("FAULT OVERTEMP  "));
                 break;
             case control::FaultReason::Overvoltage:
-                lcd.print(F("FAULT OVERVOLT  "));
+                display.print(F("FAULT OVERVOLT  "));
                 break;
             case control::FaultReason::Overpower:
-                lcd.print(F("FAULT OVERPOWER "));
+                display.print(F("FAULT OVERPOWER "));
                 break;
             case control::FaultReason::NoSource:
-                lcd.print(F("FAULT NO SOURCE "));
+                display.print(F("FAULT NO SOURCE "));
                 break;
             case control::FaultReason::DisplayFailure:
-                lcd.print(F("FAULT DISPLAY   "));
+                display.print(F("FAULT DISPLAY   "));
                 break;
             default:
-                lcd.print(F("FAULT UNKNOWN   "));
+                display.print(F("FAULT UNKNOWN   "));
                 break;
         }
-        lcd.setCursor(0, 1);
+        display.setCursor(0, 1);
         if (g_cb.controller.fault == control::FaultReason::AdcFailure) {
-            lcd.print(F("Click to retry  "));
+            display.print(F("Click to retry  "));
         } else {
-            lcd.print(F("Click to ack    "));
+            display.print(F("Click to ack    "));
         }
-        return !Wire.getWireTimeoutFlag();
+        return;
     }
 
     if (g_cb.controller.state == control::OperationState::Completed) {
-        lcd.setCursor(0, 0);
-        lcd.print(F("DONE: CUTOFF    "));
-        lcd.setCursor(0, 1);
-        lcd.print(F("Click to finish "));
-        return !Wire.getWireTimeoutFlag();
+        display.setCursor(0, 0);
+        display.print(F("DONE: CUTOFF    "));
+        display.setCursor(0, 1);
+        display.print(F("Click to finish "));
+        return;
     }
 
     // Display
-    // Line 1 - Current Set Point, temperature:
-    //   aa.aaaA ttt.ttC X
-    lcd.setCursor(0, 0);
-    DisplayFixedDouble(current_set_point.as_double(), 6, 3);
-    lcd.print("A ");
+    // Line 1 - Mode Set Point, cut off voltage, state:
+    //   aa.aaaA vv.vvvV X
+    display.setCursor(0, 0);
+    DisplayModeSetPoint();
     DisplayFixedDouble(voltage_set_point.as_double(), 6, 3);
-    lcd.print("V");
+    display.print("V");
 
     // FIXME: print out status
     switch (g_cb.controller.state) {
         case control::OperationState::Idle:
-            lcd.print(" ");
+            display.print(" ");
             break;
         case control::OperationState::Running:
-            lcd.print("*");
+            display.print("*");
             break;
         default:
-            lcd.print("?");
-    }
-    if (Wire.getWireTimeoutFlag()) {
-        return false;
+            display.print("?");
     }
 
     // Line 2 - Current Sensing, Voltage Sensing:
     //   ss.ssssA vvv.vvvV
-    lcd.setCursor(0, 1);
+    display.setCursor(0, 1);
 
     if (g_cb.page == 0) {
-        DisplayFixedDouble(g_cb.measurement.current, 6, 3);
-        lcd.print("A ");
-        DisplayFixedDouble(g_cb.measurement.voltage, 6, 3);
-        lcd.print("V ");
+        // Floating point is only used here, at display rate.
+        DisplayFixedDouble(g_cb.measurement.current_ua / 1000000.0, 6, 3);
+        display.print("A ");
+        DisplayFixedDouble(g_cb.measurement.voltage_uv / 1000000.0, 6, 3);
+        display.print("V ");
     } else if (g_cb.page == 1) {
-        double wattage = g_cb.measurement.voltage * g_cb.measurement.current;
+        double wattage = (g_cb.measurement.aligned.voltage_uv / 1000000.0) *
+            (g_cb.measurement.aligned.current_ua / 1000000.0);
         DisplayFixedDouble(wattage, 8, 4);
-        lcd.print("W ");
-        DisplayFixedDouble(g_cb.measurement.temperature, 5, 2);
-        lcd.print("C");
+        display.print("W ");
+        DisplayFixedDouble(g_cb.measurement.temperature_mc / 1000.0, 5, 2);
+        display.print("C");
     } else if (g_cb.page == 2) {
-        DisplayFixedDouble(g_cb.mah, 8, 2);
-        lcd.print("mAh     ");
+        DisplayThousandths(g_cb.energy.microampHours(), 8, 2);
+        display.print("mAh     ");
     } else if (g_cb.page == 3) {
-        DisplayFixedDouble(g_cb.watt_h, 8, 2);
-        lcd.print("Wh      ");
+        DisplayThousandths(g_cb.energy.microwattHours() / 1000, 8, 2);
+        display.print("Wh      ");
+    } else if (g_cb.page == 4) {
+        // Offset drift of the last background calibration, in ADC codes.
+        display.print("OFS V");
+        display.print(adc.offsetDrift(CHANNEL_VOLTAGE));
+        display.print(" I");
+        display.print(adc.offsetDrift(CHANNEL_CURRENT));
+        display.print("      ");
+    } else if (g_cb.page == DYNAMIC_PAGE) {
+        static const char* const shapes[] = {
+            "SQUARE 10Hz ", "TRAPEZ 10Hz ", "SINE 10Hz   ", "OFF         "
+        };
+        display.print("DYN ");
+        display.print(shapes[g_cb.dynamic_shape]);
+    } else if (g_cb.page == MODE_PAGE) {
+        static const char* const modes[] = {
+            "CC          ", "CP          ", "CR          ", "CV          "
+        };
+        display.print("MODE");
+        display.print(modes[(uint8_t)g_cb.mode]);
+#ifdef LOAD_PROFILE
+    } else if (g_cb.page == DIAG_PAGE) {
+        DisplayProfile();
+#endif
     }
 
     // positiont the cursor for showing
     // current 01.345A 89.123V
     uint8_t bit = setter_position;
-    if (setter_position >= 2) {
+    if (setter_position >= ModeSetPointIntegerDigits()) {
         bit++;
     }
     if (setter_position > 4) {
@@ -388,14 +1061,17 @@ bool UpdateDisplay()
     if (setter_position >= 7) {
         bit++;
     }
-    lcd.setCursor(bit, 0);
-    lcd.cursor();
-    return !Wire.getWireTimeoutFlag();
+    display.setCursor(bit, 0);
+    display.cursor();
 }
 
 void SaveSetPointToEEPROM()
 {
+    EEPROM.update(EEPROM_MODE_ADDR, (uint8_t)g_cb.mode);
     current_set_point.save_to_eeprom(EEPROM_CURRENT_ADDR);
+    power_set_point.save_to_eeprom(EEPROM_POWER_ADDR);
+    resistance_set_point.save_to_eeprom(EEPROM_RESISTANCE_ADDR);
+    cv_set_point.save_to_eeprom(EEPROM_CV_ADDR);
     voltage_set_point.save_to_eeprom(EEPROM_VOLTAGE_ADDR);
 }
 
@@ -403,7 +1079,7 @@ void SaveSetPointToEEPROM()
 void UpdateCursorPosition()
 {
     if (setter_position < 5) {
-        current_set_point.set_position(setter_position);
+        SetModeSetPointPosition(setter_position);
     } else {
         voltage_set_point.set_position(setter_position - 5);
     }
@@ -412,28 +1088,39 @@ void UpdateCursorPosition()
 
 void StopDischarge()
 {
-    SetLoadOutput(0);
+    SetLoadOutput(0, true);
+    stop_pressed = false;
     control::stop(g_cb.controller, millis());
     control::resetUndervoltageQualification(g_cb.undervoltage);
     SaveSetPointToEEPROM();
 }
 
 
+/* The INT0 handler has usually zeroed the DAC already; this makes the
+ * state change.  The pin is still polled, for a press that came before the
+ * release armed the interrupt. */
 bool HandleImmediateStop()
 {
     if (g_cb.controller.state != control::OperationState::Running) {
+        stop_armed = false;
+        stop_pressed = false;
         return false;
     }
 
+    if (stop_pressed) {
+        StopDischarge();
+        return true;
+    }
     const bool encoder_pressed = digitalRead(ENCODER_SW_PIN) == LOW;
     if (!encoder_pressed) {
-        g_cb.stop_armed = true;
+        stop_armed = true;
         return false;
     }
-    if (!g_cb.stop_armed) {
+    if (!stop_armed) {
         return false;
     }
 
+    stop_armed = false;
     StopDischarge();
     return true;
 }
@@ -441,19 +1128,59 @@ bool HandleImmediateStop()
 
 void LatchFault(control::FaultReason reason, uint32_t now)
 {
-    SetLoadOutput(0);
+    SetLoadOutput(0, true);
     control::latchFault(g_cb.controller, reason, now);
 }
 
 
 void CompleteDischarge(uint32_t now)
 {
-    SetLoadOutput(0);
+    SetLoadOutput(0, true);
     control::complete(g_cb.controller, now);
     SaveSetPointToEEPROM();
 }
 
 
+// A requested current within the power and thermal limits of the latest
+// measurement.
+int32_t CurrentTargetMicroamps(
+    const control::FixedMeasurementSnapshot& measurement,
+    int32_t requested_ua)
+{
+    if (measurement.safety_voltage_uv < MIN_SOURCE_MICROVOLTS) {
+        return 0;
+    }
+    return control::boundedCurrentTargetMicroamps(
+        requested_ua,
+        measurement.safety_voltage_uv,
+        measurement.temperature_mc,
+        CONTINUOUS_WATTAGE_MW,
+        THERMAL_DERATE_START_MC,
+        MAX_TEMPERATURE_MC);
+}
+
+
+// Builds the table for the bounded target and hands it to the timer
+// interrupt.  The table is never changed while it plays.
+void StartWaveform()
+{
+    const int32_t high_ua = CurrentTargetMicroamps(
+        g_cb.measurement, current_set_point.get_value() * 1000L);
+    if (!BuildWaveform(waveform_table,
+                       (WaveformShape)g_cb.dynamic_shape,
+                       high_ua / WAVEFORM_LOW_DIVISOR,
+                       high_ua,
+                       WAVEFORM_POINTS,
+                       WAVEFORM_PERIOD_MS)) {
+        return;
+    }
+    // Range current conversions for the peak of the waveform.
+    adc.predictCurrent(control::theoreticalMicroampsFromDacCode(
+        WaveformPeakCode(waveform_table)));
+    waveform.start(waveform_table);
+}
+
+
 bool StartDischarge(uint32_t held_since_ms)
 {
     uint32_t now = millis();
@@ -465,57 +1192,128 @@ bool StartDischarge(uint32_t held_since_ms)
     }
 
     SetLoadOutput(0);
-    g_cb.mah = 0;
-    g_cb.watt_h = 0;
-    g_cb.update_last = now;
-    g_cb.output_last = now;
-    g_cb.stop_armed = false;
+    g_cb.energy.reset();
+    g_cb.energy.add(g_cb.measurement.aligned.current_ua,
+                    g_cb.measurement.aligned.voltage_uv,
+                    g_cb.measurement.aligned.timestamp_us);
+    control::resetSlew(g_cb.slew, 0, now);
+    g_cb.regulation_next = now;
+    g_cb.target_ua = 0;
+    control::resetConstantVoltage(g_cb.constant_voltage);
+    stop_armed = false;
+    stop_pressed = false;
     g_cb.start_press_active = false;
     control::resetUndervoltageQualification(g_cb.undervoltage);
     SaveSetPointToEEPROM();
+    // Dynamic load is a constant current mode.
+    if (g_cb.mode == control::LoadMode::ConstantCurrent &&
+        g_cb.dynamic_shape != DYNAMIC_OFF) {
+        StartWaveform();
+    }
+    return true;
+}
+
+
+// Called by the ADC as soon as a raw conversion word crosses the hard
+// current or voltage limit, before it is converted and before the other
+// channel is sampled.
+void AdcSafetyTrip(control::FaultReason reason)
+{
+    LatchFault(reason, millis());
+}
+
+
+// Full AD7190 self-calibration.  The coefficients are stored with the
+// temperature they were taken at, so a restart can restore them.
+bool CalibrateAdc(int32_t temperature_mc, bool temperature_valid)
+{
+    if (!adc.init()) {
+        return false;
+    }
+    g_cb.adc_calibrated_mc = temperature_mc;
+    if (temperature_valid) {
+        SaveAdcCalibration(EEPROM_ADC_CALIBRATION_ADDR, adc, temperature_mc);
+    }
     return true;
 }
 
 
-bool InitializeAdc()
+/* Brings up the AD7190.  With `calibrate` the internal calibrations run
+ * here and block; setup() can afford that before the scheduler starts.
+ * Without it the converter comes up on its power-on coefficients and the
+ * acquisition calibrates it step by step, as it does after drift. */
+bool InitializeAdc(bool calibrate)
 {
     adc.begin();
-    if (!adc.detectDevice() || !adc.init()) {
+    if (!adc.detectDevice()) {
         return false;
     }
+    g_cb.recalibration_steps = 0;
+
+    // Bench fixtures restart constantly: near the temperature of the stored
+    // calibration its coefficients are written back instead of running the
+    // internal calibrations again.
+    const int32_t temperature_mc = lm35.calcTemperatureMilliCelsius();
+    AdcCalibrationRecord record;
+    bool restored = false;
+    if (lm35.isValid() &&
+        LoadAdcCalibration(EEPROM_ADC_CALIBRATION_ADDR, record) &&
+        AdcCalibrationTemperatureClose(record.temperature_mc,
+                                       temperature_mc)) {
+        restored = adc.restoreCalibration(record.channel);
+        g_cb.adc_calibrated_mc = record.temperature_mc;
+    }
+    if (!restored && calibrate &&
+        !CalibrateAdc(temperature_mc, lm35.isValid())) {
+        return false;
+    }
+    if (!restored && !calibrate) {
+        if (!adc.initUncalibrated()) {
+            return false;
+        }
+        g_cb.recalibration_steps = ADC_RECALIBRATION_STEPS;
+        g_cb.recalibration_mc = temperature_mc;
+    }
 
     // Calibration improves operating/display accuracy only. Absolute safety
     // readings use the separate nominal schematic path in ADConverter.
-    adc.setCalibData(AD7190_CONF_GAIN_1, 1.00080, 4.0);
-    adc.setCalibData(AD7190_CONF_GAIN_8, 1.00243, -0.60);
+    // The per-gain table is measured on the bench and written over the
+    // calibration console.  Without a stored table the gains above 8 share
+    // the gain 8 trim.
+    if (!LoadCalibration(EEPROM_CALIBRATION_ADDR, adc)) {
+        adc.setCalibData(AD7190_CONF_GAIN_1, 1.00080, 4.0);
+        for (uint8_t gain = AD7190_CONF_GAIN_8;
+             gain <= AD7190_CONF_GAIN_128; gain++) {
+            adc.setCalibData(gain, 1.00243, -0.60);
+        }
+    }
+    adc.setSafetyLimits(HARD_SAFETY_LIMITS);
+    adc.setSafetyTripHandler(AdcSafetyTrip);
+    adc.setSafetyTripWrite(TripLoadOutput, 0);
+    adc.clearSafetyTrip();
+    adc.enableReadyInterrupt(true);
+    // Measure the first background calibration while still Idle.
+    g_cb.zero_cal_last = millis() - ADC_ZERO_CALIBRATION_INTERVAL_MS;
+    g_cb.awaiting_measurement = true;
     return true;
 }
 
 
-void ProcessControl()
+void ProcessControl(const InputSummary& input)
 {
+    PhaseTimer timer(profiler, PHASE_CONTROL);
     // All control decisions in this pass use the same sensor sample.
     const uint32_t now = g_cb.measurement.timestamp_ms;
-    const control::MeasurementSnapshot& measurement = g_cb.measurement;
+    const control::FixedMeasurementSnapshot& measurement = g_cb.measurement;
 
     // A failed/unsafe reading is handled before any user input or DAC
     // processing.  This also keeps a newly latched fault from restarting in
     // the same pass.
-    if (!measurement.temperature_valid ||
-        measurement.temperature > MAX_TEMPERATURE) {
-        fan.turn_on();
-    } else if (measurement.temperature > 40.0 && !fan.isOn()) {
-        fan.turn_on();
-    } else if (measurement.temperature < 35.0 && fan.isOn()) {
-        fan.turn_off();
-    }
-
-    ClickEncoder::Button encoder_btn = encoder.getButton();
     if (g_cb.controller.state == control::OperationState::Fault) {
         SetLoadOutput(0);
-        if (encoder_btn == ClickEncoder::Clicked) {
+        if (input.clicked) {
             if (g_cb.controller.fault == control::FaultReason::AdcFailure) {
-                g_cb.adc_initialized = InitializeAdc();
+                g_cb.adc_initialized = InitializeAdc(false);
                 if (g_cb.adc_initialized) {
                     control::acknowledgeFault(g_cb.controller, millis());
                 }
@@ -523,13 +1321,10 @@ void ProcessControl()
                        control::FaultReason::DisplayFailure &&
                        measurement.adcValid() &&
                        measurement.temperature_valid) {
-                const control::SafetyLimits recovery_limits = {
-                    MAX_CURRENT * 1.1, 0.0, MAX_TEMPERATURE,
-                    MAX_INPUT_VOLTAGE, MAX_WATTAGE
-                };
-                if (control::evaluateSafety(measurement, recovery_limits,
+                if (control::evaluateSafety(measurement, HARD_SAFETY_LIMITS,
                                             g_cb.controller.state) ==
                     control::FaultReason::None) {
+                    adc.clearSafetyTrip();
                     control::acknowledgeFault(g_cb.controller, now);
                 }
             }
@@ -539,18 +1334,20 @@ void ProcessControl()
 
     if (g_cb.controller.state == control::OperationState::Completed) {
         SetLoadOutput(0);
-        if (encoder_btn == ClickEncoder::Clicked) {
+        if (input.clicked) {
             control::acknowledgeCompleted(g_cb.controller, now);
         }
         return;
     }
 
-    const control::SafetyLimits limits = {
-        MAX_CURRENT * 1.1,
-        voltage_set_point.as_double(),
-        MAX_TEMPERATURE,
-        MAX_INPUT_VOLTAGE,
-        MAX_WATTAGE
+    // Set points are held in mA and mV.
+    const int32_t cutoff_set_point_uv = voltage_set_point.get_value() * 1000L;
+    const control::FixedSafetyLimits limits = {
+        OVERCURRENT_MICROAMPS,
+        cutoff_set_point_uv,
+        MAX_TEMPERATURE_MC,
+        MAX_INPUT_MICROVOLTS,
+        MAX_WATTAGE_MW
     };
     const control::FaultReason unsafe_reason = control::evaluateSafety(
         measurement, limits, g_cb.controller.state);
@@ -559,6 +1356,19 @@ void ProcessControl()
         return;
     }
 
+    // The AD7190 coefficients drift with temperature.  Recalibrate once the
+    // heatsink has moved away from the calibration point, but only while no
+    // load is applied.  The acquisition runs the calibrations one at a time
+    // in place of conversions, so nothing here waits for the converter.
+    if (g_cb.controller.state == control::OperationState::Idle &&
+        g_cb.recalibration_steps == 0 &&
+        measurement.temperature_valid &&
+        !AdcCalibrationTemperatureClose(g_cb.adc_calibrated_mc,
+                                        measurement.temperature_mc)) {
+        g_cb.recalibration_steps = ADC_RECALIBRATION_STEPS;
+        g_cb.recalibration_mc = measurement.temperature_mc;
+    }
+
     // After starting, require release before arming an immediate press-to-stop.
     // A false stop from switch bounce is safe; a delayed stop is not.
     const bool encoder_pressed = digitalRead(ENCODER_SW_PIN) == LOW;
@@ -566,16 +1376,32 @@ void ProcessControl()
         return;
     }
 
-    // configuration setter control
+    // configuration setter control.  Presses queued since the last pass
+    // all count: S4 steps right and S1 left, as often as each was pressed.
+    const int cursor_steps = (int)input.presses[2] - (int)input.presses[1];
     bool pos_changed = false;
-    if (buttons[1].isRaisingEdge()) {
-        setter_position = (setter_position - 1) % MAX_SET_POSITION;
-        if (setter_position < 0) {
-            setter_position += MAX_SET_POSITION;
+    if (g_cb.page == DYNAMIC_PAGE &&
+        g_cb.controller.state == control::OperationState::Idle) {
+        // On the dynamic page the cursor buttons select the waveform.
+        g_cb.dynamic_shape = (uint8_t)WrapStep(g_cb.dynamic_shape,
+                                               cursor_steps, DYNAMIC_OFF + 1);
+    } else if (g_cb.page == MODE_PAGE &&
+               g_cb.controller.state == control::OperationState::Idle) {
+        // On the mode page they select the load mode and its set point.
+        if (cursor_steps != 0) {
+            g_cb.mode = (control::LoadMode)WrapStep(
+                (uint8_t)g_cb.mode, cursor_steps, control::kLoadModeCount);
+            pos_changed = true;
         }
-        pos_changed = true;
-    } else if (buttons[2].isRaisingEdge()) {
-        setter_position = (setter_position + 1) % MAX_SET_POSITION;
+#ifdef LOAD_PROFILE
+    } else if (g_cb.page == DIAG_PAGE) {
+        // On the diagnostics page they step through the phase views.
+        profile_view = (uint8_t)WrapStep(profile_view, cursor_steps,
+                                         2 * MAX_PROFILE_PHASES);
+#endif
+    } else if (cursor_steps != 0) {
+        setter_position = (int8_t)WrapStep(setter_position, cursor_steps,
+                                           MAX_SET_POSITION);
         pos_changed = true;
     }
 
@@ -583,32 +1409,23 @@ void ProcessControl()
         UpdateCursorPosition();
     }
     // find which to set
-    noInterrupts();
-    auto encoder_value = encoder.getValue();
-    interrupts();
-    if (encoder_value != 0) {
+    if (input.turn != 0) {
         if (setter_position < 5) {
-            current_set_point.change(encoder_value);
+            ChangeModeSetPoint(input.turn);
         } else {
-            voltage_set_point.change(encoder_value);
+            voltage_set_point.change(input.turn);
         }
     }
 
     // display control
-    if (buttons[3].isRaisingEdge()) {
-        g_cb.page = (g_cb.page + 1) % MAX_PAGE;
-    }
-    if (buttons[0].isRaisingEdge()) {
-        g_cb.page = (g_cb.page - 1) % MAX_PAGE;
-        if (g_cb.page < 0) {
-            g_cb.page += MAX_PAGE;
-        }
-    }
-
-    // Track the physical press time directly. ClickEncoder's Held event has a
-    // different duration and must not be confused with the 3 second start hold.
-    const double cutoff_voltage = voltage_set_point.as_double() >
-        MIN_SOURCE_VOLTAGE ? voltage_set_point.as_double() : MIN_SOURCE_VOLTAGE;
+    g_cb.page = WrapStep(g_cb.page,
+                         (int)input.presses[3] - (int)input.presses[0],
+                         MAX_PAGE);
+
+    // Track the physical press time directly.  A click ends within
+    // ENCODER_CLICK_MS and must not be confused with the 3 second start hold.
+    const int32_t cutoff_uv = cutoff_set_point_uv > MIN_SOURCE_MICROVOLTS ?
+        cutoff_set_point_uv : MIN_SOURCE_MICROVOLTS;
     if (g_cb.controller.state == control::OperationState::Idle) {
         if (encoder_pressed && !g_cb.start_press_active) {
             g_cb.start_press_active = true;
@@ -617,14 +1434,15 @@ void ProcessControl()
             g_cb.start_press_active = false;
         }
 
-        if (g_cb.start_press_active &&
+        // A pending recalibration, well under a second, finishes first.
+        if (g_cb.start_press_active && g_cb.recalibration_steps == 0 &&
             control::hasElapsed(now, g_cb.start_pressed_ms,
                                 control::kStartHoldMilliseconds)) {
-            if (measurement.safety_voltage < MIN_SOURCE_VOLTAGE) {
+            if (measurement.safety_voltage_uv < MIN_SOURCE_MICROVOLTS) {
                 LatchFault(control::FaultReason::NoSource, now);
                 return;
             }
-            if (measurement.safety_voltage <= cutoff_voltage) {
+            if (measurement.safety_voltage_uv <= cutoff_uv) {
                 if (StartDischarge(g_cb.start_pressed_ms)) {
                     CompleteDischarge(millis());
                 }
@@ -640,49 +1458,232 @@ void ProcessControl()
         return;
     }
 
-    if (control::qualifyUndervoltage(g_cb.undervoltage,
-                                     measurement.safety_voltage,
-                                     measurement.safety_voltage_valid,
-                                     cutoff_voltage,
-                                     now)) {
+    if (control::qualifyUndervoltageMicrovolts(
+            g_cb.undervoltage,
+            measurement.safety_voltage_uv,
+            measurement.safety_voltage_valid,
+            cutoff_uv,
+            now)) {
         CompleteDischarge(now);
         return;
     }
 
-    const uint32_t sample_elapsed = control::elapsedMilliseconds(
-        now, g_cb.update_last);
-    g_cb.mah += measurement.current * sample_elapsed / 3600.0;
-    g_cb.watt_h += measurement.current * measurement.voltage *
-        sample_elapsed / 3600000.0;
-    g_cb.update_last = now;
+    // Integrate between aligned measurements, not between loop passes; a
+    // pass without a new conversion adds nothing.
+    g_cb.energy.add(measurement.aligned.current_ua,
+                    measurement.aligned.voltage_uv,
+                    measurement.aligned.timestamp_us);
 
     // The analog AD8629/shunt loop is the fast current servo. Firmware supplies
-    // an absolute schematic-derived command, never an accumulated correction.
-    double target_current = control::boundedCurrentTarget(
-        current_set_point.as_double(),
-        measurement.safety_voltage,
-        measurement.temperature,
-        CONTINUOUS_WATTAGE,
-        THERMAL_DERATE_START,
-        MAX_TEMPERATURE);
-    if (measurement.safety_voltage < MIN_SOURCE_VOLTAGE) {
-        target_current = 0.0;
+    // an absolute schematic-derived command; only CV integrates, from the
+    // bounded target it applied last.  CR and CV close a loop around the
+    // measured voltage, so every mode updates at the fixed regulation rate;
+    // CV integrates each voltage conversion once, over its own interval.
+    if (control::fixedRateDue(now, g_cb.regulation_next,
+                              control::kRegulationPeriodMilliseconds)) {
+        g_cb.target_ua = CurrentTargetMicroamps(
+            measurement,
+            control::modeTargetMicroamps(g_cb.mode, ModeSetPoint(),
+                                         g_cb.target_ua, measurement,
+                                         g_cb.constant_voltage));
+    }
+    const int32_t target_ua = g_cb.target_ua;
+
+    // The timer interrupt owns the output while a waveform plays.  Once the
+    // power or thermal bound falls below its peak, constant current at the
+    // bound takes over; downward steps are never slewed.
+    if (waveform.isPlaying()) {
+        control::resetSlew(g_cb.slew, ad5541.getValue(), now);
+        if (control::theoreticalDacCodeForMicroamps(target_ua) >=
+            WaveformPeakCode(waveform_table)) {
+            return;
+        }
+        waveform.stop();
     }
+
     const uint16_t target_code =
-        control::theoreticalDacCodeForCurrent(target_current);
-    const uint16_t output_code = control::slewDacCode(
-        ad5541.getValue(), target_code, now, g_cb.output_last);
-    g_cb.output_last = now;
+        control::theoreticalDacCodeForMicroamps(target_ua);
+    const uint16_t output_code = control::slewDacCodeCarried(
+        g_cb.slew, ad5541.getValue(), target_code, now,
+        MODE_SLEW[static_cast<uint8_t>(g_cb.mode)]);
     SetLoadOutput(output_code);
 }
 
 
+// The stop button and the AD7190 are serviced every millisecond, so an
+// acquisition never waits longer than that for its next step.
+void SafetyTask()
+{
+    HandleImmediateStop();
+    ServiceAcquisition();
+}
+
+
+// Input handling and regulation on the latest measurement.  Until the
+// first acquisition after (re)initializing the ADC there is none, and the
+// empty snapshot would read as a failed converter.
+void ControlTask()
+{
+    const InputSummary input = DrainInput();
+    if (g_cb.awaiting_measurement) {
+        return;
+    }
+    g_cb.measurement.temperature_mc = lm35.getTemperatureMilliCelsius();
+    g_cb.measurement.temperature_valid = lm35.isValid();
+    g_cb.measurement.timestamp_ms = millis();
+    ProcessControl(input);
+}
+
+
+// A frame is still going out to the LCD.
+bool DisplayBusy()
+{
+    return g_cb.display_available && !display.idle();
+}
+
+
+/* Runs whenever no periodic task is due.  At its own interval it renders
+ * the screen into the frame, and otherwise sends the frame one LCD byte
+ * per call, about a millisecond of I2C, so a refresh never holds up the
+ * periodic tasks by more than that. */
+void DisplayTask()
+{
+    if (!g_cb.display_available) {
+        return;
+    }
+    const uint32_t now = millis();
+    const bool render = control::hasElapsed(now, g_cb.display_last,
+                                            DISPLAY_UPDATE_INTERVAL_MS);
+    if (!render && display.idle()) {
+        return;
+    }
+    const uint32_t started_us = ProfileMicros();
+    if (render) {
+        RenderDisplay();
+        g_cb.display_last = now;
+    } else {
+        display.step(lcd);
+    }
+    const uint32_t elapsed_us = ProfileMicros() - started_us;
+    profiler.record(PHASE_DISPLAY, elapsed_us);
+    if (Wire.getWireTimeoutFlag()) {
+        profiler.record(PHASE_I2C_STALL, elapsed_us);
+        Wire.clearWireTimeoutFlag();
+        g_cb.display_available = false;
+        LatchFault(control::FaultReason::DisplayFailure, millis());
+    }
+}
+
+
+#ifdef LOAD_PROFILE
+// One phase per pass keeps a report within the serial transmit buffer:
+//   CTL n=1234 min=12 avg=45 max=678 h=0,3,9,2,0,0,0,0
+void ReportTask()
+{
+    const uint8_t phase = profile_report_phase;
+    profile_report_phase = (phase + 1) % MAX_PROFILE_PHASES;
+
+    const PhaseStats& stats = profiler.stats(phase);
+    Serial.print(PROFILE_PHASE_NAMES[phase]);
+    Serial.print(F(" n="));
+    Serial.print(stats.count);
+    Serial.print(F(" min="));
+    Serial.print(profiler.minimum(phase));
+    Serial.print(F(" avg="));
+    Serial.print(profiler.mean(phase));
+    Serial.print(F(" max="));
+    Serial.print(stats.max_us);
+    Serial.print(F(" h="));
+    for (uint8_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+        if (bucket != 0) {
+            Serial.print(',');
+        }
+        Serial.print(stats.histogram[bucket]);
+    }
+    Serial.println();
+}
+#endif
+
+
+/* Applies one calibration console line.  A trim takes effect at once; the
+ * table is only written while Idle, since the EEPROM writes block for a few
+ * milliseconds a byte. */
+bool RunCalibrationCommand(const char* line)
+{
+    CalibrationCommand command;
+    if (!ParseCalibrationCommand(line, command)) {
+        return false;
+    }
+    if (command.save) {
+        if (g_cb.controller.state != control::OperationState::Idle) {
+            return false;
+        }
+        SaveCalibration(EEPROM_CALIBRATION_ADDR, adc);
+        return true;
+    }
+    // The ready interrupt applies the trims.
+    InterruptGuard guard;
+    adc.setCalibData(command.gain, command.cal);
+    return true;
+}
+
+
+// Answers each console line with "ok" or "err"; see calibration.h.
+void CalibrationTask()
+{
+    while (Serial.available() > 0) {
+        const char c = (char)Serial.read();
+        if (c != '\n' && c != '\r') {
+            if (calibration_line_length < CALIBRATION_LINE_MAX) {
+                calibration_line[calibration_line_length++] = c;
+            } else {
+                calibration_line_overflow = true;
+            }
+            continue;
+        }
+        if (calibration_line_length == 0 && !calibration_line_overflow) {
+            continue;
+        }
+        calibration_line[calibration_line_length] = '\0';
+        const bool ok = !calibration_line_overflow &&
+            RunCalibrationCommand(calibration_line);
+        Serial.println(ok ? F("ok") : F("err"));
+        calibration_line_length = 0;
+        calibration_line_overflow = false;
+    }
+}
+
+
+uint32_t SchedulerMicros()
+{
+    return micros();
+}
+
+
+/* Safety outranks control, which outranks the LM35 and the fan.  A display
+ * call is one LCD byte at most, so its I2C time shows up as at most about
+ * a millisecond of lateness of the periodic tasks. */
+const Task TASKS[] = {
+    {SafetyTask, SAFETY_TASK_PERIOD_US, 300UL, 0},
+    {ControlTask, control::kRegulationPeriodMilliseconds * 1000UL, 2000UL, 1},
+    {UpdateTemperature, TEMPERATURE_TASK_PERIOD_US, 500UL, 2},
+#ifdef LOAD_PROFILE
+    {ReportTask, PROFILE_REPORT_PERIOD_US, 0, 4},
+#endif
+    {DisplayTask, 0, 0, 3},
+    {CalibrationTask, CALIBRATION_TASK_PERIOD_US, 0, 5},
+};
+TaskScheduler<sizeof(TASKS) / sizeof(TASKS[0])> scheduler(TASKS,
+                                                          SchedulerMicros);
+
+
 void setup()
 {
     g_cb.controller = control::ControllerState();
 
     // Establish safe physical outputs before any UI delay or device probing.
     SPI.begin();
+    adc.attachBus(spi_bus);
     ad5541.begin();
     SetLoadOutput(0);
     fan.init();
@@ -713,11 +1714,22 @@ void setup()
         EEPROM.write(EEPROM_VERSION_ADDR, EEPROM_VERSION);
         SaveSetPointToEEPROM();
     } else {
+        const uint8_t mode = EEPROM.read(EEPROM_MODE_ADDR);
+        const bool mode_valid = mode < control::kLoadModeCount;
+        if (mode_valid) {
+            g_cb.mode = (control::LoadMode)mode;
+        }
         const bool current_valid =
             current_set_point.load_from_eeprom(EEPROM_CURRENT_ADDR);
+        const bool power_valid =
+            power_set_point.load_from_eeprom(EEPROM_POWER_ADDR);
+        const bool resistance_valid =
+            resistance_set_point.load_from_eeprom(EEPROM_RESISTANCE_ADDR);
+        const bool cv_valid = cv_set_point.load_from_eeprom(EEPROM_CV_ADDR);
         const bool voltage_valid =
             voltage_set_point.load_from_eeprom(EEPROM_VOLTAGE_ADDR);
-        if (!current_valid || !voltage_valid) {
+        if (!mode_valid || !current_valid || !power_valid ||
+            !resistance_valid || !cv_valid || !voltage_valid) {
             SaveSetPointToEEPROM();
         }
     }
@@ -727,28 +1739,37 @@ void setup()
     // Cursor position
     UpdateCursorPosition();
 
+    Serial.begin(SERIAL_BAUD);
+
+    // Buttons, and where the encoder rests; its pins are pulled up, as
+    // ClickEncoder did.
+    InitButtons();
+    pinMode(ENCODER_PIN_1, INPUT_PULLUP);
+    pinMode(ENCODER_PIN_2, INPUT_PULLUP);
+    pinMode(ENCODER_SW_PIN, INPUT_PULLUP);
+    encoder_turns.reset(digitalRead(ENCODER_PIN_1) == LOW,
+                        digitalRead(ENCODER_PIN_2) == LOW);
+    encoder_switch.reset(digitalRead(ENCODER_SW_PIN) == LOW ? 1 : 0);
+
     // Timer
     Timer1.initialize(1000);
     Timer1.attachInterrupt(timer_one_isr);
+    attachInterrupt(digitalPinToInterrupt(ENCODER_SW_PIN),
+                    encoder_switch_isr, FALLING);
 
     // Temperature averaging runs before the fan is allowed to turn off.
     lm35.init();
 
     // One bounded initialization attempt enters the normal fault model instead
     // of blocking setup forever. A click on FAULT ADC retries safely.
-    g_cb.adc_initialized = InitializeAdc();
+    g_cb.adc_initialized = InitializeAdc(true);
     if (!g_cb.adc_initialized) {
         LatchFault(control::FaultReason::AdcFailure, millis());
     }
 
-    // Buttons
-    buttons[0].init();
-    buttons[1].init();
-    buttons[2].init();
-    buttons[3].init();
-
     if (g_cb.display_available) {
         lcd.clear();
+        display.reset();
         if (Wire.getWireTimeoutFlag()) {
             g_cb.display_available = false;
             Wire.clearWireTimeoutFlag();
@@ -756,28 +1777,13 @@ void setup()
         }
     }
     g_cb.display_last = millis() - DISPLAY_UPDATE_INTERVAL_MS;
+
+    StartCurrentConversion();
+    scheduler.start();
 }
 
 
 void loop()
 {
-    if (HandleImmediateStop()) {
-        return;
-    }
-    if (UpdateSensors()) {
-        ProcessControl();
-    }
-
-    const uint32_t now = millis();
-    if (g_cb.display_available &&
-        control::hasElapsed(now, g_cb.display_last,
-                            DISPLAY_UPDATE_INTERVAL_MS)) {
-        const bool display_ok = UpdateDisplay();
-        g_cb.display_last = now;
-        if (!display_ok || Wire.getWireTimeoutFlag()) {
-            Wire.clearWireTimeoutFlag();
-            g_cb.display_available = false;
-            LatchFault(control::FaultReason::DisplayFailure, millis());
-        }
-    }
+    scheduler.runOnce();
 }
@@ -0,0 +1,195 @@
+#ifndef __PROFILE_H__
+#define __PROFILE_H__
+
+#include <Arduino.h>
+#include <stdint.h>
+
+/* Run time of the scheduled phases.  Build with -DLOAD_PROFILE to collect
+ * it; otherwise PhaseProfiler and PhaseTimer are empty and every call
+ * compiles away, micros() included. */
+
+#define PROFILE_BUCKETS 8
+
+enum ProfilePhase
+{
+    PHASE_ACQUISITION,
+    PHASE_TEMPERATURE,
+    PHASE_CONTROL,
+    PHASE_DISPLAY,
+    // Display passes that ended in an I2C timeout, timed as a whole.
+    PHASE_I2C_STALL,
+    MAX_PROFILE_PHASES
+};
+
+struct PhaseStats
+{
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t min_us;
+    uint32_t max_us;
+    uint16_t histogram[PROFILE_BUCKETS];
+};
+
+// Bucket b counts run times with a bit length of 2b or 2b + 1, that is from
+// ProfileBucketFloor(b) up to four times that; the last is open ended.
+inline uint8_t ProfileBucket(uint32_t elapsed_us)
+{
+    uint8_t bits = 0;
+    while (elapsed_us != 0) {
+        bits++;
+        elapsed_us >>= 1;
+    }
+    const uint8_t bucket = bits / 2;
+    return bucket < PROFILE_BUCKETS ? bucket : PROFILE_BUCKETS - 1;
+}
+
+inline uint32_t ProfileBucketFloor(uint8_t bucket)
+{
+    return bucket == 0 ? 0 : 1UL << (2 * bucket - 1);
+}
+
+// One character per bucket for the LCD: '.' when empty, else 1 to 9
+// relative to the fullest bucket.
+inline char ProfileHistogramDigit(uint16_t count, uint16_t peak)
+{
+    if (count == 0 || peak == 0) {
+        return '.';
+    }
+    return (char)('1' + (uint32_t)8 * count / peak);
+}
+
+#ifdef LOAD_PROFILE
+
+inline uint32_t ProfileMicros()
+{
+    return micros();
+}
+
+class PhaseProfiler
+{
+private:
+    PhaseStats _stats[MAX_PROFILE_PHASES];
+
+public:
+    PhaseProfiler()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        for (uint8_t phase = 0; phase < MAX_PROFILE_PHASES; phase++) {
+            PhaseStats& stats = _stats[phase];
+            stats.count = 0;
+            stats.total_us = 0;
+            stats.min_us = UINT32_MAX;
+            stats.max_us = 0;
+            for (uint8_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+                stats.histogram[bucket] = 0;
+            }
+        }
+    }
+
+    void record(uint8_t phase, uint32_t elapsed_us)
+    {
+        PhaseStats& stats = _stats[phase];
+        // Halving keeps the mean and the histogram shape instead of
+        // wrapping; the extremes are exact.
+        if (stats.count == UINT32_MAX ||
+            stats.total_us > UINT32_MAX - elapsed_us) {
+            stats.count /= 2;
+            stats.total_us /= 2;
+        }
+        stats.count++;
+        stats.total_us += elapsed_us;
+        if (elapsed_us < stats.min_us) {
+            stats.min_us = elapsed_us;
+        }
+        if (elapsed_us > stats.max_us) {
+            stats.max_us = elapsed_us;
+        }
+        uint16_t& bucket = stats.histogram[ProfileBucket(elapsed_us)];
+        if (bucket == UINT16_MAX) {
+            for (uint8_t index = 0; index < PROFILE_BUCKETS; index++) {
+                stats.histogram[index] /= 2;
+            }
+        }
+        bucket++;
+    }
+
+    const PhaseStats& stats(uint8_t phase) const
+    {
+        return _stats[phase];
+    }
+
+    uint32_t minimum(uint8_t phase) const
+    {
+        return _stats[phase].count == 0 ? 0 : _stats[phase].min_us;
+    }
+
+    uint32_t mean(uint8_t phase) const
+    {
+        return _stats[phase].count == 0 ? 0 :
+            _stats[phase].total_us / _stats[phase].count;
+    }
+
+    uint16_t peakBucket(uint8_t phase) const
+    {
+        uint16_t peak = 0;
+        for (uint8_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+            if (_stats[phase].histogram[bucket] > peak) {
+                peak = _stats[phase].histogram[bucket];
+            }
+        }
+        return peak;
+    }
+};
+
+// Records the lifetime of the enclosing scope.
+class PhaseTimer
+{
+private:
+    PhaseProfiler& _profiler;
+    uint8_t _phase;
+    uint32_t _started_us;
+
+public:
+    PhaseTimer(PhaseProfiler& profiler, uint8_t phase) :
+        _profiler(profiler),
+        _phase(phase),
+        _started_us(micros())
+    {
+    }
+
+    ~PhaseTimer()
+    {
+        _profiler.record(_phase, micros() - _started_us);
+    }
+};
+
+#else
+
+inline uint32_t ProfileMicros()
+{
+    return 0;
+}
+
+class PhaseProfiler
+{
+public:
+    void record(uint8_t, uint32_t)
+    {
+    }
+};
+
+class PhaseTimer
+{
+public:
+    PhaseTimer(PhaseProfiler&, uint8_t)
+    {
+    }
+};
+
+#endif
+
+#endif
@@ -0,0 +1,180 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <stdint.h>
+
+typedef void (*TaskFunction)();
+typedef uint32_t (*SchedulerClock)();
+
+/* A statically configured task.  A periodic task is released every
+ * `period_us` and has to finish before its next release.  A period of 0
+ * makes a background task, run only when no periodic task is due. */
+struct Task
+{
+    TaskFunction run;
+    uint32_t period_us;
+    // Expected worst-case run time, 0 for none.
+    uint32_t budget_us;
+    // Among due tasks the lowest value runs first.
+    uint8_t priority;
+};
+
+struct TaskStats
+{
+    uint32_t runs;
+    // Runs that finished after the next release, plus releases skipped
+    // because the task was still a whole period late.
+    uint32_t deadline_misses;
+    uint32_t budget_overruns;
+    uint32_t max_run_us;
+    // Start time after release: the jitter of the task.
+    uint32_t max_lateness_us;
+};
+
+/* Cooperative fixed-rate scheduler.  runOnce() runs one task to completion,
+ * so a task can only be delayed by the one running before it; that delay
+ * shows up as lateness, and the budgets tell which task caused it.  The
+ * clock is injected, so the same schedule runs on the host. */
+template <uint8_t N>
+class TaskScheduler
+{
+private:
+    const Task* _tasks;
+    SchedulerClock _clock;
+    uint32_t _next_us[N];
+    TaskStats _stats[N];
+    uint8_t _background;
+
+    void _account(uint8_t index, uint32_t started_us, uint32_t finished_us)
+    {
+        TaskStats& stats = _stats[index];
+        const uint32_t run_us = finished_us - started_us;
+        stats.runs++;
+        if (run_us > stats.max_run_us) {
+            stats.max_run_us = run_us;
+        }
+        if (_tasks[index].budget_us != 0 &&
+            run_us > _tasks[index].budget_us) {
+            stats.budget_overruns++;
+        }
+    }
+
+public:
+    TaskScheduler(const Task (&tasks)[N], SchedulerClock clock) :
+        _tasks(tasks),
+        _clock(clock),
+        _background(0)
+    {
+        start();
+    }
+
+    // Releases every periodic task now and clears the statistics.
+    void start()
+    {
+        const uint32_t now_us = _clock();
+        for (uint8_t index = 0; index < N; index++) {
+            _next_us[index] = now_us;
+        }
+        resetStats();
+    }
+
+    void resetStats()
+    {
+        for (uint8_t index = 0; index < N; index++) {
+            _stats[index].runs = 0;
+            _stats[index].deadline_misses = 0;
+            _stats[index].budget_overruns = 0;
+            _stats[index].max_run_us = 0;
+            _stats[index].max_lateness_us = 0;
+        }
+    }
+
+    /* Runs the due periodic task with the lowest priority value; ties go to
+     * the earliest release.  Without one, the next background task runs.
+     * Returns the index of the task run, or -1. */
+    int8_t runOnce()
+    {
+        const uint32_t now_us = _clock();
+        int8_t best = -1;
+        for (uint8_t index = 0; index < N; index++) {
+            if (_tasks[index].period_us == 0 ||
+                static_cast<int32_t>(now_us - _next_us[index]) < 0) {
+                continue;
+            }
+            if (best < 0 ||
+                _tasks[index].priority < _tasks[best].priority ||
+                (_tasks[index].priority == _tasks[best].priority &&
+                 static_cast<int32_t>(_next_us[index] - _next_us[best]) < 0)) {
+                best = index;
+            }
+        }
+
+        if (best < 0) {
+            for (uint8_t count = 0; count < N; count++) {
+                const uint8_t index = (_background + count) % N;
+                if (_tasks[index].period_us == 0) {
+                    best = index;
+                    _background = (index + 1) % N;
+                    break;
+                }
+            }
+            if (best < 0) {
+                return -1;
+            }
+            _tasks[best].run();
+            _account(best, now_us, _clock());
+            return best;
+        }
+
+        // Releases that passed entirely are skipped, not run back to back.
+        const uint32_t period_us = _tasks[best].period_us;
+        const uint32_t late_us = now_us - _next_us[best];
+        const uint32_t skipped = late_us / period_us;
+        TaskStats& stats = _stats[best];
+        stats.deadline_misses += skipped;
+        const uint32_t lateness_us = late_us - skipped * period_us;
+        if (lateness_us > stats.max_lateness_us) {
+            stats.max_lateness_us = lateness_us;
+        }
+        _next_us[best] += (skipped + 1) * period_us;
+
+        _tasks[best].run();
+        const uint32_t finished_us = _clock();
+        if (static_cast<int32_t>(finished_us - _next_us[best]) > 0) {
+            stats.deadline_misses++;
+        }
+        _account(best, now_us, finished_us);
+        return best;
+    }
+
+    // Earliest pending periodic release.  Until then only background tasks
+    // run, so a caller may sleep, or a simulation skip ahead, up to it.
+    uint32_t nextRelease() const
+    {
+        uint32_t next_us = 0;
+        bool found = false;
+        for (uint8_t index = 0; index < N; index++) {
+            if (_tasks[index].period_us == 0) {
+                continue;
+            }
+            if (!found ||
+                static_cast<int32_t>(_next_us[index] - next_us) < 0) {
+                next_us = _next_us[index];
+                found = true;
+            }
+        }
+        return next_us;
+    }
+
+    const TaskStats& stats(uint8_t index) const
+    {
+        return _stats[index];
+    }
+
+    uint8_t size() const
+    {
+        return N;
+    }
+};
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef __SPI_BUS_H__
+#define __SPI_BUS_H__
+
+#include <stdint.h>
+
+/* Disables interrupts for its scope and restores the previous state, so it
+ * is also safe inside an ISR. */
+class InterruptGuard
+{
+private:
+#if defined(__AVR__)
+    uint8_t _sreg;
+#endif
+
+public:
+    InterruptGuard()
+    {
+#if defined(__AVR__)
+        _sreg = SREG;
+        cli();
+#else
+        noInterrupts();
+#endif
+    }
+
+    ~InterruptGuard()
+    {
+#if defined(__AVR__)
+        SREG = _sreg;
+#else
+        interrupts();
+#endif
+    }
+};
+
+
+// Called with true to give up a parked bus before a priority transfer and
+// with false to park it again afterwards.
+typedef void (*SPIBusParkHandler)(void* owner, bool release);
+
+// A transfer an interrupt could not start; run with priority access.
+typedef void (*SPIBusDeferredWrite)(void* owner);
+
+/* Arbitration of the SPI bus shared by the AD7190 and the AD5541.
+ *
+ * The AD7190 may leave its CS low while it integrates so RDY shows on MISO
+ * ("parked").  A parked bus carries no transfer and is given up on demand:
+ * a DAC write never waits for a conversion.  Register traffic marks the bus
+ * busy for its duration, so an interrupt can tell that it must not start a
+ * transfer of its own and defer instead.  A write that cannot wait for the
+ * next interrupt is handed to priorityWrite() and goes out as the transfer
+ * in progress unlocks the bus. */
+class SPIBus
+{
+private:
+    volatile uint8_t _locks;
+    SPIBusParkHandler _park_handler;
+    void* _park_owner;
+    SPIBusDeferredWrite volatile _deferred;
+    void* volatile _deferred_owner;
+
+    // Only once nothing holds the bus; an interrupt may have taken it
+    // between the unlock and here.
+    void _runDeferred()
+    {
+        InterruptGuard guard;
+        const SPIBusDeferredWrite write = _deferred;
+        if (!write || isBusy()) {
+            return;
+        }
+        _deferred = 0;
+        beginPriority();
+        write(_deferred_owner);
+        endPriority();
+    }
+
+public:
+    SPIBus() :
+        _locks(0),
+        _park_handler(0),
+        _park_owner(0),
+        _deferred(0),
+        _deferred_owner(0)
+    {
+    }
+
+    void setParkHandler(SPIBusParkHandler handler, void* owner)
+    {
+        _park_handler = handler;
+        _park_owner = owner;
+    }
+
+    // Brackets a transfer that must not be interleaved.  Nests.
+    void lock()
+    {
+        _locks++;
+    }
+
+    void unlock()
+    {
+        _locks--;
+        if (_locks == 0 && _deferred) {
+            _runDeferred();
+        }
+    }
+
+    bool isBusy() const
+    {
+        return _locks != 0;
+    }
+
+    /* Priority access: takes the bus from a parked owner for one transfer.
+     * The bus stays locked until the owner is parked again, so an interrupt
+     * never sees it free in between. */
+    void beginPriority()
+    {
+        lock();
+        if (_park_handler) {
+            _park_handler(_park_owner, true);
+        }
+    }
+
+    void endPriority()
+    {
+        if (_park_handler) {
+            _park_handler(_park_owner, false);
+        }
+        unlock();
+    }
+
+    // ISR context: priority access unless a transfer is in progress, in
+    // which case the caller has to defer its own.
+    bool tryBeginPriority()
+    {
+        if (isBusy()) {
+            return false;
+        }
+        beginPriority();
+        return true;
+    }
+
+    /* ISR context: runs `write` with priority access now, or as the
+     * transfer in progress unlocks the bus, whichever comes first.  One
+     * write waits at a time; a later one replaces it. */
+    void priorityWrite(SPIBusDeferredWrite write, void* owner)
+    {
+        if (tryBeginPriority()) {
+            write(owner);
+            endPriority();
+            return;
+        }
+        _deferred_owner = owner;
+        _deferred = write;
+    }
+};
+
+#endif
@@ -0,0 +1,111 @@
+#include <assert.h>
+#include <stdint.h>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "../ad5541.h"
+
+SPIClass SPI;
+static uint32_t clock_ms;
+static int cs_level = HIGH;
+static bool interrupts_masked = false;
+static int masked_sections = 0;
+
+uint32_t millis()
+{
+    return clock_ms;
+}
+
+void pinMode(int, int)
+{
+}
+
+void digitalWrite(int pin, int level)
+{
+    if (pin == 9) {
+        cs_level = level;
+    }
+}
+
+void delayMicroseconds(unsigned int)
+{
+}
+
+void noInterrupts()
+{
+    interrupts_masked = true;
+    masked_sections++;
+}
+
+void interrupts()
+{
+    interrupts_masked = false;
+}
+
+static void checkSelected()
+{
+    assert(cs_level == LOW);
+}
+
+static void redundantWriteTest()
+{
+    AD5541 dac(9);
+    dac.begin();
+    SPI.transfers.clear();
+    SPI.on_transfer = checkSelected;
+
+    /* Nothing is known about the device until the first write. */
+    clock_ms = 1000;
+    assert(dac.needsWrite(0));
+    dac.setValue(0);
+    assert(SPI.transfers.size() == 1);
+    assert(SPI.transfers.back() == (std::vector<uint8_t>{0x00, 0x00}));
+    assert(cs_level == HIGH);
+
+    /* The same code is suppressed until the refresh interval has passed. */
+    assert(!dac.needsWrite(0));
+    clock_ms += AD5541_REFRESH_INTERVAL_MS - 1;
+    assert(!dac.needsWrite(0));
+    clock_ms++;
+    assert(dac.needsWrite(0));
+    dac.setValue(0);
+    assert(SPI.transfers.size() == 2);
+    assert(!dac.needsWrite(0));
+
+    /* A new code always needs a write. */
+    assert(dac.needsWrite(0xBEEF));
+    dac.setValue(0xBEEF);
+    assert(SPI.transfers.back() == (std::vector<uint8_t>{0xBE, 0xEF}));
+    assert(dac.getValue() == 0xBEEF);
+    assert(!dac.needsWrite(0xBEEF));
+    assert(dac.needsWrite(0));
+
+    /* The interrupts also write the code and its time, so main reads them
+     * with interrupts masked. */
+    masked_sections = 0;
+    assert(!dac.needsWrite(0xBEEF));
+    assert(masked_sections == 1);
+    assert(dac.getValue() == 0xBEEF);
+    assert(masked_sections == 2);
+    assert(!interrupts_masked);
+
+    /* setValue() itself never suppresses a write. */
+    dac.setValue(0xBEEF);
+    assert(SPI.transfers.size() == 4);
+
+    /* The refresh survives millis() wrapping. */
+    clock_ms = 0xFFFFFFF0UL;
+    dac.setValue(1);
+    clock_ms += AD5541_REFRESH_INTERVAL_MS - 1;
+    assert(!dac.needsWrite(1));
+    clock_ms++;
+    assert(dac.needsWrite(1));
+
+    SPI.on_transfer = 0;
+}
+
+int main()
+{
+    redundantWriteTest();
+    return 0;
+}
@@ -5,9 +5,11 @@
 #include "Arduino.h"
 #include "SPI.h"
 #include "../ad7190.h"
+#include "../adc.h"
 
 SPIClass SPI;
 static uint32_t clock_ms;
+static uint32_t clock_us;
 static int ready_level = HIGH;
 
 int analogRead(int)
@@ -24,6 +26,11 @@ uint32_t millis()
     return clock_ms++;
 }
 
+uint32_t micros()
+{
+    return clock_us;
+}
+
 int digitalRead(int)
 {
     return ready_level;
@@ -33,14 +40,27 @@ void pinMode(int, int)
 {
 }
 
-void digitalWrite(int, int)
+static int cs_level = HIGH;
+
+void digitalWrite(int pin, int level)
 {
+    if (pin == 8) {
+        cs_level = level;
+    }
 }
 
 void delay(unsigned long)
 {
 }
 
+void noInterrupts()
+{
+}
+
+void interrupts()
+{
+}
+
 static void readyTimeoutTest()
 {
     AD7190 adc(8, 12);
@@ -71,6 +91,16 @@ static void statusValidationTest()
     assert(value == 0xabcdef);
     assert(adc.status() == AD7190_STATUS_DATA_ERROR);
 
+    /* ERR on a code clamped at full scale is an overrange the caller
+     * re-ranges, not a failed conversion. */
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xff, 0xff, 0xff,
+                                                  AD7190_STAT_ERR |
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    assert(adc.readDataRegister(value, AD7190_CH_AIN1P_AINCOM));
+    assert(value == 0xffffff);
+    assert(adc.status() == AD7190_STATUS_OK);
+    value = 0xabcdef;
+
     /* NOREF is independently rejected when reference detection is enabled. */
     SPI.responses.push_back(std::vector<uint8_t>{0, 0x12, 0x34, 0x56,
                                                   AD7190_STAT_NOREF});
@@ -103,6 +133,52 @@ static void referenceDetectionTest()
     assert((SPI.transfers[1][3] & AD7190_CONF_REFDET) != 0);
 }
 
+static void shadowRegisterTest()
+{
+    AD7190 adc(8, 12);
+    SPI.transfers.clear();
+    SPI.responses.clear();
+
+    /* The first access reads the register once; later setters write blind. */
+    adc.configReferenceDetection(1);
+    adc.configUnipolar(1);
+    assert(SPI.transfers.size() == 3);
+    assert(SPI.transfers[2][0] == (AD7190_COMM_WRITE |
+                                   AD7190_COMM_ADDR(AD7190_REG_CONF)));
+    assert((SPI.transfers[2][3] & AD7190_CONF_UNIPOLAR) != 0);
+    assert((SPI.transfers[2][3] & AD7190_CONF_REFDET) != 0);
+
+    /* Writing a value the register already holds is skipped entirely. */
+    SPI.transfers.clear();
+    adc.configReferenceDetection(1);
+    adc.configChannel(AD7190_CH_AIN1P_AINCOM);
+    adc.configChannel(AD7190_CH_AIN1P_AINCOM);
+    assert(adc.setGain(AD7190_CONF_GAIN_8));
+    assert(!adc.setGain(AD7190_CONF_GAIN_8));
+    assert(adc.getGain() == AD7190_CONF_GAIN_8);
+    assert(SPI.transfers.size() == 2);
+
+    /* A single conversion is a command and is always issued.  The device
+     * returns to power-down by itself, which the shadow records. */
+    SPI.transfers.clear();
+    adc.setMode(AD7190_MODE_SINGLE);
+    adc.setMode(AD7190_MODE_SINGLE);
+    assert(SPI.transfers.size() == 3);
+    assert(adc.getMode() == AD7190_MODE_PWRDN);
+    SPI.transfers.clear();
+    adc.setMode(AD7190_MODE_PWRDN);
+    assert(SPI.transfers.empty());
+
+    /* A reset invalidates every shadow, and an explicit read resyncs. */
+    adc.reset();
+    SPI.transfers.clear();
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x00, 0x01, 0x17});
+    assert(adc.readConfigRegister() == 0x000117ul);
+    assert(adc.getGain() == AD7190_CONF_GAIN_128);
+    adc.configChannel(AD7190_CH_AIN1P_AINCOM);
+    assert(SPI.transfers.size() == 2);
+}
+
 static void resetTransferTest()
 {
     AD7190 adc(8, 12);
@@ -116,11 +192,567 @@ static void resetTransferTest()
     }
 }
 
+static void taggedReadTest()
+{
+    AD7190 adc(8, 12);
+    uint32_t value = 0;
+    uint8_t channel = 0xff;
+    ready_level = LOW;
+    SPI.responses.clear();
+
+    /* Without the status byte a result cannot be attributed to a channel. */
+    assert(!adc.readTaggedDataRegister(value, channel));
+    assert(adc.status() == AD7190_STATUS_WRONG_CHANNEL);
+
+    SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+    adc.configDataStatus(1);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x12, 0x34, 0x56,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(adc.readTaggedDataRegister(value, channel));
+    assert(value == 0x123456);
+    assert(channel == AD7190_CH_AIN2P_AINCOM);
+}
+
+static void sequenceTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    ready_level = LOW;
+    SPI.responses.clear();
+    assert(converter.init());
+
+    /* Both channels start ranged at gain 1. */
+    assert(converter.canSequence());
+    converter.startSequence();
+    assert(converter.isSequencing());
+
+    /* Half scale on both channels: the first update collects both tags. */
+    SPI.transfers.clear();
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    assert(converter.updateSequence());
+    assert(SPI.transfers.size() == 2);
+    assert(converter.readSafetyCurrentMicroamps() > 9990000L &&
+           converter.readSafetyCurrentMicroamps() < 10010000L);
+    assert(converter.readSafetyVoltageMicrovolts() > 25220000L &&
+           converter.readSafetyVoltageMicrovolts() < 25230000L);
+
+    /* Afterwards one pass reads exactly one conversion, no mode writes. */
+    SPI.transfers.clear();
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x40, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.updateSequence());
+    assert(SPI.transfers.size() == 1);
+    assert(converter.readSafetyCurrentMicroamps() > 4990000L &&
+           converter.readSafetyCurrentMicroamps() < 5010000L);
+
+    /* A low current reading is kept but leaves the sequence for gain 8. */
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x01, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.updateSequence());
+    assert(!converter.isSequencing());
+    assert(!converter.canSequence());
+
+    /* An unexpected channel tag is a failure and stops the sequence. */
+    converter.startSequence();
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN3P_AINCOM)});
+    assert(!converter.updateSequence());
+    assert(converter.status() == AD7190_STATUS_WRONG_CHANNEL);
+    assert(!converter.isSequencing());
+    SPI.responses.clear();
+}
+
+static void pollSequenceTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    ready_level = LOW;
+    SPI.responses.clear();
+    assert(converter.init());
+    converter.startSequence();
+
+    /* While RDY is high a poll only looks at the pin. */
+    ready_level = HIGH;
+    SPI.transfers.clear();
+    assert(converter.pollSequence() == ACQ_PENDING);
+    assert(SPI.transfers.empty());
+
+    /* One conversion per poll, ready once both channels have delivered. */
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.pollSequence() == ACQ_PENDING);
+    assert(SPI.transfers.size() == 1);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    assert(converter.pollSequence() == ACQ_READY);
+    assert(SPI.transfers.size() == 2);
+    assert(converter.readSafetyCurrentMicroamps() > 9990000L &&
+           converter.readSafetyCurrentMicroamps() < 10010000L);
+    assert(converter.readSafetyVoltageMicrovolts() > 25220000L &&
+           converter.readSafetyVoltageMicrovolts() < 25230000L);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x40, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.pollSequence() == ACQ_READY);
+    assert(converter.readSafetyCurrentMicroamps() > 4990000L &&
+           converter.readSafetyCurrentMicroamps() < 5010000L);
+
+    /* A converter that stops delivering times out and ends the sequence. */
+    ready_level = HIGH;
+    AcquisitionState state = ACQ_PENDING;
+    for (int poll = 0; poll < 1000 && state == ACQ_PENDING; ++poll) {
+        state = converter.pollSequence();
+    }
+    assert(state == ACQ_FAILED);
+    assert(converter.status() == AD7190_STATUS_TIMEOUT);
+    assert(!converter.isSequencing());
+    assert(converter.pollSequence() == ACQ_IDLE);
+    ready_level = LOW;
+    SPI.responses.clear();
+}
+
+static void asyncConversionTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    ready_level = LOW;
+    SPI.responses.clear();
+    assert(converter.init());
+    assert(!converter.isConverting());
+    assert(converter.pollConversion() == ACQ_IDLE);
+
+    /* Starting only configures the converter; nothing is read yet. */
+    converter.startConversion(CHANNEL_CURRENT);
+    assert(converter.isConverting());
+    assert(converter.conversionChannel() == CHANNEL_CURRENT);
+
+    /* While RDY is high a poll costs no SPI transfer and stays pending. */
+    ready_level = HIGH;
+    SPI.transfers.clear();
+    assert(converter.pollConversion() == ACQ_PENDING);
+    assert(SPI.transfers.empty());
+    assert(!converter.collectConversion());
+    assert(converter.isConverting());
+
+    /* RDY low: the result is read, ranged and stored. */
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(SPI.transfers.size() == 1);
+    assert(converter.collectConversion());
+    assert(converter.pollConversion() == ACQ_IDLE);
+    assert(converter.readSafetyCurrentMicroamps() > 9990000L &&
+           converter.readSafetyCurrentMicroamps() < 10010000L);
+
+    /* A reading below the gain 1 band is kept; only the next conversion
+     * moves up the ladder, straight to the highest gain that fits. */
+    converter.resetRangeRetries();
+    converter.startConversion(CHANNEL_VOLTAGE);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x01, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.readSafetyVoltageMicrovolts() > 190000L &&
+           converter.readSafetyVoltageMicrovolts() < 200000L);
+    assert(converter.channelGain(CHANNEL_VOLTAGE) == AD7190_CONF_GAIN_128);
+    converter.startConversion(CHANNEL_VOLTAGE);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.readSafetyVoltageMicrovolts() > 190000L &&
+           converter.readSafetyVoltageMicrovolts() < 200000L);
+    assert(converter.rangeRetries() == 0);
+
+    /* Only a clipped result is repeated, at gain 1, and counted. */
+    converter.startConversion(CHANNEL_VOLTAGE);
+    SPI.transfers.clear();
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xFF, 0xFF, 0xFF,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_PENDING);
+    assert(SPI.transfers.size() > 1);
+    assert(converter.rangeRetries() == 1);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.readSafetyVoltageMicrovolts() > 25220000L &&
+           converter.readSafetyVoltageMicrovolts() < 25230000L);
+
+    /* A low current moves the current channel to gain 8, but a DAC command
+     * for 10 A ranges the next conversion at gain 1 before it starts. */
+    converter.startConversion(CHANNEL_CURRENT);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x01, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    converter.predictCurrent(10000000L);
+    converter.startConversion(CHANNEL_CURRENT);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.readSafetyCurrentMicroamps() > 9990000L &&
+           converter.readSafetyCurrentMicroamps() < 10010000L);
+    assert(converter.rangeRetries() == 1);
+    converter.predictCurrent(0);
+
+    /* A conversion that never becomes ready fails after the timeout. */
+    converter.startConversion(CHANNEL_CURRENT);
+    ready_level = HIGH;
+    AcquisitionState state = ACQ_PENDING;
+    for (int poll = 0; poll < 1000 && state == ACQ_PENDING; ++poll) {
+        state = converter.pollConversion();
+    }
+    assert(state == ACQ_FAILED);
+    assert(converter.status() == AD7190_STATUS_TIMEOUT);
+    assert(!converter.collectConversion());
+    assert(converter.pollConversion() == ACQ_IDLE);
+
+    /* Cancelling drops a pending conversion. */
+    converter.startConversion(CHANNEL_CURRENT);
+    converter.cancelConversion();
+    assert(!converter.isConverting());
+    ready_level = LOW;
+    SPI.responses.clear();
+}
+
+static void readyInterruptTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    ready_level = LOW;
+    SPI.responses.clear();
+    assert(converter.init());
+    converter.enableReadyInterrupt(true);
+
+    /* The conversion is parked; nothing is read until RDY falls. */
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    SPI.transfers.clear();
+    converter.onReadyInterrupt();
+    assert(SPI.transfers.empty());
+    assert(converter.pollConversion() == ACQ_PENDING);
+
+    /* The interrupt latches the word and its timestamp; polling then only
+     * decodes the queued sample without touching the bus. */
+    ready_level = LOW;
+    clock_us = 123456;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(SPI.transfers.size() == 1);
+    clock_us = 200000;
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(SPI.transfers.size() == 1);
+    assert(converter.collectConversion());
+    assert(converter.readCurrentTimestamp() == 123456);
+    assert(converter.readSafetyCurrentMicroamps() > 9990000L &&
+           converter.readSafetyCurrentMicroamps() < 10010000L);
+
+    /* A second edge without a parked conversion is ignored. */
+    converter.onReadyInterrupt();
+    assert(SPI.transfers.size() == 1);
+
+    /* RDY already low when parking is caught without waiting for an edge,
+     * and a bus release in between cannot lose the sample. */
+    SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+    SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x40, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    clock_us = 300000;
+    converter.startConversion(CHANNEL_VOLTAGE);
+    converter.releaseBus();
+    converter.reclaimBus();
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.readVoltageTimestamp() == 300000);
+    converter.enableReadyInterrupt(false);
+    SPI.responses.clear();
+}
+
+static control::FaultReason tripped_reason = control::FaultReason::None;
+static int trip_calls = 0;
+static int trip_cs_level = LOW;
+
+static void recordTrip(control::FaultReason reason)
+{
+    tripped_reason = reason;
+    trip_cs_level = cs_level;
+    ++trip_calls;
+}
+
+static void safetyTripTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    ready_level = LOW;
+    SPI.responses.clear();
+    assert(converter.init());
+    const control::FixedSafetyLimits limits = {
+        16500000L, 0, 95000L, 50000000L, 200000L
+    };
+    converter.setSafetyLimits(limits);
+    converter.setSafetyTripHandler(recordTrip);
+    tripped_reason = control::FaultReason::None;
+    trip_calls = 0;
+
+    /* 10 A is inside the limit.  A blocking read first writes the mode
+     * register, which takes the first queued response. */
+    SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    int32_t current_uv = 0;
+    int32_t nominal_uv = 0;
+    assert(converter._read<CHANNEL_CURRENT>(current_uv, nominal_uv));
+    assert(trip_calls == 0);
+    assert(converter.safetyTrip() == control::FaultReason::None);
+
+    /* 0xD33333 is 16.5 A at gain 1; the next code trips on the raw word,
+     * and the handler runs with the AD7190 deselected. */
+    SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xD3, 0x33, 0x33,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter._read<CHANNEL_CURRENT>(current_uv, nominal_uv));
+    assert(trip_calls == 0);
+    SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xD3, 0x33, 0x34,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter._read<CHANNEL_CURRENT>(current_uv, nominal_uv));
+    assert(trip_calls == 1);
+    assert(trip_cs_level == HIGH);
+    assert(tripped_reason == control::FaultReason::Overcurrent);
+    assert(converter.safetyTrip() == control::FaultReason::Overcurrent);
+
+    /* The trip stays latched: the handler is not called again. */
+    converter.startConversion(CHANNEL_CURRENT);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xF0, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(trip_calls == 1);
+
+    /* After clearing, the non-blocking path trips as well, and an
+     * overvoltage is reported for the voltage channel. */
+    converter.clearSafetyTrip();
+    converter.startConversion(CHANNEL_VOLTAGE);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xFF, 0xFF, 0xF0,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN1P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(trip_calls == 2);
+    assert(tripped_reason == control::FaultReason::Overvoltage);
+    SPI.responses.clear();
+}
+
+static void gainLadderTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    ready_level = LOW;
+    SPI.responses.clear();
+    assert(converter.init());
+
+    /* A reading jumps straight to the highest gain it fits, then follows
+     * the input down the ladder: 156 mV, 78 mV, 39 mV, 19.5 mV, 9.8 mV. */
+    const uint8_t codes[] = {0x08, 0x40, 0x40, 0x40, 0x40};
+    const uint8_t expected[] = {
+        AD7190_CONF_GAIN_16, AD7190_CONF_GAIN_32, AD7190_CONF_GAIN_64,
+        AD7190_CONF_GAIN_128, AD7190_CONF_GAIN_128,
+    };
+    for (size_t i = 0; i < sizeof(expected); ++i) {
+        converter.startConversion(CHANNEL_CURRENT);
+        SPI.responses.push_back(std::vector<uint8_t>{0, codes[i], 0x00, 0x00,
+                                                      AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+        assert(converter.pollConversion() == ACQ_READY);
+        assert(converter.collectConversion());
+        assert(converter.channelGain(CHANNEL_CURRENT) == expected[i]);
+    }
+    /* 39 mA resolved at gain 128 without any repeat. */
+    assert(converter.readSafetyCurrentMicroamps() > 39000 &&
+           converter.readSafetyCurrentMicroamps() < 39100);
+    assert(converter.rangeRetries() == 0);
+
+    /* 35 mV is still inside the gain 128 band, but the input rose by 25 mV
+     * in one conversion, so the next one is ranged for 60 mV.  A DAC command
+     * steps down exactly as far as needed. */
+    converter.startConversion(CHANNEL_CURRENT);
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xE6, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.channelGain(CHANNEL_CURRENT) == AD7190_CONF_GAIN_64);
+    converter.predictCurrent(400000L);
+    converter.startConversion(CHANNEL_CURRENT);
+    assert(converter.channelGain(CHANNEL_CURRENT) == AD7190_CONF_GAIN_32);
+    converter.cancelConversion();
+
+    /* Calibration is per gain code. */
+    const GainCalibData cal = {-1500, 16800000L};
+    converter.setCalibData(AD7190_CONF_GAIN_64, cal);
+    assert(converter.getCalibData(AD7190_CONF_GAIN_64).offset_uv == -1500);
+    assert(converter.getCalibData(AD7190_CONF_GAIN_32).offset_uv == 0);
+    SPI.responses.clear();
+}
+
+static void calibrationRestoreTest()
+{
+    ready_level = LOW;
+
+    /* init() reads back each channel's coefficients after calibrating.
+     * A dry run locates those reads in the transfer sequence. */
+    ADConverter dry_run(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                        5000.0, 12);
+    SPI.responses.clear();
+    SPI.transfers.clear();
+    assert(dry_run.init());
+    std::vector<std::vector<uint8_t> > responses(SPI.transfers.size(),
+                                                 std::vector<uint8_t>(4, 0));
+    uint8_t next = 0x11;
+    for (size_t i = 0; i < SPI.transfers.size(); ++i) {
+        const uint8_t command = SPI.transfers[i][0];
+        if (command == (AD7190_COMM_READ | AD7190_COMM_ADDR(AD7190_REG_OFFSET)) ||
+            command == (AD7190_COMM_READ |
+                        AD7190_COMM_ADDR(AD7190_REG_FULLSCALE))) {
+            responses[i] = std::vector<uint8_t>{0, next, 0x22, 0x33};
+            next += 0x11;
+        }
+    }
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    SPI.responses = responses;
+    assert(converter.init());
+    assert(converter.channelCalibration(CHANNEL_VOLTAGE).offset == 0x112233);
+    assert(converter.channelCalibration(CHANNEL_VOLTAGE).full_scale ==
+           0x222233);
+    assert(converter.channelCalibration(CHANNEL_CURRENT).offset == 0x332233);
+    assert(converter.channelCalibration(CHANNEL_CURRENT).full_scale ==
+           0x442233);
+
+    /* Restoring writes and reads back both registers of each channel and
+     * never starts a calibration. */
+    const ChannelCalibration cal[MAX_CHANNELS] = {
+        {0x800123UL, 0x5a0000UL},
+        {0x7ffedcUL, 0x5b0000UL},
+    };
+    ADConverter restored(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                         5000.0, 12);
+    SPI.responses.clear();
+    assert(restored.init());
+    SPI.responses.clear();
+    SPI.transfers.clear();
+    for (uint8_t chn = 0; chn < MAX_CHANNELS; ++chn) {
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(std::vector<uint8_t>{
+            0, (uint8_t)(cal[chn].offset >> 16),
+            (uint8_t)(cal[chn].offset >> 8), (uint8_t)cal[chn].offset});
+        SPI.responses.push_back(std::vector<uint8_t>{
+            0, (uint8_t)(cal[chn].full_scale >> 16),
+            (uint8_t)(cal[chn].full_scale >> 8),
+            (uint8_t)cal[chn].full_scale});
+    }
+    assert(restored.restoreCalibration(cal));
+    assert(restored.status() == AD7190_STATUS_OK);
+    assert(SPI.transfers.size() == 10);
+    for (size_t i = 0; i < SPI.transfers.size(); ++i) {
+        assert(SPI.transfers[i][0] !=
+               (AD7190_COMM_WRITE | AD7190_COMM_ADDR(AD7190_REG_MODE)));
+    }
+    assert(SPI.transfers[1] == (std::vector<uint8_t>{
+        AD7190_COMM_WRITE | AD7190_COMM_ADDR(AD7190_REG_OFFSET),
+        0x80, 0x01, 0x23}));
+    assert(restored.channelCalibration(CHANNEL_CURRENT).full_scale ==
+           0x5b0000UL);
+
+    /* A register that does not read back fails the restore. */
+    SPI.responses.clear();
+    assert(!restored.restoreCalibration(cal));
+    assert(restored.status() == AD7190_STATUS_DEVICE_ERROR);
+}
+
+static void backgroundCalibrationTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    ready_level = LOW;
+    SPI.responses.clear();
+    assert(converter.init());
+    const ChannelCalibration cal[MAX_CHANNELS] = {
+        {0x800000UL, 0x5a0000UL},
+        {0x800000UL, 0x5b0000UL},
+    };
+    for (uint8_t chn = 0; chn < MAX_CHANNELS; ++chn) {
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00});
+        SPI.responses.push_back(std::vector<uint8_t>{
+            0, (uint8_t)(cal[chn].full_scale >> 16), 0x00, 0x00});
+    }
+    assert(converter.restoreCalibration(cal));
+
+    /* Starting only issues the calibration; the slot is then busy. */
+    ready_level = HIGH;
+    SPI.responses.clear();
+    SPI.transfers.clear();
+    converter.startZeroCalibration(CHANNEL_CURRENT);
+    assert(converter.isCalibrating());
+    assert(converter.isConverting());
+    const size_t issued = SPI.transfers.size();
+    assert(SPI.transfers.back()[0] ==
+           (AD7190_COMM_WRITE | AD7190_COMM_ADDR(AD7190_REG_MODE)));
+    assert((SPI.transfers.back()[1] >> 5) == AD7190_MODE_CAL_INT_ZERO);
+    assert(converter.pollConversion() == ACQ_PENDING);
+    assert(SPI.transfers.size() == issued);
+
+    /* Done: the new offset is read and its change reported. */
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x2a});
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(!converter.isCalibrating());
+    assert(!converter.isConverting());
+    assert(converter.offsetDrift(CHANNEL_CURRENT) == 42);
+    assert(converter.offsetDrift(CHANNEL_VOLTAGE) == 0);
+    assert(converter.channelCalibration(CHANNEL_CURRENT).offset == 0x80002aUL);
+    assert(converter.channelCalibration(CHANNEL_CURRENT).full_scale ==
+           0x5b0000UL);
+
+    /* A calibration that never completes fails after its own timeout. */
+    ready_level = HIGH;
+    converter.startZeroCalibration(CHANNEL_VOLTAGE);
+    AcquisitionState state = ACQ_PENDING;
+    for (int poll = 0; poll < 2000 && state == ACQ_PENDING; ++poll) {
+        state = converter.pollConversion();
+    }
+    assert(state == ACQ_FAILED);
+    assert(converter.status() == AD7190_STATUS_TIMEOUT);
+    assert(!converter.collectConversion());
+    assert(!converter.isCalibrating());
+    SPI.responses.clear();
+}
+
 int main()
 {
     readyTimeoutTest();
     statusValidationTest();
     referenceDetectionTest();
     resetTransferTest();
+    shadowRegisterTest();
+    taggedReadTest();
+    sequenceTest();
+    pollSequenceTest();
+    asyncConversionTest();
+    readyInterruptTest();
+    safetyTripTest();
+    gainLadderTest();
+    calibrationRestoreTest();
+    backgroundCalibrationTest();
     return 0;
 }
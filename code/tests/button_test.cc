@@ -0,0 +1,114 @@
+#include <assert.h>
+#include <stdint.h>
+
+#include "../button.h"
+
+static bool noEvents(const ButtonEvents& events)
+{
+    return !events.press && !events.release && !events.hold &&
+        !events.repeat;
+}
+
+// Samples `pressed` `count` times; true if none of them had an event.
+static bool quiet(ButtonDebouncer<4>& buttons, uint8_t pressed,
+                  uint16_t count)
+{
+    for (uint16_t index = 0; index < count; index++) {
+        if (!noEvents(buttons.sample(pressed))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void debounceTests()
+{
+    ButtonDebouncer<4> buttons(0, 0);
+
+    /* A press counts on its eighth sample in a row. */
+    assert(quiet(buttons, 0x01, 7));
+    assert(buttons.pressed() == 0);
+    ButtonEvents events = buttons.sample(0x01);
+    assert(events.press == 0x01 && events.release == 0);
+    assert(buttons.pressed() == 0x01);
+
+    /* Bounce restarts the count, in either direction. */
+    for (uint8_t round = 0; round < 5; round++) {
+        assert(quiet(buttons, 0x00, 5));
+        assert(quiet(buttons, 0x01, 1));
+    }
+    assert(buttons.pressed() == 0x01);
+    assert(quiet(buttons, 0x00, 7));
+    events = buttons.sample(0x00);
+    assert(events.release == 0x01 && events.press == 0);
+    assert(buttons.pressed() == 0);
+
+    /* Each button is counted on its own. */
+    assert(quiet(buttons, 0x02, 4));
+    assert(quiet(buttons, 0x0A, 3));
+    events = buttons.sample(0x0A);
+    assert(events.press == 0x02);
+    assert(quiet(buttons, 0x0A, 3));
+    events = buttons.sample(0x0A);
+    assert(events.press == 0x08);
+    assert(buttons.pressed() == 0x0A);
+
+    /* reset() takes a state without events. */
+    buttons.reset(0x04);
+    assert(buttons.pressed() == 0x04);
+    assert(quiet(buttons, 0x04, 100));
+}
+
+static void holdTests()
+{
+    /* Hold after 600 ticks pressed, counted from the debounced press, then
+     * a repeat every 200. */
+    ButtonDebouncer<4> buttons(600, 200);
+    assert(quiet(buttons, 0x04, 7));
+    ButtonEvents events = buttons.sample(0x04);
+    assert(events.press == 0x04 && !events.hold && !events.repeat);
+    assert(quiet(buttons, 0x04, 598));
+    events = buttons.sample(0x04);
+    assert(events.hold == 0x04 && events.repeat == 0x04 && !events.press);
+    for (uint8_t repeat = 0; repeat < 3; repeat++) {
+        assert(quiet(buttons, 0x04, 199));
+        events = buttons.sample(0x04);
+        assert(events.repeat == 0x04 && !events.hold);
+    }
+
+    /* A second button pressed meanwhile has its own timing. */
+    assert(quiet(buttons, 0x06, 7));
+    events = buttons.sample(0x06);
+    assert(events.press == 0x02 && !events.repeat);
+    for (uint16_t tick = 0; tick < 8; tick++) {
+        events = buttons.sample(0x06);
+        assert(!(events.repeat & 0x02));
+    }
+
+    /* Released, the next press starts over. */
+    assert(quiet(buttons, 0x00, 7));
+    events = buttons.sample(0x00);
+    assert(events.release == 0x06 && !events.repeat);
+    assert(buttons.pressed() == 0);
+    assert(quiet(buttons, 0x04, 7));
+    events = buttons.sample(0x04);
+    assert(events.press == 0x04);
+    assert(quiet(buttons, 0x04, 598));
+    assert(buttons.sample(0x04).hold == 0x04);
+
+    /* Released within the hold time: no hold at all. */
+    ButtonDebouncer<4> short_press(600, 200);
+    assert(quiet(short_press, 0x01, 7));
+    assert(short_press.sample(0x01).press == 0x01);
+    assert(quiet(short_press, 0x01, 500));
+    assert(quiet(short_press, 0x00, 7));
+    assert(short_press.sample(0x00).release == 0x01);
+    assert(quiet(short_press, 0x00, 1000));
+}
+
+int main()
+{
+    debounceTests();
+    holdTests();
+    return 0;
+}
@@ -0,0 +1,228 @@
+#include <assert.h>
+#include <stdint.h>
+#include <vector>
+
+#include "Arduino.h"
+#include "EEPROM.h"
+#include "SPI.h"
+#include "../calibration.h"
+
+EEPROMClass EEPROM;
+SPIClass SPI;
+
+int analogRead(int)
+{
+    return 0;
+}
+
+void analogReference(int)
+{
+}
+
+uint32_t millis()
+{
+    return 0;
+}
+
+uint32_t micros()
+{
+    return 0;
+}
+
+int digitalRead(int)
+{
+    return LOW;
+}
+
+void pinMode(int, int)
+{
+}
+
+void digitalWrite(int, int)
+{
+}
+
+void delay(unsigned long)
+{
+}
+
+void noInterrupts()
+{
+}
+
+void interrupts()
+{
+}
+
+static const uint8_t kGainCodes[MAX_GAINS] = {
+    AD7190_CONF_GAIN_1, AD7190_CONF_GAIN_8, AD7190_CONF_GAIN_16,
+    AD7190_CONF_GAIN_32, AD7190_CONF_GAIN_64, AD7190_CONF_GAIN_128,
+};
+
+static void crcTests()
+{
+    // CRC-16/CCITT-FALSE check value.
+    const uint8_t check[] = {'1', '2', '3', '4', '5', '6', '7', '8', '9'};
+    assert(CalibrationCrc(check, sizeof(check)) == 0x29b1);
+}
+
+static void roundTripTests()
+{
+    ADConverter source(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                       5000.0, 12);
+    for (uint8_t i = 0; i < MAX_GAINS; ++i) {
+        const GainCalibData cal = {
+            static_cast<int32_t>(-1000 + 337 * i),
+            static_cast<int32_t>(16777216L + 4099L * i)
+        };
+        source.setCalibData(kGainCodes[i], cal);
+    }
+    SaveCalibration(0x30, source);
+    assert(sizeof(CalibrationRecord) + 0x30 <= sizeof(EEPROM.bytes));
+    // The layout BUILDING.md gives for writing the table from outside.
+    assert(sizeof(CalibrationRecord) == 52);
+    assert(EEPROM.bytes[0x32] == CALIBRATION_VERSION);
+    assert(EEPROM.bytes[0x33] == MAX_GAINS);
+    assert(EEPROM.bytes[0x34] == (uint8_t)(-1000 & 0xFF));
+
+    ADConverter restored(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                         5000.0, 12);
+    assert(LoadCalibration(0x30, restored));
+    for (uint8_t i = 0; i < MAX_GAINS; ++i) {
+        const GainCalibData& cal = restored.getCalibData(kGainCodes[i]);
+        assert(cal.offset_uv == -1000 + 337 * i);
+        assert(cal.scale_q24 == 16777216L + 4099L * i);
+    }
+}
+
+static void corruptionTests()
+{
+    ADConverter source(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                       5000.0, 12);
+    const GainCalibData cal = {4000, 16790638L};
+    source.setCalibData(AD7190_CONF_GAIN_1, cal);
+    SaveCalibration(0x30, source);
+
+    // Any flipped bit leaves the converter at its previous calibration.
+    ADConverter target(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                       5000.0, 12);
+    for (size_t offset = 0; offset < sizeof(CalibrationRecord); ++offset) {
+        EEPROM.bytes[0x30 + offset] ^= 0x10;
+        assert(!LoadCalibration(0x30, target));
+        assert(target.getCalibData(AD7190_CONF_GAIN_1).offset_uv == 0);
+        EEPROM.bytes[0x30 + offset] ^= 0x10;
+    }
+    assert(LoadCalibration(0x30, target));
+    assert(target.getCalibData(AD7190_CONF_GAIN_1).offset_uv == 4000);
+
+    // A record from another layout is rejected even with a valid CRC.
+    CalibrationRecord record;
+    EEPROM.get(0x30, record);
+    record.version = CALIBRATION_VERSION + 1;
+    record.crc = CalibrationRecordCrc(record);
+    EEPROM.put(0x30, record);
+    assert(!LoadCalibration(0x30, target));
+
+    // Blank EEPROM.
+    memset(EEPROM.bytes, 0xff, sizeof(EEPROM.bytes));
+    assert(!LoadCalibration(0x30, target));
+}
+
+static void parseTests()
+{
+    CalibrationCommand command;
+    assert(ParseCalibrationCommand("save", command));
+    assert(command.save);
+
+    assert(ParseCalibrationCommand("gain 1 4000 16790638", command));
+    assert(!command.save);
+    assert(command.gain == AD7190_CONF_GAIN_1);
+    assert(command.cal.offset_uv == 4000);
+    assert(command.cal.scale_q24 == 16790638L);
+    assert(ParseCalibrationCommand("gain 128  -600 16818000", command));
+    assert(command.gain == AD7190_CONF_GAIN_128);
+    assert(command.cal.offset_uv == -600);
+    for (uint8_t i = 0; i < MAX_GAINS; ++i) {
+        char line[CALIBRATION_LINE_MAX + 1];
+        snprintf(line, sizeof(line), "gain %d 0 16777216",
+                 i == 0 ? 1 : 8 << (i - 1));
+        assert(ParseCalibrationCommand(line, command));
+        assert(command.gain == kGainCodes[i]);
+    }
+
+    assert(!ParseCalibrationCommand("", command));
+    assert(!ParseCalibrationCommand("saved", command));
+    assert(!ParseCalibrationCommand("gain 2 0 16777216", command));
+    assert(!ParseCalibrationCommand("gain 256 0 16777216", command));
+    assert(!ParseCalibrationCommand("gain 8 0 0", command));
+    assert(!ParseCalibrationCommand("gain 8 0", command));
+    assert(!ParseCalibrationCommand("gain 8 0 16777216 1", command));
+    assert(!ParseCalibrationCommand("gain 8 0x10 16777216", command));
+    assert(!ParseCalibrationCommand("gain 8 0 3000000000", command));
+}
+
+static std::vector<uint8_t> registerResponse(uint32_t value)
+{
+    return std::vector<uint8_t>{0, (uint8_t)(value >> 16),
+                                (uint8_t)(value >> 8), (uint8_t)value};
+}
+
+// After init() every restore costs exactly: channel select, two writes and
+// two read backs per channel.
+static void restore(ADConverter& adc, const ChannelCalibration* cal)
+{
+    SPI.responses.clear();
+    assert(adc.init());
+    for (uint8_t chn = 0; chn < MAX_CHANNELS; ++chn) {
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(std::vector<uint8_t>(4, 0));
+        SPI.responses.push_back(registerResponse(cal[chn].offset));
+        SPI.responses.push_back(registerResponse(cal[chn].full_scale));
+    }
+    assert(adc.restoreCalibration(cal));
+}
+
+static void adcCalibrationTests()
+{
+    ADConverter source(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                       5000.0, 12);
+    const ChannelCalibration cal[MAX_CHANNELS] = {
+        {0x800123UL, 0x5a1234UL},
+        {0x7ffedcUL, 0x5b4321UL},
+    };
+    restore(source, cal);
+    memset(EEPROM.bytes, 0xff, sizeof(EEPROM.bytes));
+    AdcCalibrationRecord record;
+    assert(!LoadAdcCalibration(0x70, record));
+
+    SaveAdcCalibration(0x70, source, 31250);
+    assert(sizeof(AdcCalibrationRecord) + 0x70 <= sizeof(EEPROM.bytes));
+    assert(LoadAdcCalibration(0x70, record));
+    assert(record.temperature_mc == 31250);
+    assert(record.channel[CHANNEL_VOLTAGE].offset == 0x800123UL);
+    assert(record.channel[CHANNEL_CURRENT].full_scale == 0x5b4321UL);
+
+    for (size_t offset = 0; offset < sizeof(AdcCalibrationRecord); ++offset) {
+        EEPROM.bytes[0x70 + offset] ^= 0x01;
+        assert(!LoadAdcCalibration(0x70, record));
+        EEPROM.bytes[0x70 + offset] ^= 0x01;
+    }
+
+    // Within 5 C either way the stored coefficients are used.
+    assert(AdcCalibrationTemperatureClose(31250, 31250));
+    assert(AdcCalibrationTemperatureClose(31250, 36250));
+    assert(AdcCalibrationTemperatureClose(31250, 26250));
+    assert(!AdcCalibrationTemperatureClose(31250, 36251));
+    assert(!AdcCalibrationTemperatureClose(31250, 26249));
+}
+
+int main()
+{
+    crcTests();
+    roundTripTests();
+    corruptionTests();
+    parseTests();
+    adcCalibrationTests();
+    return 0;
+}
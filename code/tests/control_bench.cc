@@ -0,0 +1,468 @@
+/* Host timings for the pure functions in control.h.  Each function runs
+ * over prepared measurement streams and reports nanoseconds per call and
+ * calls per second, for the double and the fixed-point variant side by
+ * side.  The figures are for comparing two versions of an algorithm on the
+ * same machine; cycles on the ATmega328P come from `make -C code bench`.
+ *
+ *   control_bench [samples.csv]
+ *
+ * An optional CSV adds a recorded stream, one sample per line:
+ * `ms,current_ua,voltage_uv,temperature_mc`. */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <vector>
+
+#include "../control.h"
+#include "sim/plant.h"
+
+using namespace control;
+
+// Figures as main.cc has them.
+static const int32_t kReferenceMicrovolts = 5000000L;
+static const FixedSafetyLimits kFixedLimits = {
+    16500000L, 0, 95000L, 50000000L, 200000L
+};
+static const SafetyLimits kLimits = {16.5, 0.0, 95.0, 50.0, 200.0};
+static const int32_t kContinuousPowerMilliwatts = 180000L;
+static const int32_t kDerateStartMillidegrees = 80000L;
+static const int32_t kCutoffMicrovolts = 3000000L;
+
+// Each timing is the best of this many repetitions of at least this long.
+static const int kRepetitions = 5;
+static const double kMinimumRunNanoseconds = 20e6;
+
+// One converter result pair as the firmware sees it.
+struct Sample
+{
+    uint32_t ms;
+    uint32_t current_code;
+    uint32_t voltage_code;
+    int32_t temperature_mc;
+    bool valid;
+};
+
+// A stream with both snapshot types built up front, so the timed loops
+// measure only the function under test.
+struct Stream
+{
+    const char* name;
+    std::vector<Sample> samples;
+    std::vector<MeasurementSnapshot> snapshots;
+    std::vector<FixedMeasurementSnapshot> fixed_snapshots;
+};
+
+static volatile uint32_t sink;
+
+static Sample sampleFromMicro(uint32_t ms, int32_t current_ua,
+                              int32_t voltage_uv, int32_t temperature_mc,
+                              bool valid)
+{
+    Sample sample;
+    sample.ms = ms;
+    sample.current_code = adcCodeForMicrovolts(
+        theoreticalSenseMicrovoltsForMicroamps(current_ua),
+        kReferenceMicrovolts, 0);
+    sample.voltage_code = adcCodeForMicrovolts(
+        theoreticalDividerMicrovoltsForMicrovolts(voltage_uv),
+        kReferenceMicrovolts, 0);
+    sample.temperature_mc = temperature_mc;
+    sample.valid = valid;
+    return sample;
+}
+
+static void buildSnapshots(Stream& stream)
+{
+    for (size_t i = 0; i < stream.samples.size(); i++) {
+        const Sample& sample = stream.samples[i];
+        FixedMeasurementSnapshot fixed;
+        fixed.current_ua = theoreticalMicroampsFromSenseMicrovolts(
+            adcMicrovoltsFromCode(sample.current_code,
+                                  kReferenceMicrovolts, 0));
+        fixed.voltage_uv = theoreticalMicrovoltsFromDivider(
+            adcMicrovoltsFromCode(sample.voltage_code,
+                                  kReferenceMicrovolts, 0));
+        fixed.temperature_mc = sample.temperature_mc;
+        fixed.current_valid = sample.valid;
+        fixed.voltage_valid = sample.valid;
+        fixed.temperature_valid = sample.valid;
+        fixed.timestamp_ms = sample.ms;
+        fixed.safety_current_ua = fixed.current_ua;
+        fixed.safety_voltage_uv = fixed.voltage_uv;
+        fixed.safety_current_valid = sample.valid;
+        fixed.safety_voltage_valid = sample.valid;
+        fixed.current_timestamp_us = sample.ms * 1000UL;
+        fixed.voltage_timestamp_us = sample.ms * 1000UL;
+        fixed.aligned.current_ua = fixed.current_ua;
+        fixed.aligned.voltage_uv = fixed.voltage_uv;
+        fixed.aligned.safety_current_ua = fixed.current_ua;
+        fixed.aligned.safety_voltage_uv = fixed.voltage_uv;
+        fixed.aligned.timestamp_us = fixed.current_timestamp_us;
+        stream.fixed_snapshots.push_back(fixed);
+
+        MeasurementSnapshot measurement;
+        measurement.current = theoreticalCurrentFromSenseVoltage(
+            sample.current_code * 5.0 / 16777216.0);
+        measurement.voltage = theoreticalVoltageFromDivider(
+            sample.voltage_code * 5.0 / 16777216.0);
+        measurement.temperature = sample.temperature_mc / 1000.0;
+        measurement.current_valid = sample.valid;
+        measurement.voltage_valid = sample.valid;
+        measurement.temperature_valid = sample.valid;
+        measurement.timestamp_ms = sample.ms;
+        measurement.safety_current = measurement.current;
+        measurement.safety_voltage = measurement.voltage;
+        measurement.safety_current_valid = sample.valid;
+        measurement.safety_voltage_valid = sample.valid;
+        measurement.current_timestamp_us = fixed.current_timestamp_us;
+        measurement.voltage_timestamp_us = fixed.voltage_timestamp_us;
+        stream.snapshots.push_back(measurement);
+    }
+}
+
+/* A 1 A discharge of a 1.3 Ah cell recorded from the test plant, one
+ * sample a second down to the cut-off. */
+static Stream plantStream()
+{
+    Stream stream;
+    stream.name = "plant";
+    sim::PlantConfig cell = sim::DefaultPlantConfig();
+    cell.capacity_ah = 1.3;
+    sim::Plant plant(cell);
+    plant.setDacCode(theoreticalDacCodeForMicroamps(1000000L));
+    uint32_t ms = 0;
+    while (plant.terminalVolts() > 2.9) {
+        stream.samples.push_back(sampleFromMicro(
+            ms,
+            static_cast<int32_t>(plant.currentAmps() * 1e6),
+            static_cast<int32_t>(plant.terminalVolts() * 1e6),
+            static_cast<int32_t>(plant.heatsinkCelsius() * 1000.0),
+            true));
+        for (int step = 0; step < 100; step++) {
+            plant.advance(0.01);
+        }
+        ms += 1000;
+    }
+    return stream;
+}
+
+/* 0 to 15 A at 24 V while the heatsink climbs through the derating band
+ * to the trip point: every limit in evaluateSafety() and every bound in
+ * boundedCurrentTarget() is reached. */
+static Stream rampStream()
+{
+    Stream stream;
+    stream.name = "ramp";
+    const uint32_t count = 4096;
+    for (uint32_t i = 0; i < count; i++) {
+        const int32_t current_ua =
+            static_cast<int32_t>(15000000LL * i / count);
+        const int32_t voltage_uv = 24000000L - current_ua / 10;
+        const int32_t temperature_mc =
+            25000L + static_cast<int32_t>(75000LL * i / count);
+        stream.samples.push_back(sampleFromMicro(
+            i * 20UL, current_ua, voltage_uv, temperature_mc, true));
+    }
+    return stream;
+}
+
+/* Noisy samples around the 3.0 V cut-off, with one sample in 64 invalid,
+ * so the branches do not settle into one predictable path. */
+static Stream noiseStream()
+{
+    Stream stream;
+    stream.name = "noise";
+    uint32_t state = 12345;
+    const uint32_t count = 4096;
+    for (uint32_t i = 0; i < count; i++) {
+        state = state * 1664525UL + 1013904223UL;
+        const int32_t noise = static_cast<int32_t>(state >> 16) - 32768;
+        const int32_t current_ua = 1000000L + noise * 8;
+        const int32_t voltage_uv = kCutoffMicrovolts + noise * 6;
+        const int32_t temperature_mc = 60000L + noise;
+        stream.samples.push_back(sampleFromMicro(
+            i * 20UL, current_ua, voltage_uv, temperature_mc,
+            (state & 0x3F000000UL) != 0));
+    }
+    return stream;
+}
+
+static bool fileStream(const char* path, Stream& stream)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    stream.name = "file";
+    unsigned long ms;
+    long current_ua;
+    long voltage_uv;
+    long temperature_mc;
+    while (fscanf(file, "%lu,%ld,%ld,%ld", &ms, &current_ua, &voltage_uv,
+                  &temperature_mc) == 4) {
+        stream.samples.push_back(sampleFromMicro(
+            static_cast<uint32_t>(ms), static_cast<int32_t>(current_ua),
+            static_cast<int32_t>(voltage_uv),
+            static_cast<int32_t>(temperature_mc), true));
+    }
+    fclose(file);
+    return !stream.samples.empty();
+}
+
+/* Nanoseconds per call of `body(i)` for i over the stream, the best of
+ * kRepetitions runs.  The results are folded into `sink` so no call can be
+ * dropped. */
+template <typename Body>
+static double nanosecondsPerCall(size_t stream_length, Body body)
+{
+    typedef std::chrono::steady_clock Clock;
+    size_t calls = stream_length;
+    double best = 0.0;
+    for (int repetition = 0; repetition < kRepetitions; repetition++) {
+        while (true) {
+            uint32_t folded = 0;
+            const Clock::time_point start = Clock::now();
+            for (size_t call = 0, i = 0; call < calls; call++) {
+                folded += body(i);
+                if (++i == stream_length) {
+                    i = 0;
+                }
+            }
+            const double elapsed = static_cast<double>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    Clock::now() - start).count());
+            sink = sink + folded;
+            if (elapsed < kMinimumRunNanoseconds) {
+                calls *= 2;
+                continue;
+            }
+            const double per_call = elapsed / calls;
+            if (repetition == 0 || per_call < best) {
+                best = per_call;
+            }
+            break;
+        }
+    }
+    return best;
+}
+
+static void report(const char* function, const char* variant,
+                   const Stream& stream, double nanoseconds)
+{
+    printf("%s/%s/%s ns/op=%.2f ops/s=%.0f\n", function, variant,
+           stream.name, nanoseconds, 1e9 / nanoseconds);
+}
+
+static void safetyBench(const Stream& stream)
+{
+    const MeasurementSnapshot* snapshots = &stream.snapshots[0];
+    const FixedMeasurementSnapshot* fixed = &stream.fixed_snapshots[0];
+    const size_t length = stream.samples.size();
+
+    report("evaluateSafety", "double", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(evaluateSafety(
+                   snapshots[i], kLimits, OperationState::Running));
+           }));
+    report("evaluateSafety", "fixed", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(evaluateSafety(
+                   fixed[i], kFixedLimits, OperationState::Running));
+           }));
+}
+
+/* The output follows the measured current, as if it were the target, so
+ * the slew runs both ways. */
+static void slewBench(const Stream& stream)
+{
+    const FixedMeasurementSnapshot* fixed = &stream.fixed_snapshots[0];
+    const size_t length = stream.samples.size();
+    std::vector<uint16_t> targets(length);
+    for (size_t i = 0; i < length; i++) {
+        targets[i] = theoreticalDacCodeForMicroamps(fixed[i].current_ua);
+    }
+    const uint16_t* target = &targets[0];
+
+    uint16_t output = 0;
+    report("slewDacCode", "double", stream,
+           nanosecondsPerCall(length, [&](size_t i) {
+               output = slewDacCode(output, target[i], fixed[i].timestamp_ms,
+                                    fixed[i].timestamp_ms - 20UL);
+               return static_cast<uint32_t>(output);
+           }));
+    output = 0;
+    report("slewDacCode", "fixed", stream,
+           nanosecondsPerCall(length, [&](size_t i) {
+               output = slewDacCodeFixed(output, target[i],
+                                         fixed[i].timestamp_ms,
+                                         fixed[i].timestamp_ms - 20UL);
+               return static_cast<uint32_t>(output);
+           }));
+
+    static const SlewSettings kLinear = {SlewProfile::Linear, 5000L, 0};
+    static const SlewSettings kSCurve = {SlewProfile::SCurve, 5000L, 25000L};
+    SlewState state;
+    output = 0;
+    report("slewDacCode", "carried", stream,
+           nanosecondsPerCall(length, [&](size_t i) {
+               output = slewDacCodeCarried(state, output, target[i],
+                                           fixed[i].timestamp_ms, kLinear);
+               return static_cast<uint32_t>(output);
+           }));
+    resetSlew(state, 0, 0);
+    output = 0;
+    report("slewDacCode", "scurve", stream,
+           nanosecondsPerCall(length, [&](size_t i) {
+               output = slewDacCodeCarried(state, output, target[i],
+                                           fixed[i].timestamp_ms, kSCurve);
+               return static_cast<uint32_t>(output);
+           }));
+}
+
+static void boundBench(const Stream& stream)
+{
+    const MeasurementSnapshot* snapshots = &stream.snapshots[0];
+    const FixedMeasurementSnapshot* fixed = &stream.fixed_snapshots[0];
+    const size_t length = stream.samples.size();
+
+    report("boundedCurrentTarget", "double", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(1e6 * boundedCurrentTarget(
+                   10.0, snapshots[i].safety_voltage,
+                   snapshots[i].temperature,
+                   kContinuousPowerMilliwatts / 1000.0,
+                   kDerateStartMillidegrees / 1000.0,
+                   kLimits.max_temperature));
+           }));
+    report("boundedCurrentTarget", "fixed", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(boundedCurrentTargetMicroamps(
+                   10000000L, fixed[i].safety_voltage_uv,
+                   fixed[i].temperature_mc, kContinuousPowerMilliwatts,
+                   kDerateStartMillidegrees,
+                   kFixedLimits.max_temperature_mc));
+           }));
+}
+
+/* The qualification is restarted once it completes, so a stream that
+ * crosses the cut-off keeps exercising the timer. */
+static void undervoltageBench(const Stream& stream)
+{
+    const MeasurementSnapshot* snapshots = &stream.snapshots[0];
+    const FixedMeasurementSnapshot* fixed = &stream.fixed_snapshots[0];
+    const size_t length = stream.samples.size();
+
+    UndervoltageQualification qualification;
+    report("qualifyUndervoltage", "double", stream,
+           nanosecondsPerCall(length, [&](size_t i) {
+               const bool completed = qualifyUndervoltage(
+                   qualification, snapshots[i].safety_voltage,
+                   snapshots[i].safety_voltage_valid,
+                   kCutoffMicrovolts / 1e6, snapshots[i].timestamp_ms);
+               if (completed) {
+                   resetUndervoltageQualification(qualification);
+               }
+               return static_cast<uint32_t>(completed);
+           }));
+    resetUndervoltageQualification(qualification);
+    report("qualifyUndervoltage", "fixed", stream,
+           nanosecondsPerCall(length, [&](size_t i) {
+               const bool completed = qualifyUndervoltageMicrovolts(
+                   qualification, fixed[i].safety_voltage_uv,
+                   fixed[i].safety_voltage_valid, kCutoffMicrovolts,
+                   fixed[i].timestamp_ms);
+               if (completed) {
+                   resetUndervoltageQualification(qualification);
+               }
+               return static_cast<uint32_t>(completed);
+           }));
+}
+
+/* Raw converter words to amps and volts, and the current command to a DAC
+ * code and back.  The double variants take the word through volts at the
+ * converter input the way the original floating-point path did. */
+static void transferBench(const Stream& stream)
+{
+    const Sample* samples = &stream.samples[0];
+    const MeasurementSnapshot* snapshots = &stream.snapshots[0];
+    const FixedMeasurementSnapshot* fixed = &stream.fixed_snapshots[0];
+    const size_t length = stream.samples.size();
+
+    report("currentFromCode", "double", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(
+                   1e6 * theoreticalCurrentFromSenseVoltage(
+                       samples[i].current_code * 5.0 / 16777216.0));
+           }));
+    report("currentFromCode", "fixed", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(
+                   theoreticalMicroampsFromSenseMicrovolts(
+                       adcMicrovoltsFromCode(samples[i].current_code,
+                                             kReferenceMicrovolts, 0)));
+           }));
+    report("voltageFromCode", "double", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(
+                   1e6 * theoreticalVoltageFromDivider(
+                       samples[i].voltage_code * 5.0 / 16777216.0));
+           }));
+    report("voltageFromCode", "fixed", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(
+                   theoreticalMicrovoltsFromDivider(
+                       adcMicrovoltsFromCode(samples[i].voltage_code,
+                                             kReferenceMicrovolts, 0)));
+           }));
+    report("dacCodeForCurrent", "double", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(
+                   theoreticalDacCodeForCurrent(snapshots[i].current));
+           }));
+    report("dacCodeForCurrent", "fixed", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(
+                   theoreticalDacCodeForMicroamps(fixed[i].current_ua));
+           }));
+    report("currentFromDacCode", "double", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(
+                   1e6 * theoreticalCurrentFromDacCode(
+                       static_cast<uint16_t>(samples[i].current_code >> 12)));
+           }));
+    report("currentFromDacCode", "fixed", stream,
+           nanosecondsPerCall(length, [=](size_t i) {
+               return static_cast<uint32_t>(
+                   theoreticalMicroampsFromDacCode(
+                       static_cast<uint16_t>(samples[i].current_code >> 12)));
+           }));
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<Stream> streams;
+    streams.push_back(plantStream());
+    streams.push_back(rampStream());
+    streams.push_back(noiseStream());
+    if (argc > 1) {
+        Stream recorded;
+        if (!fileStream(argv[1], recorded)) {
+            fprintf(stderr, "%s: no samples\n", argv[1]);
+            return 1;
+        }
+        streams.push_back(recorded);
+    }
+
+    for (size_t i = 0; i < streams.size(); i++) {
+        Stream& stream = streams[i];
+        buildSnapshots(stream);
+        safetyBench(stream);
+        slewBench(stream);
+        boundBench(stream);
+        undervoltageBench(stream);
+        transferBench(stream);
+    }
+    return 0;
+}
@@ -1,5 +1,7 @@
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
 
 #include "../control.h"
 
@@ -23,7 +25,9 @@ static MeasurementSnapshot validMeasurement()
         5.0,   // theoretical safety current
         24.0,  // theoretical safety voltage
         true,  // safety_current_valid
-        true   // safety_voltage_valid
+        true,  // safety_voltage_valid
+        1000000,  // current_timestamp_us
+        1000000   // voltage_timestamp_us
     };
     return measurement;
 }
@@ -125,6 +129,15 @@ static void safetyTests()
 
 static void cutoffTests()
 {
+    // A short derating span still scales a large target exactly.
+    assert(boundedCurrentTargetMicroamps(15000000L, 1000000L, 80050L,
+                                         0, 80000L, 80100L) == 7500000L);
+    assert(boundedCurrentTargetMicroamps(15000000L, 1000000L, 80099L,
+                                         0, 80000L, 80100L) == 150000L);
+    // A span past 65 C is coarsened, not overflowed.
+    assert(boundedCurrentTargetMicroamps(10000000L, 1000000L, 100000L,
+                                         0, 0, 200000L) == 5000000L);
+
     UndervoltageQualification cutoff;
     assert(!qualifyUndervoltage(cutoff, 12.0, true, 12.0, 99U));
     assert(qualifyUndervoltage(cutoff, 12.0, true, 12.0, 599U));
@@ -193,6 +206,15 @@ static void stateAndTimingTests()
     assert(!tryStart(controller, 15000, 12000, true));
     assert(acknowledgeFault(controller, 16000));
     assert(controller.state == OperationState::Idle);
+
+    // Background calibration windows.
+    assert(calibrationWindowAvailable(OperationState::Idle, 500, 0, 100));
+    assert(!calibrationWindowAvailable(OperationState::Running, 60, 0, 100));
+    assert(calibrationWindowAvailable(OperationState::Running, 60, 40, 100));
+    assert(!calibrationWindowAvailable(OperationState::Running, 60, 41, 100));
+    assert(!calibrationWindowAvailable(OperationState::Running, 120, 1, 100));
+    assert(!calibrationWindowAvailable(OperationState::Fault, 0, 1, 100));
+    assert(!calibrationWindowAvailable(OperationState::Completed, 0, 1, 100));
 }
 
 static void targetLimitTests()
@@ -212,6 +234,590 @@ static void targetLimitTests()
     assert(boundedCurrentTarget(15.0, 0.0, 25.0, 180.0, 80.0, 95.0) == 0.0);
 }
 
+static bool withinOne(int64_t actual, double expected)
+{
+    return fabs(static_cast<double>(actual) - expected) <= 1.0;
+}
+
+static FixedMeasurementSnapshot validFixedMeasurement()
+{
+    FixedMeasurementSnapshot measurement = {
+        5000000,   // current_ua
+        24000000,  // voltage_uv
+        25000,     // temperature_mc
+        true,      // current_valid
+        true,      // voltage_valid
+        true,      // temperature_valid
+        1000,      // timestamp_ms
+        5000000,   // safety_current_ua
+        24000000,  // safety_voltage_uv
+        true,      // safety_current_valid
+        true,      // safety_voltage_valid
+        1000000,   // current_timestamp_us
+        1000000,   // voltage_timestamp_us
+        {5000000, 24000000, 5000000, 24000000, 1000000}  // aligned
+    };
+    return measurement;
+}
+
+static void fixedConversionTests()
+{
+    // The integer scale factors are the schematic constants.
+    assert(near(1.0 / (kCurrentSenseGain * kCurrentShuntOhms),
+                kSenseMicroampsPerMicrovolt, 1e-12));
+    assert(near(kInputDividerRatioQ24 / 16777216.0, kInputDividerRatio, 1e-7));
+
+    // ADC codes at every gain, against the double formula used before.
+    for (uint32_t code = 0; code < 16777216UL; code += 4099U) {
+        for (uint8_t shift = 0; shift <= 7; ++shift) {
+            const double expected = static_cast<double>(code) * 5000000.0 /
+                16777216.0 / static_cast<double>(1U << shift);
+            assert(withinOne(adcMicrovoltsFromCode(code, 5000000L, shift),
+                             expected));
+        }
+    }
+
+    for (int32_t uv = -1000; uv <= 5000000L; uv += 997) {
+        assert(withinOne(theoreticalMicroampsFromSenseMicrovolts(uv),
+                         theoreticalCurrentFromSenseVoltage(uv / 1e6) * 1e6));
+        assert(withinOne(theoreticalMicrovoltsFromDivider(uv),
+                         theoreticalVoltageFromDivider(uv / 1e6) * 1e6));
+    }
+
+    for (int32_t ua = -1000; ua <= 16000000L; ua += 211) {
+        const int32_t fixed_code = theoreticalDacCodeForMicroamps(ua);
+        const int32_t double_code = theoreticalDacCodeForCurrent(ua / 1e6);
+        assert(fixed_code - double_code <= 1 && double_code - fixed_code <= 1);
+    }
+    assert(theoreticalDacCodeForMicroamps(1000000L) == 321U);
+    assert(theoreticalDacCodeForMicroamps(15000000L) ==
+           kTheoreticalDacHardCapCode);
+
+    for (uint32_t code = 0; code <= 65535U; ++code) {
+        assert(withinOne(theoreticalMicroampsFromDacCode(
+                             static_cast<uint16_t>(code)),
+                         theoreticalCurrentFromDacCode(
+                             static_cast<uint16_t>(code)) * 1e6));
+    }
+
+    // Raw code thresholds: the code at the limit reads at or below it, the
+    // next code above it, and large limits saturate at full scale.
+    for (int32_t uv = 1; uv <= 5000000L; uv += 7919) {
+        for (uint8_t shift = 0; shift <= 7; shift = shift ? shift + 1 : 3) {
+            const uint32_t code = adcCodeForMicrovolts(uv, 5000000L, shift);
+            if (code == 0xFFFFFFUL) {
+                continue;
+            }
+            const double code_uv = static_cast<double>(code) * 5000000.0 /
+                16777216.0 / static_cast<double>(1U << shift);
+            const double next_uv = code_uv + 5000000.0 / 16777216.0 /
+                static_cast<double>(1U << shift);
+            assert(code_uv <= uv && next_uv > uv);
+        }
+    }
+    assert(adcCodeForMicrovolts(0, 5000000L, 0) == 0U);
+    assert(adcCodeForMicrovolts(5000000L, 5000000L, 0) == 0xFFFFFFUL);
+    assert(adcCodeForMicrovolts(1000000L, 5000000L, 3) == 0xFFFFFFUL);
+
+    assert(theoreticalSenseMicrovoltsForMicroamps(16500000L) == 4125000L);
+    // One divider microvolt is ~10 uV at the input.
+    const int32_t round_trip = theoreticalMicrovoltsFromDivider(
+        theoreticalDividerMicrovoltsForMicrovolts(50000000L));
+    assert(round_trip <= 50000000L && round_trip > 50000000L - 11);
+}
+
+static void fixedControlTests()
+{
+    const uint16_t target = theoreticalDacCodeForCurrent(15.0);
+    for (uint32_t elapsed = 0; elapsed <= 200U; ++elapsed) {
+        const int fixed_code = slewDacCodeFixed(0U, target, elapsed, 0U);
+        const int double_code = slewDacCode(0U, target, elapsed, 0U);
+        assert(fixed_code - double_code <= 1 && double_code - fixed_code <= 1);
+    }
+    assert(slewDacCodeFixed(0U, target, 1000U, 0U) == 160U);
+    assert(slewDacCodeFixed(target, 0U, 1000U, 0U, 0) == 0U);
+    assert(slewDacCodeFixed(0U, 100U, 1000U, 0U, 0) == 0U);
+
+    for (int32_t voltage_mv = 0; voltage_mv <= 50000; voltage_mv += 250) {
+        for (int32_t temperature_mc = 20000; temperature_mc <= 96000;
+             temperature_mc += 1500) {
+            const double expected = boundedCurrentTarget(
+                15.0, voltage_mv / 1000.0, temperature_mc / 1000.0,
+                180.0, 80.0, 95.0) * 1e6;
+            const int32_t actual = boundedCurrentTargetMicroamps(
+                15000000L, voltage_mv * 1000L, temperature_mc,
+                180000L, 80000L, 95000L);
+            assert(withinOne(actual, expected));
+        }
+    }
+
+    UndervoltageQualification cutoff;
+    assert(!qualifyUndervoltageMicrovolts(cutoff, 11900000L, true,
+                                          12000000L, 100U));
+    assert(!qualifyUndervoltageMicrovolts(cutoff, 12050000L, true,
+                                          12000000L, 500U));
+    assert(qualifyUndervoltageMicrovolts(cutoff, 12050000L, true,
+                                         12000000L, 600U));
+    resetUndervoltageQualification(cutoff);
+    assert(!qualifyUndervoltageMicrovolts(cutoff, 11900000L, true,
+                                          12000000L, 100U));
+    assert(!qualifyUndervoltageMicrovolts(cutoff, 12110000L, true,
+                                          12000000L, 200U));
+    assert(!qualifyUndervoltageMicrovolts(cutoff, 11900000L, true,
+                                          12000000L, 600U));
+}
+
+static const SlewSettings kLinearSlew = {SlewProfile::Linear, 5000L, 0};
+static const SlewSettings kSCurveSlew = {SlewProfile::SCurve, 5000L, 25000L};
+
+/* Ramps from 0 towards `target`, calling every `period_us` on a millis()
+ * clock that starts at `start_ms`, and returns the code at `until_ms`.
+ * `arrived_ms` gets the first call that reached the target. */
+static uint16_t rampCode(const SlewSettings& settings, uint16_t target,
+                         uint32_t period_us, uint32_t until_ms,
+                         uint32_t start_ms = 0, uint32_t* arrived_ms = NULL)
+{
+    SlewState state;
+    resetSlew(state, 0, start_ms);
+    uint16_t code = 0;
+    uint64_t clock_us = 0;
+    while (clock_us < until_ms * 1000ULL) {
+        clock_us += period_us;
+        if (clock_us > until_ms * 1000ULL) {
+            clock_us = until_ms * 1000ULL;
+        }
+        const uint32_t now_ms =
+            start_ms + static_cast<uint32_t>(clock_us / 1000);
+        code = slewDacCodeCarried(state, code, target, now_ms, settings);
+        if (arrived_ms && code == target && *arrived_ms == 0) {
+            *arrived_ms = static_cast<uint32_t>(clock_us / 1000);
+        }
+    }
+    return code;
+}
+
+static void carriedSlewTests()
+{
+    const uint16_t full = theoreticalDacCodeForMicroamps(15000000L);
+    const uint16_t one_amp = theoreticalDacCodeForMicroamps(1000000L);
+    const uint32_t periods_us[] = {
+        100, 250, 500, 600, 999, 1000, 1500, 3000, 7000, 20000, 33000
+    };
+    const size_t period_count = sizeof(periods_us) / sizeof(periods_us[0]);
+
+    // The old slew loses the remainder of every call and stands still once
+    // a call is worth less than one code.
+    SlewState state;
+    uint16_t truncated = 0;
+    for (uint32_t ms = 1; ms <= 1000; ms++) {
+        truncated = slewDacCodeFixed(truncated, full, ms, ms - 1);
+    }
+    assert(truncated == 1000U);
+
+    // Linear: 5 A/s is 1.6056 codes/ms, and the code at any instant is the
+    // same whatever the loop period.
+    for (uint32_t until_ms = 20; until_ms <= 1000; until_ms += 245) {
+        const uint16_t expected = static_cast<uint16_t>(
+            (slewCodesPerMillisecondQ16(5000L) * until_ms) >> 16);
+        for (size_t i = 0; i < period_count; i++) {
+            assert(rampCode(kLinearSlew, full, periods_us[i], until_ms) ==
+                   expected);
+        }
+    }
+    assert(rampCode(kLinearSlew, full, 1000, 1000) == 1605U);
+
+    // S-curve: slower than linear at first, the same everywhere, and at the
+    // target in 2 * sqrt(1 A / 25 A/s^2) = 400 ms.
+    assert(rampCode(kSCurveSlew, one_amp, 1000, 20) <
+           rampCode(kLinearSlew, one_amp, 1000, 20));
+    for (uint32_t until_ms = 20; until_ms <= 600; until_ms += 73) {
+        const uint16_t expected = rampCode(kSCurveSlew, one_amp, 1000,
+                                           until_ms);
+        for (size_t i = 0; i < period_count; i++) {
+            assert(rampCode(kSCurveSlew, one_amp, periods_us[i], until_ms) ==
+                   expected);
+        }
+    }
+    uint32_t arrived_ms = 0;
+    assert(rampCode(kSCurveSlew, one_amp, 1000, 1000, 0, &arrived_ms) ==
+           one_amp);
+    assert(arrived_ms > 380 && arrived_ms < 420);
+
+    // The S-curve never moves faster than the linear rate.
+    resetSlew(state, 0, 0);
+    uint16_t code = 0;
+    for (uint32_t ms = 1; ms <= 3500; ms++) {
+        const uint16_t next =
+            slewDacCodeCarried(state, code, full, ms, kSCurveSlew);
+        assert(next - code <= 2);
+        code = next;
+    }
+    assert(code == full);
+
+    // Rollover of millis() does not disturb the ramp.
+    assert(rampCode(kLinearSlew, full, 500, 1000, 0xFFFFFE00UL) == 1605U);
+    assert(rampCode(kSCurveSlew, one_amp, 500, 300, 0xFFFFFF00UL) ==
+           rampCode(kSCurveSlew, one_amp, 500, 300));
+
+    // Downward steps are immediate and drop the remainder and the rate.
+    resetSlew(state, 0, 0);
+    code = slewDacCodeCarried(state, 0, full, 250, kSCurveSlew);
+    assert(code > 0);
+    assert(slewDacCodeCarried(state, code, 10U, 260, kSCurveSlew) == 10U);
+    assert(state.fraction == 0 && state.rate_q16 == 0);
+
+    // A stall still counts for at most 100 ms.
+    resetSlew(state, 0, 0);
+    assert(slewDacCodeCarried(state, 0, full, 10000, kLinearSlew) ==
+           rampCode(kLinearSlew, full, 1000, 100));
+
+    // A code written by anyone else restarts the carry from there.
+    resetSlew(state, 0, 0);
+    code = slewDacCodeCarried(state, 0, full, 10, kLinearSlew);
+    assert(code == 16U && state.fraction != 0);
+    assert(slewDacCodeCarried(state, 500U, full, 10, kLinearSlew) == 500U);
+    assert(state.code == 500U && state.fraction == 0);
+
+    // The hard cap holds and a zero rate never rises.
+    resetSlew(state, 0, 0);
+    code = 0;
+    for (uint32_t ms = 20; ms <= 5000; ms += 20) {
+        code = slewDacCodeCarried(state, code, 65535U, ms, kLinearSlew);
+    }
+    assert(code == kTheoreticalDacHardCapCode);
+    const SlewSettings stopped = {SlewProfile::Linear, 0, 0};
+    resetSlew(state, 0, 0);
+    assert(slewDacCodeCarried(state, 0, full, 100, stopped) == 0U);
+}
+
+static void fixedSafetyTests()
+{
+    const SafetyLimits limits = {10.0, 12.0, 80.0, 60.0, 200.0};
+    const FixedSafetyLimits fixed_limits = {
+        10000000L, 12000000L, 80000L, 60000000L, 200000L
+    };
+    const int32_t currents_ua[] = {0, 5000000L, 9000000L, 10000000L,
+                                   10000001L, 16000000L};
+    const int32_t voltages_uv[] = {0, 11900000L, 22222222L, 24000000L,
+                                   60000000L, 60000001L};
+    const int32_t temperatures_mc[] = {25000L, 80000L, 80001L};
+    for (size_t c = 0; c < sizeof(currents_ua) / sizeof(currents_ua[0]); ++c) {
+        for (size_t v = 0; v < sizeof(voltages_uv) / sizeof(voltages_uv[0]);
+             ++v) {
+            for (size_t t = 0;
+                 t < sizeof(temperatures_mc) / sizeof(temperatures_mc[0]);
+                 ++t) {
+                MeasurementSnapshot measurement = validMeasurement();
+                FixedMeasurementSnapshot fixed = validFixedMeasurement();
+                fixed.safety_current_ua = currents_ua[c];
+                fixed.safety_voltage_uv = voltages_uv[v];
+                fixed.aligned.safety_current_ua = currents_ua[c];
+                fixed.aligned.safety_voltage_uv = voltages_uv[v];
+                fixed.temperature_mc = temperatures_mc[t];
+                measurement.safety_current = currents_ua[c] / 1e6;
+                measurement.safety_voltage = voltages_uv[v] / 1e6;
+                measurement.temperature = temperatures_mc[t] / 1000.0;
+                assert(evaluateSafety(fixed, fixed_limits,
+                                      OperationState::Running) ==
+                       evaluateSafety(measurement, limits,
+                                      OperationState::Running));
+            }
+        }
+    }
+
+    FixedMeasurementSnapshot fixed = validFixedMeasurement();
+    fixed.safety_voltage_valid = false;
+    assert(evaluateSafety(fixed, fixed_limits, OperationState::Running) ==
+           FaultReason::AdcFailure);
+    fixed = validFixedMeasurement();
+    fixed.temperature_valid = false;
+    assert(evaluateSafety(fixed, fixed_limits, OperationState::Running) ==
+           FaultReason::TemperatureSensorFailure);
+}
+
+static void sampleHistoryTests()
+{
+    SampleHistory history;
+    ChannelSample sample;
+    assert(!newestSample(history, sample));
+    assert(!interpolateSample(history, 0, sample));
+
+    recordSample(history, 1000, 2000, 100);
+    recordSample(history, 3000, 6000, 300);
+    recordSample(history, 9000, 9000, 300);
+    assert(history.count == 2);
+    assert(interpolateSample(history, 200, sample));
+    assert(sample.value == 2000 && sample.safety_value == 4000);
+    assert(sample.timestamp_us == 200);
+    assert(interpolateSample(history, 300, sample) && sample.value == 3000);
+    assert(interpolateSample(history, 100, sample) && sample.value == 1000);
+    // Neither before the oldest nor after the newest sample.
+    assert(!interpolateSample(history, 99, sample));
+    assert(!interpolateSample(history, 301, sample));
+
+    // Falling values, a span over 2^16 us and the micros() wrap.
+    resetSampleHistory(history);
+    recordSample(history, 5000000L, 5000000L, 0xFFFF0000UL);
+    recordSample(history, 1000000L, 1000000L, 0x00010000UL);
+    assert(interpolateSample(history, 0, sample));
+    assert(sample.value == 3000000L);
+
+    // Only the last kSampleHistoryLength samples are kept.
+    resetSampleHistory(history);
+    for (uint32_t i = 0; i < 6; i++) {
+        recordSample(history, (int32_t)i, (int32_t)i, i * 10);
+    }
+    assert(history.count == kSampleHistoryLength);
+    assert(!interpolateSample(history, 15, sample));
+    assert(interpolateSample(history, 25, sample) && sample.value == 2);
+
+    /* A ramp from 1 A to 11 A over one second on a 12 V source with 0.5 Ohm
+     * behind it.  Current is converted 5 ms before voltage, as the
+     * AD7190 does.  The latest pair multiplied as it is reads the voltage
+     * of 5 ms later, about 0.25 V low at 10 A/s; aligned, each power is the
+     * true one at its instant, to rounding. */
+    SampleHistory current;
+    SampleHistory voltage;
+    AlignedMeasurement aligned;
+    double worst_skewed_mw = 0.0;
+    double worst_aligned_mw = 0.0;
+    for (uint32_t t_us = 0; t_us <= 1000000UL; t_us += 10000) {
+        const double amps = 1.0 + 10.0 * t_us / 1e6;
+        const double later_amps = 1.0 + 10.0 * (t_us + 5000) / 1e6;
+        const int32_t current_ua = (int32_t)lround(amps * 1e6);
+        const int32_t voltage_uv =
+            (int32_t)lround((12.0 - 0.5 * later_amps) * 1e6);
+        recordSample(current, current_ua, current_ua, t_us);
+        recordSample(voltage, voltage_uv, voltage_uv, t_us + 5000);
+        if (!alignMeasurement(current, voltage, aligned)) {
+            continue;
+        }
+        const double aligned_amps = aligned.current_ua / 1e6;
+        const double true_mw = aligned_amps * (12.0 - 0.5 * aligned_amps) * 1e3;
+        const double aligned_mw =
+            aligned.current_ua / 1e6 * aligned.voltage_uv / 1e3;
+        const double skewed_mw = current_ua / 1e6 * voltage_uv / 1e3;
+        const double now_true_mw = amps * (12.0 - 0.5 * amps) * 1e3;
+        worst_aligned_mw = fmax(worst_aligned_mw, fabs(aligned_mw - true_mw));
+        worst_skewed_mw = fmax(worst_skewed_mw, fabs(skewed_mw - now_true_mw));
+        assert(aligned.timestamp_us == t_us);
+        assert(labs(aligned.voltage_uv - lround(
+                   (12.0 - 0.5 * aligned_amps) * 1e6)) <= 2);
+    }
+    assert(worst_skewed_mw > 100.0);
+    assert(worst_aligned_mw < 0.1);
+
+    /* While the channels alternate, whichever converted last, both are
+     * taken at the older instant. */
+    resetSampleHistory(current);
+    resetSampleHistory(voltage);
+    recordSample(current, 1000000L, 1000000L, 0);
+    recordSample(voltage, 10000000L, 10000000L, 5000);
+    recordSample(current, 2000000L, 2000000L, 10000);
+    assert(alignMeasurement(current, voltage, aligned));
+    assert(aligned.timestamp_us == 5000);
+    assert(aligned.current_ua == 1500000L);
+    assert(aligned.voltage_uv == 10000000L);
+    recordSample(voltage, 9000000L, 9000000L, 15000);
+    assert(alignMeasurement(current, voltage, aligned));
+    assert(aligned.timestamp_us == 10000);
+    assert(aligned.current_ua == 2000000L);
+    assert(aligned.voltage_uv == 9500000L);
+
+    /* The power check and CP/CR take the aligned pair. */
+    const FixedSafetyLimits limits = {
+        20000000L, 0, 95000L, 60000000L, 100000L
+    };
+    FixedMeasurementSnapshot measurement = validFixedMeasurement();
+    measurement.safety_voltage_uv = 30000000L;
+    measurement.aligned.safety_voltage_uv = 19000000L;
+    assert(evaluateSafety(measurement, limits, OperationState::Running) ==
+           FaultReason::None);
+    measurement.aligned.safety_voltage_uv = 21000000L;
+    assert(evaluateSafety(measurement, limits, OperationState::Running) ==
+           FaultReason::Overpower);
+    measurement.aligned.voltage_uv = 12000000L;
+    ConstantVoltageIntegrator integrator;
+    assert(modeTargetMicroamps(LoadMode::ConstantPower, 120000L, 0,
+                               measurement, integrator) == 10000000L);
+}
+
+static void regulationModeTests()
+{
+    /* The fixed-rate gate keeps its phase under jitter and skips missed
+     * periods instead of bursting them. */
+    uint32_t next_ms = 1000U;
+    assert(!fixedRateDue(999U, next_ms, 20U));
+    assert(fixedRateDue(1003U, next_ms, 20U));
+    assert(next_ms == 1020U);
+    assert(!fixedRateDue(1019U, next_ms, 20U));
+    assert(fixedRateDue(1021U, next_ms, 20U));
+    assert(next_ms == 1040U);
+    assert(fixedRateDue(1100U, next_ms, 20U));
+    assert(next_ms == 1120U);
+    assert(!fixedRateDue(1100U, next_ms, 20U));
+    next_ms = 0xFFFFFFF0U;
+    assert(fixedRateDue(0xFFFFFFF5U, next_ms, 20U));
+    assert(next_ms == 4U);
+    assert(!fixedRateDue(0xFFFFFFFFU, next_ms, 20U));
+    assert(fixedRateDue(4U, next_ms, 20U));
+
+    /* CP: 120 W from 24 V is 5 A; CR: 24 V over 4.8 Ohm is 5 A. */
+    assert(constantPowerTargetMicroamps(120000L, 24000000L) == 5000000L);
+    assert(constantPowerTargetMicroamps(1L, 3000000L) == 333L);
+    assert(constantPowerTargetMicroamps(120000L, 0) == 0);
+    assert(constantPowerTargetMicroamps(1000000L, 1000000L) ==
+           kMaximumTheoreticalCurrentMicroamps);
+    assert(constantResistanceTargetMicroamps(4800L, 24000000L) == 5000000L);
+    assert(constantResistanceTargetMicroamps(3L, 1000L) == 333333L);
+    assert(constantResistanceTargetMicroamps(0, 24000000L) == 0);
+    assert(constantResistanceTargetMicroamps(1L, 50000000L) ==
+           kMaximumTheoreticalCurrentMicroamps);
+
+    /* Against the 64-bit quotients: CR is exact, CP within the rounding of
+     * the voltage to millivolts. */
+    for (int32_t voltage_uv = 1000; voltage_uv <= 60000000L;
+         voltage_uv += 12347) {
+        for (int32_t resistance_mohm = 1; resistance_mohm <= 99999L;
+             resistance_mohm = resistance_mohm * 3 + 1) {
+            const int64_t exact =
+                (static_cast<int64_t>(voltage_uv) * 1000 +
+                 resistance_mohm / 2) / resistance_mohm;
+            assert(constantResistanceTargetMicroamps(resistance_mohm,
+                                                     voltage_uv) ==
+                   limitMicroamps(exact));
+        }
+        for (int32_t power_mw = 1; power_mw <= 2000000L;
+             power_mw = power_mw * 5 + 3) {
+            const double exact = power_mw * 1e9 / voltage_uv;
+            const double tolerance = exact * 500.0 / voltage_uv + 1.0;
+            const double maximum = kMaximumTheoreticalCurrentMicroamps;
+            const int32_t actual =
+                constantPowerTargetMicroamps(power_mw, voltage_uv);
+            if (exact >= maximum + tolerance) {
+                assert(actual == kMaximumTheoreticalCurrentMicroamps);
+            } else if (exact < maximum - tolerance) {
+                assert(near(actual, exact, tolerance));
+            }
+        }
+    }
+    assert(constantResistanceTargetMicroamps(2000000000L, 2000000000L) ==
+           1000L);
+    assert(constantPowerTargetMicroamps(2147483647L, 60000000L) ==
+           kMaximumTheoreticalCurrentMicroamps);
+    assert(constantPowerTargetMicroamps(1000L, 400L) ==
+           kMaximumTheoreticalCurrentMicroamps);
+
+    /* CV integrates the error, never below zero or above the maximum. */
+    assert(constantVoltageTargetMicroamps(1000000L, 12000000L, 12100000L) ==
+           1000000L + 100 * kConstantVoltageGainMicroampsPerMillivolt);
+    assert(constantVoltageTargetMicroamps(1000000L, 12000000L, 11900000L) ==
+           1000000L - 100 * kConstantVoltageGainMicroampsPerMillivolt);
+    assert(constantVoltageTargetMicroamps(1000L, 12000000L, 0) == 0);
+    assert(constantVoltageTargetMicroamps(
+               kMaximumTheoreticalCurrentMicroamps, 0, 50000000L) ==
+           kMaximumTheoreticalCurrentMicroamps);
+
+    /* The step scales with the time since the previous voltage: 80 ms
+     * integrates four regulation periods' worth. */
+    assert(constantVoltageTargetMicroamps(1000000L, 12000000L, 12100000L,
+                                          80000UL) ==
+           1000000L + 400 * kConstantVoltageGainMicroampsPerMillivolt);
+    assert(constantVoltageTargetMicroamps(1000000L, 12000000L, 12100000L,
+                                          0) == 1000000L);
+
+    /* Each voltage integrates once: the first as one period, a repeat of
+     * the same conversion not at all, the next over its interval, and a
+     * long gap no longer than the cap. */
+    ConstantVoltageIntegrator integrator;
+    assert(integrateConstantVoltage(integrator, 1000000L, 12000000L,
+                                    12100000L, 500000UL) ==
+           1000000L + 100 * kConstantVoltageGainMicroampsPerMillivolt);
+    assert(integrateConstantVoltage(integrator, 1005000L, 12000000L,
+                                    12100000L, 500000UL) == 1005000L);
+    assert(integrateConstantVoltage(integrator, 1005000L, 12000000L,
+                                    12100000L, 540000UL) ==
+           1005000L + 200 * kConstantVoltageGainMicroampsPerMillivolt);
+    assert(integrateConstantVoltage(integrator, 1000000L, 12000000L,
+                                    12100000L, 5540000UL) ==
+           1000000L + 1250 * kConstantVoltageGainMicroampsPerMillivolt);
+    resetConstantVoltage(integrator);
+    assert(integrateConstantVoltage(integrator, 1000000L, 12000000L,
+                                    12100000L, 5540000UL) ==
+           1000000L + 100 * kConstantVoltageGainMicroampsPerMillivolt);
+
+    /* Against a 15 V source with 0.5 Ohm output resistance, CV at 12 V
+     * settles at 6 A without overshoot, with a new voltage every
+     * regulation period. */
+    FixedMeasurementSnapshot measurement = validFixedMeasurement();
+    int32_t current_ua = 0;
+    int32_t peak_ua = 0;
+    int32_t fast_after_one_second = 0;
+    resetConstantVoltage(integrator);
+    for (int update = 0; update < 2000; ++update) {
+        measurement.voltage_uv = 15000000L - current_ua / 2;
+        measurement.voltage_timestamp_us += 20000UL;
+        current_ua = modeTargetMicroamps(LoadMode::ConstantVoltage, 12000000L,
+                                         current_ua, measurement, integrator);
+        if (update == 49) {
+            fast_after_one_second = current_ua;
+        }
+        peak_ua = current_ua > peak_ua ? current_ua : peak_ua;
+    }
+    assert(current_ua > 5990000L && current_ua < 6010000L);
+    assert(peak_ua < 6010000L);
+
+    /* The ADC delivers a voltage only every 80 ms, one current and one
+     * voltage conversion, while the regulation still runs every 20 ms.
+     * The ticks between two voltages leave the target alone, and the
+     * target moves at the same rate per second as with a voltage every
+     * period, so the loop neither winds up on a stale error nor
+     * overshoots. */
+    measurement = validFixedMeasurement();
+    resetConstantVoltage(integrator);
+    current_ua = 0;
+    peak_ua = 0;
+    int32_t slow_after_one_second = 0;
+    for (int update = 0; update < 2000; ++update) {
+        const int32_t previous_ua = current_ua;
+        const bool new_voltage = update % 4 == 0;
+        if (new_voltage) {
+            measurement.voltage_uv = 15000000L - current_ua / 2;
+            measurement.voltage_timestamp_us += 80000UL;
+        }
+        current_ua = modeTargetMicroamps(LoadMode::ConstantVoltage, 12000000L,
+                                         current_ua, measurement, integrator);
+        if (!new_voltage) {
+            assert(current_ua == previous_ua);
+        }
+        if (update == 49) {
+            slow_after_one_second = current_ua;
+        }
+        peak_ua = current_ua > peak_ua ? current_ua : peak_ua;
+    }
+    assert(current_ua > 5990000L && current_ua < 6010000L);
+    assert(peak_ua < 6010000L);
+    assert(slow_after_one_second > fast_after_one_second * 9 / 10 &&
+           slow_after_one_second < fast_after_one_second * 11 / 10);
+
+    /* The mode dispatch uses the calibrated voltage, and requests nothing
+     * from an invalid reading in the voltage-dependent modes. */
+    measurement = validFixedMeasurement();
+    assert(modeTargetMicroamps(LoadMode::ConstantCurrent, 3000000L, 0,
+                               measurement, integrator) == 3000000L);
+    assert(modeTargetMicroamps(LoadMode::ConstantPower, 120000L, 0,
+                               measurement, integrator) == 5000000L);
+    assert(modeTargetMicroamps(LoadMode::ConstantResistance, 4800L, 0,
+                               measurement, integrator) == 5000000L);
+    measurement.voltage_valid = false;
+    assert(modeTargetMicroamps(LoadMode::ConstantCurrent, 3000000L, 0,
+                               measurement, integrator) == 3000000L);
+    assert(modeTargetMicroamps(LoadMode::ConstantPower, 120000L, 0,
+                               measurement, integrator) == 0);
+    assert(modeTargetMicroamps(LoadMode::ConstantVoltage, 1000L, 4000000L,
+                               measurement, integrator) == 0);
+}
+
 int main()
 {
     conversionTests();
@@ -220,5 +826,11 @@ int main()
     cutoffTests();
     stateAndTimingTests();
     targetLimitTests();
+    fixedConversionTests();
+    fixedControlTests();
+    carriedSlewTests();
+    fixedSafetyTests();
+    sampleHistoryTests();
+    regulationModeTests();
     return 0;
 }
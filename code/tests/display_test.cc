@@ -0,0 +1,153 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "../display.h"
+
+// An HD44780 that counts the bytes it is sent.
+class FakeLcd
+{
+public:
+    char screen[2][17];
+    uint8_t col;
+    uint8_t row;
+    bool cursor_visible;
+    uint16_t bytes;
+
+    FakeLcd() :
+        col(0),
+        row(0),
+        cursor_visible(false),
+        bytes(0)
+    {
+        for (uint8_t line = 0; line < 2; line++) {
+            memset(screen[line], ' ', 16);
+            screen[line][16] = '\0';
+        }
+    }
+
+    void setCursor(uint8_t new_col, uint8_t new_row)
+    {
+        bytes++;
+        col = new_col;
+        row = new_row;
+    }
+
+    void cursor()
+    {
+        bytes++;
+        cursor_visible = true;
+    }
+
+    void noCursor()
+    {
+        bytes++;
+        cursor_visible = false;
+    }
+
+    size_t write(uint8_t value)
+    {
+        bytes++;
+        if (col < 16) {
+            screen[row][col] = (char)value;
+        }
+        col++;
+        return 1;
+    }
+};
+
+typedef DisplayFrame<16, 2> Frame;
+
+// Steps until the frame is shown; the number of steps taken.
+static uint16_t flush(Frame& frame, FakeLcd& lcd)
+{
+    uint16_t steps = 0;
+    while (frame.step(lcd)) {
+        steps++;
+        assert(steps < 100);
+    }
+    assert(frame.idle());
+    return steps;
+}
+
+static void sendTests()
+{
+    /* Every step is one LCD byte, and the LCD ends up showing the frame
+     * with the cursor where it was placed. */
+    Frame frame;
+    FakeLcd lcd;
+    assert(frame.idle());
+    assert(!frame.step(lcd));
+
+    frame.noCursor();
+    frame.setCursor(0, 0);
+    frame.print("01.000A 03.000V ");
+    frame.setCursor(0, 1);
+    frame.print("00.999A");
+    frame.print(42L);
+    frame.setCursor(4, 0);
+    frame.cursor();
+    assert(frame.at(7, 1) == '4');
+    assert(!frame.idle());
+
+    const uint16_t steps = flush(frame, lcd);
+    assert(steps == lcd.bytes);
+    assert(strcmp(lcd.screen[0], "01.000A 03.000V ") == 0);
+    assert(strcmp(lcd.screen[1], "00.999A42       ") == 0);
+    assert(lcd.cursor_visible);
+    assert(lcd.col == 4 && lcd.row == 0);
+
+    /* Blanks already shown are skipped, so a row costs a move to the
+     * first change, the characters after it and the cursor. */
+    assert(steps < 16 + 9 + 6);
+}
+
+static void changeTests()
+{
+    /* A second render that changes one character sends only that one,
+     * with the cursor hidden around it. */
+    Frame frame;
+    FakeLcd lcd;
+    frame.setCursor(0, 0);
+    frame.print("12.345V");
+    frame.setCursor(2, 0);
+    frame.cursor();
+    flush(frame, lcd);
+
+    lcd.bytes = 0;
+    frame.noCursor();
+    frame.setCursor(0, 0);
+    frame.print("12.346V");
+    frame.setCursor(2, 0);
+    frame.cursor();
+    assert(flush(frame, lcd) == 5);
+    assert(lcd.bytes == 5);
+    assert(strncmp(lcd.screen[0], "12.346V", 7) == 0);
+    assert(lcd.cursor_visible);
+
+    /* An unchanged render sends nothing. */
+    lcd.bytes = 0;
+    frame.noCursor();
+    frame.setCursor(0, 0);
+    frame.print("12.346V");
+    frame.setCursor(2, 0);
+    frame.cursor();
+    assert(flush(frame, lcd) == 0);
+
+    /* Text past the end of a row is dropped, and hiding the cursor is one
+     * byte. */
+    frame.noCursor();
+    frame.setCursor(12, 1);
+    frame.print("ABCDEFG");
+    flush(frame, lcd);
+    assert(strcmp(lcd.screen[1], "            ABCD") == 0);
+    assert(!lcd.cursor_visible);
+}
+
+int main()
+{
+    sendTests();
+    changeTests();
+    return 0;
+}
@@ -0,0 +1,456 @@
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+
+#include "../main.cc"
+#include "sim/firmware_sim.h"
+
+using sim::bench;
+
+static const uint64_t kSecondUs = 1000000ULL;
+
+static bool isRunning()
+{
+    return g_cb.controller.state == control::OperationState::Running;
+}
+
+static bool isFinished()
+{
+    return g_cb.controller.state != control::OperationState::Running;
+}
+
+static bool isIdle()
+{
+    return g_cb.controller.state == control::OperationState::Idle;
+}
+
+static bool isFault()
+{
+    return g_cb.controller.state == control::OperationState::Fault;
+}
+
+// The start gesture: the encoder switch held for more than 3 s.
+static void holdToStart()
+{
+    bench.press(ENCODER_SW_PIN);
+    sim::RunFor(3300 * 1000ULL);
+    bench.release(ENCODER_SW_PIN);
+    sim::RunFor(200 * 1000ULL);
+}
+
+static void click()
+{
+    bench.press(ENCODER_SW_PIN);
+    sim::RunFor(100 * 1000ULL);
+    bench.release(ENCODER_SW_PIN);
+    sim::RunFor(200 * 1000ULL);
+}
+
+static bool rowHasText(uint8_t row)
+{
+    for (uint8_t col = 0; col < LCD_IIC_COLS; col++) {
+        const char c = lcd.screen[row][col];
+        if (c != ' ' && c != '\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void bootTests()
+{
+    /* A cold start with set points in EEPROM and no stored calibration
+     * runs the internal calibrations and settles Idle on the full cell. */
+    sim::PlantConfig cell = sim::DefaultPlantConfig();
+    cell.capacity_ah = 1.3;
+    bench.plant = sim::Plant(cell);
+    sim::StoreSetPoints(control::LoadMode::ConstantCurrent, 1000, 3000);
+    sim::Boot();
+    sim::RunFor(2 * kSecondUs);
+
+    assert(g_cb.adc_initialized);
+    assert(g_cb.controller.state == control::OperationState::Idle);
+    assert(current_set_point.get_value() == 1000);
+    assert(voltage_set_point.get_value() == 3000);
+    assert(g_cb.measurement.voltage_valid);
+    assert(labs(g_cb.measurement.voltage_uv - 4200000L) < 2000);
+    assert(labs(g_cb.measurement.current_ua) < 1000);
+    assert(bench.dac_code == 0);
+    assert(rowHasText(0));
+    assert(bench.converter.conversions() > 20);
+    assert(bench.timer_interrupts > 1900);
+}
+
+static void dischargeTests()
+{
+    /* 1 A from a 1.3 Ah cell down to the 3.0 V cut-off takes about 77
+     * minutes, which carries micros() through its 71 minute wrap. */
+    scheduler.resetStats();
+    const double start_as = bench.plant.chargeAmpSeconds();
+    const double start_j = bench.plant.energyJoules();
+    const uint64_t start_us = bench.now_us;
+    holdToStart();
+    assert(isRunning());
+
+    sim::RunFor(10 * kSecondUs);
+    assert(fabs(bench.plant.currentAmps() - 1.0) < 0.005);
+    assert(labs(g_cb.measurement.current_ua - 1000000L) < 2000);
+
+    assert(sim::RunUntil(isFinished, 7200 * kSecondUs));
+    assert(g_cb.controller.state == control::OperationState::Completed);
+    assert(bench.now_us > 0x100000000ULL);
+    const double hours = (bench.now_us - start_us) / 3600e6;
+    assert(hours > 1.2 && hours < 1.3);
+    assert(bench.plant.terminalVolts() < 3.1);
+
+    /* The counters agree with the charge and energy that left the cell. */
+    const double plant_mah =
+        (bench.plant.chargeAmpSeconds() - start_as) / 3.6;
+    const double plant_wh = (bench.plant.energyJoules() - start_j) / 3600.0;
+    const double mah = g_cb.energy.microampHours() / 1000.0;
+    const double wh = g_cb.energy.microwattHours() / 1e6;
+    assert(fabs(mah - plant_mah) < plant_mah * 0.005);
+    assert(fabs(wh - plant_wh) < plant_wh * 0.005);
+
+    /* Every pass fit its budget, and a display call is one LCD byte, about
+     * 1.1 ms of I2C, so no task starts more than that late.  A safety
+     * release only misses when such a byte starts just after it, a handful
+     * of times an hour; control releases never miss. */
+    const TaskStats& safety = scheduler.stats(0);
+    const TaskStats& regulation = scheduler.stats(1);
+    const TaskStats& display_stats = scheduler.stats(
+        sizeof(TASKS) / sizeof(TASKS[0]) - 1);
+    assert(safety.budget_overruns == 0);
+    assert(regulation.budget_overruns == 0);
+    assert(regulation.runs > 180000);
+    assert(display_stats.max_run_us < 1200);
+    assert(regulation.deadline_misses == 0);
+    assert(regulation.max_lateness_us < 1200);
+    assert(safety.max_lateness_us < 1200);
+    assert(safety.deadline_misses * 100000 <
+           safety.runs + safety.deadline_misses);
+    assert(bench.spi_mode_errors == 0);
+
+    click();
+    assert(g_cb.controller.state == control::OperationState::Idle);
+}
+
+static void stopLatencyTests()
+{
+    /* A press on the encoder switch zeroes the DAC from INT0 at once,
+     * wherever the main loop is; polled, it waited for the next safety pass
+     * behind whatever display traffic was going out.  The main loop makes
+     * the state change in its next pass. */
+    bench.plant.setStateOfCharge(0.8);
+    sim::RunFor(2 * kSecondUs);
+    holdToStart();
+    assert(isRunning());
+    sim::RunFor(2 * kSecondUs);
+    assert(bench.dac_code != 0);
+    bench.watchDacFrom(bench.now_us);
+    bench.press(ENCODER_SW_PIN);
+    assert(bench.dac_code == 0);
+    assert(bench.dac_zero_us - bench.last_press_us < 20);
+    assert(sim::RunUntil(isIdle, 10 * 1000ULL));
+    bench.release(ENCODER_SW_PIN);
+    sim::RunFor(200 * 1000ULL);
+
+    /* Pressed in the middle of an AD7190 transfer, the write follows the
+     * end of that transfer rather than the next interrupt, the two devices
+     * are never selected together and the conversions carry on. */
+    holdToStart();
+    assert(isRunning());
+    sim::RunFor(2 * kSecondUs);
+    const uint32_t conversions = bench.converter.conversions();
+    const uint32_t presses = bench.external_interrupts;
+    bench.watchDacFrom(bench.now_us);
+    bench.pressInAdcTransfer(ENCODER_SW_PIN);
+    assert(sim::RunUntil(isIdle, 100 * 1000ULL));
+    assert(bench.external_interrupts == presses + 1);
+    assert(bench.dac_zero_us != 0);
+    assert(bench.dac_zero_us - bench.last_press_us < 50);
+    assert(bench.dac_code == 0);
+    bench.release(ENCODER_SW_PIN);
+    sim::RunFor(kSecondUs);
+    assert(isIdle());
+    assert(bench.converter.conversions() > conversions + 10);
+    assert(bench.bus_conflicts == 0);
+    assert(bench.spi_mode_errors == 0);
+}
+
+// `count` 15 ms taps, 97 ms apart, so they land anywhere in the control
+// and display periods.
+static void tapButton(int pin, uint8_t count)
+{
+    for (uint8_t index = 0; index < count; index++) {
+        bench.tap(pin, bench.now_us + 1000, 15000);
+        sim::RunFor(97 * 1000ULL);
+    }
+}
+
+// `detents` whole quadrature cycles on the encoder pins, 2 ms per quarter
+// step; positive goes B, A and B, A, neither.
+static void turnEncoder(int detents)
+{
+    const int first = detents > 0 ? ENCODER_PIN_2 : ENCODER_PIN_1;
+    const int second = detents > 0 ? ENCODER_PIN_1 : ENCODER_PIN_2;
+    for (int index = detents > 0 ? detents : -detents; index > 0; index--) {
+        bench.press(first);
+        sim::RunFor(2000);
+        bench.press(second);
+        sim::RunFor(2000);
+        bench.release(first);
+        sim::RunFor(2000);
+        bench.release(second);
+        sim::RunFor(2000);
+    }
+}
+
+static void inputTests()
+{
+    /* Taps shorter than the 20 ms control period each count once, wherever
+     * they land in the display refresh. */
+    const int page = g_cb.page;
+    tapButton(BUTTON_4_PIN, 3);
+    sim::RunFor(100 * 1000ULL);
+    assert(g_cb.page == (page + 3) % MAX_PAGE);
+    tapButton(BUTTON_1_PIN, 3);
+    sim::RunFor(100 * 1000ULL);
+    assert(g_cb.page == page);
+
+    /* Contact bounce on press and release is one press, and a glitch
+     * shorter than the debounce is none. */
+    bench.press(BUTTON_4_PIN);
+    bench.advance(300);
+    bench.release(BUTTON_4_PIN);
+    bench.advance(300);
+    bench.press(BUTTON_4_PIN);
+    sim::RunFor(50 * 1000ULL);
+    bench.release(BUTTON_4_PIN);
+    bench.advance(300);
+    bench.press(BUTTON_4_PIN);
+    bench.advance(300);
+    bench.release(BUTTON_4_PIN);
+    sim::RunFor(100 * 1000ULL);
+    assert(g_cb.page == (page + 1) % MAX_PAGE);
+    bench.tap(BUTTON_4_PIN, bench.now_us + 1000, 5000);
+    sim::RunFor(100 * 1000ULL);
+    assert(g_cb.page == (page + 1) % MAX_PAGE);
+    tapButton(BUTTON_1_PIN, 1);
+    sim::RunFor(100 * 1000ULL);
+    assert(g_cb.page == page);
+
+    /* Held for 1.1 s: the press, then repeats at 600, 800 and 1000 ms. */
+    bench.tap(BUTTON_4_PIN, bench.now_us + 1000, 1100 * 1000ULL);
+    sim::RunFor(1300 * 1000ULL);
+    assert(g_cb.page == (page + 4) % MAX_PAGE);
+    tapButton(BUTTON_1_PIN, 4);
+    sim::RunFor(100 * 1000ULL);
+    assert(g_cb.page == page);
+
+    /* Encoder detents are decoded and queued from the timer interrupt. */
+    const int32_t set_point = current_set_point.get_value();
+    turnEncoder(2);
+    sim::RunFor(100 * 1000ULL);
+    assert(current_set_point.get_value() != set_point);
+    turnEncoder(-2);
+    sim::RunFor(100 * 1000ULL);
+    assert(current_set_point.get_value() == set_point);
+    assert(input_queue.dropped() == 0);
+}
+
+// A single AD7190 conversion at filter word 48: four 10 ms output periods.
+static const uint64_t kConversionUs = 40000ULL;
+
+static bool isCalibrating()
+{
+    return adc.isCalibrating();
+}
+
+// Shorts the MOSFET now; the time until the DAC is at 0.
+static uint64_t shortLatencyUs()
+{
+    const uint64_t shorted_us = bench.now_us;
+    bench.watchDacFrom(shorted_us);
+    bench.plant.shortMosfet(true);
+    assert(sim::RunUntil(isFault, kSecondUs));
+    assert(g_cb.controller.fault == control::FaultReason::Overcurrent);
+    assert(bench.dac_zero_us != 0);
+    assert(bench.dac_code == 0);
+    const uint64_t latency_us = bench.dac_zero_us - shorted_us;
+
+    bench.plant.shortMosfet(false);
+    sim::RunFor(200 * 1000ULL);
+    click();
+    assert(isIdle());
+    return latency_us;
+}
+
+static void faultLatencyTests()
+{
+    /* A shorted MOSFET pulls the source's short-circuit current.  The
+     * first current conversion to finish after it clips at the gain
+     * ranged for the commanded current, and the ready interrupt trips on
+     * that clipped word; nothing waits for a repeat at gain 1.  At worst
+     * the short lands at the start of a voltage conversion, or of a
+     * background calibration that takes a current conversion's place, so
+     * the trip follows that one and a single current conversion, wherever
+     * the short falls in the display refresh and the control period.  The
+     * shorts are 7.3 ms apart across a refresh. */
+    bench.plant.setStateOfCharge(0.8);
+    sim::RunFor(2 * kSecondUs);
+    uint64_t worst_us = 0;
+    for (uint8_t trial = 0; trial < 28; trial++) {
+        holdToStart();
+        assert(isRunning());
+        sim::RunFor(2 * kSecondUs + trial * 7300ULL);
+        const uint64_t latency_us = shortLatencyUs();
+        assert(latency_us < 2 * kConversionUs + 2000);
+        if (latency_us > worst_us) {
+            worst_us = latency_us;
+        }
+    }
+    // The sweep found the worst phase, not only a lucky one.
+    assert(worst_us > 3 * kConversionUs / 2);
+
+    /* The same bound holds for a short during a zero calibration. */
+    for (uint8_t trial = 0; trial < 3; trial++) {
+        holdToStart();
+        assert(isRunning());
+        assert(sim::RunUntil(isCalibrating,
+                             (ADC_ZERO_CALIBRATION_INTERVAL_MS + 1000) *
+                                 1000ULL));
+        sim::RunFor(trial * 15000ULL);
+        assert(shortLatencyUs() < 2 * kConversionUs + 2000);
+    }
+}
+
+static bool isRecalibrated()
+{
+    return g_cb.recalibration_steps == 0;
+}
+
+static void driftTests()
+{
+    /* Once the heatsink has moved away from the calibration point, the
+     * Idle load recalibrates zero and full scale of both channels one
+     * calibration at a time between measurements, so no task waits for
+     * the converter, and stores the result for the next boot. */
+    sim::RunFor(kSecondUs);
+    assert(isIdle());
+    scheduler.resetStats();
+    const uint32_t full_calibrations =
+        bench.converter.fullScaleCalibrations();
+    const int32_t temperature_mc = g_cb.measurement.temperature_mc;
+    g_cb.adc_calibrated_mc = temperature_mc - 10000L;
+    sim::RunFor(100 * 1000ULL);
+    assert(g_cb.recalibration_steps != 0);
+    assert(sim::RunUntil(isRecalibrated, kSecondUs));
+    assert(bench.converter.fullScaleCalibrations() ==
+           full_calibrations + MAX_CHANNELS);
+    assert(AdcCalibrationTemperatureClose(g_cb.adc_calibrated_mc,
+                                          temperature_mc));
+    AdcCalibrationRecord record;
+    assert(LoadAdcCalibration(EEPROM_ADC_CALIBRATION_ADDR, record));
+    assert(record.temperature_mc == g_cb.adc_calibrated_mc);
+    sim::RunFor(200 * 1000ULL);
+    assert(isIdle());
+    assert(g_cb.measurement.voltage_valid);
+    assert(labs(g_cb.measurement.voltage_uv -
+                (int32_t)(bench.plant.terminalVolts() * 1e6)) < 2000);
+
+    const TaskStats& safety = scheduler.stats(0);
+    const TaskStats& regulation = scheduler.stats(1);
+    assert(safety.max_lateness_us < 1200);
+    assert(regulation.max_lateness_us < 1200);
+    assert(safety.budget_overruns == 0);
+    assert(regulation.budget_overruns == 0);
+}
+
+static void adcRetryTests()
+{
+    /* An ADC failure acknowledged with a click, with no stored calibration
+     * to restore: the converter comes back on its power-on coefficients
+     * at once and calibrates step by step while Idle, so the click holds
+     * up no task, and the start gesture waits for the calibration. */
+    EEPROM.bytes[EEPROM_ADC_CALIBRATION_ADDR] ^= 0xFF;
+    g_cb.adc_initialized = false;
+    LatchFault(control::FaultReason::AdcFailure, millis());
+    sim::RunFor(100 * 1000ULL);
+    assert(isFault());
+    scheduler.resetStats();
+    const uint32_t full_calibrations =
+        bench.converter.fullScaleCalibrations();
+    click();
+    assert(isIdle());
+    assert(g_cb.adc_initialized);
+    assert(g_cb.recalibration_steps != 0);
+    assert(sim::RunUntil(isRecalibrated, kSecondUs));
+    assert(bench.converter.fullScaleCalibrations() ==
+           full_calibrations + MAX_CHANNELS);
+    AdcCalibrationRecord record;
+    assert(LoadAdcCalibration(EEPROM_ADC_CALIBRATION_ADDR, record));
+
+    const TaskStats& safety = scheduler.stats(0);
+    const TaskStats& regulation = scheduler.stats(1);
+    assert(safety.max_lateness_us < 1200);
+    assert(regulation.max_lateness_us < 1200);
+    assert(safety.budget_overruns == 0);
+    assert(regulation.budget_overruns == 0);
+
+    holdToStart();
+    assert(isRunning());
+    click();
+    assert(isIdle());
+}
+
+static bool consoleAnswers(const char* command, const char* answer)
+{
+    Serial.line[0] = '\0';
+    Serial.send(command);
+    sim::RunFor(20 * 1000ULL);
+    return strcmp(Serial.line, answer) == 0;
+}
+
+static void calibrationConsoleTests()
+{
+    // A trim sent over the serial console applies at once and is saved,
+    // while Idle, where the next boot loads it.
+    assert(isIdle());
+    assert(consoleAnswers("gain 16 -512 16801234\n", "ok"));
+    assert(adc.getCalibData(AD7190_CONF_GAIN_16).offset_uv == -512);
+    assert(adc.getCalibData(AD7190_CONF_GAIN_16).scale_q24 == 16801234L);
+    assert(consoleAnswers("gain 12 0 16777216\n", "err"));
+    assert(consoleAnswers("gain 1 0 0\n", "err"));
+    assert(consoleAnswers(
+        "gain 1 0 16777216 and then a good deal more than fits\r\n", "err"));
+    assert(consoleAnswers("save\n", "ok"));
+
+    const GainCalibData saved = adc.getCalibData(AD7190_CONF_GAIN_16);
+    adc.setCalibData(AD7190_CONF_GAIN_16, 1.0, 0.0);
+    assert(LoadCalibration(EEPROM_CALIBRATION_ADDR, adc));
+    assert(adc.getCalibData(AD7190_CONF_GAIN_16).offset_uv ==
+           saved.offset_uv);
+    assert(adc.getCalibData(AD7190_CONF_GAIN_16).scale_q24 ==
+           saved.scale_q24);
+
+    // The EEPROM writes would stall the load, so not while it runs.
+    holdToStart();
+    assert(isRunning());
+    assert(consoleAnswers("save\n", "err"));
+    click();
+    assert(isIdle());
+}
+
+int main()
+{
+    bootTests();
+    dischargeTests();
+    stopLatencyTests();
+    inputTests();
+    faultLatencyTests();
+    driftTests();
+    adcRetryTests();
+    calibrationConsoleTests();
+    return 0;
+}
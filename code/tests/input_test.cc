@@ -0,0 +1,126 @@
+#include <assert.h>
+#include <stdint.h>
+
+#include "../input.h"
+
+static void orderTests()
+{
+    /* Events come out in the order they went in, with their values and
+     * timestamps, across the index wrap. */
+    InputQueue queue;
+    InputEvent event;
+    assert(!queue.pop(event));
+    for (uint16_t round = 0; round < 3 * INPUT_QUEUE_SIZE; round++) {
+        assert(queue.push(INPUT_BUTTON_PRESS, (int8_t)(round & 3), round));
+        assert(queue.push(INPUT_ENCODER_TURN, -5, (uint16_t)(round + 1)));
+        assert(queue.pop(event));
+        assert(event.type == INPUT_BUTTON_PRESS);
+        assert(event.value == (int8_t)(round & 3));
+        assert(event.timestamp_ms == round);
+        assert(queue.pop(event));
+        assert(event.type == INPUT_ENCODER_TURN);
+        assert(event.value == -5);
+        assert(event.timestamp_ms == round + 1);
+        assert(!queue.pop(event));
+    }
+    assert(queue.dropped() == 0);
+}
+
+static void fullTests()
+{
+    /* One slot tells full from empty.  A full queue keeps what it has and
+     * counts what it drops. */
+    InputQueue queue;
+    for (uint8_t index = 0; index < INPUT_QUEUE_SIZE - 1; index++) {
+        assert(!queue.full());
+        assert(queue.push(INPUT_BUTTON_PRESS, (int8_t)index, index));
+    }
+    assert(queue.full());
+    assert(!queue.push(INPUT_BUTTON_RELEASE, 9, 99));
+    assert(!queue.push(INPUT_BUTTON_RELEASE, 9, 99));
+    assert(queue.dropped() == 2);
+
+    InputEvent event;
+    for (uint8_t index = 0; index < INPUT_QUEUE_SIZE - 1; index++) {
+        assert(queue.pop(event));
+        assert(event.type == INPUT_BUTTON_PRESS && event.value == index);
+    }
+    assert(!queue.pop(event));
+    assert(!queue.full());
+
+    // The count saturates.
+    for (uint16_t index = 0; index < 300; index++) {
+        queue.push(INPUT_ENCODER_TURN, 1, 0);
+    }
+    assert(queue.dropped() == 0xFF);
+}
+
+// Quarter steps of a positive turn: neither, B, A and B, A.
+static const bool kTurnA[4] = {false, false, true, true};
+static const bool kTurnB[4] = {false, true, true, false};
+
+/* `quarters` quarter steps from `phase`, each held for `ticks` samples;
+ * the detents reported on the way. */
+static int16_t turn(RotaryDecoder& decoder, uint8_t& phase, int8_t quarters,
+                    uint16_t ticks)
+{
+    int16_t detents = 0;
+    while (quarters != 0) {
+        phase = (uint8_t)((phase + (quarters > 0 ? 1 : 3)) & 3);
+        quarters = (int8_t)(quarters > 0 ? quarters - 1 : quarters + 1);
+        for (uint16_t tick = 0; tick < ticks; tick++) {
+            detents += decoder.sample(kTurnA[phase], kTurnB[phase]);
+        }
+    }
+    return detents;
+}
+
+static void rotaryTests()
+{
+    /* A detent is four quarter steps; the ones towards the next detent are
+     * kept, and turning back undoes them. */
+    RotaryDecoder decoder(4);
+    uint8_t phase = 0;
+    decoder.reset(false, false);
+    assert(decoder.sample(false, false) == 0);
+    assert(turn(decoder, phase, 3, 200) == 0);
+    assert(turn(decoder, phase, 1, 200) == 1);
+    assert(turn(decoder, phase, 8, 200) == 2);
+    assert(turn(decoder, phase, -8, 200) == -2);
+    assert(turn(decoder, phase, 2, 200) == 0);
+    assert(turn(decoder, phase, -2, 200) == 0);
+
+    /* A bounce between two positions counts nothing. */
+    for (uint8_t bounce = 0; bounce < 10; bounce++) {
+        assert(turn(decoder, phase, 1, 1) + turn(decoder, phase, -1, 1) ==
+               0);
+    }
+
+    /* A fast turn accelerates, up to 1 + 3072 / 256 per detent, and the
+     * acceleration decays once the knob rests. */
+    int16_t fast = 0;
+    for (uint8_t detent = 0; detent < 40; detent++) {
+        fast = turn(decoder, phase, 4, 1);
+        assert(fast >= 1 && fast <= 13);
+    }
+    assert(fast >= 12);
+    for (uint16_t tick = 0; tick < 2000; tick++) {
+        assert(decoder.sample(kTurnA[phase], kTurnB[phase]) == 0);
+    }
+    assert(turn(decoder, phase, 4, 200) == 1);
+
+    /* With one step per detent every quarter step counts. */
+    RotaryDecoder fine(1);
+    phase = 0;
+    fine.reset(false, false);
+    assert(turn(fine, phase, 3, 200) == 3);
+    assert(turn(fine, phase, -3, 200) == -3);
+}
+
+int main()
+{
+    orderTests();
+    fullTests();
+    rotaryTests();
+    return 0;
+}
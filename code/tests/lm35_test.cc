@@ -57,6 +57,8 @@ static void normalReadingTests()
     sensor.update();
     assert(sensor.isValid());
     assertNear(sensor.getTemperature(), 100.0 * 5000.0 / 1024.0 / 10.0);
+    // 48.828125 C
+    assert(sensor.getTemperatureMilliCelsius() == 48828);
 }
 
 static void initializationRailTests()
@@ -120,6 +122,16 @@ static void rollingAverageTests()
     assertNear(sensor.getTemperature(),
                (double)expected_sum * 5000.0 / 1024.0 / 10.0 /
                LM35_SAMPLES);
+    assert(std::fabs(sensor.getTemperatureMilliCelsius() -
+                     sensor.getTemperature() * 1000.0) <= 1.0);
+
+    // Full-scale input must not overflow the integer path.
+    for (int i = 0; i < LM35_SAMPLES; ++i) {
+        analog_value = LM35_ADC_RAIL_HIGH - 1;
+        sensor.update();
+    }
+    assert(std::fabs(sensor.getTemperatureMilliCelsius() -
+                     sensor.getTemperature() * 1000.0) <= 1.0);
     assert(sensor.isValid());
 }
 
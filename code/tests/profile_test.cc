@@ -0,0 +1,108 @@
+#include <assert.h>
+#include <stdint.h>
+
+#define LOAD_PROFILE
+#include "Arduino.h"
+#include "../profile.h"
+
+static uint32_t clock_us;
+
+uint32_t micros()
+{
+    return clock_us;
+}
+
+static void bucketTests()
+{
+    assert(ProfileBucket(0) == 0);
+    assert(ProfileBucket(1) == 0);
+    assert(ProfileBucket(2) == 1);
+    assert(ProfileBucket(7) == 1);
+    assert(ProfileBucket(8) == 2);
+    assert(ProfileBucket(31) == 2);
+    assert(ProfileBucket(32) == 3);
+    assert(ProfileBucket(8191) == 6);
+    assert(ProfileBucket(8192) == 7);
+    assert(ProfileBucket(UINT32_MAX) == PROFILE_BUCKETS - 1);
+
+    /* Every bucket starts at its floor. */
+    for (uint8_t bucket = 1; bucket < PROFILE_BUCKETS; bucket++) {
+        assert(ProfileBucket(ProfileBucketFloor(bucket)) == bucket);
+        assert(ProfileBucket(ProfileBucketFloor(bucket) - 1) == bucket - 1);
+    }
+
+    assert(ProfileHistogramDigit(0, 10) == '.');
+    assert(ProfileHistogramDigit(1, 100) == '1');
+    assert(ProfileHistogramDigit(50, 100) == '5');
+    assert(ProfileHistogramDigit(100, 100) == '9');
+}
+
+static void statisticsTests()
+{
+    PhaseProfiler profiler;
+    assert(profiler.minimum(PHASE_CONTROL) == 0);
+    assert(profiler.mean(PHASE_CONTROL) == 0);
+    assert(profiler.peakBucket(PHASE_CONTROL) == 0);
+
+    profiler.record(PHASE_CONTROL, 100);
+    profiler.record(PHASE_CONTROL, 300);
+    profiler.record(PHASE_CONTROL, 20);
+    const PhaseStats& stats = profiler.stats(PHASE_CONTROL);
+    assert(stats.count == 3);
+    assert(profiler.minimum(PHASE_CONTROL) == 20);
+    assert(stats.max_us == 300);
+    assert(profiler.mean(PHASE_CONTROL) == 140);
+    assert(stats.histogram[ProfileBucket(100)] == 1);
+    assert(stats.histogram[ProfileBucket(300)] == 1);
+    assert(stats.histogram[ProfileBucket(20)] == 1);
+    /* Phases are independent. */
+    assert(profiler.stats(PHASE_DISPLAY).count == 0);
+
+    profiler.reset();
+    assert(profiler.stats(PHASE_CONTROL).count == 0);
+    assert(profiler.stats(PHASE_CONTROL).max_us == 0);
+}
+
+static void saturationTests()
+{
+    PhaseProfiler profiler;
+
+    /* A full bucket halves the histogram instead of wrapping. */
+    profiler.record(PHASE_DISPLAY, 10000);
+    for (uint32_t count = 0; count < 70000; count++) {
+        profiler.record(PHASE_DISPLAY, 10);
+    }
+    const PhaseStats& stats = profiler.stats(PHASE_DISPLAY);
+    assert(stats.histogram[ProfileBucket(10)] > 32768);
+    assert(stats.histogram[ProfileBucket(10000)] == 0);
+    assert(stats.count == 70001);
+
+    /* So does a total that would overflow, keeping the mean. */
+    for (uint8_t count = 0; count < 10; count++) {
+        profiler.record(PHASE_I2C_STALL, 1000000000UL);
+    }
+    assert(profiler.mean(PHASE_I2C_STALL) == 1000000000UL);
+    assert(profiler.stats(PHASE_I2C_STALL).count < 10);
+}
+
+static void timerTests()
+{
+    PhaseProfiler profiler;
+    clock_us = UINT32_MAX - 10;
+    {
+        PhaseTimer timer(profiler, PHASE_ACQUISITION);
+        clock_us += 250;
+    }
+    /* The scope is timed across the micros() wrap. */
+    assert(profiler.stats(PHASE_ACQUISITION).count == 1);
+    assert(profiler.stats(PHASE_ACQUISITION).max_us == 250);
+}
+
+int main()
+{
+    bucketTests();
+    statisticsTests();
+    saturationTests();
+    timerTests();
+    return 0;
+}
@@ -0,0 +1,180 @@
+#include <assert.h>
+#include <stdint.h>
+
+#include "../scheduler.h"
+
+static uint32_t clock_us;
+static char trace[64];
+static uint8_t trace_length;
+// Simulated run time of each task.
+static uint32_t cost_us[3];
+
+static uint32_t hostClock()
+{
+    return clock_us;
+}
+
+static void record(char name, uint32_t cost)
+{
+    if (trace_length < sizeof(trace) - 1) {
+        trace[trace_length++] = name;
+        trace[trace_length] = '\0';
+    }
+    clock_us += cost;
+}
+
+static void safetyTask()
+{
+    record('S', cost_us[0]);
+}
+
+static void controlTask()
+{
+    record('C', cost_us[1]);
+}
+
+static void displayTask()
+{
+    record('D', cost_us[2]);
+}
+
+static bool traceIs(const char* expected)
+{
+    uint8_t index = 0;
+    for (; expected[index] != '\0'; index++) {
+        if (trace[index] != expected[index]) {
+            return false;
+        }
+    }
+    return trace[index] == '\0';
+}
+
+static void resetTrace()
+{
+    trace_length = 0;
+    trace[0] = '\0';
+}
+
+static const Task kTasks[] = {
+    {displayTask, 0, 0, 3},
+    {controlTask, 4000, 1000, 1},
+    {safetyTask, 1000, 200, 0},
+};
+
+// Runs the scheduler until the clock reaches `end_us`, idling 100 us at a
+// time when nothing is due.
+static void runUntil(TaskScheduler<3>& scheduler, uint32_t end_us,
+                     bool background = true)
+{
+    while (static_cast<int32_t>(clock_us - end_us) < 0) {
+        const int8_t index = scheduler.runOnce();
+        if (index < 0 || (!background && index == 0)) {
+            clock_us += 100;
+        }
+    }
+}
+
+static void priorityTests()
+{
+    clock_us = 0;
+    cost_us[0] = 100;
+    cost_us[1] = 500;
+    cost_us[2] = 0;
+    resetTrace();
+    TaskScheduler<3> scheduler(kTasks, hostClock);
+
+    /* Both periodic tasks are due at start: safety first, then control,
+     * and the background task only once nothing is due. */
+    assert(scheduler.runOnce() == 2);
+    assert(scheduler.runOnce() == 1);
+    assert(scheduler.runOnce() == 0);
+    assert(traceIs("SCD"));
+
+    /* A due task always wins over the background task. */
+    clock_us = 1000;
+    resetTrace();
+    assert(scheduler.runOnce() == 2);
+    assert(scheduler.runOnce() == 0);
+    assert(traceIs("SD"));
+
+    /* Safety is released again first, at 2 ms. */
+    assert(scheduler.nextRelease() == 2000);
+}
+
+static void rateTests()
+{
+    clock_us = 0;
+    cost_us[0] = 100;
+    cost_us[1] = 500;
+    cost_us[2] = 50;
+    TaskScheduler<3> scheduler(kTasks, hostClock);
+
+    /* Over 100 ms the tasks run exactly at their rates, without misses. */
+    runUntil(scheduler, 100000);
+    assert(scheduler.stats(2).runs == 100);
+    assert(scheduler.stats(1).runs == 25);
+    assert(scheduler.stats(2).deadline_misses == 0);
+    assert(scheduler.stats(1).deadline_misses == 0);
+    assert(scheduler.stats(1).budget_overruns == 0);
+    assert(scheduler.stats(1).max_run_us == 500);
+    /* Control only ever waits behind one safety run. */
+    assert(scheduler.stats(1).max_lateness_us <= 100);
+    assert(scheduler.stats(0).runs > 0);
+}
+
+static void overrunTests()
+{
+    clock_us = 0;
+    cost_us[0] = 100;
+    cost_us[1] = 500;
+    cost_us[2] = 0;
+    TaskScheduler<3> scheduler(kTasks, hostClock);
+    runUntil(scheduler, 8000, false);
+    scheduler.resetStats();
+
+    /* A control pass that takes 1.5 ms blows its budget and delays the
+     * safety task, which is counted as lateness, not as a miss. */
+    cost_us[1] = 1500;
+    runUntil(scheduler, 12050, false);
+    assert(scheduler.stats(1).budget_overruns == 1);
+    assert(scheduler.stats(1).deadline_misses == 0);
+    assert(scheduler.stats(2).deadline_misses == 0);
+    assert(scheduler.stats(2).max_lateness_us == 600);
+    cost_us[1] = 500;
+
+    /* A 9 ms pass misses its own deadline and skips the releases it slept
+     * through instead of running them back to back. */
+    cost_us[1] = 9000;
+    const uint32_t safety_runs = scheduler.stats(2).runs;
+    runUntil(scheduler, 16050, false);
+    cost_us[1] = 500;
+    runUntil(scheduler, 30000, false);
+    assert(scheduler.stats(1).deadline_misses >= 2);
+    assert(scheduler.stats(2).deadline_misses >= 8);
+    assert(scheduler.stats(1).max_run_us == 9000);
+    /* After the stall safety is back at one run per millisecond. */
+    assert(scheduler.stats(2).runs - safety_runs < 30 - 12);
+}
+
+static void wrapTests()
+{
+    /* The schedule survives the 32-bit microsecond clock wrapping. */
+    clock_us = 0xFFFF0000UL;
+    cost_us[0] = 100;
+    cost_us[1] = 500;
+    cost_us[2] = 0;
+    TaskScheduler<3> scheduler(kTasks, hostClock);
+    runUntil(scheduler, 0x00010000UL, false);
+    assert(scheduler.stats(2).runs == 132 || scheduler.stats(2).runs == 131);
+    assert(scheduler.stats(2).deadline_misses == 0);
+    assert(scheduler.stats(1).deadline_misses == 0);
+}
+
+int main()
+{
+    priorityTests();
+    rateTests();
+    overrunTests();
+    wrapTests();
+    return 0;
+}
@@ -0,0 +1,365 @@
+#ifndef ELECTRONIC_DC_LOAD_SIM_AD7190_MODEL_H
+#define ELECTRONIC_DC_LOAD_SIM_AD7190_MODEL_H
+
+#include <stdint.h>
+
+#include "../../ad7190.h"
+#include "../../control.h"
+#include "plant.h"
+
+namespace sim {
+
+/* Board trims the firmware applies without a stored calibration table
+ * (InitializeAdc()): the modelled front end has exactly these errors, so an
+ * uncalibrated firmware reads the plant without error. */
+struct FrontEndTrim
+{
+    double scale;
+    double offset_uv;
+};
+
+static const FrontEndTrim kGain1Trim = {1.00080, 4000.0};
+static const FrontEndTrim kHighGainTrim = {1.00243, -600.0};
+static const double kVoltageTrimOffsetUv = 6000.0;
+static const double kVoltageTrimScale = 0.9994;
+static const double kReferenceUv = 5000000.0;
+// Internal 4.92 MHz clock; sinc4 settles in four output periods.
+static const double kMasterClockHz = 4.92e6;
+
+/* AD7190 register model behind SPI frames.  Every driver access is one
+ * frame: a communications byte followed by the register bytes.  Single
+ * conversions, continuous sequencing of the enabled channels and the
+ * internal calibrations take the sinc4 settling time of the programmed
+ * filter word and average their input over that window.  An input beyond
+ * the range clamps the code and sets ERR, as on the device. */
+class AD7190Model
+{
+public:
+    enum Job
+    {
+        JOB_NONE,
+        JOB_CONVERT,
+        JOB_CAL_ZERO,
+        JOB_CAL_FULL,
+    };
+
+    // Converter input pins, AIN1 and AIN2 against AINCOM.
+    static const uint8_t kVoltageChannel = AD7190_CH_AIN1P_AINCOM;
+    static const uint8_t kCurrentChannel = AD7190_CH_AIN2P_AINCOM;
+    static const uint32_t kDefaultFullScale = 0x5A0000UL;
+
+    // Offset register codes per degree above 25 C found by a zero-scale
+    // calibration, so background calibrations see drift.
+    double offset_codes_per_c;
+
+private:
+    uint32_t _mode;
+    uint32_t _conf;
+    uint8_t _gpocon;
+    uint32_t _offset[8];
+    uint32_t _full_scale[8];
+    uint32_t _data;
+    uint8_t _status;
+    bool _ready;
+
+    Job _job;
+    uint8_t _channel;
+    uint64_t _started_us;
+    uint64_t _done_us;
+    double _start_charge_as;
+    double _start_voltage_vs;
+    double _start_s;
+    uint32_t _conversions;
+    uint32_t _full_calibrations;
+
+    static uint8_t _gainShift(uint8_t gain_code)
+    {
+        return gain_code >= AD7190_CONF_GAIN_8 ? gain_code : 0;
+    }
+
+    uint8_t _lowestChannel(uint8_t from) const
+    {
+        const uint8_t enabled = (uint8_t)(_conf >> 8);
+        for (uint8_t step = 0; step < 8; step++) {
+            const uint8_t channel = (uint8_t)((from + step) & 7);
+            if ((enabled & (1u << channel)) != 0) {
+                return channel;
+            }
+        }
+        return 0;
+    }
+
+    uint64_t _settlingUs() const
+    {
+        uint32_t words = AD7190_MODE_RATE(_mode);
+        if (words == 0) {
+            words = 1;
+        }
+        return (uint64_t)(4.0 * 1024.0 * words / kMasterClockHz * 1e6);
+    }
+
+    void _begin(Job job, uint8_t channel, uint64_t now_us, const Plant& plant)
+    {
+        _job = job;
+        _channel = channel;
+        _started_us = now_us;
+        _done_us = now_us + _settlingUs();
+        _start_charge_as = plant.chargeAmpSeconds();
+        _start_voltage_vs = plant.voltageVoltSeconds();
+        _start_s = plant.seconds();
+        _ready = false;
+    }
+
+    void _startMode(uint64_t now_us, const Plant& plant)
+    {
+        const uint8_t mode = (uint8_t)((_mode >> 21) & 7);
+        switch (mode) {
+            case AD7190_MODE_CONT:
+            case AD7190_MODE_SINGLE:
+                _begin(JOB_CONVERT, _lowestChannel(0), now_us, plant);
+                break;
+            case AD7190_MODE_CAL_INT_ZERO:
+                _begin(JOB_CAL_ZERO, _lowestChannel(0), now_us, plant);
+                break;
+            case AD7190_MODE_CAL_INT_FULL:
+                _begin(JOB_CAL_FULL, _lowestChannel(0), now_us, plant);
+                break;
+            default:
+                _job = JOB_NONE;
+                break;
+        }
+    }
+
+    void _setMode(uint8_t mode)
+    {
+        _mode = (_mode & ~AD7190_MODE_SEL(7ul)) | AD7190_MODE_SEL(mode);
+    }
+
+    // Converter input in microvolts from the averaged plant quantity.
+    double _inputUv(uint8_t channel, double amps, double volts,
+                    uint8_t gain_code) const
+    {
+        const FrontEndTrim& trim = gain_code >= AD7190_CONF_GAIN_8 ?
+            kHighGainTrim : kGain1Trim;
+        double calibrated_uv = 0.0;
+        if (channel == kCurrentChannel) {
+            calibrated_uv = amps * 1e6 /
+                control::kSenseMicroampsPerMicrovolt;
+        } else if (channel == kVoltageChannel) {
+            const double ratio =
+                control::kInputDividerRatioQ24 / 16777216.0;
+            calibrated_uv = (volts * 1e6 / kVoltageTrimScale -
+                             kVoltageTrimOffsetUv) / ratio;
+        }
+        const double input_uv = (calibrated_uv - trim.offset_uv) / trim.scale;
+        // The sense amplifier and the divider cannot go below ground.
+        return input_uv > 0.0 ? input_uv : 0.0;
+    }
+
+    void _finishConversion(const Plant& plant)
+    {
+        const double window_s = plant.seconds() - _start_s;
+        double amps = plant.currentAmps();
+        double volts = plant.terminalVolts();
+        if (window_s > 0.0) {
+            amps = (plant.chargeAmpSeconds() - _start_charge_as) / window_s;
+            volts = (plant.voltageVoltSeconds() - _start_voltage_vs) /
+                window_s;
+        }
+        const uint8_t gain_code = (uint8_t)AD7190_CONF_GAIN(_conf);
+        const double code = _inputUv(_channel, amps, volts, gain_code) *
+            (double)(1ul << _gainShift(gain_code)) * 16777216.0 /
+            kReferenceUv;
+        _status = (uint8_t)AD7190_STAT_CH(_channel);
+        if (code >= 16777215.0) {
+            _data = 0xFFFFFFUL;
+            _status |= (uint8_t)AD7190_STAT_ERR;
+        } else {
+            _data = (uint32_t)(code + 0.5);
+        }
+        _conversions++;
+    }
+
+public:
+    AD7190Model() :
+        offset_codes_per_c(0.0),
+        _full_calibrations(0)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        _mode = 0x080060UL;
+        _conf = 0x000117UL;
+        _gpocon = 0;
+        for (uint8_t channel = 0; channel < 8; channel++) {
+            _offset[channel] = 0x800000UL;
+            _full_scale[channel] = kDefaultFullScale;
+        }
+        _data = 0;
+        _status = AD7190_STAT_RDY;
+        _ready = false;
+        _job = JOB_NONE;
+        _channel = 0;
+        _started_us = 0;
+        _done_us = 0;
+        _start_charge_as = 0.0;
+        _start_voltage_vs = 0.0;
+        _start_s = 0.0;
+        _conversions = 0;
+    }
+
+    // One SPI frame while CS is low; the plant must be current.
+    void exchange(uint8_t* data, uint8_t count, uint64_t now_us,
+                  const Plant& plant)
+    {
+        if (count == 0) {
+            return;
+        }
+        // 40 consecutive ones reset the serial interface and registers.
+        if (count >= 6 && data[count - 1] == 0xFF && data[count - 2] == 0xFF &&
+            data[count - 3] == 0xFF && data[count - 4] == 0xFF &&
+            data[count - 5] == 0xFF) {
+            reset();
+            for (uint8_t index = 0; index < count; index++) {
+                data[index] = 0xFF;
+            }
+            return;
+        }
+
+        const uint8_t comms = data[0];
+        const uint8_t reg = (uint8_t)((comms >> 3) & 7);
+        const uint8_t size = (uint8_t)(count - 1);
+        data[0] = 0;
+
+        if ((comms & AD7190_COMM_READ) != 0) {
+            uint32_t value = 0;
+            switch (reg) {
+                case AD7190_REG_STAT:
+                    value = (uint32_t)((_status & 0x7F) |
+                                       (_ready ? 0 : AD7190_STAT_RDY));
+                    break;
+                case AD7190_REG_MODE:
+                    value = _mode;
+                    break;
+                case AD7190_REG_CONF:
+                    value = _conf;
+                    break;
+                case AD7190_REG_DATA:
+                    value = size == 4 ? (_data << 8) | _status : _data;
+                    _ready = false;
+                    break;
+                case AD7190_REG_ID:
+                    value = ID_AD7190;
+                    break;
+                case AD7190_REG_GPOCON:
+                    value = _gpocon;
+                    break;
+                case AD7190_REG_OFFSET:
+                    value = _offset[_lowestChannel(0)];
+                    break;
+                case AD7190_REG_FULLSCALE:
+                    value = _full_scale[_lowestChannel(0)];
+                    break;
+            }
+            for (uint8_t index = size; index > 0; index--) {
+                data[index] = (uint8_t)value;
+                value >>= 8;
+            }
+            return;
+        }
+
+        uint32_t value = 0;
+        for (uint8_t index = 1; index <= size; index++) {
+            value = (value << 8) | data[index];
+            data[index] = 0;
+        }
+        switch (reg) {
+            case AD7190_REG_MODE:
+                _mode = value & 0xFFFFFFUL;
+                _startMode(now_us, plant);
+                break;
+            case AD7190_REG_CONF:
+                _conf = value & 0xFFFFFFUL;
+                // A configuration change restarts a continuous sequence.
+                if (((_mode >> 21) & 7) == AD7190_MODE_CONT) {
+                    _startMode(now_us, plant);
+                }
+                break;
+            case AD7190_REG_GPOCON:
+                _gpocon = (uint8_t)value;
+                break;
+            case AD7190_REG_OFFSET:
+                _offset[_lowestChannel(0)] = value & 0xFFFFFFUL;
+                break;
+            case AD7190_REG_FULLSCALE:
+                _full_scale[_lowestChannel(0)] = value & 0xFFFFFFUL;
+                break;
+        }
+    }
+
+    bool busy() const
+    {
+        return _job != JOB_NONE;
+    }
+
+    uint64_t doneAt() const
+    {
+        return _done_us;
+    }
+
+    // Ends the running job at doneAt(); the plant must be current.
+    void complete(const Plant& plant)
+    {
+        const Job job = _job;
+        _job = JOB_NONE;
+        if (job == JOB_CONVERT) {
+            _finishConversion(plant);
+            const uint8_t mode = (uint8_t)((_mode >> 21) & 7);
+            if (mode == AD7190_MODE_SINGLE) {
+                _setMode(AD7190_MODE_PWRDN);
+            } else {
+                // Continuous: on to the next enabled channel.
+                _begin(JOB_CONVERT, _lowestChannel(_channel + 1), _done_us,
+                       plant);
+            }
+        } else if (job == JOB_CAL_ZERO) {
+            const double drift =
+                offset_codes_per_c * (plant.heatsinkCelsius() - 25.0);
+            _offset[_channel] = (uint32_t)(0x800000L + (int32_t)drift);
+            _setMode(AD7190_MODE_IDLE);
+        } else if (job == JOB_CAL_FULL) {
+            _full_scale[_channel] = kDefaultFullScale;
+            _full_calibrations++;
+            _setMode(AD7190_MODE_IDLE);
+        }
+        _ready = true;
+    }
+
+    // DOUT/RDY level while selected.
+    bool ready() const
+    {
+        return _ready;
+    }
+
+    uint32_t conversions() const
+    {
+        return _conversions;
+    }
+
+    // Since construction; a serial interface reset keeps the count.
+    uint32_t fullScaleCalibrations() const
+    {
+        return _full_calibrations;
+    }
+
+    uint32_t offsetRegister(uint8_t channel) const
+    {
+        return _offset[channel];
+    }
+};
+
+}  // namespace sim
+
+#endif
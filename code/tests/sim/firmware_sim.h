@@ -0,0 +1,543 @@
+#ifndef ELECTRONIC_DC_LOAD_SIM_FIRMWARE_SIM_H
+#define ELECTRONIC_DC_LOAD_SIM_FIRMWARE_SIM_H
+
+/* Closed-loop bench for the whole firmware on the host.  Include it after
+ * main.cc: it provides the Arduino core the sketch links against and wires
+ * the SPI, I2C, timer, external and pin-change interrupt stand-ins to the
+ * AD7190 model and the plant.
+ *
+ * Time is simulated.  Every core call charges roughly what it costs on a
+ * 16 MHz ATmega328P, and interrupts fire at those points when enabled, so
+ * run times, lateness and interrupt latency come out in the scheduler
+ * statistics as they would on the board.  When nothing is due the bench
+ * skips straight to the next release, which is what lets an hour of
+ * discharge run in seconds. */
+
+#include <stdint.h>
+
+#include "ad7190_model.h"
+#include "plant.h"
+
+SPIClass SPI;
+EEPROMClass EEPROM;
+TwoWire Wire;
+TimerOne Timer1;
+HardwareSerial Serial;
+
+namespace sim {
+
+// Approximate cost of the core calls, in microseconds.
+static const uint32_t kPinCostUs = 2;
+static const uint32_t kClockCostUs = 1;
+static const uint32_t kSpiFrameCostUs = 3;
+static const uint32_t kSpiByteCostUs = 2;
+static const uint32_t kAnalogReadCostUs = 112;
+// One byte at 100 kHz, address and acknowledges included.
+static const uint32_t kWireByteCostUs = 90;
+// Longest the plant is integrated in one step.
+static const uint64_t kPlantStepUs = 10000;
+static const uint8_t kPins = 20;
+// INT0 and INT1.
+static const uint8_t kExternalInterrupts = 2;
+
+class Bench
+{
+public:
+    Plant plant;
+    AD7190Model converter;
+
+    uint64_t now_us;
+    uint8_t input_level[kPins];
+    uint8_t output_level[kPins];
+
+    uint16_t dac_code;
+    // First time the DAC was written to 0 after `watchDacFrom()`.
+    uint64_t dac_zero_us;
+    uint64_t last_press_us;
+    uint32_t timer_interrupts;
+    uint32_t ready_interrupts;
+    uint32_t external_interrupts;
+    // Transfers that found both devices selected.
+    uint32_t bus_conflicts;
+    // Selects and transfers of a device in another SPI mode than its own,
+    // AD7190 mode 3 and AD5541 mode 0: a CPOL change with CS low clocks it.
+    uint32_t spi_mode_errors;
+
+private:
+    uint64_t _plant_us;
+    uint16_t _dac_shift;
+    bool _dac_selected_written;
+    bool _interrupts_enabled;
+    bool _in_interrupt;
+    bool _timer_pending;
+    bool _ready_pending;
+    void (*_external_isr[kExternalInterrupts])();
+    bool _external_pending[kExternalInterrupts];
+    int _press_in_adc_transfer;
+    int _tap_pin;
+    uint64_t _tap_press_us;
+    uint64_t _tap_release_us;
+    uint64_t _next_timer_us;
+    uint64_t _watch_dac_from_us;
+
+    // Pin edges: INTn on a falling edge once attached.
+    void _setInput(int pin, uint8_t level)
+    {
+        const uint8_t previous = input_level[pin];
+        input_level[pin] = level;
+        if (previous == level) {
+            return;
+        }
+        const int interrupt = digitalPinToInterrupt(pin);
+        if (level == LOW && interrupt >= 0 &&
+            interrupt < kExternalInterrupts && _external_isr[interrupt]) {
+            _external_pending[interrupt] = true;
+        }
+    }
+
+    uint64_t _nextTapUs() const
+    {
+        if (_tap_pin < 0) {
+            return UINT64_MAX;
+        }
+        return input_level[_tap_pin] == LOW ? _tap_release_us : _tap_press_us;
+    }
+
+    void _stepTap()
+    {
+        if (input_level[_tap_pin] == LOW) {
+            _setInput(_tap_pin, HIGH);
+            _tap_pin = -1;
+        } else {
+            _setInput(_tap_pin, LOW);
+            last_press_us = now_us;
+        }
+    }
+
+    bool _externalPending() const
+    {
+        for (uint8_t index = 0; index < kExternalInterrupts; index++) {
+            if (_external_pending[index]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void _syncPlant()
+    {
+        while (_plant_us < now_us) {
+            uint64_t step_us = now_us - _plant_us;
+            if (step_us > kPlantStepUs) {
+                step_us = kPlantStepUs;
+            }
+            plant.advance(step_us / 1e6);
+            _plant_us += step_us;
+        }
+    }
+
+    bool _adcSelected() const
+    {
+        return output_level[ADC_CS_PIN] == LOW;
+    }
+
+    void _serviceInterrupts()
+    {
+        if (!_interrupts_enabled || _in_interrupt) {
+            return;
+        }
+        while (_timer_pending || _ready_pending || _externalPending()) {
+            _in_interrupt = true;
+            _interrupts_enabled = false;
+            // INT0, INT1, PCINT0 and Timer1 in vector priority order.
+            if (_externalPending()) {
+                uint8_t index = 0;
+                while (!_external_pending[index]) {
+                    index++;
+                }
+                _external_pending[index] = false;
+                external_interrupts++;
+                _external_isr[index]();
+            } else if (_ready_pending) {
+                _ready_pending = false;
+                ready_interrupts++;
+                PCINT0_vect();
+            } else {
+                _timer_pending = false;
+                timer_interrupts++;
+                if (Timer1.isr) {
+                    Timer1.isr();
+                }
+            }
+            _in_interrupt = false;
+            _interrupts_enabled = true;
+        }
+    }
+
+public:
+    Bench() :
+        now_us(0),
+        dac_code(0),
+        dac_zero_us(0),
+        last_press_us(0),
+        timer_interrupts(0),
+        ready_interrupts(0),
+        external_interrupts(0),
+        bus_conflicts(0),
+        spi_mode_errors(0),
+        _plant_us(0),
+        _dac_shift(0),
+        _dac_selected_written(false),
+        _interrupts_enabled(true),
+        _in_interrupt(false),
+        _timer_pending(false),
+        _ready_pending(false),
+        _press_in_adc_transfer(-1),
+        _tap_pin(-1),
+        _tap_press_us(0),
+        _tap_release_us(0),
+        _next_timer_us(0),
+        _watch_dac_from_us(0)
+    {
+        for (uint8_t pin = 0; pin < kPins; pin++) {
+            input_level[pin] = HIGH;
+            output_level[pin] = HIGH;
+        }
+        for (uint8_t index = 0; index < kExternalInterrupts; index++) {
+            _external_isr[index] = 0;
+            _external_pending[index] = false;
+        }
+    }
+
+    /* Lets `us` pass: the plant, a running conversion and Timer1 move on,
+     * and the interrupts due in that time fire if enabled. */
+    void advance(uint64_t us)
+    {
+        const uint64_t end_us = now_us + us;
+        while (true) {
+            uint64_t event_us = end_us;
+            if (Timer1.isr && Timer1.period_us != 0) {
+                if (_next_timer_us == 0) {
+                    _next_timer_us = now_us + Timer1.period_us;
+                }
+                if (_next_timer_us < event_us) {
+                    event_us = _next_timer_us;
+                }
+            }
+            if (converter.busy() && converter.doneAt() < event_us) {
+                event_us = converter.doneAt();
+            }
+            const uint64_t tap_us = _nextTapUs();
+            if (tap_us < event_us) {
+                event_us = tap_us;
+            }
+            if (event_us >= end_us) {
+                break;
+            }
+            now_us = event_us;
+            if (now_us == tap_us) {
+                _stepTap();
+            }
+            if (Timer1.isr && now_us == _next_timer_us) {
+                _next_timer_us += Timer1.period_us;
+                _timer_pending = true;
+            }
+            if (converter.busy() && now_us == converter.doneAt()) {
+                _syncPlant();
+                converter.complete(plant);
+                // RDY falls on the selected converter.
+                _ready_pending = _ready_pending || _adcSelected();
+            }
+            // An interrupt handler spends time of its own.
+            _serviceInterrupts();
+        }
+        if (now_us < end_us) {
+            now_us = end_us;
+        }
+        _serviceInterrupts();
+    }
+
+    void setInterrupts(bool enabled)
+    {
+        _interrupts_enabled = enabled;
+        if (enabled) {
+            _serviceInterrupts();
+        }
+    }
+
+    // Handles a falling edge on the pin of INT `interrupt`.
+    void attachExternal(int interrupt, void (*isr)())
+    {
+        if (interrupt >= 0 && interrupt < kExternalInterrupts) {
+            _external_isr[interrupt] = isr;
+        }
+    }
+
+    void exchange(uint8_t* data, uint8_t count)
+    {
+        const uint32_t cost_us =
+            kSpiFrameCostUs + kSpiByteCostUs * (uint32_t)count;
+        if (_press_in_adc_transfer >= 0 && _adcSelected()) {
+            // Halfway through the frame.
+            advance(cost_us / 2);
+            const int pin = _press_in_adc_transfer;
+            _press_in_adc_transfer = -1;
+            press(pin);
+            advance(cost_us - cost_us / 2);
+        } else {
+            advance(cost_us);
+        }
+        if (_adcSelected() && SPI.mode != SPI_MODE3) {
+            spi_mode_errors++;
+        }
+        if (_adcSelected()) {
+            _syncPlant();
+            converter.exchange(data, count, now_us, plant);
+        } else if (output_level[DAC_CS_PIN] == LOW && count == 2) {
+            // The AD5541 latches the shifted word when CS rises.
+            _dac_shift = (uint16_t)((data[0] << 8) | data[1]);
+            _dac_selected_written = true;
+        }
+    }
+
+    void writePin(int pin, int value)
+    {
+        advance(kPinCostUs);
+        if (pin < 0 || pin >= kPins) {
+            return;
+        }
+        const uint8_t previous = output_level[pin];
+        output_level[pin] = value == LOW ? LOW : HIGH;
+        if (output_level[ADC_CS_PIN] == LOW &&
+            output_level[DAC_CS_PIN] == LOW) {
+            bus_conflicts++;
+        }
+        if (previous != LOW && value == LOW &&
+            ((pin == ADC_CS_PIN && SPI.mode != SPI_MODE3) ||
+             (pin == DAC_CS_PIN && SPI.mode != SPI_MODE0))) {
+            spi_mode_errors++;
+        }
+        if (pin == DAC_CS_PIN && previous == LOW && value != LOW &&
+            _dac_selected_written) {
+            _dac_selected_written = false;
+            _syncPlant();
+            if (_dac_shift == 0 && dac_code != 0 && dac_zero_us == 0 &&
+                now_us >= _watch_dac_from_us && _watch_dac_from_us != 0) {
+                dac_zero_us = now_us;
+            }
+            dac_code = _dac_shift;
+            plant.setDacCode(dac_code);
+        } else if (pin == FAN_SW_PIN) {
+            _syncPlant();
+            plant.setFan(value != LOW);
+        }
+    }
+
+    int readPin(int pin)
+    {
+        advance(kPinCostUs);
+        if (pin == MISO) {
+            // DOUT/RDY only drives the line while the AD7190 is selected.
+            return _adcSelected() && converter.ready() ? LOW : HIGH;
+        }
+        if (pin < 0 || pin >= kPins) {
+            return HIGH;
+        }
+        return input_level[pin];
+    }
+
+    int readAnalog(int pin)
+    {
+        advance(kAnalogReadCostUs);
+        if (pin != LM35_PIN) {
+            return 0;
+        }
+        _syncPlant();
+        // LM35: 10 mV per degree against the 5 V reference.
+        const double code = plant.heatsinkCelsius() * 10.0 / 5000.0 * 1024.0;
+        if (code <= 0.0) {
+            return 0;
+        }
+        return code >= 1023.0 ? 1023 : (int)(code + 0.5);
+    }
+
+    // Makes dac_zero_us record the next fall of the output to 0.
+    void watchDacFrom(uint64_t from_us)
+    {
+        _watch_dac_from_us = from_us;
+        dac_zero_us = 0;
+    }
+
+    /* Buttons and the encoder switch pull their pins low.  The interrupt
+     * of the edge is taken at once if interrupts are enabled. */
+    void press(int pin)
+    {
+        _setInput(pin, LOW);
+        last_press_us = now_us;
+        _serviceInterrupts();
+    }
+
+    // Presses `pin` in the middle of the next AD7190 transfer.
+    void pressInAdcTransfer(int pin)
+    {
+        _press_in_adc_transfer = pin;
+    }
+
+    void release(int pin)
+    {
+        _setInput(pin, HIGH);
+        _serviceInterrupts();
+    }
+
+    /* Presses `pin` at `at_us` for `hold_us`, wherever the sketch is by
+     * then; one tap at a time. */
+    void tap(int pin, uint64_t at_us, uint64_t hold_us)
+    {
+        _tap_pin = pin;
+        _tap_press_us = at_us;
+        _tap_release_us = at_us + hold_us;
+    }
+
+    const Plant& syncedPlant()
+    {
+        _syncPlant();
+        return plant;
+    }
+};
+
+Bench bench;
+
+inline void ExchangeSpi(uint8_t* data, uint8_t count)
+{
+    bench.exchange(data, count);
+}
+
+inline void TransmitWire(uint16_t bytes)
+{
+    bench.advance((uint64_t)kWireByteCostUs * bytes);
+}
+
+// Set points as SaveSetPointToEEPROM() leaves them, so setup() loads them.
+inline void StoreSetPoints(control::LoadMode mode, int32_t set_point,
+                           int32_t cutoff_mv)
+{
+    EEPROM.write(EEPROM_VERSION_ADDR, EEPROM_VERSION);
+    EEPROM.write(EEPROM_MODE_ADDR, (uint8_t)mode);
+    const int32_t current_ma =
+        mode == control::LoadMode::ConstantCurrent ? set_point : 0;
+    const int32_t power_cw =
+        mode == control::LoadMode::ConstantPower ? set_point : 0;
+    const int32_t resistance_mohm =
+        mode == control::LoadMode::ConstantResistance ? set_point : 0;
+    const int32_t cv_mv =
+        mode == control::LoadMode::ConstantVoltage ? set_point : 0;
+    EEPROM.put(EEPROM_CURRENT_ADDR, current_ma);
+    EEPROM.put(EEPROM_VOLTAGE_ADDR, cutoff_mv);
+    EEPROM.put(EEPROM_POWER_ADDR, power_cw);
+    EEPROM.put(EEPROM_RESISTANCE_ADDR, resistance_mohm);
+    EEPROM.put(EEPROM_CV_ADDR, cv_mv);
+}
+
+// Powers the board up: hooks the buses to the models and runs setup().
+inline void Boot()
+{
+    SPI.on_exchange = ExchangeSpi;
+    Wire.on_transmit = TransmitWire;
+    setup();
+}
+
+/* Runs the sketch for `us`.  loop() is one scheduler pass; once a pass
+ * finds no periodic task due it ran the background task, and unless a
+ * display frame is still going out the MCU would only spin until the next
+ * release, so the bench skips there.  That only moves the start of a
+ * display refresh by less than a period. */
+inline void RunFor(uint64_t us)
+{
+    const uint64_t end_us = bench.now_us + us;
+    while (bench.now_us < end_us) {
+        const int8_t index = scheduler.runOnce();
+        if (index >= 0 && (TASKS[index].period_us != 0 || DisplayBusy())) {
+            continue;
+        }
+        const int32_t wait_us = static_cast<int32_t>(
+            scheduler.nextRelease() - (uint32_t)bench.now_us);
+        bench.advance(wait_us > 0 ? (uint64_t)wait_us : 1);
+    }
+}
+
+// Runs until `done()` holds or `limit_us` passed; true if it held.
+inline bool RunUntil(bool (*done)(), uint64_t limit_us)
+{
+    const uint64_t end_us = bench.now_us + limit_us;
+    while (bench.now_us < end_us) {
+        if (done()) {
+            return true;
+        }
+        RunFor(1000);
+    }
+    return done();
+}
+
+}  // namespace sim
+
+uint32_t micros()
+{
+    sim::bench.advance(sim::kClockCostUs);
+    return (uint32_t)sim::bench.now_us;
+}
+
+uint32_t millis()
+{
+    sim::bench.advance(sim::kClockCostUs);
+    return (uint32_t)(sim::bench.now_us / 1000);
+}
+
+void delay(unsigned long milliseconds)
+{
+    sim::bench.advance((uint64_t)milliseconds * 1000);
+}
+
+void delayMicroseconds(unsigned int microseconds)
+{
+    sim::bench.advance(microseconds);
+}
+
+int digitalRead(int pin)
+{
+    return sim::bench.readPin(pin);
+}
+
+void digitalWrite(int pin, int value)
+{
+    sim::bench.writePin(pin, value);
+}
+
+void pinMode(int, int)
+{
+}
+
+int analogRead(int pin)
+{
+    return sim::bench.readAnalog(pin);
+}
+
+void analogReference(int)
+{
+}
+
+void noInterrupts()
+{
+    sim::bench.setInterrupts(false);
+}
+
+void interrupts()
+{
+    sim::bench.setInterrupts(true);
+}
+
+void attachInterrupt(int interrupt, void (*handler)(), int)
+{
+    sim::bench.attachExternal(interrupt, handler);
+}
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef ELECTRONIC_DC_LOAD_SIM_PLANT_H
+#define ELECTRONIC_DC_LOAD_SIM_PLANT_H
+
+#include <math.h>
+#include <stdint.h>
+
+#include "../../control.h"
+
+namespace sim {
+
+// Open circuit voltage against state of charge, piecewise linear.
+struct OcvPoint
+{
+    double soc;
+    double volts;
+};
+
+// One Li-ion cell.  Below empty the voltage falls off towards 0 V.
+static const OcvPoint kLiIonOcv[] = {
+    {0.00, 3.00}, {0.05, 3.30}, {0.10, 3.45}, {0.20, 3.55}, {0.40, 3.70},
+    {0.60, 3.85}, {0.80, 4.00}, {1.00, 4.20},
+};
+
+struct PlantConfig
+{
+    double capacity_ah;
+    double initial_soc;
+    double internal_ohms;
+    const OcvPoint* ocv;
+    uint8_t ocv_points;
+    // Shunt, MOSFET on resistance and wiring: the least the load can present.
+    double path_ohms;
+    // Actual current per commanded current, 1.0 for an ideal DAC and loop.
+    double loop_gain;
+    double ambient_c;
+    double heatsink_c_per_w;
+    double heatsink_c_per_w_fan;
+    double heatsink_j_per_c;
+};
+
+inline PlantConfig DefaultPlantConfig()
+{
+    PlantConfig config;
+    config.capacity_ah = 1.0;
+    config.initial_soc = 1.0;
+    config.internal_ohms = 0.05;
+    config.ocv = kLiIonOcv;
+    config.ocv_points = sizeof(kLiIonOcv) / sizeof(kLiIonOcv[0]);
+    config.path_ohms = 0.05;
+    config.loop_gain = 1.0;
+    config.ambient_c = 25.0;
+    config.heatsink_c_per_w = 1.2;
+    config.heatsink_c_per_w_fan = 0.4;
+    config.heatsink_j_per_c = 150.0;
+    return config;
+}
+
+/* Battery, MOSFET/op-amp current loop and heatsink.  The analog loop
+ * settles within microseconds, so the current follows the DAC at once,
+ * limited by what the source can drive through the minimum path
+ * resistance.  Charge and voltage are integrated exactly between updates,
+ * so converter results can be averaged over their conversion window. */
+class Plant
+{
+private:
+    PlantConfig _config;
+    double _soc;
+    double _ocv;
+    double _commanded_a;
+    double _current_a;
+    double _heatsink_c;
+    bool _fan_on;
+    // Faults a test can inject.
+    bool _mosfet_shorted;
+    bool _source_connected;
+
+    // Running integrals since the start, in A*s, V*s, J and s.
+    double _charge_as;
+    double _voltage_vs;
+    double _energy_j;
+    double _time_s;
+
+    double _ocvAt(double soc) const
+    {
+        const OcvPoint* table = _config.ocv;
+        const uint8_t last = _config.ocv_points - 1;
+        if (soc <= table[0].soc) {
+            // Empty: collapse over the next 2 % of capacity.
+            const double volts =
+                table[0].volts * (1.0 + (soc - table[0].soc) / 0.02);
+            return volts > 0.0 ? volts : 0.0;
+        }
+        if (soc >= table[last].soc) {
+            return table[last].volts;
+        }
+        uint8_t index = 1;
+        while (table[index].soc < soc) {
+            index++;
+        }
+        const OcvPoint& low = table[index - 1];
+        const OcvPoint& high = table[index];
+        return low.volts + (high.volts - low.volts) *
+            (soc - low.soc) / (high.soc - low.soc);
+    }
+
+    void _settle()
+    {
+        if (!_source_connected) {
+            _current_a = 0.0;
+            return;
+        }
+        const double limit_a =
+            _ocv / (_config.internal_ohms + _config.path_ohms);
+        double current_a = _mosfet_shorted ?
+            limit_a : _commanded_a * _config.loop_gain;
+        if (current_a > limit_a) {
+            current_a = limit_a;
+        }
+        _current_a = current_a > 0.0 ? current_a : 0.0;
+    }
+
+public:
+    explicit Plant(const PlantConfig& config = DefaultPlantConfig()) :
+        _config(config),
+        _soc(config.initial_soc),
+        _ocv(0.0),
+        _commanded_a(0.0),
+        _current_a(0.0),
+        _heatsink_c(config.ambient_c),
+        _fan_on(false),
+        _mosfet_shorted(false),
+        _source_connected(true),
+        _charge_as(0.0),
+        _voltage_vs(0.0),
+        _energy_j(0.0),
+        _time_s(0.0)
+    {
+        _ocv = _ocvAt(_soc);
+        _settle();
+    }
+
+    // Integrates `dt_s` at the present operating point.  Call often: the
+    // battery and heatsink only move between calls.
+    void advance(double dt_s)
+    {
+        const double volts = terminalVolts();
+        _charge_as += _current_a * dt_s;
+        _voltage_vs += volts * dt_s;
+        _energy_j += volts * _current_a * dt_s;
+        _time_s += dt_s;
+
+        _soc -= _current_a * dt_s / (_config.capacity_ah * 3600.0);
+        _ocv = _ocvAt(_soc);
+
+        // All of the power ends up in the MOSFET's heatsink.
+        const double c_per_w = _fan_on ?
+            _config.heatsink_c_per_w_fan : _config.heatsink_c_per_w;
+        const double heat_w = volts * _current_a -
+            (_heatsink_c - _config.ambient_c) / c_per_w;
+        _heatsink_c += heat_w * dt_s / _config.heatsink_j_per_c;
+        _settle();
+    }
+
+    void setDacCode(uint16_t code)
+    {
+        _commanded_a = control::theoreticalMicroampsFromDacCode(code) / 1e6;
+        _settle();
+    }
+
+    // Swaps in a cell at another state of charge, e.g. between scenarios.
+    void setStateOfCharge(double soc)
+    {
+        _soc = soc;
+        _ocv = _ocvAt(_soc);
+        _settle();
+    }
+
+    void setFan(bool on)
+    {
+        _fan_on = on;
+    }
+
+    void shortMosfet(bool shorted)
+    {
+        _mosfet_shorted = shorted;
+        _settle();
+    }
+
+    void connectSource(bool connected)
+    {
+        _source_connected = connected;
+        _settle();
+    }
+
+    double currentAmps() const
+    {
+        return _current_a;
+    }
+
+    double terminalVolts() const
+    {
+        if (!_source_connected) {
+            return 0.0;
+        }
+        return _ocv - _current_a * _config.internal_ohms;
+    }
+
+    double heatsinkCelsius() const
+    {
+        return _heatsink_c;
+    }
+
+    bool fanOn() const
+    {
+        return _fan_on;
+    }
+
+    double stateOfCharge() const
+    {
+        return _soc;
+    }
+
+    double chargeAmpSeconds() const
+    {
+        return _charge_as;
+    }
+
+    double voltageVoltSeconds() const
+    {
+        return _voltage_vs;
+    }
+
+    double energyJoules() const
+    {
+        return _energy_j;
+    }
+
+    double seconds() const
+    {
+        return _time_s;
+    }
+};
+
+}  // namespace sim
+
+#endif
@@ -0,0 +1,341 @@
+#include <assert.h>
+#include <cstddef>
+#include <stdint.h>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "../spi_bus.h"
+#include "../adc.h"
+#include "../ad5541.h"
+
+SPIClass SPI;
+static uint32_t clock_ms;
+static int ready_level = LOW;
+static int adc_cs_level = HIGH;
+static int dac_cs_level = HIGH;
+
+int analogRead(int)
+{
+    return 0;
+}
+
+void analogReference(int)
+{
+}
+
+uint32_t millis()
+{
+    return clock_ms++;
+}
+
+uint32_t micros()
+{
+    return clock_ms * 1000UL;
+}
+
+int digitalRead(int)
+{
+    return ready_level;
+}
+
+void pinMode(int, int)
+{
+}
+
+void digitalWrite(int pin, int level)
+{
+    if (pin == 8) {
+        adc_cs_level = level;
+    } else if (pin == 9) {
+        dac_cs_level = level;
+    }
+}
+
+void delay(unsigned long)
+{
+}
+
+void delayMicroseconds(unsigned int)
+{
+}
+
+void noInterrupts()
+{
+}
+
+void interrupts()
+{
+}
+
+static SPIBus bus;
+static int dac_transfers = 0;
+static int adc_transfers = 0;
+
+// Every transfer on the shared bus selects exactly one device, and ADC
+// register traffic always holds the bus lock.
+static void checkTransfer()
+{
+    assert(adc_cs_level == HIGH || dac_cs_level == HIGH);
+    assert(adc_cs_level == LOW || dac_cs_level == LOW);
+    assert(bus.isBusy());
+    if (dac_cs_level == LOW) {
+        dac_transfers++;
+    } else {
+        adc_transfers++;
+    }
+}
+
+static int park_calls = 0;
+static bool park_released = false;
+
+static void recordPark(void* owner, bool release)
+{
+    assert(owner == &park_calls);
+    park_calls++;
+    park_released = release;
+}
+
+static int deferred_writes = 0;
+
+// Runs with priority access to the bus passed as the owner.
+static void recordWrite(void* owner)
+{
+    assert(static_cast<SPIBus*>(owner)->isBusy());
+    deferred_writes++;
+}
+
+static void lockTest()
+{
+    SPIBus local;
+    assert(!local.isBusy());
+    local.lock();
+    local.lock();
+    local.unlock();
+    assert(local.isBusy());
+    local.unlock();
+    assert(!local.isBusy());
+
+    /* Without a parked owner priority access only locks the bus. */
+    local.beginPriority();
+    assert(local.isBusy());
+    local.endPriority();
+    assert(!local.isBusy());
+
+    /* The parked owner is released before and re-parked after. */
+    local.setParkHandler(recordPark, &park_calls);
+    local.beginPriority();
+    assert(park_calls == 1 && park_released);
+    local.endPriority();
+    assert(park_calls == 2 && !park_released);
+    assert(!local.isBusy());
+
+    /* An interrupt never takes the bus from a transfer in progress. */
+    local.lock();
+    assert(!local.tryBeginPriority());
+    assert(park_calls == 2);
+    local.unlock();
+    assert(local.tryBeginPriority());
+    assert(park_calls == 3 && park_released);
+    local.endPriority();
+    assert(!local.isBusy());
+
+    /* A write that cannot wait for the next interrupt goes out at once on
+     * a free bus, and otherwise as the transfer in progress unlocks it. */
+    local.priorityWrite(recordWrite, &local);
+    assert(deferred_writes == 1 && park_calls == 6);
+    local.lock();
+    local.lock();
+    local.priorityWrite(recordWrite, &local);
+    assert(deferred_writes == 1 && park_calls == 6);
+    local.unlock();
+    assert(deferred_writes == 1);
+    local.unlock();
+    assert(deferred_writes == 2 && park_calls == 8 && !park_released);
+    assert(!local.isBusy());
+    local.lock();
+    local.unlock();
+    assert(deferred_writes == 2);
+}
+
+static void interleaveTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    AD5541 dac(9);
+    dac.begin();
+    converter.attachBus(bus);
+    SPI.responses.clear();
+    assert(converter.init());
+    converter.enableReadyInterrupt(true);
+    SPI.on_transfer = checkTransfer;
+
+    /* The converter integrates parked: CS low, no transfer, bus not busy. */
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    assert(converter.isConverting());
+    assert(adc_cs_level == LOW);
+    assert(!bus.isBusy());
+
+    /* A DAC write goes out at once, the conversion carries on and is parked
+     * again afterwards. */
+    SPI.transfers.clear();
+    adc_transfers = 0;
+    SPI.responses.push_back(std::vector<uint8_t>(2, 0));
+    bus.beginPriority();
+    assert(adc_cs_level == HIGH);
+    dac.setValue(0x1234);
+    bus.endPriority();
+    assert(dac_transfers == 1);
+    assert(adc_transfers == 0);
+    assert(SPI.transfers.size() == 1);
+    assert(SPI.transfers.back() == (std::vector<uint8_t>{0x12, 0x34}));
+    assert(adc_cs_level == LOW);
+    assert(!bus.isBusy());
+    assert(converter.pollConversion() == ACQ_PENDING);
+
+    /* The result latched after the interleaved write is the conversion's. */
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x80, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(adc_transfers == 1);
+    assert(adc_cs_level == HIGH);
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.readSafetyCurrentMicroamps() > 9990000L &&
+           converter.readSafetyCurrentMicroamps() < 10010000L);
+
+    /* With nothing parked a DAC write leaves the converter alone. */
+    SPI.responses.push_back(std::vector<uint8_t>(2, 0));
+    bus.beginPriority();
+    dac.setValue(0);
+    bus.endPriority();
+    assert(dac_transfers == 2);
+    assert(adc_transfers == 1);
+    assert(adc_cs_level == HIGH);
+
+    SPI.on_transfer = 0;
+    converter.enableReadyInterrupt(false);
+    SPI.responses.clear();
+}
+
+static void readyTripTest()
+{
+    ADConverter converter(8, AD7190_CH_AIN1P_AINCOM, AD7190_CH_AIN2P_AINCOM,
+                          5000.0, 12);
+    converter.attachBus(bus);
+    SPI.responses.clear();
+    assert(converter.init());
+    const control::FixedSafetyLimits limits = {
+        16500000L, 0, 95000L, 50000000L, 200000L
+    };
+    converter.setSafetyLimits(limits);
+    converter.setSafetyTripWrite(recordWrite, &bus);
+    converter.enableReadyInterrupt(true);
+    deferred_writes = 0;
+
+    /* 16.5 A at gain 1 is 0xD33333.  A word at it is no trip. */
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xD3, 0x33, 0x33,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(deferred_writes == 0);
+    assert(!converter.safetyTripWritten());
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+
+    /* One code above, the ready interrupt itself issues the write, before
+     * the main loop has seen the word, and only once. */
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xD3, 0x33, 0x34,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(deferred_writes == 1);
+    assert(converter.safetyTripWritten());
+    assert(!bus.isBusy());
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.safetyTrip() == control::FaultReason::Overcurrent);
+
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xF0, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(deferred_writes == 1);
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+
+    converter.clearSafetyTrip();
+    assert(!converter.safetyTripWritten());
+
+    /* Above gain 1 the limit is past full scale.  78 mA read with 100 mA
+     * commanded ranges the next conversion at gain 128, and a clip there
+     * trips at once: the current is beyond what the DAC asks for. */
+    converter.predictCurrent(100000L);
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x01, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    assert(converter.channelGain(CHANNEL_CURRENT) == AD7190_CONF_GAIN_128);
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xFF, 0xFF, 0xFF,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(deferred_writes == 2);
+    assert(converter.safetyTripWritten());
+    ready_level = HIGH;
+    assert(converter.pollConversion() == ACQ_PENDING);
+    assert(converter.safetyTrip() == control::FaultReason::Overcurrent);
+    converter.cancelConversion();
+    converter.clearSafetyTrip();
+
+    /* A command stepped up to 1 A while the gain 128 conversion runs: the
+     * clip is expected and only repeated at gain 1. */
+    converter.predictCurrent(100000L);
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0x01, 0x00, 0x00,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(converter.pollConversion() == ACQ_READY);
+    assert(converter.collectConversion());
+    ready_level = HIGH;
+    converter.startConversion(CHANNEL_CURRENT);
+    assert(converter.channelGain(CHANNEL_CURRENT) == AD7190_CONF_GAIN_128);
+    converter.predictCurrent(1000000L);
+    ready_level = LOW;
+    SPI.responses.push_back(std::vector<uint8_t>{0, 0xFF, 0xFF, 0xFF,
+                                                  AD7190_STAT_CH(AD7190_CH_AIN2P_AINCOM)});
+    converter.onReadyInterrupt();
+    assert(deferred_writes == 2);
+    assert(!converter.safetyTripWritten());
+    ready_level = HIGH;
+    assert(converter.pollConversion() == ACQ_PENDING);
+    assert(converter.safetyTrip() == control::FaultReason::None);
+    assert(converter.channelGain(CHANNEL_CURRENT) == AD7190_CONF_GAIN_1);
+    converter.cancelConversion();
+
+    converter.enableReadyInterrupt(false);
+    SPI.responses.clear();
+}
+
+int main()
+{
+    lockTest();
+    interleaveTest();
+    readyTripTest();
+    return 0;
+}
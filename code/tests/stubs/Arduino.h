@@ -2,20 +2,160 @@
 #define ELECTRONIC_DC_LOAD_HOST_ARDUINO_H
 
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
 #define EXTERNAL 0
 #define LOW 0
 #define HIGH 1
 #define INPUT 0
 #define OUTPUT 1
+#define INPUT_PULLUP 2
+#define FALLING 2
 #define MISO 12
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+
+#define constrain(value, low, high) \
+    ((value) < (low) ? (low) : ((value) > (high) ? (high) : (value)))
+// Flash strings are plain strings on the host.
+#define F(string) (string)
+// Interrupt vectors become plain functions a simulation can call.
+#define ISR(vector) void vector()
+// INT0 and INT1 of the ATmega328P.
+#define digitalPinToInterrupt(pin) ((pin) == 2 ? 0 : ((pin) == 3 ? 1 : -1))
 
 int analogRead(int pin);
 void analogReference(int mode);
 uint32_t millis();
+uint32_t micros();
 int digitalRead(int pin);
 void pinMode(int pin, int mode);
 void digitalWrite(int pin, int value);
 void delay(unsigned long milliseconds);
+void delayMicroseconds(unsigned int microseconds);
+void noInterrupts();
+void interrupts();
+void attachInterrupt(int interrupt, void (*handler)(), int mode);
+
+// avr-libc: right aligned in `width` columns with `precision` decimals.
+inline char* dtostrf(double value, signed char width, unsigned char precision,
+                     char* buffer)
+{
+    sprintf(buffer, "%*.*f", width, precision, value);
+    return buffer;
+}
+
+// The print() overloads the firmware uses, on top of write().
+class Print
+{
+public:
+    virtual ~Print()
+    {
+    }
+
+    virtual size_t write(uint8_t value) = 0;
+
+    size_t print(const char* text)
+    {
+        size_t count = 0;
+        while (*text != '\0') {
+            count += write((uint8_t)*text++);
+        }
+        return count;
+    }
+
+    size_t print(char value)
+    {
+        return write((uint8_t)value);
+    }
+
+    size_t print(long value)
+    {
+        char text[12];
+        snprintf(text, sizeof(text), "%ld", value);
+        return print(text);
+    }
+
+    size_t print(unsigned long value)
+    {
+        char text[12];
+        snprintf(text, sizeof(text), "%lu", value);
+        return print(text);
+    }
+
+    size_t print(int value)
+    {
+        return print((long)value);
+    }
+
+    size_t print(unsigned int value)
+    {
+        return print((unsigned long)value);
+    }
+};
+
+/* Receives what a test queues in `input`.  Text lines are kept, the last
+ * one in `line`; the profiling build's numbers are discarded. */
+class HardwareSerial
+{
+public:
+    char input[128];
+    size_t input_length;
+    size_t input_position;
+    char line[32];
+
+    HardwareSerial() : input_length(0), input_position(0)
+    {
+        line[0] = '\0';
+    }
+
+    void begin(unsigned long)
+    {
+    }
+
+    // Queues text for the firmware to read.
+    void send(const char* text)
+    {
+        while (*text != '\0' && input_length < sizeof(input)) {
+            input[input_length++] = *text++;
+        }
+    }
+
+    int available()
+    {
+        return (int)(input_length - input_position);
+    }
+
+    int read()
+    {
+        if (input_position == input_length) {
+            return -1;
+        }
+        const int c = (uint8_t)input[input_position++];
+        if (input_position == input_length) {
+            input_position = input_length = 0;
+        }
+        return c;
+    }
+
+    template <typename T>
+    void print(const T&)
+    {
+    }
+
+    void println()
+    {
+    }
+
+    void println(const char* text)
+    {
+        snprintf(line, sizeof(line), "%s", text);
+    }
+};
+
+extern HardwareSerial Serial;
 
 #endif
@@ -8,12 +8,28 @@
 class EEPROMClass
 {
 public:
-    uint8_t bytes[128];
+    // ATmega328P EEPROM size
+    uint8_t bytes[1024];
 
     EEPROMClass() : bytes{}
     {
     }
 
+    uint8_t read(int address) const
+    {
+        return bytes[address];
+    }
+
+    void write(int address, uint8_t value)
+    {
+        bytes[address] = value;
+    }
+
+    void update(int address, uint8_t value)
+    {
+        bytes[address] = value;
+    }
+
     template <typename T>
     void put(int address, const T& value)
     {
@@ -0,0 +1,134 @@
+#ifndef ELECTRONIC_DC_LOAD_HOST_LIQUIDCRYSTAL_I2C_H
+#define ELECTRONIC_DC_LOAD_HOST_LIQUIDCRYSTAL_I2C_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "Wire.h"
+
+/* HD44780 behind a PCF8574.  Every LCD byte goes out as two nibbles of
+ * three expander writes each, so it costs the bus six two-byte
+ * transmissions.  The visible text is kept in `screen`. */
+class LiquidCrystal_I2C
+{
+private:
+    uint8_t _cols;
+    uint8_t _rows;
+    uint8_t _col;
+    uint8_t _row;
+
+    void _send()
+    {
+        Wire.transmit(12);
+    }
+
+public:
+    char screen[4][21];
+    bool cursor_visible;
+
+    LiquidCrystal_I2C(uint8_t, uint8_t cols, uint8_t rows) :
+        _cols(cols),
+        _rows(rows),
+        _col(0),
+        _row(0),
+        cursor_visible(false)
+    {
+        memset(screen, 0, sizeof(screen));
+    }
+
+    void init()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        _send();
+        for (uint8_t row = 0; row < _rows; row++) {
+            memset(screen[row], ' ', _cols);
+            screen[row][_cols] = '\0';
+        }
+        _col = 0;
+        _row = 0;
+        delayMicroseconds(2000);
+    }
+
+    void home()
+    {
+        _send();
+        _col = 0;
+        _row = 0;
+        delayMicroseconds(2000);
+    }
+
+    void setCursor(uint8_t col, uint8_t row)
+    {
+        _send();
+        _col = col;
+        _row = row < _rows ? row : _rows - 1;
+    }
+
+    void cursor()
+    {
+        _send();
+        cursor_visible = true;
+    }
+
+    void noCursor()
+    {
+        _send();
+        cursor_visible = false;
+    }
+
+    size_t write(uint8_t value)
+    {
+        _send();
+        if (_col < _cols) {
+            screen[_row][_col] = (char)value;
+        }
+        _col++;
+        return 1;
+    }
+
+    size_t print(const char* text)
+    {
+        size_t count = 0;
+        while (*text != '\0') {
+            count += write((uint8_t)*text++);
+        }
+        return count;
+    }
+
+    size_t print(char value)
+    {
+        return write((uint8_t)value);
+    }
+
+    size_t print(long value)
+    {
+        char text[12];
+        snprintf(text, sizeof(text), "%ld", value);
+        return print(text);
+    }
+
+    size_t print(unsigned long value)
+    {
+        char text[12];
+        snprintf(text, sizeof(text), "%lu", value);
+        return print(text);
+    }
+
+    size_t print(int value)
+    {
+        return print((long)value);
+    }
+
+    size_t print(unsigned int value)
+    {
+        return print((unsigned long)value);
+    }
+};
+
+#endif
@@ -7,7 +7,10 @@
 class SPISettings
 {
 public:
-    SPISettings(uint32_t, uint8_t, uint8_t)
+    uint8_t mode;
+
+    SPISettings(uint32_t, uint8_t, uint8_t data_mode) :
+        mode(data_mode)
     {
     }
 };
@@ -17,17 +20,47 @@ class SPIClass
 public:
     std::vector<std::vector<uint8_t> > transfers;
     std::vector<std::vector<uint8_t> > responses;
+    // Called before every transfer, e.g. to check the chip selects.
+    void (*on_transfer)();
+    // A device model: when set it answers every transfer in place, and
+    // nothing is recorded.
+    void (*on_exchange)(uint8_t* data, uint8_t count);
+    // The mode of the latest beginTransaction(), and how many are open.
+    uint8_t mode;
+    int transactions;
+
+    SPIClass() :
+        on_transfer(0),
+        on_exchange(0),
+        mode(0),
+        transactions(0)
+    {
+    }
+
+    void begin()
+    {
+    }
 
-    void beginTransaction(const SPISettings&)
+    void beginTransaction(const SPISettings& settings)
     {
+        mode = settings.mode;
+        transactions++;
     }
 
     void endTransaction()
     {
+        transactions--;
     }
 
     void transfer(uint8_t* data, uint8_t count)
     {
+        if (on_transfer) {
+            on_transfer();
+        }
+        if (on_exchange) {
+            on_exchange(data, count);
+            return;
+        }
         transfers.push_back(std::vector<uint8_t>(data, data + count));
         if (!responses.empty()) {
             const std::vector<uint8_t> response = responses.front();
@@ -41,11 +74,19 @@ public:
             }
         }
     }
+
+    uint16_t transfer16(uint16_t value)
+    {
+        uint8_t data[2] = {(uint8_t)(value >> 8), (uint8_t)value};
+        transfer(data, 2);
+        return (uint16_t)((data[0] << 8) | data[1]);
+    }
 };
 
 extern SPIClass SPI;
 
 #define MSBFIRST 1
+#define SPI_MODE0 0
 #define SPI_MODE3 3
 
 #endif
@@ -0,0 +1,32 @@
+#ifndef ELECTRONIC_DC_LOAD_HOST_TIMERONE_H
+#define ELECTRONIC_DC_LOAD_HOST_TIMERONE_H
+
+#include <stdint.h>
+
+// The interrupt is only recorded; a simulation calls it every period.
+class TimerOne
+{
+public:
+    uint32_t period_us;
+    void (*isr)();
+
+    TimerOne() :
+        period_us(0),
+        isr(0)
+    {
+    }
+
+    void initialize(uint32_t period)
+    {
+        period_us = period;
+    }
+
+    void attachInterrupt(void (*callback)())
+    {
+        isr = callback;
+    }
+};
+
+extern TimerOne Timer1;
+
+#endif
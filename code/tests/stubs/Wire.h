@@ -0,0 +1,51 @@
+#ifndef ELECTRONIC_DC_LOAD_HOST_WIRE_H
+#define ELECTRONIC_DC_LOAD_HOST_WIRE_H
+
+#include <stdint.h>
+
+class TwoWire
+{
+public:
+    // Set by a test to make the bus look stuck.
+    bool timeout_flag;
+    uint32_t timeout_us;
+    // Called for every byte put on the bus, e.g. to charge its time.
+    void (*on_transmit)(uint16_t bytes);
+
+    TwoWire() :
+        timeout_flag(false),
+        timeout_us(0),
+        on_transmit(0)
+    {
+    }
+
+    void begin()
+    {
+    }
+
+    void setWireTimeout(uint32_t timeout, bool)
+    {
+        timeout_us = timeout;
+    }
+
+    bool getWireTimeoutFlag() const
+    {
+        return timeout_flag;
+    }
+
+    void clearWireTimeoutFlag()
+    {
+        timeout_flag = false;
+    }
+
+    void transmit(uint16_t bytes)
+    {
+        if (on_transmit) {
+            on_transmit(bytes);
+        }
+    }
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,159 @@
+#include <assert.h>
+#include <stdint.h>
+
+#include "../waveform.h"
+
+using namespace control;
+
+static bool allClamped(const WaveformTable& table)
+{
+    for (uint8_t index = 0; index < table.points; index++) {
+        if (table.code[index] > kTheoreticalDacHardCapCode) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void sineTests()
+{
+    assert(WaveformSineQ15(0) == 0);
+    assert(WaveformSineQ15(0x4000) == 32767);
+    assert(WaveformSineQ15(0x8000) == 0);
+    assert(WaveformSineQ15(0xC000) == -32767);
+    // sin(30 degrees), interpolated between table steps.
+    const int32_t thirty = WaveformSineQ15(65536 / 12);
+    assert(thirty > 16383 - 40 && thirty < 16384 + 40);
+    assert(WaveformSineQ15(65536 - 65536 / 12) == -thirty);
+}
+
+static void shapeTests()
+{
+    WaveformTable table;
+
+    /* Square: low for the first half, high for the second. */
+    assert(BuildWaveform(table, WAVEFORM_SQUARE, 1000000L, 5000000L, 4, 100));
+    assert(table.points == 4);
+    assert(table.ticks_per_point == 25);
+    assert(table.code[0] == theoreticalDacCodeForMicroamps(1000000L));
+    assert(table.code[1] == table.code[0]);
+    assert(table.code[2] == theoreticalDacCodeForMicroamps(5000000L));
+    assert(table.code[3] == table.code[2]);
+
+    /* Trapezoid: rise, high, fall, low over quarters of the period. */
+    assert(BuildWaveform(table, WAVEFORM_TRAPEZOID, 0, 8000000L, 16, 16));
+    assert(table.ticks_per_point == 1);
+    assert(table.code[0] == 0);
+    assert(table.code[2] == theoreticalDacCodeForMicroamps(4000000L));
+    for (uint8_t index = 4; index < 8; index++) {
+        assert(table.code[index] == theoreticalDacCodeForMicroamps(8000000L));
+    }
+    assert(table.code[10] == theoreticalDacCodeForMicroamps(4000000L));
+    for (uint8_t index = 12; index < 16; index++) {
+        assert(table.code[index] == 0);
+    }
+    for (uint8_t index = 1; index < 4; index++) {
+        assert(table.code[index] > table.code[index - 1]);
+        assert(table.code[index + 8] < table.code[index + 7]);
+    }
+
+    /* Sine: starts at the low level, peaks halfway and is symmetric. */
+    assert(BuildWaveform(table, WAVEFORM_SINE, 2000000L, 6000000L, 64, 64));
+    assert(table.code[0] == theoreticalDacCodeForMicroamps(2000000L));
+    assert(table.code[32] == theoreticalDacCodeForMicroamps(6000000L));
+    assert(table.code[16] == theoreticalDacCodeForMicroamps(4000000L));
+    for (uint8_t index = 1; index < 32; index++) {
+        assert(table.code[index] >= table.code[index - 1]);
+        assert(table.code[index] == table.code[64 - index]);
+    }
+}
+
+static void clampTests()
+{
+    /* Every shape is clamped to the hard cap, whatever was asked for. */
+    WaveformTable table;
+    for (uint8_t shape = 0; shape < MAX_WAVEFORM_SHAPES; shape++) {
+        assert(BuildWaveform(table, (WaveformShape)shape,
+                             -5000000L, 40000000L, 64, 128));
+        assert(allClamped(table));
+        assert(WaveformPeakCode(table) == kTheoreticalDacHardCapCode);
+    }
+    assert(WaveformCode(-1) == 0);
+    assert(WaveformCode(2000000000L) == kTheoreticalDacHardCapCode);
+
+    const int32_t levels[] = {0, 20000000L, 3000000L, -1};
+    assert(BuildStepWaveform(table, levels, 4, 5));
+    assert(allClamped(table));
+    assert(table.points == 4);
+    assert(table.ticks_per_point == 5);
+    assert(table.code[1] == kTheoreticalDacHardCapCode);
+    assert(table.code[2] == theoreticalDacCodeForMicroamps(3000000L));
+    assert(table.code[3] == 0);
+}
+
+static void timingLimitTests()
+{
+    WaveformTable table;
+    /* Entries change at most once per 1 ms tick. */
+    assert(!BuildWaveform(table, WAVEFORM_SQUARE, 0, 1000000L, 8, 4));
+    assert(BuildWaveform(table, WAVEFORM_SQUARE, 0, 1000000L, 8, 8));
+    /* The period must split into whole ticks that fit the counter. */
+    assert(!BuildWaveform(table, WAVEFORM_SQUARE, 0, 1000000L, 8, 20));
+    assert(!BuildWaveform(table, WAVEFORM_SQUARE, 0, 1000000L, 2, 1024));
+    assert(!BuildWaveform(table, WAVEFORM_SQUARE, 0, 1000000L, 1, 10));
+    assert(!BuildWaveform(table, WAVEFORM_TRAPEZOID, 0, 1000000L, 2, 10));
+    assert(!BuildWaveform(table, WAVEFORM_SINE, 0, 1000000L,
+                          WAVEFORM_MAX_POINTS + 1, 130));
+    const int32_t levels[] = {0};
+    assert(!BuildStepWaveform(table, levels, 0, 1));
+    assert(!BuildStepWaveform(table, levels, 1, 0));
+    assert(!BuildStepWaveform(table, levels, 1, 256));
+}
+
+static void playerTests()
+{
+    WaveformTable table;
+    const int32_t levels[] = {1000000L, 2000000L, 3000000L};
+    assert(BuildStepWaveform(table, levels, 3, 2));
+
+    WaveformPlayer player;
+    uint16_t code = 0;
+    assert(!player.isPlaying());
+    assert(!player.tick(code));
+
+    /* Each entry is written on the first of its ticks, and the period
+     * repeats after points * ticks_per_point ticks. */
+    player.start(table);
+    uint8_t expected_index = 0;
+    for (uint16_t tick = 0; tick < 60; tick++) {
+        const bool write = player.tick(code);
+        assert(write == (tick % 2 == 0));
+        if (write) {
+            assert(code == table.code[expected_index]);
+            expected_index = (expected_index + 1) % 3;
+        }
+    }
+
+    /* A deferred write is retried with the code due on the next tick. */
+    player.start(table);
+    assert(player.tick(code) && code == table.code[0]);
+    player.defer();
+    assert(player.tick(code) && code == table.code[0]);
+    player.defer();
+    assert(player.tick(code) && code == table.code[1]);
+    assert(!player.tick(code));
+
+    player.stop();
+    assert(!player.isPlaying());
+    assert(!player.tick(code));
+}
+
+int main()
+{
+    sineTests();
+    shapeTests();
+    clampTests();
+    timingLimitTests();
+    playerTests();
+    return 0;
+}
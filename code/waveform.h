@@ -0,0 +1,239 @@
+#ifndef __WAVEFORM_H__
+#define __WAVEFORM_H__
+
+#include <stdint.h>
+
+#include "control.h"
+
+/* Dynamic load: a table of DAC codes played out from the Timer1 interrupt.
+ * Tables are built in the main loop and every entry is clamped to the
+ * hard cap there, so the interrupt only copies codes to the DAC. */
+
+// Timer1 period, and so the fastest rate a table entry can change (1 kHz).
+#define WAVEFORM_TICK_US       1000ul
+#define WAVEFORM_MAX_POINTS    64
+
+enum WaveformShape
+{
+    WAVEFORM_SQUARE = 0,
+    WAVEFORM_TRAPEZOID,
+    WAVEFORM_SINE,
+
+    MAX_WAVEFORM_SHAPES,
+};
+
+struct WaveformTable
+{
+    uint16_t code[WAVEFORM_MAX_POINTS];
+    uint8_t points;
+    // Timer ticks every entry is held for.
+    uint8_t ticks_per_point;
+};
+
+
+inline uint16_t WaveformCode(int32_t current_ua)
+{
+    const uint16_t code = control::theoreticalDacCodeForMicroamps(current_ua);
+    return code > control::kTheoreticalDacHardCapCode ?
+        control::kTheoreticalDacHardCapCode : code;
+}
+
+
+// sin() over a quarter turn in Q15, in steps of 1/64 of a turn.
+const int16_t WAVEFORM_QUARTER_SINE_Q15[17] = {
+    0, 3212, 6393, 9512, 12539, 15446, 18204, 20787,
+    23170, 25329, 27245, 28898, 30273, 31356, 32137, 32609, 32767
+};
+
+// Q15 sine of a Q16 phase (65536 is a full turn), interpolated linearly.
+inline int32_t WaveformSineQ15(uint16_t phase)
+{
+    const uint8_t quadrant = (uint8_t)(phase >> 14);
+    uint16_t position = phase & 0x3FFFu;
+    if (quadrant & 1u) {
+        position = (uint16_t)(0x4000u - position);
+    }
+    const uint8_t index = (uint8_t)(position >> 10);
+    const int32_t fraction = position & 0x3FFu;
+    int32_t value = WAVEFORM_QUARTER_SINE_Q15[index];
+    if (index < 16) {
+        value += ((WAVEFORM_QUARTER_SINE_Q15[index + 1] - value) *
+                  fraction) >> 10;
+    }
+    return (quadrant & 2u) ? -value : value;
+}
+
+
+// Level of point `index` of a `points` long period, starting at `low_ua`.
+inline int32_t WaveformLevel(WaveformShape shape,
+                             int32_t low_ua,
+                             int32_t high_ua,
+                             uint8_t index,
+                             uint8_t points)
+{
+    const int32_t span_ua = high_ua - low_ua;
+    switch (shape) {
+    case WAVEFORM_SQUARE:
+        return index < points / 2 ? low_ua : high_ua;
+    case WAVEFORM_TRAPEZOID: {
+        // Rise, high, fall and low over a quarter period each; a remainder
+        // of points goes to the low level.
+        const uint8_t quarter = points / 4;
+        if (index < quarter) {
+            return low_ua + (int32_t)((int64_t)span_ua * index / quarter);
+        }
+        if (index < 2 * quarter) {
+            return high_ua;
+        }
+        if (index < 3 * quarter) {
+            return high_ua -
+                (int32_t)((int64_t)span_ua * (index - 2 * quarter) / quarter);
+        }
+        return low_ua;
+    }
+    case WAVEFORM_SINE: {
+        // Starts at the low level, as the other shapes do.
+        const uint16_t phase = (uint16_t)(((uint32_t)index << 16) / points);
+        const int32_t cosine = WaveformSineQ15((uint16_t)(phase + 0x4000u));
+        const int64_t half_span = span_ua / 2;
+        return low_ua + (int32_t)half_span -
+            (int32_t)((half_span * cosine + (1L << 14)) >> 15);
+    }
+    default:
+        return low_ua;
+    }
+}
+
+
+/* Fill `table` with one period of `shape` between two currents.  The period
+ * is split into `points` entries of period_ms / points timer ticks each; it
+ * fails if that is not a whole number of ticks between 1 and 255. */
+inline bool BuildWaveform(WaveformTable& table,
+                          WaveformShape shape,
+                          int32_t low_ua,
+                          int32_t high_ua,
+                          uint8_t points,
+                          uint16_t period_ms)
+{
+    const uint8_t min_points = shape == WAVEFORM_TRAPEZOID ? 4 : 2;
+    if (shape >= MAX_WAVEFORM_SHAPES || points < min_points ||
+        points > WAVEFORM_MAX_POINTS || period_ms % points != 0) {
+        return false;
+    }
+    const uint16_t ticks = period_ms / points;
+    if (ticks == 0 || ticks > 255) {
+        return false;
+    }
+    for (uint8_t index = 0; index < points; index++) {
+        table.code[index] =
+            WaveformCode(WaveformLevel(shape, low_ua, high_ua, index, points));
+    }
+    table.points = points;
+    table.ticks_per_point = (uint8_t)ticks;
+    return true;
+}
+
+
+// A user sequence of current levels, each held for `dwell_ms`.
+inline bool BuildStepWaveform(WaveformTable& table,
+                              const int32_t* levels_ua,
+                              uint8_t count,
+                              uint16_t dwell_ms)
+{
+    if (count == 0 || count > WAVEFORM_MAX_POINTS ||
+        dwell_ms == 0 || dwell_ms > 255) {
+        return false;
+    }
+    for (uint8_t index = 0; index < count; index++) {
+        table.code[index] = WaveformCode(levels_ua[index]);
+    }
+    table.points = count;
+    table.ticks_per_point = (uint8_t)dwell_ms;
+    return true;
+}
+
+
+inline uint16_t WaveformPeakCode(const WaveformTable& table)
+{
+    uint16_t peak = 0;
+    for (uint8_t index = 0; index < table.points; index++) {
+        if (table.code[index] > peak) {
+            peak = table.code[index];
+        }
+    }
+    return peak;
+}
+
+
+/* Plays a table from the timer interrupt.  start() and stop() are called
+ * from the main loop; the table must not change while playing. */
+class WaveformPlayer
+{
+private:
+    const WaveformTable* _table;
+    volatile bool _playing;
+    uint8_t _index;
+    uint8_t _ticks;
+    bool _pending;
+
+public:
+    WaveformPlayer() :
+        _table(0),
+        _playing(false),
+        _index(0),
+        _ticks(0),
+        _pending(false)
+    {
+    }
+
+    void start(const WaveformTable& table)
+    {
+        _playing = false;
+        _table = &table;
+        _index = 0;
+        _ticks = 0;
+        _pending = false;
+        _playing = true;
+    }
+
+    void stop()
+    {
+        _playing = false;
+    }
+
+    bool isPlaying() const
+    {
+        return _playing;
+    }
+
+    /* ISR context, once per timer tick.  Returns true with the code of the
+     * current entry when it has to be written: on its first tick, or on
+     * any tick after a defer(). */
+    bool tick(uint16_t& code)
+    {
+        if (!_playing) {
+            return false;
+        }
+        if (_ticks == 0) {
+            _pending = true;
+        }
+        code = _table->code[_index];
+        if (++_ticks >= _table->ticks_per_point) {
+            _ticks = 0;
+            if (++_index >= _table->points) {
+                _index = 0;
+            }
+        }
+        const bool write = _pending;
+        _pending = false;
+        return write;
+    }
+
+    // The code from tick() could not be written; retry on the next tick.
+    void defer()
+    {
+        _pending = true;
+    }
+};
+
+#endif